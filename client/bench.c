@@ -0,0 +1,911 @@
+#define _GNU_SOURCE
+#include "bench.h"
+#include "cluster.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+
+// Log-linear latency buckets: values below HIST_SUB ns are exact, above that
+// every power of two is split into HIST_SUB / 2 buckets (~3% resolution).
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_HALF (HIST_SUB / 2)
+#define HIST_MAX_SHIFT 35
+#define HIST_BUCKETS (HIST_SUB + HIST_MAX_SHIFT * HIST_HALF)
+
+#define TAG_ERR 1
+#define READ_CHUNK (64 * 1024)
+
+enum
+{
+    DIST_UNIFORM,
+    DIST_ZIPF,
+};
+
+typedef struct
+{
+    uint64_t total;
+    uint64_t max;
+    uint64_t counts[HIST_BUCKETS];
+} histogram;
+
+static struct
+{
+    const char *host;
+    int port;
+    int connections;
+    int threads;
+    int pipeline;
+    uint64_t requests;
+    double duration;
+    double warmup;
+    // requests per second over all connections, 0 runs closed loop
+    double rate;
+    uint64_t keys;
+    int key_dist;
+    double zipf_theta;
+    uint32_t value_min;
+    uint32_t value_max;
+    int value_dist;
+    // out of get_weight + set_weight requests are GETs
+    unsigned get_weight;
+    unsigned set_weight;
+    int json;
+    // -h/-p is one node of a cluster; connections are spread over all of them
+    int cluster;
+} g_opt = {"127.0.0.1", 1234, 50, 1, 1, 100000, 0, 0, 0, 100000, DIST_UNIFORM, 0.99, 32, 32, DIST_UNIFORM, 1, 1, 0, 0};
+
+// with --cluster, which node serves each slot
+static slot_map g_slots;
+
+// draws before a cluster connection gives up finding a key of its node's
+// slots and sends one that gets redirected
+#define MAX_KEY_DRAWS 1024
+
+// YCSB-style zipfian generator over [0, n) (Gray et al., "Quickly generating
+// billion-record synthetic databases"). zeta(n) is computed once up front.
+typedef struct
+{
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} zipf;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+static double random_unit(uint64_t *state)
+{
+    return (double)(next_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void init_zipf(zipf *z, uint64_t n, double theta)
+{
+    z->n = n;
+    z->theta = theta;
+    double zeta2 = 1.0 + pow(0.5, theta);
+    z->zetan = 0;
+    for (uint64_t i = 1; i <= n; i++)
+    {
+        z->zetan += 1.0 / pow((double)i, theta);
+    }
+    z->alpha = 1.0 / (1.0 - theta);
+    z->eta = (1.0 - pow(2.0 / (double)n, 1.0 - theta)) / (1.0 - zeta2 / z->zetan);
+}
+
+static uint64_t next_zipf(const zipf *z, uint64_t *state)
+{
+    double u = random_unit(state);
+    double uz = u * z->zetan;
+    if (uz < 1.0)
+    {
+        return 0;
+    }
+    if (uz < 1.0 + pow(0.5, z->theta))
+    {
+        return 1;
+    }
+    uint64_t v = (uint64_t)((double)z->n * pow(z->eta * u - z->eta + 1.0, z->alpha));
+    return v < z->n ? v : z->n - 1;
+}
+
+static size_t bucket_index(uint64_t value)
+{
+    if (value < HIST_SUB)
+    {
+        return (size_t)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - (HIST_SUB_BITS - 1);
+    size_t index = HIST_SUB + (size_t)(shift - 1) * HIST_HALF + (size_t)((value >> shift) - HIST_HALF);
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+static uint64_t bucket_high(size_t index)
+{
+    if (index < HIST_SUB)
+    {
+        return index;
+    }
+    size_t shift = (index - HIST_SUB) / HIST_HALF + 1;
+    uint64_t sub = (index - HIST_SUB) % HIST_HALF + HIST_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+static void record(histogram *h, uint64_t ns)
+{
+    h->counts[bucket_index(ns)]++;
+    h->total++;
+    if (ns > h->max)
+    {
+        h->max = ns;
+    }
+}
+
+// HdrHistogram's recordCorrectedValue: a sample that took longer than the
+// expected interval hid the requests that would have been issued meanwhile,
+// so record those too with their shorter waits.
+static void record_corrected(histogram *h, uint64_t ns, uint64_t expected_interval)
+{
+    record(h, ns);
+    if (expected_interval == 0)
+    {
+        return;
+    }
+    for (uint64_t missing = ns > expected_interval ? ns - expected_interval : 0; missing >= expected_interval;
+         missing -= expected_interval)
+    {
+        record(h, missing);
+    }
+}
+
+static void merge_histogram(histogram *into, const histogram *from)
+{
+    into->total += from->total;
+    if (from->max > into->max)
+    {
+        into->max = from->max;
+    }
+    for (size_t i = 0; i < HIST_BUCKETS; i++)
+    {
+        into->counts[i] += from->counts[i];
+    }
+}
+
+static double percentile_us(const histogram *h, double p)
+{
+    if (h->total == 0)
+    {
+        return 0;
+    }
+    uint64_t target = (uint64_t)ceil(p * (double)h->total);
+    if (target == 0)
+    {
+        target = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen >= target)
+        {
+            uint64_t high = bucket_high(i);
+            return (double)(high < h->max ? high : h->max) / 1000.0;
+        }
+    }
+    return (double)h->max / 1000.0;
+}
+
+// One client connection with its own send and receive buffers. The times at
+// which outstanding requests were due and actually written sit in a ring, in
+// the order their replies will arrive.
+typedef struct
+{
+    int fd;
+    // the cluster node it is connected to
+    int node;
+    uint8_t *out;
+    size_t out_len;
+    size_t out_sent;
+    size_t out_cap;
+    uint8_t *in;
+    size_t in_len;
+    size_t in_cap;
+    uint64_t *due;
+    uint64_t *sent;
+    int head;
+    int outstanding;
+    uint64_t next_due;
+    uint64_t issued;
+    uint64_t quota;
+} bench_conn;
+
+typedef struct
+{
+    pthread_t thread;
+    int id;
+    bench_conn *conns;
+    int nconns;
+    uint64_t rng;
+    const zipf *key_zipf;
+    const zipf *value_zipf;
+    const uint8_t *value_bytes;
+    // nanoseconds between requests on one connection in open loop
+    uint64_t interval;
+    uint64_t start;
+    uint64_t measure_from;
+    uint64_t deadline;
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint64_t service_sum;
+    histogram service;
+    histogram corrected;
+    // past the deadline of a -d run: nothing new is issued
+    bool draining;
+    int failed;
+} bench_thread;
+
+static void die(const char *msg)
+{
+    int err = errno;
+    fprintf(stderr, "[%d] %s\n", err, msg);
+    exit(1);
+}
+
+static int connect_to_server(const char *host, int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        die("socket");
+    }
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+    {
+        fprintf(stderr, "bad host address: %s\n", host);
+        exit(1);
+    }
+    if (connect(fd, (const struct sockaddr *)&addr, sizeof(addr)))
+    {
+        die("connect()");
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    return fd;
+}
+
+static void reserve(uint8_t **buf, size_t *cap, size_t needed)
+{
+    if (needed <= *cap)
+    {
+        return;
+    }
+    size_t new_cap = *cap ? *cap : 4096;
+    while (new_cap < needed)
+    {
+        new_cap *= 2;
+    }
+    *buf = (uint8_t *)realloc(*buf, new_cap);
+    if (!*buf)
+    {
+        die("out of memory");
+    }
+    *cap = new_cap;
+}
+
+static void put_arg(uint8_t *dst, size_t *pos, const void *data, uint32_t len)
+{
+    memcpy(dst + *pos, &len, 4);
+    memcpy(dst + *pos + 4, data, len);
+    *pos += 4 + len;
+}
+
+static void queue_request(bench_thread *t, bench_conn *c, uint64_t due, uint64_t now)
+{
+    char key[32];
+    uint32_t key_len;
+    for (int draw = 0;; draw++)
+    {
+        uint64_t key_index = g_opt.key_dist == DIST_ZIPF ? next_zipf(t->key_zipf, &t->rng)
+                                                         : next_random(&t->rng) % g_opt.keys;
+        key_len = (uint32_t)snprintf(key, sizeof(key), "key:%012llu", (unsigned long long)key_index);
+        // a cluster connection only sends keys its node serves, drawn from
+        // the same distribution restricted to them
+        if (!g_opt.cluster || g_slots.slot_node[key_slot((const uint8_t *)key, key_len)] == c->node ||
+            draw == MAX_KEY_DRAWS)
+        {
+            break;
+        }
+    }
+
+    bool is_get = next_random(&t->rng) % (g_opt.get_weight + g_opt.set_weight) < g_opt.get_weight;
+    uint32_t value_len = 0;
+    if (!is_get)
+    {
+        uint32_t span = g_opt.value_max - g_opt.value_min + 1;
+        value_len = g_opt.value_min + (uint32_t)(g_opt.value_dist == DIST_ZIPF ? next_zipf(t->value_zipf, &t->rng)
+                                                                               : next_random(&t->rng) % span);
+    }
+
+    size_t payload = 4 + (4 + 3) + (4 + key_len) + (is_get ? 0 : 4 + value_len);
+    reserve(&c->out, &c->out_cap, c->out_len + 4 + payload);
+    uint8_t *dst = c->out + c->out_len;
+    uint32_t frame_len = (uint32_t)payload;
+    uint32_t nargs = is_get ? 2 : 3;
+    memcpy(dst, &frame_len, 4);
+    memcpy(dst + 4, &nargs, 4);
+    size_t pos = 8;
+    put_arg(dst, &pos, is_get ? "get" : "set", 3);
+    put_arg(dst, &pos, key, key_len);
+    if (!is_get)
+    {
+        put_arg(dst, &pos, t->value_bytes, value_len);
+    }
+    c->out_len += pos;
+
+    int slot = (c->head + c->outstanding) % g_opt.pipeline;
+    c->due[slot] = due;
+    c->sent[slot] = now;
+    c->outstanding++;
+    c->issued++;
+}
+
+static bool flush_conn(bench_thread *t, bench_conn *c)
+{
+    while (c->out_sent < c->out_len)
+    {
+        ssize_t rv = write(c->fd, c->out + c->out_sent, c->out_len - c->out_sent);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN)
+        {
+            return true;
+        }
+        if (rv <= 0)
+        {
+            return false;
+        }
+        c->out_sent += (size_t)rv;
+        t->bytes_out += (uint64_t)rv;
+    }
+    c->out_len = 0;
+    c->out_sent = 0;
+    return true;
+}
+
+static void complete_request(bench_thread *t, bench_conn *c, uint64_t now, bool error)
+{
+    uint64_t due = c->due[c->head];
+    uint64_t sent = c->sent[c->head];
+    c->head = (c->head + 1) % g_opt.pipeline;
+    c->outstanding--;
+
+    if (sent < t->measure_from)
+    {
+        return;
+    }
+    t->completed++;
+    if (error)
+    {
+        t->errors++;
+    }
+    uint64_t service = now - sent;
+    t->service_sum += service;
+    record(&t->service, service);
+    if (g_opt.rate > 0)
+    {
+        // open loop: measured from when the request was due, so time spent
+        // queued behind a stalled connection counts
+        record(&t->corrected, now - due);
+    }
+    else
+    {
+        // closed loop has no schedule; back-fill against the mean service time
+        record_corrected(&t->corrected, service, t->service_sum / t->completed);
+    }
+}
+
+static bool read_conn(bench_thread *t, bench_conn *c, uint64_t now)
+{
+    while (true)
+    {
+        reserve(&c->in, &c->in_cap, c->in_len + READ_CHUNK);
+        ssize_t rv = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN)
+        {
+            break;
+        }
+        if (rv <= 0)
+        {
+            return false;
+        }
+        c->in_len += (size_t)rv;
+        t->bytes_in += (uint64_t)rv;
+    }
+
+    size_t pos = 0;
+    while (c->in_len - pos >= 4)
+    {
+        uint32_t len = 0;
+        memcpy(&len, c->in + pos, 4);
+        if (c->in_len - pos - 4 < len)
+        {
+            break;
+        }
+        if (c->outstanding == 0)
+        {
+            fprintf(stderr, "unexpected reply\n");
+            return false;
+        }
+        complete_request(t, c, now, len > 0 && c->in[pos + 4] == TAG_ERR);
+        pos += 4 + len;
+    }
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+    return true;
+}
+
+static bool thread_done(const bench_thread *t)
+{
+    for (int i = 0; i < t->nconns; i++)
+    {
+        if (t->conns[i].issued < t->conns[i].quota || t->conns[i].outstanding > 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void *bench_main(void *arg)
+{
+    bench_thread *t = (bench_thread *)arg;
+    struct pollfd *pfds = (struct pollfd *)calloc((size_t)t->nconns, sizeof(struct pollfd));
+    if (!pfds)
+    {
+        die("out of memory");
+    }
+
+    uint64_t now = now_ns();
+    for (int i = 0; i < t->nconns; i++)
+    {
+        // stagger open-loop connections so the arrivals are evenly spread
+        t->conns[i].next_due = t->start + t->interval * (uint64_t)i / (uint64_t)t->nconns;
+    }
+
+    while (!thread_done(t))
+    {
+        bool accepting = !t->draining;
+        uint64_t wake_at = UINT64_MAX;
+        for (int i = 0; i < t->nconns; i++)
+        {
+            bench_conn *c = &t->conns[i];
+            if (accepting)
+            {
+                if (g_opt.rate > 0)
+                {
+                    // a full pipeline delays requests, it never drops them:
+                    // their due times stay put and show up as latency
+                    while (c->next_due <= now && c->outstanding < g_opt.pipeline && c->issued < c->quota)
+                    {
+                        queue_request(t, c, c->next_due, now);
+                        c->next_due += t->interval;
+                    }
+                    if (c->issued < c->quota && c->next_due < wake_at)
+                    {
+                        wake_at = c->next_due;
+                    }
+                }
+                else
+                {
+                    while (c->outstanding < g_opt.pipeline && c->issued < c->quota)
+                    {
+                        queue_request(t, c, now, now);
+                    }
+                }
+            }
+            if (!flush_conn(t, c))
+            {
+                fprintf(stderr, "connection lost\n");
+                t->failed = 1;
+                free(pfds);
+                return NULL;
+            }
+            pfds[i].fd = c->fd;
+            pfds[i].events = (short)(POLLIN | (c->out_len > c->out_sent ? POLLOUT : 0));
+            pfds[i].revents = 0;
+        }
+
+        // ppoll for sub-millisecond wakeups, open loop intervals are short
+        uint64_t timeout = 100000000;
+        if (wake_at != UINT64_MAX)
+        {
+            timeout = wake_at > now ? wake_at - now : 0;
+        }
+        if (!t->draining && t->deadline > now && t->deadline - now < timeout)
+        {
+            timeout = t->deadline - now;
+        }
+        struct timespec ts = {(time_t)(timeout / 1000000000), (long)(timeout % 1000000000)};
+        int rv = ppoll(pfds, (nfds_t)t->nconns, &ts, NULL);
+        if (rv < 0 && errno != EINTR)
+        {
+            die("ppoll()");
+        }
+        now = now_ns();
+        for (int i = 0; rv > 0 && i < t->nconns; i++)
+        {
+            if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP))
+            {
+                if (!read_conn(t, &t->conns[i], now))
+                {
+                    fprintf(stderr, "connection lost\n");
+                    t->failed = 1;
+                    free(pfds);
+                    return NULL;
+                }
+            }
+        }
+
+        // a duration run stops issuing at the deadline and drains what is out
+        if (!t->draining && now >= t->deadline)
+        {
+            for (int i = 0; i < t->nconns; i++)
+            {
+                t->conns[i].quota = t->conns[i].issued;
+            }
+            t->draining = true;
+        }
+    }
+    free(pfds);
+    return NULL;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: client bench [options]\n"
+            "  -h HOST / -p PORT      server address (127.0.0.1:1234)\n"
+            "  -c N                   connections in total (50)\n"
+            "  -t N                   threads (1)\n"
+            "  -P N                   pipeline depth per connection (1)\n"
+            "  -n N                   requests in total (100000)\n"
+            "  -d SECONDS             run for a fixed time instead of -n\n"
+            "  --warmup SECONDS       leave the first seconds out of the results\n"
+            "  --rate R               open loop at R requests/s in total (default closed loop)\n"
+            "  --keys N               key space size (100000)\n"
+            "  --key-dist uniform|zipf, --zipf-theta T (0.99)\n"
+            "  --value-size N|MIN-MAX SET value sizes in bytes (32)\n"
+            "  --value-dist uniform|zipf\n"
+            "  --ratio GET:SET        request mix (1:1)\n"
+            "  --json                 print the summary as one JSON object\n"
+            "  --cluster              -h/-p is a cluster node; spread the connections over every\n"
+            "                         node, each sending keys of its node's slots only\n");
+    exit(1);
+}
+
+static int parse_dist(const char *name)
+{
+    if (strcmp(name, "uniform") == 0)
+    {
+        return DIST_UNIFORM;
+    }
+    if (strcmp(name, "zipf") == 0 || strcmp(name, "zipfian") == 0)
+    {
+        return DIST_ZIPF;
+    }
+    usage();
+    return DIST_UNIFORM;
+}
+
+static void parse_bench_args(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "--json") == 0)
+        {
+            g_opt.json = 1;
+            continue;
+        }
+        if (strcmp(arg, "--cluster") == 0)
+        {
+            g_opt.cluster = 1;
+            continue;
+        }
+        if (!value)
+        {
+            usage();
+        }
+        i++;
+        if (strcmp(arg, "-h") == 0)
+        {
+            g_opt.host = value;
+        }
+        else if (strcmp(arg, "-p") == 0)
+        {
+            g_opt.port = atoi(value);
+        }
+        else if (strcmp(arg, "-c") == 0)
+        {
+            g_opt.connections = atoi(value);
+        }
+        else if (strcmp(arg, "-t") == 0)
+        {
+            g_opt.threads = atoi(value);
+        }
+        else if (strcmp(arg, "-P") == 0)
+        {
+            g_opt.pipeline = atoi(value);
+        }
+        else if (strcmp(arg, "-n") == 0)
+        {
+            g_opt.requests = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(arg, "-d") == 0)
+        {
+            g_opt.duration = atof(value);
+        }
+        else if (strcmp(arg, "--warmup") == 0)
+        {
+            g_opt.warmup = atof(value);
+        }
+        else if (strcmp(arg, "--rate") == 0)
+        {
+            g_opt.rate = atof(value);
+        }
+        else if (strcmp(arg, "--keys") == 0)
+        {
+            g_opt.keys = strtoull(value, NULL, 10);
+        }
+        else if (strcmp(arg, "--key-dist") == 0)
+        {
+            g_opt.key_dist = parse_dist(value);
+        }
+        else if (strcmp(arg, "--zipf-theta") == 0)
+        {
+            g_opt.zipf_theta = atof(value);
+        }
+        else if (strcmp(arg, "--value-size") == 0)
+        {
+            unsigned min = 0, max = 0;
+            int n = sscanf(value, "%u-%u", &min, &max);
+            if (n < 1)
+            {
+                usage();
+            }
+            g_opt.value_min = min;
+            g_opt.value_max = n == 2 ? max : min;
+        }
+        else if (strcmp(arg, "--value-dist") == 0)
+        {
+            g_opt.value_dist = parse_dist(value);
+        }
+        else if (strcmp(arg, "--ratio") == 0)
+        {
+            if (sscanf(value, "%u:%u", &g_opt.get_weight, &g_opt.set_weight) != 2)
+            {
+                usage();
+            }
+        }
+        else
+        {
+            usage();
+        }
+    }
+
+    if (g_opt.connections < 1 || g_opt.threads < 1 || g_opt.pipeline < 1 || g_opt.keys < 1 ||
+        g_opt.value_max < g_opt.value_min || g_opt.get_weight + g_opt.set_weight == 0 ||
+        (g_opt.zipf_theta <= 0 || g_opt.zipf_theta >= 1))
+    {
+        usage();
+    }
+    if (g_opt.threads > g_opt.connections)
+    {
+        g_opt.threads = g_opt.connections;
+    }
+}
+
+static void print_latency_text(const char *label, const histogram *h)
+{
+    printf("  %-10s %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", label,
+           percentile_us(h, 0.50), percentile_us(h, 0.90), percentile_us(h, 0.99),
+           percentile_us(h, 0.999), percentile_us(h, 0.9999), (double)h->max / 1000.0);
+}
+
+static void print_latency_json(const char *label, const histogram *h)
+{
+    printf("\"%s\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"p9999\":%.1f,\"max\":%.1f}", label,
+           percentile_us(h, 0.50), percentile_us(h, 0.90), percentile_us(h, 0.99),
+           percentile_us(h, 0.999), percentile_us(h, 0.9999), (double)h->max / 1000.0);
+}
+
+int run_bench(int argc, char **argv)
+{
+    parse_bench_args(argc, argv);
+
+    zipf key_zipf = {};
+    zipf value_zipf = {};
+    if (g_opt.key_dist == DIST_ZIPF)
+    {
+        init_zipf(&key_zipf, g_opt.keys, g_opt.zipf_theta);
+    }
+    if (g_opt.value_dist == DIST_ZIPF)
+    {
+        init_zipf(&value_zipf, (uint64_t)(g_opt.value_max - g_opt.value_min) + 1, g_opt.zipf_theta);
+    }
+    uint8_t *value_bytes = (uint8_t *)malloc(g_opt.value_max + 1);
+    if (!value_bytes)
+    {
+        die("out of memory");
+    }
+    for (uint32_t i = 0; i <= g_opt.value_max; i++)
+    {
+        value_bytes[i] = (uint8_t)('a' + i % 26);
+    }
+
+    bench_thread *threads = (bench_thread *)calloc((size_t)g_opt.threads, sizeof(bench_thread));
+    bench_conn *conns = (bench_conn *)calloc((size_t)g_opt.connections, sizeof(bench_conn));
+    if (!threads || !conns)
+    {
+        die("out of memory");
+    }
+
+    if (g_opt.cluster)
+    {
+        int fd = connect_node(g_opt.host, g_opt.port);
+        if (fd < 0 || !fetch_slot_map(fd, &g_slots) || g_slots.nnodes == 0)
+        {
+            die("cannot fetch the slot map");
+        }
+        close(fd);
+        if (g_opt.connections < g_slots.nnodes)
+        {
+            fprintf(stderr, "warning: %d connection(s) for %d nodes\n", g_opt.connections, g_slots.nnodes);
+        }
+    }
+
+    uint64_t per_conn_interval = g_opt.rate > 0 ? (uint64_t)(1e9 * g_opt.connections / g_opt.rate) : 0;
+    for (int i = 0; i < g_opt.connections; i++)
+    {
+        bench_conn *c = &conns[i];
+        if (g_opt.cluster)
+        {
+            c->node = i % g_slots.nnodes;
+            c->fd = connect_to_server(g_slots.nodes[c->node].host, g_slots.nodes[c->node].port);
+        }
+        else
+        {
+            c->fd = connect_to_server(g_opt.host, g_opt.port);
+        }
+        c->due = (uint64_t *)calloc((size_t)g_opt.pipeline, sizeof(uint64_t));
+        c->sent = (uint64_t *)calloc((size_t)g_opt.pipeline, sizeof(uint64_t));
+        if (!c->due || !c->sent)
+        {
+            die("out of memory");
+        }
+        // -n is split over the connections, -d leaves them unbounded
+        c->quota = g_opt.duration > 0 ? UINT64_MAX
+                                      : g_opt.requests / g_opt.connections + ((uint64_t)i < g_opt.requests % g_opt.connections);
+    }
+
+    uint64_t start = now_ns();
+    int next_conn = 0;
+    for (int i = 0; i < g_opt.threads; i++)
+    {
+        bench_thread *t = &threads[i];
+        t->id = i;
+        t->nconns = g_opt.connections / g_opt.threads + (i < g_opt.connections % g_opt.threads);
+        t->conns = &conns[next_conn];
+        next_conn += t->nconns;
+        t->rng = 0x9E3779B97F4A7C15ull * (uint64_t)(i + 1);
+        t->key_zipf = &key_zipf;
+        t->value_zipf = &value_zipf;
+        t->value_bytes = value_bytes;
+        t->interval = per_conn_interval;
+        t->start = start;
+        t->measure_from = start + (uint64_t)(g_opt.warmup * 1e9);
+        t->deadline = g_opt.duration > 0 ? start + (uint64_t)((g_opt.warmup + g_opt.duration) * 1e9) : UINT64_MAX;
+        if (pthread_create(&t->thread, NULL, bench_main, t))
+        {
+            die("pthread_create()");
+        }
+    }
+
+    histogram *service = (histogram *)calloc(1, sizeof(histogram));
+    histogram *corrected = (histogram *)calloc(1, sizeof(histogram));
+    if (!service || !corrected)
+    {
+        die("out of memory");
+    }
+    uint64_t completed = 0, errors = 0, bytes_in = 0, bytes_out = 0;
+    int failed = 0;
+    for (int i = 0; i < g_opt.threads; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        merge_histogram(service, &threads[i].service);
+        merge_histogram(corrected, &threads[i].corrected);
+        completed += threads[i].completed;
+        errors += threads[i].errors;
+        bytes_in += threads[i].bytes_in;
+        bytes_out += threads[i].bytes_out;
+        failed |= threads[i].failed;
+    }
+    double elapsed = (double)(now_ns() - start) / 1e9 - g_opt.warmup;
+    if (elapsed <= 0)
+    {
+        elapsed = 1e-9;
+    }
+    double throughput = (double)completed / elapsed;
+
+    if (g_opt.json)
+    {
+        printf("{\"mode\":\"%s\",\"nodes\":%d,\"connections\":%d,\"threads\":%d,\"pipeline\":%d,\"requests\":%llu,"
+               "\"errors\":%llu,\"seconds\":%.3f,\"ops_per_sec\":%.1f,\"bytes_in\":%llu,\"bytes_out\":%llu,",
+               g_opt.rate > 0 ? "open" : "closed", g_opt.cluster ? g_slots.nnodes : 1, g_opt.connections,
+               g_opt.threads, g_opt.pipeline, (unsigned long long)completed, (unsigned long long)errors, elapsed, throughput,
+               (unsigned long long)bytes_in, (unsigned long long)bytes_out);
+        print_latency_json("latency_us", corrected);
+        printf(",");
+        print_latency_json("service_latency_us", service);
+        printf("}\n");
+    }
+    else
+    {
+        printf("%s loop, %d connection(s) on %d thread(s), pipeline %d\n", g_opt.rate > 0 ? "open" : "closed",
+               g_opt.connections, g_opt.threads, g_opt.pipeline);
+        if (g_opt.cluster)
+        {
+            printf("cluster of %d node(s)\n", g_slots.nnodes);
+        }
+        printf("requests: %llu  errors: %llu  seconds: %.3f  throughput: %.1f ops/s\n",
+               (unsigned long long)completed, (unsigned long long)errors, elapsed, throughput);
+        printf("bytes in: %llu  bytes out: %llu\n", (unsigned long long)bytes_in, (unsigned long long)bytes_out);
+        printf("latency (usec)     p50        p90        p99      p99.9     p99.99        max\n");
+        print_latency_text("corrected", corrected);
+        print_latency_text("service", service);
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,8 @@
+#ifndef BENCH_HEADER
+#define BENCH_HEADER
+
+// Load generator behind `client bench ...`; argv[0] is "bench".
+// Returns the process exit code.
+int run_bench(int argc, char **argv);
+
+#endif
@@ -4,175 +4,325 @@
 #include <stdio.h>
 #include <errno.h>
 #include <unistd.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <netinet/ip.h>
-#include <assert.h>
+#include <stdbool.h>
+#include "bench.h"
+#include "cluster.h"
+#include "customredis.h"
 
-const size_t k_max_msg = 4096;
+static void msg(const char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+}
+
+// A space separated command, its arguments pointing into the text.
+typedef struct
+{
+    cr_slice *args;
+    uint32_t nargs;
+} command;
 
-static int32_t read_full(int fd, char *buf, size_t n)
+static bool split_command(const char *text, command *cmd)
 {
-    while (n > 0)
+    cmd->nargs = 0;
+    cmd->args = (cr_slice *)malloc((strlen(text) / 2 + 1) * sizeof(cr_slice));
+    if (!cmd->args)
     {
-        ssize_t rv = read(fd, buf, n);
-        if (rv <= 0)
-        {
-            return -1;
-        }
-        assert((size_t)rv <= n);
-        n -= (size_t)rv;
-        buf += rv;
+        msg("malloc failed");
+        return false;
     }
-    return 0;
+    const char *cur = text;
+    while (*(cur += strspn(cur, " ")))
+    {
+        size_t len = strcspn(cur, " ");
+        cmd->args[cmd->nargs].data = cur;
+        cmd->args[cmd->nargs++].len = len;
+        cur += len;
+    }
+    return true;
 }
 
-static int32_t write_all(int fd, const char *buf, size_t n)
+// Prints one reply value.
+static void print_response(const cr_reply *reply)
 {
-    while (n > 0)
+    switch (reply->type)
     {
-        ssize_t rv = write(fd, buf, n);
-        if (rv <= 0)
+    case CR_NIL:
+        printf("(nil)\n");
+        break;
+    case CR_ERR:
+        printf("(err) %u %.*s\n", reply->code, (int)reply->len, (const char *)reply->str);
+        break;
+    case CR_STR:
+        printf("(str) %.*s\n", (int)reply->len, (const char *)reply->str);
+        break;
+    case CR_INT:
+        printf("(int) %lld\n", (long long)reply->integer);
+        break;
+    case CR_DBL:
+        printf("(dbl) %g\n", reply->dbl);
+        break;
+    case CR_ARR:
+        printf("(arr) len=%zu\n", reply->count);
+        for (size_t i = 0; i < reply->count; i++)
         {
-            return -1;
+            print_response(&reply->elements[i]);
         }
-        assert((size_t)rv <= n);
-        n -= (size_t)rv;
-        buf += rv;
+        printf("(arr) end\n");
+        break;
     }
-    return 0;
 }
 
-static void msg(const char *msg)
+// Where requests go: a single server, or in cluster mode the node serving
+// each key's slot, with a client per node opened on first use.
+typedef struct
 {
-    fprintf(stderr, "%s\n", msg);
-}
+    bool cluster;
+    slot_map map;
+    cr_client *clients[CLUSTER_MAX_NODES];
+} router;
 
-static int32_t query(int fd, const char *text)
+static bool init_router(router *r, const char *host, int port, bool cluster)
 {
-    uint32_t length = (uint32_t)strlen(text);
-    if (length > k_max_msg)
+    r->cluster = cluster;
+    init_slot_map(&r->map);
+    memset(r->clients, 0, sizeof(r->clients));
+    // node 0 is the seed; the slot map lists it again when it serves slots
+    slot_map_node(&r->map, host, port);
+    if (!cluster)
     {
-        return -1;
+        return true;
     }
-
-    char write_buffer[4 + k_max_msg];
-    memcpy(write_buffer, &length, 4);
-    memcpy(&write_buffer[4], text, length);
-
-    int32_t err = write_all(fd, write_buffer, 4 + length);
-    if (err)
+    int fd = connect_node(host, port);
+    slot_map learned;
+    bool ok = fd >= 0 && fetch_slot_map(fd, &learned);
+    if (fd >= 0)
     {
-        return err;
+        close(fd);
     }
-
-    uint32_t resp_len;
-    err = read_full(fd, (char *)&resp_len, 4);
-    if (err)
+    if (!ok)
     {
-        msg(errno == 0 ? "EOF" : "read() error");
-        return err;
+        msg("cannot fetch the slot map");
+        return false;
     }
-
-    if (resp_len > k_max_msg)
+    for (int slot = 0; slot < CLUSTER_SLOTS; slot++)
     {
-        msg("response too long");
-        return -1;
+        int node = learned.slot_node[slot];
+        if (node >= 0)
+        {
+            r->map.slot_node[slot] = (int16_t)slot_map_node(&r->map, learned.nodes[node].host, learned.nodes[node].port);
+        }
     }
+    return true;
+}
 
-    // Read response message
-    char read_buffer[k_max_msg + 1];
-    err = read_full(fd, read_buffer, resp_len);
-    if (err)
+static void close_router(router *r)
+{
+    for (int i = 0; i < r->map.nnodes; i++)
     {
-        msg("read() error");
-        return err;
+        if (r->clients[i])
+        {
+            cr_close(r->clients[i]);
+        }
     }
-
-    read_buffer[resp_len] = '\0';
-    printf("server says: %s\n", read_buffer);
-    return 0;
 }
 
-static int32_t bulk_query(int fd, const char *queries[], size_t num_queries)
+static cr_client *node_client(router *r, int node)
 {
-    // Calculate total buffer size needed
-    size_t total_size = 8; // 4 bytes for marker + 4 bytes for num_queries
-    for (size_t i = 0; i < num_queries; i++)
+    if (!r->clients[node])
     {
-        total_size += 4 + strlen(queries[i]); // 4 bytes length + message
+        cr_options options = {};
+        options.host = r->map.nodes[node].host;
+        options.port = r->map.nodes[node].port;
+        r->clients[node] = cr_connect(&options);
+        if (!r->clients[node])
+        {
+            fprintf(stderr, "cannot connect to %s:%d\n", r->map.nodes[node].host, r->map.nodes[node].port);
+        }
     }
+    return r->clients[node];
+}
 
-    // Allocate buffer
-    char *buffer = malloc(total_size);
-    if (!buffer)
+// Every command takes its key as the first argument, if it has one. Commands
+// without a key go to the seed node.
+static int route(router *r, const command *cmd)
+{
+    if (!r->cluster || cmd->nargs < 2)
     {
-        msg("malloc failed");
-        return -1;
+        return 0;
     }
+    int node = r->map.slot_node[key_slot((const uint8_t *)cmd->args[1].data, cmd->args[1].len)];
+    return node < 0 ? 0 : node;
+}
 
-    // Write marker and number of queries
-    uint32_t marker = 0xFFFFFFFF;
-    uint32_t queries_count = (uint32_t)num_queries;
-    memcpy(buffer, &marker, 4);
-    memcpy(buffer + 4, &queries_count, 4);
+typedef enum
+{
+    REDIRECT_NONE,
+    REDIRECT_MOVED,
+    REDIRECT_ASK,
+    REDIRECT_TRYAGAIN,
+} redirect;
 
-    // Write each query
-    size_t offset = 8;
-    for (size_t i = 0; i < num_queries; i++)
+// Tells a redirect error apart from a reply; MOVED updates the slot map and
+// both it and ASK set node to where the slot is.
+static redirect check_redirect(router *r, const cr_reply *reply, int *node)
+{
+    if (!r->cluster || reply->type != CR_ERR)
+    {
+        return REDIRECT_NONE;
+    }
+    if (reply->code == ERR_TRYAGAIN)
+    {
+        return REDIRECT_TRYAGAIN;
+    }
+    char text[96], host[48];
+    unsigned slot;
+    int port;
+    if ((reply->code != ERR_MOVED && reply->code != ERR_ASK) || reply->len >= sizeof(text))
     {
-        uint32_t len = (uint32_t)strlen(queries[i]);
-        memcpy(buffer + offset, &len, 4);
-        memcpy(buffer + offset + 4, queries[i], len);
-        offset += 4 + len;
+        return REDIRECT_NONE;
     }
+    memcpy(text, reply->str, reply->len);
+    text[reply->len] = '\0';
+    char *addr = strchr(text, ' ');
+    if (sscanf(text, "%u", &slot) != 1 || slot >= CLUSTER_SLOTS || !addr ||
+        !parse_node_addr(addr + 1, host, sizeof(host), &port) || (*node = slot_map_node(&r->map, host, port)) < 0)
+    {
+        return REDIRECT_NONE;
+    }
+    if (reply->code == ERR_MOVED)
+    {
+        r->map.slot_node[slot] = (int16_t)*node;
+        return REDIRECT_MOVED;
+    }
+    return REDIRECT_ASK;
+}
 
-    // Send bulk request
-    int32_t err = write_all(fd, buffer, total_size);
-    free(buffer);
-    if (err)
+// Waits for a request's reply, -1 if none came.
+static int32_t wait_reply(cr_future *future)
+{
+    int status = future ? cr_wait(future, -1) : CR_ENOMEM;
+    if (status != CR_OK)
     {
-        return err;
+        msg(cr_strerror(status));
+        return -1;
     }
+    return 0;
+}
 
-    // Read responses
-    for (size_t i = 0; i < num_queries; i++)
+#define MAX_REDIRECTS 16
+#define TRYAGAIN_US 10000
+
+// Follows the redirects of a request whose reply future holds until a real
+// reply arrives; *future then holds that.
+static int32_t follow_redirects(router *r, const command *cmd, cr_future **future)
+{
+    for (int attempt = 0; attempt < MAX_REDIRECTS; attempt++)
     {
-        uint32_t resp_len;
-        err = read_full(fd, (char *)&resp_len, 4);
-        if (err)
+        int node;
+        redirect kind = check_redirect(r, cr_future_reply(*future), &node);
+        if (kind == REDIRECT_NONE)
         {
-            msg(errno == 0 ? "EOF" : "read() error");
-            return err;
+            return 0;
         }
-
-        if (resp_len > k_max_msg)
+        cr_future_free(*future);
+        *future = NULL;
+        if (kind == REDIRECT_TRYAGAIN)
+        {
+            usleep(TRYAGAIN_US);
+            node = route(r, cmd);
+        }
+        cr_client *client = node_client(r, node);
+        if (!client)
         {
-            msg("response too long");
             return -1;
         }
-
-        char read_buffer[k_max_msg + 1];
-        err = read_full(fd, read_buffer, resp_len);
-        if (err)
+        // ASKING lets the next request at a slot still being imported
+        cr_request req = {cmd->args, cmd->nargs, kind == REDIRECT_ASK ? CR_ASKING : 0u, NULL, 0};
+        *future = cr_send(client, &req);
+        if (wait_reply(*future))
         {
-            msg("read() error");
-            return err;
+            return -1;
         }
+    }
+    return 0;
+}
+
+// Sends one command to the node its key maps to and waits for the real
+// reply, which the caller frees with its future.
+static int32_t request(router *r, const command *cmd, cr_future **future)
+{
+    cr_client *client = node_client(r, route(r, cmd));
+    if (!client)
+    {
+        return -1;
+    }
+    cr_request req = {cmd->args, cmd->nargs, 0, NULL, 0};
+    *future = cr_send(client, &req);
+    return wait_reply(*future) ? -1 : follow_redirects(r, cmd, future);
+}
 
-        read_buffer[resp_len] = '\0';
-        printf("server response %zu: %s\n", i + 1, read_buffer);
+static int32_t query(router *r, const char *text)
+{
+    command cmd;
+    if (!split_command(text, &cmd))
+    {
+        return -1;
+    }
+    cr_future *future = NULL;
+    int32_t err = request(r, &cmd, &future);
+    if (!err)
+    {
+        print_response(cr_future_reply(future));
     }
+    cr_future_free(future);
+    free(cmd.args);
+    return err;
+}
 
-    return 0;
+// Sends every query before waiting on any, so they share connections and
+// writes on each node, and prints the replies in query order. Redirected
+// queries are sent again one by one.
+static int32_t bulk_query(router *r, const char *queries[], size_t num_queries)
+{
+    command *cmds = (command *)calloc(num_queries, sizeof(command));
+    cr_future **futures = (cr_future **)calloc(num_queries, sizeof(cr_future *));
+    int32_t err = cmds && futures ? 0 : -1;
+    if (err)
+    {
+        msg("malloc failed");
+    }
+    for (size_t i = 0; !err && i < num_queries; i++)
+    {
+        cr_client *client = split_command(queries[i], &cmds[i]) ? node_client(r, route(r, &cmds[i])) : NULL;
+        cr_request req = {cmds[i].args, cmds[i].nargs, 0, NULL, 0};
+        futures[i] = client ? cr_send(client, &req) : NULL;
+        err = futures[i] ? 0 : -1;
+    }
+    for (size_t i = 0; !err && i < num_queries; i++)
+    {
+        err = wait_reply(futures[i]) ? -1 : follow_redirects(r, &cmds[i], &futures[i]);
+    }
+    for (size_t i = 0; !err && i < num_queries; i++)
+    {
+        printf("server response %zu: ", i + 1);
+        print_response(cr_future_reply(futures[i]));
+    }
+    for (size_t i = 0; cmds && futures && i < num_queries; i++)
+    {
+        cr_future_free(futures[i]);
+        free(cmds[i].args);
+    }
+    free(cmds);
+    free(futures);
+    return err;
 }
 
-static int32_t multi_query(int fd, const char *queries[], size_t num_queries)
+static int32_t multi_query(router *r, const char *queries[], size_t num_queries)
 {
     for (size_t i = 0; i < num_queries; i++)
     {
         printf("Sending query: %s\n", queries[i]);
-        int32_t err = query(fd, queries[i]);
+        int32_t err = query(r, queries[i]);
         if (err)
             return err;
     }
@@ -186,27 +336,215 @@ static void die(const char *msg)
     abort();
 }
 
-int main()
+// Runs one command on a node and fails on an error reply, which is printed.
+static bool node_command(cr_client *client, const char *addr, const char *text)
+{
+    command cmd;
+    if (!split_command(text, &cmd))
+    {
+        return false;
+    }
+    cr_request req = {cmd.args, cmd.nargs, 0, NULL, 0};
+    cr_future *future = cr_send(client, &req);
+    bool ok = wait_reply(future) == 0;
+    if (ok && cr_future_reply(future)->type == CR_ERR)
+    {
+        printf("%s: %s: ", addr, text);
+        print_response(cr_future_reply(future));
+        ok = false;
+    }
+    cr_future_free(future);
+    free(cmd.args);
+    return ok;
+}
+
+static cr_client *connect_addr(const char *addr)
+{
+    char host[48];
+    cr_options options = {};
+    options.host = host;
+    options.connections = 1;
+    if (!parse_node_addr(addr, host, sizeof(host), &options.port))
+    {
+        fprintf(stderr, "expected host:port, got %s\n", addr);
+        return NULL;
+    }
+    cr_client *client = cr_connect(&options);
+    if (!client)
+    {
+        fprintf(stderr, "cannot connect to %s\n", addr);
+    }
+    return client;
+}
+
+// Splits the slots evenly over the nodes, in the order given, and tells
+// every node the whole map.
+static int cluster_create(char **addrs, int count)
+{
+    if (count < 1 || count > CLUSTER_MAX_NODES)
+    {
+        fprintf(stderr, "expected 1 to %d nodes\n", CLUSTER_MAX_NODES);
+        return 1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        cr_client *client = connect_addr(addrs[i]);
+        if (!client)
+        {
+            return 1;
+        }
+        bool ok = true;
+        for (int owner = 0; ok && owner < count; owner++)
+        {
+            char text[128];
+            snprintf(text, sizeof(text), "cluster setslot %d-%d node %s", owner * CLUSTER_SLOTS / count,
+                     (owner + 1) * CLUSTER_SLOTS / count - 1, addrs[owner]);
+            ok = node_command(client, addrs[i], text);
+        }
+        cr_close(client);
+        if (!ok)
+        {
+            return 1;
+        }
+    }
+    printf("%d slots over %d node(s)\n", CLUSTER_SLOTS, count);
+    return 0;
+}
+
+#define MIGRATE_POLL_US 100000
+
+// Moves slots from one node to another while both keep serving: the target
+// imports, the source migrates its keys over and switches the slots to the
+// target once it has none left, then the other nodes learn the new owner.
+static int cluster_migrate(const char *slots, const char *from, const char *to)
+{
+    char text[128];
+    char host[48], from_host[48];
+    int port, from_port, first, last;
+    char *end;
+    first = (int)strtol(slots, &end, 10);
+    last = *end == '-' ? (int)strtol(end + 1, NULL, 10) : first;
+    if (!parse_node_addr(to, host, sizeof(host), &port) ||
+        !parse_node_addr(from, from_host, sizeof(from_host), &from_port))
+    {
+        fprintf(stderr, "expected host:port, got %s %s\n", from, to);
+        return 1;
+    }
+    cr_client *from_client = connect_addr(from);
+    cr_client *to_client = from_client ? connect_addr(to) : NULL;
+    // the slot map is polled over a plain blocking connection
+    int map_fd = to_client ? connect_node(from_host, from_port) : -1;
+    slot_map map;
+    bool ok = map_fd >= 0;
+    if (ok)
+    {
+        snprintf(text, sizeof(text), "cluster setslot %s importing %s", slots, from);
+        ok = node_command(to_client, to, text);
+    }
+    if (ok)
+    {
+        snprintf(text, sizeof(text), "cluster setslot %s migrating %s", slots, to);
+        ok = node_command(from_client, from, text);
+    }
+    uint64_t waited = 0;
+    while (ok)
+    {
+        ok = fetch_slot_map(map_fd, &map);
+        int owner = ok ? map.slot_node[last] : -1;
+        if (owner >= 0 && map.slot_node[first] == owner && map.nodes[owner].port == port &&
+            strcmp(map.nodes[owner].host, host) == 0)
+        {
+            break;
+        }
+        usleep(MIGRATE_POLL_US);
+        if (++waited % 50 == 0)
+        {
+            printf("still migrating after %llus\n", (unsigned long long)(waited / 10));
+        }
+    }
+    if (map_fd >= 0)
+    {
+        close(map_fd);
+    }
+    if (to_client)
+    {
+        cr_close(to_client);
+    }
+    if (from_client)
+    {
+        cr_close(from_client);
+    }
+    for (int i = 0; ok && i < map.nnodes; i++)
+    {
+        char addr[64];
+        snprintf(addr, sizeof(addr), "%s:%d", map.nodes[i].host, map.nodes[i].port);
+        if (strcmp(addr, from) == 0 || strcmp(addr, to) == 0)
+        {
+            continue;
+        }
+        cr_client *client = connect_addr(addr);
+        snprintf(text, sizeof(text), "cluster setslot %s node %s", slots, to);
+        ok = client && node_command(client, addr, text);
+        if (client)
+        {
+            cr_close(client);
+        }
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "migration of slots %s failed\n", slots);
+        return 1;
+    }
+    printf("slots %s moved from %s to %s\n", slots, from, to);
+    return 0;
+}
+
+static void usage(void)
 {
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0)
+    fprintf(stderr, "usage: client [--cluster HOST:PORT]\n"
+                    "       client cluster create HOST:PORT...\n"
+                    "       client cluster migrate SLOT[-SLOT] FROM_HOST:PORT TO_HOST:PORT\n"
+                    "       client bench [options]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        return run_bench(argc - 1, argv + 1);
+    }
+    if (argc > 2 && strcmp(argv[1], "cluster") == 0 && strcmp(argv[2], "create") == 0)
     {
-        die("socket");
+        return cluster_create(argv + 3, argc - 3);
+    }
+    if (argc == 6 && strcmp(argv[1], "cluster") == 0 && strcmp(argv[2], "migrate") == 0)
+    {
+        return cluster_migrate(argv[3], argv[4], argv[5]);
     }
 
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(1234);
-    addr.sin_addr.s_addr = ntohl(INADDR_LOOPBACK);
-    int rv = connect(fd, (const struct sockaddr *)&addr, sizeof(addr));
-    if (rv)
+    // the demo below runs against one server, or routes each key to its
+    // node in cluster mode
+    char host[48] = "127.0.0.1";
+    int port = 1234;
+    bool cluster = argc == 3 && strcmp(argv[1], "--cluster") == 0;
+    if ((argc > 1 && !cluster) || (cluster && !parse_node_addr(argv[2], host, sizeof(host), &port)))
+    {
+        usage();
+    }
+    router r;
+    if (!init_router(&r, host, port, cluster))
+    {
+        return 1;
+    }
+    if (!node_client(&r, 0))
     {
         die("connect()");
     }
 
     // Example of a single query
     printf("Sending a single query...\n");
-    int32_t err = query(fd, "Hello server");
+    int32_t err = query(&r, "set greeting hello");
     if (err)
     {
         goto L_DONE;
@@ -215,20 +553,26 @@ int main()
     // Example of multiple queries
     printf("\nSending multiple queries...\n");
     const char *multiple_queries[] = {
-        "Query 1",
-        "Query 2",
-        "Query 3"};
-    err = multi_query(fd, multiple_queries, 3);
+        "get greeting",
+        "exists greeting",
+        "del greeting",
+        "get greeting"};
+    err = multi_query(&r, multiple_queries, 4);
+    if (err)
+    {
+        goto L_DONE;
+    }
 
     // Example of bulk queries
     printf("\nSending bulk queries...\n");
     const char *bulk_queries[] = {
-        "Query 1",
-        "Query 2",
-        "Query 3"};
-    err = bulk_query(fd, bulk_queries, 3);
+        "set k1 v1",
+        "set k2 v2",
+        "get k1",
+        "get k2"};
+    err = bulk_query(&r, bulk_queries, 4);
 
 L_DONE:
-    close(fd);
+    close_router(&r);
     return 0;
-}
\ No newline at end of file
+}
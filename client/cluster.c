@@ -0,0 +1,228 @@
+#include "cluster.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#define TAG_INT 3
+#define TAG_STR 2
+#define TAG_ARR 5
+// CLUSTER SLOTS lists one entry per run of slots, so this is plenty
+#define MAX_SLOTS_REPLY (1 << 20)
+
+// CRC16-CCITT (XMODEM), the same table the server picks slots with.
+static const uint16_t crc16_table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,};
+
+uint32_t key_slot(const uint8_t *key, size_t len)
+{
+    const uint8_t *open = (const uint8_t *)memchr(key, '{', len);
+    if (open)
+    {
+        size_t after = (size_t)(open - key) + 1;
+        const uint8_t *close = (const uint8_t *)memchr(open + 1, '}', len - after);
+        if (close && close > open + 1)
+        {
+            key = open + 1;
+            len = (size_t)(close - key);
+        }
+    }
+    uint16_t crc = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        crc = (uint16_t)(crc << 8) ^ crc16_table[((crc >> 8) ^ key[i]) & 0xFF];
+    }
+    return crc & (CLUSTER_SLOTS - 1);
+}
+
+void init_slot_map(slot_map *map)
+{
+    map->nnodes = 0;
+    for (int slot = 0; slot < CLUSTER_SLOTS; slot++)
+    {
+        map->slot_node[slot] = -1;
+    }
+}
+
+int slot_map_node(slot_map *map, const char *host, int port)
+{
+    for (int i = 0; i < map->nnodes; i++)
+    {
+        if (map->nodes[i].port == port && strcmp(map->nodes[i].host, host) == 0)
+        {
+            return i;
+        }
+    }
+    if (map->nnodes == CLUSTER_MAX_NODES)
+    {
+        return -1;
+    }
+    cluster_node *node = &map->nodes[map->nnodes];
+    snprintf(node->host, sizeof(node->host), "%s", host);
+    node->port = port;
+    return map->nnodes++;
+}
+
+bool parse_node_addr(const char *addr, char *host, size_t host_size, int *port)
+{
+    const char *colon = strrchr(addr, ':');
+    if (!colon || colon == addr || (size_t)(colon - addr) >= host_size)
+    {
+        return false;
+    }
+    char *end;
+    long value = strtol(colon + 1, &end, 10);
+    if (*end != '\0' && *end != ' ')
+    {
+        return false;
+    }
+    if (end == colon + 1 || value < 1 || value > 65535)
+    {
+        return false;
+    }
+    memcpy(host, addr, (size_t)(colon - addr));
+    host[colon - addr] = '\0';
+    *port = (int)value;
+    return true;
+}
+
+int connect_node(const char *host, int port)
+{
+    char service[8];
+    snprintf(service, sizeof(service), "%d", port);
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *found = NULL;
+    if (getaddrinfo(host, service, &hints, &found) != 0)
+    {
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, found->ai_addr, found->ai_addrlen) != 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(found);
+    return fd;
+}
+
+static bool io_full(int fd, uint8_t *buf, size_t n, bool writing)
+{
+    while (n > 0)
+    {
+        ssize_t rv = writing ? write(fd, buf, n) : read(fd, buf, n);
+        if (rv <= 0)
+        {
+            return false;
+        }
+        n -= (size_t)rv;
+        buf += rv;
+    }
+    return true;
+}
+
+static bool take(const uint8_t **p, const uint8_t *end, void *out, size_t n)
+{
+    if ((size_t)(end - *p) < n)
+    {
+        return false;
+    }
+    memcpy(out, *p, n);
+    *p += n;
+    return true;
+}
+
+static bool take_int(const uint8_t **p, const uint8_t *end, int64_t *value)
+{
+    uint8_t tag;
+    return take(p, end, &tag, 1) && tag == TAG_INT && take(p, end, value, 8);
+}
+
+bool fetch_slot_map(int fd, slot_map *map)
+{
+    // CLUSTER SLOTS as one request frame
+    uint8_t frame[4 + 4 + (4 + 7) + (4 + 5)];
+    uint32_t words[] = {sizeof(frame) - 4, 2, 7};
+    memcpy(frame, words, sizeof(words));
+    memcpy(frame + 12, "CLUSTER", 7);
+    words[0] = 5;
+    memcpy(frame + 19, words, 4);
+    memcpy(frame + 23, "SLOTS", 5);
+    uint32_t len = 0;
+    if (!io_full(fd, frame, sizeof(frame), true) || !io_full(fd, (uint8_t *)&len, 4, false) ||
+        len > MAX_SLOTS_REPLY)
+    {
+        return false;
+    }
+    uint8_t *reply = (uint8_t *)malloc(len);
+    if (!reply || !io_full(fd, reply, len, false))
+    {
+        free(reply);
+        return false;
+    }
+    const uint8_t *p = reply;
+    const uint8_t *end = reply + len;
+    uint8_t tag;
+    uint32_t count;
+    bool ok = take(&p, end, &tag, 1) && tag == TAG_ARR && take(&p, end, &count, 4);
+    init_slot_map(map);
+    for (uint32_t i = 0; ok && i < count; i++)
+    {
+        uint32_t fields, host_len;
+        int64_t first, last, port;
+        char host[48];
+        ok = take(&p, end, &tag, 1) && tag == TAG_ARR && take(&p, end, &fields, 4) && fields == 4 &&
+             take_int(&p, end, &first) && take_int(&p, end, &last) && take(&p, end, &tag, 1) &&
+             tag == TAG_STR && take(&p, end, &host_len, 4) && host_len < sizeof(host) &&
+             take(&p, end, host, host_len) && take_int(&p, end, &port) && first >= 0 && first <= last &&
+             last < CLUSTER_SLOTS;
+        if (!ok)
+        {
+            break;
+        }
+        host[host_len] = '\0';
+        int node = slot_map_node(map, host, (int)port);
+        ok = node >= 0;
+        for (int64_t slot = first; ok && slot <= last; slot++)
+        {
+            map->slot_node[slot] = (int16_t)node;
+        }
+    }
+    free(reply);
+    return ok;
+}
@@ -0,0 +1,52 @@
+#ifndef CLUSTER_HEADER
+#define CLUSTER_HEADER
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Client side of the server's cluster mode: which node serves a key's hash
+// slot, learned from CLUSTER SLOTS and corrected by MOVED replies.
+#define CLUSTER_SLOTS 16384
+#define CLUSTER_MAX_NODES 64
+
+// reply error codes a cluster node redirects with; the message is
+// "<slot> <host:port>" for the first two
+#define ERR_MOVED 10
+#define ERR_ASK 11
+#define ERR_TRYAGAIN 12
+#define ERR_CLUSTERDOWN 13
+
+typedef struct
+{
+    char host[48];
+    int port;
+} cluster_node;
+
+typedef struct
+{
+    int nnodes;
+    cluster_node nodes[CLUSTER_MAX_NODES];
+    // index into nodes, -1 while unknown
+    int16_t slot_node[CLUSTER_SLOTS];
+} slot_map;
+
+// CRC16 of the key, or of its non-empty {hash tag}, as the server hashes it.
+uint32_t key_slot(const uint8_t *key, size_t len);
+
+void init_slot_map(slot_map *map);
+
+// The index of host:port in the map, added when new; -1 when it is full.
+int slot_map_node(slot_map *map, const char *host, int port);
+
+// Splits "host:port"; false when it is not one.
+bool parse_node_addr(const char *addr, char *host, size_t host_size, int *port);
+
+// Blocking connect to host:port, -1 on failure.
+int connect_node(const char *host, int port);
+
+// Fills the map from the CLUSTER SLOTS reply of the node behind the blocking
+// socket fd. False on any error.
+bool fetch_slot_map(int fd, slot_map *map);
+
+#endif
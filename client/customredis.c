@@ -0,0 +1,1146 @@
+#define _GNU_SOURCE
+#include "customredis.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#define DEFAULT_CONNECTIONS 2
+#define DEFAULT_CONNECT_TIMEOUT_MS 1000
+#define MAX_CONNECTIONS 256
+// the largest request frame the server takes (its k_max_msg)
+#define MAX_REQUEST (32u << 20)
+#define READ_CHUNK (64 * 1024)
+// a reply frame at least this long that is not all buffered yet is received
+// in place instead of through the read buffer
+#define DIRECT_MIN (64 * 1024)
+// pause after a failed connect before the next one
+#define RECONNECT_MS 100
+// arrays nest this deep at most
+#define MAX_DEPTH 32
+
+// A request waiting for its reply, in the order the replies will arrive.
+typedef struct
+{
+    cr_callback callback;
+    void *arg;
+    cr_future *future;
+    void *into;
+    size_t into_cap;
+    uint64_t queued_ms;
+    // the reply to an ASKING added for CR_ASKING, dropped
+    bool skip;
+} pending;
+
+typedef struct
+{
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+} bytes;
+
+enum
+{
+    CONN_DOWN,
+    CONN_CONNECTING,
+    CONN_UP,
+};
+
+// where the bytes of the reply being received go
+enum
+{
+    // the read buffer, for everything but the rest of a large reply
+    RX_BUFFER,
+    // a frame of its own, handed over to a future or freed after the callback
+    RX_FRAME,
+    // the string of a large reply, into the caller's buffer
+    RX_INTO,
+};
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    // under the lock: request frames not yet taken for writing, and the
+    // requests whose replies are still to come, oldest at head
+    bytes out;
+    pending *queue;
+    size_t head;
+    size_t count;
+    size_t cap;
+
+    // the I/O thread's alone, but state is read by submitters choosing a
+    // connection
+    _Atomic int state;
+    int fd;
+    uint64_t connect_deadline;
+    uint64_t retry_at;
+    // frames taken from out, written up to written
+    bytes writing;
+    size_t written;
+    bytes in;
+    int rx;
+    uint8_t *frame;
+    size_t frame_len;
+    size_t frame_got;
+    pending into_request;
+    size_t into_len;
+    size_t into_got;
+} conn;
+
+struct cr_client
+{
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    int timeout_ms;
+    int connect_timeout_ms;
+    conn *conns;
+    int nconns;
+    _Atomic unsigned next_conn;
+    int wake_fd;
+    // set by submitters to poke the I/O thread once until it looks again
+    _Atomic bool wake_pending;
+    _Atomic bool closing;
+    pthread_t thread;
+    _Atomic uint64_t requests;
+    _Atomic uint64_t replies;
+    _Atomic uint64_t writes;
+    _Atomic uint64_t reads;
+    _Atomic uint64_t reconnects;
+};
+
+struct cr_future
+{
+    pthread_mutex_t lock;
+    pthread_cond_t completed;
+    bool done;
+    int status;
+    // the reply tree and the frame its strings point into
+    cr_reply *reply;
+    uint8_t *frame;
+    // the caller's and the I/O thread's
+    _Atomic int refs;
+};
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static bool reserve(bytes *b, size_t needed)
+{
+    if (needed <= b->cap)
+    {
+        return true;
+    }
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < needed)
+    {
+        cap *= 2;
+    }
+    uint8_t *data = (uint8_t *)realloc(b->data, cap);
+    if (!data)
+    {
+        return false;
+    }
+    b->data = data;
+    b->cap = cap;
+    return true;
+}
+
+static void put_u32(uint8_t *p, uint32_t value)
+{
+    memcpy(p, &value, 4);
+}
+
+static uint32_t get_u32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+// Reply parsing: a first pass counts the values so the tree is a single
+// allocation, a second fills it in.
+static bool count_values(const uint8_t *data, size_t len, size_t *pos, size_t *values, int depth)
+{
+    if (*pos >= len || depth > MAX_DEPTH)
+    {
+        return false;
+    }
+    uint8_t tag = data[(*pos)++];
+    size_t left = len - *pos;
+    (*values)++;
+    switch (tag)
+    {
+    case CR_NIL:
+        return true;
+    case CR_ERR:
+        if (left < 8 || left - 8 < get_u32(data + *pos + 4))
+        {
+            return false;
+        }
+        *pos += 8 + get_u32(data + *pos + 4);
+        return true;
+    case CR_STR:
+        if (left < 4 || left - 4 < get_u32(data + *pos))
+        {
+            return false;
+        }
+        *pos += 4 + get_u32(data + *pos);
+        return true;
+    case CR_INT:
+    case CR_DBL:
+        if (left < 8)
+        {
+            return false;
+        }
+        *pos += 8;
+        return true;
+    case CR_ARR:
+    {
+        if (left < 4)
+        {
+            return false;
+        }
+        uint32_t count = get_u32(data + *pos);
+        *pos += 4;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (!count_values(data, len, pos, values, depth + 1))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+// Fills in out from a value count_values accepted; arrays take their
+// elements from *spare onwards.
+static void fill_value(const uint8_t *data, size_t *pos, cr_reply *out, cr_reply **spare)
+{
+    memset(out, 0, sizeof(*out));
+    out->type = (cr_type)data[(*pos)++];
+    switch (out->type)
+    {
+    case CR_NIL:
+        break;
+    case CR_ERR:
+        out->code = get_u32(data + *pos);
+        out->len = get_u32(data + *pos + 4);
+        out->str = data + *pos + 8;
+        *pos += 8 + out->len;
+        break;
+    case CR_STR:
+        out->len = get_u32(data + *pos);
+        out->str = data + *pos + 4;
+        *pos += 4 + out->len;
+        break;
+    case CR_INT:
+        memcpy(&out->integer, data + *pos, 8);
+        *pos += 8;
+        break;
+    case CR_DBL:
+        memcpy(&out->dbl, data + *pos, 8);
+        *pos += 8;
+        break;
+    case CR_ARR:
+        out->count = get_u32(data + *pos);
+        *pos += 4;
+        out->elements = *spare;
+        *spare += out->count;
+        for (size_t i = 0; i < out->count; i++)
+        {
+            fill_value(data, pos, &out->elements[i], spare);
+        }
+        break;
+    }
+}
+
+// The reply tree of a whole frame, or NULL when it is malformed (*status
+// CR_EPROTO) or on out of memory (*status CR_ENOMEM).
+static cr_reply *parse_reply(const uint8_t *data, size_t len, int *status)
+{
+    size_t pos = 0, values = 0;
+    if (!count_values(data, len, &pos, &values, 0) || pos != len)
+    {
+        *status = CR_EPROTO;
+        return NULL;
+    }
+    cr_reply *tree = (cr_reply *)malloc(values * sizeof(cr_reply));
+    if (!tree)
+    {
+        *status = CR_ENOMEM;
+        return NULL;
+    }
+    cr_reply *spare = tree + 1;
+    pos = 0;
+    fill_value(data, &pos, tree, &spare);
+    return tree;
+}
+
+static void release_future(cr_future *future)
+{
+    if (atomic_fetch_sub(&future->refs, 1) == 1)
+    {
+        pthread_mutex_destroy(&future->lock);
+        pthread_cond_destroy(&future->completed);
+        free(future->reply);
+        free(future->frame);
+        free(future);
+    }
+}
+
+// Hands the outcome to whoever waits for it. reply is a tree as
+// parse_reply makes, frame the memory it points into; both are taken over.
+static void complete(const pending *p, int status, cr_reply *reply, uint8_t *frame)
+{
+    if (p->future)
+    {
+        cr_future *future = p->future;
+        pthread_mutex_lock(&future->lock);
+        future->status = status;
+        future->reply = reply;
+        future->frame = frame;
+        future->done = true;
+        pthread_cond_broadcast(&future->completed);
+        pthread_mutex_unlock(&future->lock);
+        release_future(future);
+        return;
+    }
+    if (p->callback)
+    {
+        p->callback(p->arg, status, reply);
+    }
+    free(reply);
+    free(frame);
+}
+
+static bool pop_pending(conn *c, pending *p)
+{
+    pthread_mutex_lock(&c->lock);
+    bool found = c->count > 0;
+    if (found)
+    {
+        *p = c->queue[c->head];
+        c->head = (c->head + 1) % c->cap;
+        c->count--;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return found;
+}
+
+static bool peek_pending(conn *c, pending *p)
+{
+    pthread_mutex_lock(&c->lock);
+    bool found = c->count > 0;
+    if (found)
+    {
+        *p = c->queue[c->head];
+    }
+    pthread_mutex_unlock(&c->lock);
+    return found;
+}
+
+// Drops the connection and fails every request queued on it, sent or not.
+// The next request reconnects, no sooner than retry_at.
+static void fail_conn(conn *c, int status, uint64_t retry_at)
+{
+    if (c->fd >= 0)
+    {
+        close(c->fd);
+        c->fd = -1;
+    }
+    atomic_store(&c->state, CONN_DOWN);
+    c->retry_at = retry_at;
+    c->writing.len = 0;
+    c->written = 0;
+    c->in.len = 0;
+    free(c->frame);
+    c->frame = NULL;
+    // a request receiving in place is still queued and fails with the rest
+    c->rx = RX_BUFFER;
+
+    pthread_mutex_lock(&c->lock);
+    pending *queue = c->queue;
+    size_t head = c->head, count = c->count, cap = c->cap;
+    c->queue = NULL;
+    c->head = c->count = c->cap = 0;
+    c->out.len = 0;
+    pthread_mutex_unlock(&c->lock);
+    for (size_t i = 0; i < count; i++)
+    {
+        const pending *p = &queue[(head + i) % cap];
+        if (!p->skip)
+        {
+            complete(p, status, NULL, NULL);
+        }
+    }
+    free(queue);
+}
+
+// Completes the oldest request with a whole reply frame. frame is the
+// buffer data lies in when the frame is owned, NULL when data is in the read
+// buffer. Returns false when the connection has to be dropped.
+static bool deliver(cr_client *client, conn *c, const uint8_t *data, size_t len, uint8_t *frame)
+{
+    pending p;
+    if (!pop_pending(c, &p))
+    {
+        free(frame);
+        return false;
+    }
+    atomic_fetch_add(&client->replies, 1);
+    if (p.skip)
+    {
+        free(frame);
+        return true;
+    }
+    bool into = p.into && len > 0 && data[0] == CR_STR;
+    if (!frame && p.future && !into)
+    {
+        // the tree has to outlive the read buffer
+        frame = (uint8_t *)malloc(len ? len : 1);
+        if (!frame)
+        {
+            complete(&p, CR_ENOMEM, NULL, NULL);
+            return true;
+        }
+        memcpy(frame, data, len);
+        data = frame;
+    }
+    int status = CR_OK;
+    cr_reply *reply = parse_reply(data, len, &status);
+    if (!reply)
+    {
+        complete(&p, status, NULL, frame);
+        return status != CR_EPROTO;
+    }
+    if (into)
+    {
+        size_t n = reply->len < p.into_cap ? reply->len : p.into_cap;
+        memcpy(p.into, reply->str, n);
+        reply->str = (const uint8_t *)p.into;
+        status = reply->len > p.into_cap ? CR_ETRUNC : CR_OK;
+        if (frame && p.future)
+        {
+            free(frame);
+            frame = NULL;
+        }
+    }
+    complete(&p, status, reply, frame);
+    return true;
+}
+
+// The string of a large reply is all in the caller's buffer.
+static void deliver_into(cr_client *client, conn *c)
+{
+    pending p;
+    pop_pending(c, &p);
+    atomic_fetch_add(&client->replies, 1);
+    cr_reply *reply = (cr_reply *)calloc(1, sizeof(cr_reply));
+    if (!reply)
+    {
+        complete(&p, CR_ENOMEM, NULL, NULL);
+        return;
+    }
+    reply->type = CR_STR;
+    reply->str = (const uint8_t *)p.into;
+    reply->len = c->into_len;
+    complete(&p, c->into_len > p.into_cap ? CR_ETRUNC : CR_OK, reply, NULL);
+}
+
+// Takes the complete replies out of the read buffer. A large reply that is
+// only partly there switches the connection to receiving the rest in place.
+static bool process_buffer(cr_client *client, conn *c)
+{
+    size_t pos = 0;
+    bool ok = true;
+    while (ok && c->in.len - pos >= 4)
+    {
+        size_t len = get_u32(c->in.data + pos);
+        size_t avail = c->in.len - pos - 4;
+        const uint8_t *body = c->in.data + pos + 4;
+        if (avail >= len)
+        {
+            ok = deliver(client, c, body, len, NULL);
+            pos += 4 + len;
+            continue;
+        }
+        if (len < DIRECT_MIN)
+        {
+            ok = reserve(&c->in, c->in.len - pos + len + 4);
+            break;
+        }
+        pending head;
+        if (!peek_pending(c, &head))
+        {
+            return false;
+        }
+        if (head.into && !head.skip)
+        {
+            if (avail < 5)
+            {
+                break;
+            }
+            if (body[0] == CR_STR && (size_t)get_u32(body + 1) + 5 == len)
+            {
+                // the string goes straight to the caller's buffer
+                c->into_len = get_u32(body + 1);
+                c->into_got = avail - 5;
+                size_t n = c->into_got < head.into_cap ? c->into_got : head.into_cap;
+                memcpy(head.into, body + 5, n);
+                c->rx = RX_INTO;
+                pos = c->in.len;
+                break;
+            }
+        }
+        c->frame = (uint8_t *)malloc(len);
+        if (!c->frame)
+        {
+            return false;
+        }
+        memcpy(c->frame, body, avail);
+        c->frame_len = len;
+        c->frame_got = avail;
+        c->rx = RX_FRAME;
+        pos = c->in.len;
+        break;
+    }
+    memmove(c->in.data, c->in.data + pos, c->in.len - pos);
+    c->in.len -= pos;
+    return ok;
+}
+
+// Reads until the socket is drained. Returns false when the connection has
+// to be dropped.
+static bool read_conn(cr_client *client, conn *c)
+{
+    uint8_t discard[4096];
+    while (true)
+    {
+        uint8_t *dst;
+        size_t room;
+        if (c->rx == RX_FRAME)
+        {
+            dst = c->frame + c->frame_got;
+            room = c->frame_len - c->frame_got;
+        }
+        else if (c->rx == RX_INTO)
+        {
+            // past the caller's buffer the rest is read and thrown away
+            pending *p = &c->into_request;
+            size_t left = c->into_len - c->into_got;
+            if (c->into_got < p->into_cap)
+            {
+                dst = (uint8_t *)p->into + c->into_got;
+                room = p->into_cap - c->into_got < left ? p->into_cap - c->into_got : left;
+            }
+            else
+            {
+                dst = discard;
+                room = left < sizeof(discard) ? left : sizeof(discard);
+            }
+        }
+        else
+        {
+            if (!reserve(&c->in, c->in.len + READ_CHUNK))
+            {
+                return false;
+            }
+            dst = c->in.data + c->in.len;
+            room = c->in.cap - c->in.len;
+        }
+        ssize_t n = room ? recv(c->fd, dst, room, MSG_DONTWAIT) : 0;
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return true;
+        }
+        if (n <= 0 && room)
+        {
+            return false;
+        }
+        atomic_fetch_add(&client->reads, 1);
+        if (c->rx == RX_FRAME)
+        {
+            c->frame_got += (size_t)n;
+            if (c->frame_got == c->frame_len)
+            {
+                uint8_t *frame = c->frame;
+                c->frame = NULL;
+                c->rx = RX_BUFFER;
+                if (!deliver(client, c, frame, c->frame_len, frame))
+                {
+                    return false;
+                }
+            }
+        }
+        else if (c->rx == RX_INTO)
+        {
+            c->into_got += (size_t)n;
+            if (c->into_got == c->into_len)
+            {
+                c->rx = RX_BUFFER;
+                deliver_into(client, c);
+            }
+        }
+        else
+        {
+            c->in.len += (size_t)n;
+            if (!process_buffer(client, c))
+            {
+                return false;
+            }
+            if (c->rx == RX_INTO)
+            {
+                // the request stays queued until its string is complete
+                peek_pending(c, &c->into_request);
+                if (c->into_got == c->into_len)
+                {
+                    c->rx = RX_BUFFER;
+                    deliver_into(client, c);
+                }
+            }
+        }
+    }
+}
+
+static bool write_conn(cr_client *client, conn *c)
+{
+    while (c->written < c->writing.len)
+    {
+        ssize_t n = send(c->fd, c->writing.data + c->written, c->writing.len - c->written, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return true;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        atomic_fetch_add(&client->writes, 1);
+        c->written += (size_t)n;
+    }
+    return true;
+}
+
+// Starts a non-blocking connect; the connection is UP, CONNECTING or DOWN
+// after it.
+static void start_connect(cr_client *client, conn *c, uint64_t now)
+{
+    c->fd = socket(client->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0)
+    {
+        fail_conn(c, CR_EIO, now + RECONNECT_MS);
+        return;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, (const struct sockaddr *)&client->addr, client->addr_len) == 0)
+    {
+        atomic_store(&c->state, CONN_UP);
+    }
+    else if (errno == EINPROGRESS)
+    {
+        atomic_store(&c->state, CONN_CONNECTING);
+        c->connect_deadline = now + (uint64_t)client->connect_timeout_ms;
+    }
+    else
+    {
+        fail_conn(c, CR_EIO, now + RECONNECT_MS);
+    }
+}
+
+static void finish_connect(conn *c, uint64_t now)
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len) != 0 || error != 0)
+    {
+        fail_conn(c, CR_EIO, now + RECONNECT_MS);
+        return;
+    }
+    atomic_store(&c->state, CONN_UP);
+}
+
+static int earlier(int timeout, uint64_t at, uint64_t now)
+{
+    int until = at > now ? (int)(at - now) : 0;
+    return timeout < 0 || until < timeout ? until : timeout;
+}
+
+// Each iteration takes whatever the submitters queued on a connection as one
+// block to write, so requests that arrive while a write is under way go out
+// together in the next.
+static void *io_main(void *arg)
+{
+    cr_client *client = (cr_client *)arg;
+    struct pollfd *pfds = (struct pollfd *)calloc((size_t)client->nconns + 1, sizeof(struct pollfd));
+    if (!pfds)
+    {
+        abort();
+    }
+    while (!atomic_load(&client->closing))
+    {
+        atomic_store(&client->wake_pending, false);
+        uint64_t now = now_ms();
+        int timeout = -1;
+        for (int i = 0; i < client->nconns; i++)
+        {
+            conn *c = &client->conns[i];
+            pthread_mutex_lock(&c->lock);
+            if (c->written == c->writing.len && c->out.len > 0)
+            {
+                bytes taken = c->out;
+                c->out = c->writing;
+                c->out.len = 0;
+                c->writing = taken;
+                c->written = 0;
+            }
+            uint64_t oldest = c->count > 0 ? c->queue[c->head].queued_ms : 0;
+            bool waiting = c->count > 0;
+            pthread_mutex_unlock(&c->lock);
+
+            int state = atomic_load(&c->state);
+            if (state == CONN_DOWN && waiting)
+            {
+                if (now < c->retry_at)
+                {
+                    timeout = earlier(timeout, c->retry_at, now);
+                }
+                else
+                {
+                    atomic_fetch_add(&client->reconnects, 1);
+                    start_connect(client, c, now);
+                    state = atomic_load(&c->state);
+                }
+            }
+            if (state == CONN_CONNECTING && now >= c->connect_deadline)
+            {
+                fail_conn(c, CR_EIO, now + RECONNECT_MS);
+                state = CONN_DOWN;
+            }
+            if (state == CONN_UP && !write_conn(client, c))
+            {
+                fail_conn(c, CR_EIO, now);
+                state = CONN_DOWN;
+            }
+            if (state != CONN_DOWN && waiting && client->timeout_ms > 0)
+            {
+                if (now >= oldest + (uint64_t)client->timeout_ms)
+                {
+                    fail_conn(c, CR_ETIMEDOUT, now);
+                    state = CONN_DOWN;
+                }
+                else
+                {
+                    timeout = earlier(timeout, oldest + (uint64_t)client->timeout_ms, now);
+                }
+            }
+            if (state == CONN_CONNECTING)
+            {
+                timeout = earlier(timeout, c->connect_deadline, now);
+            }
+            pfds[i].fd = state == CONN_DOWN ? -1 : c->fd;
+            pfds[i].events = (short)(state == CONN_CONNECTING ? POLLOUT
+                                                              : POLLIN | (c->written < c->writing.len ? POLLOUT : 0));
+            pfds[i].revents = 0;
+        }
+        pfds[client->nconns].fd = client->wake_fd;
+        pfds[client->nconns].events = POLLIN;
+        pfds[client->nconns].revents = 0;
+        // a submission after the flag was cleared has already poked wake_fd
+        if (poll(pfds, (nfds_t)client->nconns + 1, timeout) < 0 && errno != EINTR)
+        {
+            abort();
+        }
+        if (pfds[client->nconns].revents & POLLIN)
+        {
+            uint64_t count;
+            ssize_t rv = read(client->wake_fd, &count, sizeof(count));
+            (void)rv;
+        }
+        now = now_ms();
+        for (int i = 0; i < client->nconns; i++)
+        {
+            conn *c = &client->conns[i];
+            if (!pfds[i].revents)
+            {
+                continue;
+            }
+            if (atomic_load(&c->state) == CONN_CONNECTING)
+            {
+                finish_connect(c, now);
+            }
+            else if ((pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) && !read_conn(client, c))
+            {
+                fail_conn(c, CR_EIO, now);
+            }
+        }
+    }
+    for (int i = 0; i < client->nconns; i++)
+    {
+        fail_conn(&client->conns[i], CR_ECLOSED, 0);
+    }
+    free(pfds);
+    return NULL;
+}
+
+static bool resolve(cr_client *client, const char *host, int port)
+{
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *found = NULL;
+    if (getaddrinfo(host, service, &hints, &found) != 0)
+    {
+        return false;
+    }
+    memcpy(&client->addr, found->ai_addr, found->ai_addrlen);
+    client->addr_len = found->ai_addrlen;
+    freeaddrinfo(found);
+    return true;
+}
+
+// Brings a connection up before the I/O thread exists.
+static bool connect_now(cr_client *client, conn *c)
+{
+    uint64_t now = now_ms();
+    start_connect(client, c, now);
+    if (atomic_load(&c->state) == CONN_CONNECTING)
+    {
+        struct pollfd pfd = {c->fd, POLLOUT, 0};
+        if (poll(&pfd, 1, client->connect_timeout_ms) == 1)
+        {
+            finish_connect(c, now);
+        }
+    }
+    return atomic_load(&c->state) == CONN_UP;
+}
+
+static void free_client(cr_client *client)
+{
+    for (int i = 0; client->conns && i < client->nconns; i++)
+    {
+        conn *c = &client->conns[i];
+        if (c->fd >= 0)
+        {
+            close(c->fd);
+        }
+        pthread_mutex_destroy(&c->lock);
+        free(c->out.data);
+        free(c->writing.data);
+        free(c->in.data);
+        free(c->queue);
+        free(c->frame);
+    }
+    if (client->wake_fd >= 0)
+    {
+        close(client->wake_fd);
+    }
+    free(client->conns);
+    free(client);
+}
+
+cr_client *cr_connect(const cr_options *options)
+{
+    cr_client *client = (cr_client *)calloc(1, sizeof(cr_client));
+    if (!client)
+    {
+        return NULL;
+    }
+    client->wake_fd = -1;
+    client->nconns = options->connections > 0 ? options->connections : DEFAULT_CONNECTIONS;
+    client->nconns = client->nconns < MAX_CONNECTIONS ? client->nconns : MAX_CONNECTIONS;
+    client->timeout_ms = options->timeout_ms;
+    client->connect_timeout_ms =
+        options->connect_timeout_ms > 0 ? options->connect_timeout_ms : DEFAULT_CONNECT_TIMEOUT_MS;
+    client->conns = (conn *)calloc((size_t)client->nconns, sizeof(conn));
+    if (!client->conns)
+    {
+        free(client);
+        return NULL;
+    }
+    for (int i = 0; i < client->nconns; i++)
+    {
+        pthread_mutex_init(&client->conns[i].lock, NULL);
+        client->conns[i].fd = -1;
+        atomic_init(&client->conns[i].state, CONN_DOWN);
+    }
+    bool ok = resolve(client, options->host, options->port);
+    for (int i = 0; ok && i < client->nconns; i++)
+    {
+        ok = connect_now(client, &client->conns[i]);
+    }
+    client->wake_fd = ok ? eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC) : -1;
+    if (client->wake_fd < 0 || pthread_create(&client->thread, NULL, io_main, client) != 0)
+    {
+        free_client(client);
+        return NULL;
+    }
+    return client;
+}
+
+void cr_close(cr_client *client)
+{
+    atomic_store(&client->closing, true);
+    uint64_t one = 1;
+    ssize_t rv = write(client->wake_fd, &one, sizeof(one));
+    (void)rv;
+    pthread_join(client->thread, NULL);
+    free_client(client);
+}
+
+// Picks a connection round robin, preferring one that is up.
+static conn *pick_conn(cr_client *client)
+{
+    unsigned start = atomic_fetch_add(&client->next_conn, 1);
+    for (int i = 0; i < client->nconns; i++)
+    {
+        conn *c = &client->conns[(start + (unsigned)i) % (unsigned)client->nconns];
+        if (atomic_load(&c->state) == CONN_UP)
+        {
+            return c;
+        }
+    }
+    return &client->conns[start % (unsigned)client->nconns];
+}
+
+static bool push_pending(conn *c, const pending *p)
+{
+    if (c->count == c->cap)
+    {
+        size_t cap = c->cap ? c->cap * 2 : 64;
+        pending *queue = (pending *)malloc(cap * sizeof(pending));
+        if (!queue)
+        {
+            return false;
+        }
+        for (size_t i = 0; i < c->count; i++)
+        {
+            queue[i] = c->queue[(c->head + i) % c->cap];
+        }
+        free(c->queue);
+        c->queue = queue;
+        c->head = 0;
+        c->cap = cap;
+    }
+    c->queue[(c->head + c->count) % c->cap] = *p;
+    c->count++;
+    return true;
+}
+
+static void append_frame(bytes *out, const cr_slice *args, uint32_t nargs, size_t size)
+{
+    uint8_t *p = out->data + out->len;
+    put_u32(p, (uint32_t)(size - 4));
+    put_u32(p + 4, nargs);
+    p += 8;
+    for (uint32_t i = 0; i < nargs; i++)
+    {
+        put_u32(p, (uint32_t)args[i].len);
+        if (args[i].len)
+        {
+            memcpy(p + 4, args[i].data, args[i].len);
+        }
+        p += 4 + args[i].len;
+    }
+    out->len += size;
+}
+
+static int queue_request(cr_client *client, const cr_request *request, pending *p)
+{
+    if (atomic_load(&client->closing))
+    {
+        return CR_ECLOSED;
+    }
+    size_t size = 8;
+    for (uint32_t i = 0; i < request->nargs; i++)
+    {
+        size += 4 + request->args[i].len;
+        if (size - 4 > MAX_REQUEST)
+        {
+            return CR_ETOOBIG;
+        }
+    }
+    static const cr_slice asking = {"ASKING", 6};
+    bool ask = request->flags & CR_ASKING;
+    size_t asking_size = 8 + 4 + asking.len;
+    p->into = request->into;
+    p->into_cap = request->into ? request->into_cap : 0;
+    p->queued_ms = now_ms();
+    p->skip = false;
+    pending skipped = {};
+    skipped.skip = true;
+    skipped.queued_ms = p->queued_ms;
+
+    conn *c = pick_conn(client);
+    pthread_mutex_lock(&c->lock);
+    bool ok = reserve(&c->out, c->out.len + size + (ask ? asking_size : 0)) && (!ask || push_pending(c, &skipped));
+    if (ok && !push_pending(c, p))
+    {
+        // the ASKING's entry is the last one, take it back
+        c->count -= ask;
+        ok = false;
+    }
+    if (ok)
+    {
+        if (ask)
+        {
+            append_frame(&c->out, &asking, 1, asking_size);
+        }
+        append_frame(&c->out, request->args, request->nargs, size);
+    }
+    pthread_mutex_unlock(&c->lock);
+    if (!ok)
+    {
+        return CR_ENOMEM;
+    }
+    atomic_fetch_add(&client->requests, 1);
+    if (!atomic_exchange(&client->wake_pending, true))
+    {
+        uint64_t one = 1;
+        ssize_t rv = write(client->wake_fd, &one, sizeof(one));
+        (void)rv;
+    }
+    return CR_OK;
+}
+
+int cr_submit(cr_client *client, const cr_request *request, cr_callback callback, void *arg)
+{
+    pending p = {};
+    p.callback = callback;
+    p.arg = arg;
+    return queue_request(client, request, &p);
+}
+
+cr_future *cr_send(cr_client *client, const cr_request *request)
+{
+    cr_future *future = (cr_future *)calloc(1, sizeof(cr_future));
+    if (!future)
+    {
+        return NULL;
+    }
+    pthread_mutex_init(&future->lock, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&future->completed, &attr);
+    pthread_condattr_destroy(&attr);
+    atomic_init(&future->refs, 2);
+    pending p = {};
+    p.future = future;
+    int status = queue_request(client, request, &p);
+    if (status != CR_OK)
+    {
+        // never queued: complete it here so waiting on it still works
+        future->status = status;
+        future->done = true;
+        atomic_store(&future->refs, 1);
+    }
+    return future;
+}
+
+int cr_wait(cr_future *future, int timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    if (timeout_ms > 0)
+    {
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+    pthread_mutex_lock(&future->lock);
+    while (!future->done && timeout_ms != 0)
+    {
+        if (timeout_ms < 0)
+        {
+            pthread_cond_wait(&future->completed, &future->lock);
+        }
+        else if (pthread_cond_timedwait(&future->completed, &future->lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    int status = future->done ? future->status : CR_ETIMEDOUT;
+    pthread_mutex_unlock(&future->lock);
+    return status;
+}
+
+const cr_reply *cr_future_reply(const cr_future *future)
+{
+    return future->done ? future->reply : NULL;
+}
+
+void cr_future_free(cr_future *future)
+{
+    if (future)
+    {
+        release_future(future);
+    }
+}
+
+void cr_get_stats(cr_client *client, cr_stats *stats)
+{
+    stats->requests = atomic_load(&client->requests);
+    stats->replies = atomic_load(&client->replies);
+    stats->writes = atomic_load(&client->writes);
+    stats->reads = atomic_load(&client->reads);
+    stats->reconnects = atomic_load(&client->reconnects);
+}
+
+const char *cr_strerror(int status)
+{
+    switch (status)
+    {
+    case CR_OK:
+        return "ok";
+    case CR_ETRUNC:
+        return "reply truncated to the buffer";
+    case CR_EIO:
+        return "connection failed";
+    case CR_ETIMEDOUT:
+        return "timed out";
+    case CR_ENOMEM:
+        return "out of memory";
+    case CR_EPROTO:
+        return "protocol error";
+    case CR_ECLOSED:
+        return "client closed";
+    case CR_ETOOBIG:
+        return "request too large";
+    default:
+        return "unknown error";
+    }
+}
@@ -0,0 +1,155 @@
+#ifndef CUSTOMREDIS_HEADER
+#define CUSTOMREDIS_HEADER
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// libcustomredis: an asynchronous client for the server's binary protocol.
+//
+// A cr_client owns a pool of connections to one server and a thread doing
+// all of their I/O. Any number of threads may submit requests at once; each
+// request is appended to a connection's outgoing buffer and the I/O thread
+// writes whatever has accumulated in one go, so requests issued concurrently
+// share connections and system calls instead of each paying a round trip.
+// Replies come back in order per connection and complete either a callback,
+// run on the I/O thread, or a future any thread can wait on.
+//
+// Replies have no size limit. A large reply is received straight into the
+// memory it is handed over in: a buffer the caller supplied with the request
+// for a string reply, or else a frame the future takes over, so values of
+// any size are not copied on the way in.
+//
+// Link with -lcustomredis -lpthread.
+
+// Status of a completed request. Anything but CR_OK and CR_ETRUNC means no
+// reply arrived.
+typedef enum
+{
+    CR_OK = 0,
+    // the string reply was longer than the caller's buffer, which holds its
+    // first bytes; the reply's len is the full length
+    CR_ETRUNC = 1,
+    // the connection failed before the reply arrived
+    CR_EIO = -1,
+    // no reply within cr_options.timeout_ms; the connection is reset
+    CR_ETIMEDOUT = -2,
+    CR_ENOMEM = -3,
+    // the server sent something that is not a reply
+    CR_EPROTO = -4,
+    // the client is being closed
+    CR_ECLOSED = -5,
+    // the request is larger than the server accepts
+    CR_ETOOBIG = -6,
+} cr_status;
+
+typedef enum
+{
+    CR_NIL = 0,
+    CR_ERR = 1,
+    CR_STR = 2,
+    CR_INT = 3,
+    CR_DBL = 4,
+    CR_ARR = 5,
+} cr_type;
+
+// A parsed reply. Strings and error messages are not terminated; they point
+// into the received frame, or into the caller's buffer for a request with
+// one.
+typedef struct cr_reply
+{
+    cr_type type;
+    // error code for CR_ERR, see protocol.h of the server
+    uint32_t code;
+    const uint8_t *str;
+    size_t len;
+    int64_t integer;
+    double dbl;
+    size_t count;
+    struct cr_reply *elements;
+} cr_reply;
+
+typedef struct
+{
+    const void *data;
+    size_t len;
+} cr_slice;
+
+// Send the server's ASKING immediately before the request, on the same
+// connection, for a slot being imported in cluster mode.
+#define CR_ASKING 1u
+
+typedef struct
+{
+    const cr_slice *args;
+    uint32_t nargs;
+    unsigned flags;
+    // optional: a string reply is received into into, up to into_cap bytes,
+    // and the reply's str points there; must stay valid until completion
+    void *into;
+    size_t into_cap;
+} cr_request;
+
+typedef struct
+{
+    const char *host;
+    int port;
+    // connections in the pool, 2 if 0
+    int connections;
+    // how long a connection may wait on a reply, 0 for ever
+    int timeout_ms;
+    // how long a connect may take, 1000 if 0
+    int connect_timeout_ms;
+} cr_options;
+
+typedef struct cr_client cr_client;
+typedef struct cr_future cr_future;
+
+// Runs on the I/O thread once the request completes. reply is NULL unless
+// status is CR_OK or CR_ETRUNC, and is only valid during the call. The
+// callback may submit further requests but must not block.
+typedef void (*cr_callback)(void *arg, int status, const cr_reply *reply);
+
+// Connects the whole pool and starts the I/O thread. NULL when the server
+// cannot be reached or on out of memory. A connection that fails later is
+// reconnected on demand.
+cr_client *cr_connect(const cr_options *options);
+
+// Fails everything still in flight with CR_ECLOSED, then frees the client.
+// Futures stay valid until freed.
+void cr_close(cr_client *client);
+
+// Queues a request; the callback gets its result. Returns CR_OK, or an
+// error without calling the callback.
+int cr_submit(cr_client *client, const cr_request *request, cr_callback callback, void *arg);
+
+// Queues a request whose result a future holds. NULL on out of memory.
+cr_future *cr_send(cr_client *client, const cr_request *request);
+
+// Waits up to timeout_ms (-1 for ever) for the future to complete. Returns
+// its status, or CR_ETIMEDOUT if it is still pending.
+int cr_wait(cr_future *future, int timeout_ms);
+
+// The reply of a completed future, NULL if none arrived. Owned by the
+// future.
+const cr_reply *cr_future_reply(const cr_future *future);
+
+// May be called before completion; the request still runs.
+void cr_future_free(cr_future *future);
+
+typedef struct
+{
+    uint64_t requests;
+    uint64_t replies;
+    // system calls that sent or received data; requests / writes is how many
+    // requests each write carried on average
+    uint64_t writes;
+    uint64_t reads;
+    uint64_t reconnects;
+} cr_stats;
+
+void cr_get_stats(cr_client *client, cr_stats *stats);
+
+const char *cr_strerror(int status);
+
+#endif
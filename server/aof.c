@@ -0,0 +1,904 @@
+#include "aof.h"
+#include "command.h"
+#include "fdio.h"
+#include "snapshot.h"
+#include "repl.h"
+#include "log.h"
+#include "zset.h"
+#include "hmap.h"
+#include "qlist.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#define WRITE_IOV 128
+#define BASE_CHUNK (1 << 20)
+
+static const char *const fsync_names[] = {
+    [AOF_FSYNC_ALWAYS] = "always",
+    [AOF_FSYNC_EVERYSEC] = "everysec",
+    [AOF_FSYNC_NO] = "no",
+};
+
+bool parseAofFsync(const char *name, AofFsync *policy)
+{
+    for (size_t i = 0; i < sizeof(fsync_names) / sizeof(fsync_names[0]); i++)
+    {
+        if (strcmp(name, fsync_names[i]) == 0)
+        {
+            *policy = (AofFsync)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *aofFsyncName(AofFsync policy)
+{
+    return fsync_names[policy];
+}
+
+// Writes the commands that rebuild the keys of the shards, buffered in
+// large chunks, or appends them to a buffer when into is set.
+typedef struct
+{
+    int fd;
+    Buffer *into;
+    uint8_t *buf;
+    size_t capacity;
+    size_t used;
+    uint64_t keys;
+    uint64_t now;
+    bool failed;
+} BaseWriter;
+
+static uint8_t *putArg(uint8_t *p, const void *data, uint32_t len)
+{
+    memcpy(p, &len, 4);
+    memcpy(p + 4, data, len);
+    return p + 4 + len;
+}
+
+static bool putFrame(BaseWriter *w, const Slice *args, uint32_t nargs)
+{
+    if (w->into)
+    {
+        w->failed = !appendRequest(w->into, args, nargs);
+        return !w->failed;
+    }
+    size_t payload = 4;
+    for (uint32_t i = 0; i < nargs; i++)
+    {
+        payload += 4 + args[i].len;
+    }
+    size_t size = 4 + payload;
+
+    if (w->used + size > w->capacity)
+    {
+        if (!writeAll(w->fd, w->buf, w->used))
+        {
+            w->failed = true;
+            return false;
+        }
+        w->used = 0;
+    }
+    if (size > w->capacity)
+    {
+        uint8_t *grown = (uint8_t *)realloc(w->buf, size);
+        if (!grown)
+        {
+            w->failed = true;
+            return false;
+        }
+        w->buf = grown;
+        w->capacity = size;
+    }
+
+    uint8_t *p = w->buf + w->used;
+    uint32_t len = (uint32_t)payload;
+    memcpy(p, &len, 4);
+    memcpy(p + 4, &nargs, 4);
+    p += 8;
+    for (uint32_t i = 0; i < nargs; i++)
+    {
+        p = putArg(p, args[i].data, args[i].len);
+    }
+    w->used += size;
+    return true;
+}
+
+static Slice textArg(const char *text, size_t len)
+{
+    Slice slice = {(const uint8_t *)text, (uint32_t)len};
+    return slice;
+}
+
+// ZADD frames of up to AOF_REWRITE_ITEMS members; %.17g reads back as the
+// same double.
+static bool appendZSet(BaseWriter *w, const Slice *key, const ZSet *zset)
+{
+    Slice args[2 + 2 * AOF_REWRITE_ITEMS];
+    char scores[AOF_REWRITE_ITEMS][32];
+    args[0] = textArg("ZADD", 4);
+    args[1] = *key;
+    ZSetIter iter;
+    zsetSeek(zset, 0, &iter);
+    const uint8_t *member;
+    uint32_t len;
+    double score;
+    uint32_t items = 0;
+    bool more = true;
+    while (more)
+    {
+        more = zsetNext(&iter, &member, &len, &score);
+        if (more)
+        {
+            int digits = snprintf(scores[items], sizeof(scores[items]), "%.17g", score);
+            args[2 + 2 * items] = textArg(scores[items], (size_t)digits);
+            args[3 + 2 * items] = (Slice){member, len};
+            items++;
+        }
+        if (items == AOF_REWRITE_ITEMS || (!more && items > 0))
+        {
+            if (!putFrame(w, args, 2 + 2 * items))
+            {
+                return false;
+            }
+            items = 0;
+        }
+    }
+    return true;
+}
+
+// HSET frames of up to AOF_REWRITE_ITEMS fields.
+static bool appendHash(BaseWriter *w, const Slice *key, const HMap *hmap)
+{
+    Slice args[2 + 2 * AOF_REWRITE_ITEMS];
+    args[0] = textArg("HSET", 4);
+    args[1] = *key;
+    HMapIter iter;
+    hmapIterate(hmap, &iter);
+    const uint8_t *field, *value;
+    uint32_t field_len, value_len;
+    uint32_t items = 0;
+    bool more = true;
+    while (more)
+    {
+        more = hmapNext(&iter, &field, &field_len, &value, &value_len);
+        if (more)
+        {
+            args[2 + 2 * items] = (Slice){field, field_len};
+            args[3 + 2 * items] = (Slice){value, value_len};
+            items++;
+        }
+        if (items == AOF_REWRITE_ITEMS || (!more && items > 0))
+        {
+            if (!putFrame(w, args, 2 + 2 * items))
+            {
+                return false;
+            }
+            items = 0;
+        }
+    }
+    return true;
+}
+
+// RPUSH frames of up to AOF_REWRITE_ITEMS elements.
+static bool appendList(BaseWriter *w, const Slice *key, const QList *list)
+{
+    Slice args[2 + AOF_REWRITE_ITEMS];
+    args[0] = textArg("RPUSH", 5);
+    args[1] = *key;
+    QListIter iter;
+    qlistSeek(list, 0, &iter);
+    const uint8_t *value;
+    uint32_t len;
+    uint32_t items = 0;
+    bool more = true;
+    while (more)
+    {
+        more = qlistNext(&iter, &value, &len);
+        if (more)
+        {
+            args[2 + items] = (Slice){value, len};
+            items++;
+        }
+        if (items == AOF_REWRITE_ITEMS || (!more && items > 0))
+        {
+            if (!putFrame(w, args, 2 + items))
+            {
+                return false;
+            }
+            items = 0;
+        }
+    }
+    return true;
+}
+
+static bool appendKey(const Node *node, void *arg)
+{
+    BaseWriter *w = (BaseWriter *)arg;
+    uint64_t deadline = nodeDeadline(node);
+    if (deadline != KEYSPACE_NO_EXPIRY && deadline <= w->now)
+    {
+        return true;
+    }
+
+    char pxat[24];
+    size_t pxat_len = 0;
+    if (deadline != KEYSPACE_NO_EXPIRY)
+    {
+        pxat_len = (size_t)snprintf(pxat, sizeof(pxat), "%llu", (unsigned long long)deadline);
+    }
+    Slice key = {nodeKey(node), node->key_len};
+    bool ok;
+    if (node->type == VALUE_STRING)
+    {
+        uint8_t buf[KEYSPACE_INT_CHARS];
+        uint32_t value_len;
+        const uint8_t *value = nodeString(node, buf, &value_len);
+        Slice args[5] = {textArg("SET", 3), key, {value, value_len}, textArg("PXAT", 4), textArg(pxat, pxat_len)};
+        ok = putFrame(w, args, pxat_len ? 5 : 3);
+    }
+    else
+    {
+        // containers are rebuilt member by member and get their TTL after
+        Slice args[3] = {textArg("PEXPIREAT", 9), key, textArg(pxat, pxat_len)};
+        const void *object = nodeObject(node);
+        switch (node->type)
+        {
+        case VALUE_ZSET:
+            ok = appendZSet(w, &key, (const ZSet *)object);
+            break;
+        case VALUE_HASH:
+            ok = appendHash(w, &key, (const HMap *)object);
+            break;
+        default:
+            ok = appendList(w, &key, (const QList *)object);
+            break;
+        }
+        ok = ok && (!pxat_len || putFrame(w, args, 3));
+    }
+    w->keys++;
+    return ok;
+}
+
+bool aofAppendKey(Buffer *out, const Node *node)
+{
+    BaseWriter w = {};
+    w.into = out;
+    w.now = keyspaceClock();
+    return appendKey(node, &w);
+}
+
+// Writes every unexpired key to path and fsyncs it. It does not log, so a
+// forked child may call it; on failure errno tells why.
+static bool writeBase(const char *path, Keyspace *const *shards, int count, uint64_t *keys)
+{
+    BaseWriter w = {};
+    w.now = keyspaceClock();
+    w.capacity = BASE_CHUNK;
+    w.buf = (uint8_t *)malloc(w.capacity);
+    if (!w.buf)
+    {
+        return false;
+    }
+    w.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w.fd < 0)
+    {
+        free(w.buf);
+        return false;
+    }
+
+    bool ok = true;
+    for (int i = 0; ok && i < count; i++)
+    {
+        keyspaceForEach(shards[i], appendKey, &w);
+        ok = !w.failed;
+    }
+    ok = ok && writeAll(w.fd, w.buf, w.used) && fsync(w.fd) == 0;
+    int saved = errno;
+    if (close(w.fd) != 0 && ok)
+    {
+        ok = false;
+        saved = errno;
+    }
+    free(w.buf);
+    *keys = w.keys;
+    errno = saved;
+    return ok;
+}
+
+bool replayAof(const char *path, Keyspace *const *shards, int count, int (*shard_of)(uint64_t hcode))
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+        {
+            return true;
+        }
+        logError("append-only file %s: %s", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        logError("append-only file %s: %s", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+    if (size == 0)
+    {
+        close(fd);
+        return true;
+    }
+    void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        logError("append-only file %s: mmap: %s", path, strerror(errno));
+        return false;
+    }
+    madvise(mapped, size, MADV_SEQUENTIAL);
+
+    uint64_t start = monotonicMs();
+    const uint8_t *data = (const uint8_t *)mapped;
+    Buffer scratch;
+    initBuffer(&scratch);
+    Slice args[MAX_COMMAND_ARGS];
+    uint64_t commands = 0;
+    size_t offset = 0;
+    bool ok = true;
+    while (offset < size)
+    {
+        uint32_t len = 0;
+        if (size - offset < 4 || (memcpy(&len, data + offset, 4), size - offset - 4 < len))
+        {
+            break;
+        }
+        uint32_t nargs = 0;
+        if (parseRequest(data + offset + 4, len, args, MAX_COMMAND_ARGS, &nargs) != PARSE_OK)
+        {
+            logError("append-only file %s: malformed record at offset %zu", path, offset);
+            ok = false;
+            break;
+        }
+        const Command *cmd = requestCommand(args, nargs);
+        const Slice *key = requestKey(cmd, args, nargs);
+        int shard = key && count > 1 ? shard_of(keyspaceHash(key->data, key->len)) : 0;
+        CommandContext ctx = {shards[shard], &scratch, NULL, 0, NULL};
+        executeCommand(&ctx, cmd, args, nargs);
+        consumeNewBuffer(&scratch, bufferSize(&scratch));
+        commands++;
+        offset += 4 + (size_t)len;
+    }
+    freeBuffer(&scratch);
+    munmap(mapped, size);
+    if (!ok)
+    {
+        return false;
+    }
+
+    if (offset < size)
+    {
+        // a crash mid-append; what came before it is intact
+        logWarn("append-only file %s: dropping %zu bytes of a record cut short at offset %zu", path, size - offset,
+                offset);
+        if (truncate(path, (off_t)offset) != 0)
+        {
+            logError("append-only file %s: truncate: %s", path, strerror(errno));
+            return false;
+        }
+    }
+    logInfo("replayed %llu commands from %s in %llu ms", (unsigned long long)commands, path,
+            (unsigned long long)(monotonicMs() - start));
+    return true;
+}
+
+static struct
+{
+    bool enabled;
+    char *path;
+    AofFsync policy;
+    int count;
+    Keyspace **shards;
+    // per worker, touched only by its owner
+    Buffer *staged;
+    // serializes appends and guards fd, the rewrite buffer and collecting
+    pthread_mutex_t write_lock;
+    int fd;
+    // bytes in the file, including those not synced yet
+    _Atomic uint64_t written;
+    // serializes fsyncs and guards synced; taken before write_lock
+    pthread_mutex_t sync_lock;
+    uint64_t synced;
+    bool write_failing;
+    // commits made while a rewrite child runs are kept here for the new file
+    bool collecting;
+    bool collect_failed;
+    uint8_t *rewrite_buf;
+    size_t rewrite_len;
+    size_t rewrite_capacity;
+    // held from the start of a rewrite until it is finished or abandoned
+    _Atomic bool rewriting;
+    // the worker that forked the running child, -1 without one; only that
+    // worker touches child, child_done, child_ok and started_ms
+    _Atomic int child_owner;
+    pid_t child;
+    bool child_done;
+    bool child_ok;
+    uint64_t started_ms;
+    _Atomic uint64_t base_size;
+    // a failed automatic rewrite is not retried before the file reaches this
+    _Atomic uint64_t auto_floor;
+    _Atomic bool last_rewrite_ok;
+    _Atomic uint64_t fsyncs;
+    // once a replica attaches, every commit also goes to replFeed, with the
+    // file enabled or not; set while the workers are paused
+    bool feeding;
+    // per worker, how many staged bytes replFeed already has
+    size_t *fed;
+} g_aof;
+
+static void rewritePath(char *out, size_t size, pid_t pid)
+{
+    snprintf(out, size, "%s.rewrite-%d", g_aof.path, (int)pid);
+}
+
+static void fatal(const char *what)
+{
+    logError("append-only file %s: %s: %s", g_aof.path, what, strerror(errno));
+    logFlush();
+    abort();
+}
+
+static void syncUpTo(uint64_t target)
+{
+    pthread_mutex_lock(&g_aof.sync_lock);
+    if (g_aof.synced < target)
+    {
+        // everything written before the fsync starts is covered by it
+        uint64_t upto = atomic_load(&g_aof.written);
+        if (fdatasync(g_aof.fd) != 0)
+        {
+            if (g_aof.policy == AOF_FSYNC_ALWAYS)
+            {
+                fatal("fdatasync");
+            }
+            logError("append-only file %s: fdatasync: %s", g_aof.path, strerror(errno));
+        }
+        else
+        {
+            g_aof.synced = upto;
+            atomic_fetch_add_explicit(&g_aof.fsyncs, 1, memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&g_aof.sync_lock);
+}
+
+static void *syncEverySecond(void *arg)
+{
+    (void)arg;
+    while (true)
+    {
+        struct timespec second = {1, 0};
+        nanosleep(&second, NULL);
+        syncUpTo(atomic_load(&g_aof.written));
+    }
+    return NULL;
+}
+
+bool initAof(const char *path, AofFsync policy, Keyspace *const *shards, int count)
+{
+    g_aof.path = strdup(path);
+    g_aof.policy = policy;
+    g_aof.count = count;
+    g_aof.shards = (Keyspace **)calloc((size_t)count, sizeof(Keyspace *));
+    g_aof.staged = (Buffer *)calloc((size_t)count, sizeof(Buffer));
+    if (!g_aof.path || !g_aof.shards || !g_aof.staged)
+    {
+        return false;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        g_aof.shards[i] = shards[i];
+        initBuffer(&g_aof.staged[i]);
+    }
+
+    if (access(path, F_OK) != 0)
+    {
+        // start from what the snapshot held so the file alone is complete
+        char tmp[PATH_MAX];
+        rewritePath(tmp, sizeof(tmp), getpid());
+        uint64_t keys = 0;
+        if (!writeBase(tmp, shards, count, &keys) || rename(tmp, path) != 0)
+        {
+            logError("append-only file %s: %s", path, strerror(errno));
+            unlink(tmp);
+            return false;
+        }
+        logInfo("created %s with %llu keys", path, (unsigned long long)keys);
+    }
+    g_aof.fd = open(path, O_WRONLY | O_APPEND | O_CLOEXEC);
+    struct stat st;
+    if (g_aof.fd < 0 || fstat(g_aof.fd, &st) != 0)
+    {
+        logError("append-only file %s: %s", path, strerror(errno));
+        return false;
+    }
+    atomic_init(&g_aof.written, (uint64_t)st.st_size);
+    g_aof.synced = (uint64_t)st.st_size;
+    atomic_init(&g_aof.base_size, (uint64_t)st.st_size);
+    atomic_init(&g_aof.auto_floor, 0);
+    atomic_init(&g_aof.rewriting, false);
+    atomic_init(&g_aof.child_owner, -1);
+    atomic_init(&g_aof.last_rewrite_ok, true);
+    atomic_init(&g_aof.fsyncs, 0);
+    pthread_mutex_init(&g_aof.write_lock, NULL);
+    pthread_mutex_init(&g_aof.sync_lock, NULL);
+
+    if (policy == AOF_FSYNC_EVERYSEC)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, syncEverySecond, NULL) != 0)
+        {
+            return false;
+        }
+        pthread_detach(thread);
+    }
+    g_aof.enabled = true;
+    logInfo("appending to %s, fsync %s", path, aofFsyncName(policy));
+    return true;
+}
+
+bool aofEnabled(void)
+{
+    return g_aof.enabled;
+}
+
+bool aofStartFeed(int count)
+{
+    if (g_aof.feeding)
+    {
+        return true;
+    }
+    if (!g_aof.staged)
+    {
+        g_aof.staged = (Buffer *)calloc((size_t)count, sizeof(Buffer));
+        if (!g_aof.staged)
+        {
+            return false;
+        }
+        for (int i = 0; i < count; i++)
+        {
+            initBuffer(&g_aof.staged[i]);
+        }
+    }
+    g_aof.fed = (size_t *)calloc((size_t)count, sizeof(size_t));
+    if (!g_aof.fed)
+    {
+        return false;
+    }
+    g_aof.feeding = true;
+    return true;
+}
+
+Buffer *aofBuffer(int self)
+{
+    return g_aof.enabled || g_aof.feeding ? &g_aof.staged[self] : NULL;
+}
+
+bool aofSyncsBeforeReply(void)
+{
+    return g_aof.enabled && g_aof.policy == AOF_FSYNC_ALWAYS;
+}
+
+// Keeps a copy of bytes just appended for the file a rewrite is building.
+static void collect(const Buffer *staged, size_t len)
+{
+    if (g_aof.collect_failed)
+    {
+        return;
+    }
+    if (g_aof.rewrite_len + len > g_aof.rewrite_capacity)
+    {
+        size_t capacity = g_aof.rewrite_capacity ? g_aof.rewrite_capacity : BASE_CHUNK;
+        while (capacity < g_aof.rewrite_len + len)
+        {
+            capacity *= 2;
+        }
+        uint8_t *grown = (uint8_t *)realloc(g_aof.rewrite_buf, capacity);
+        if (!grown)
+        {
+            // the rewrite is abandoned when its child finishes
+            g_aof.collect_failed = true;
+            return;
+        }
+        g_aof.rewrite_buf = grown;
+        g_aof.rewrite_capacity = capacity;
+    }
+    copyFromBuffer(staged, 0, g_aof.rewrite_buf + g_aof.rewrite_len, len);
+    g_aof.rewrite_len += len;
+}
+
+void aofCommit(int self)
+{
+    if (!g_aof.enabled && !g_aof.feeding)
+    {
+        return;
+    }
+    Buffer *staged = &g_aof.staged[self];
+    size_t size = bufferSize(staged);
+    if (size == 0)
+    {
+        return;
+    }
+    if (g_aof.feeding)
+    {
+        // replicas get the records even while the file will not take them
+        replFeed(staged, g_aof.fed[self], size - g_aof.fed[self]);
+        g_aof.fed[self] = size;
+    }
+    if (!g_aof.enabled)
+    {
+        consumeNewBuffer(staged, size);
+        g_aof.fed[self] = 0;
+        return;
+    }
+
+    pthread_mutex_lock(&g_aof.write_lock);
+    bool failed = false;
+    while (bufferSize(staged) > 0)
+    {
+        struct iovec iov[WRITE_IOV];
+        int iovcnt = bufferIovecs(staged, iov, WRITE_IOV);
+        ssize_t n = writev(g_aof.fd, iov, iovcnt);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            failed = true;
+            break;
+        }
+        if (g_aof.collecting)
+        {
+            collect(staged, (size_t)n);
+        }
+        consumeNewBuffer(staged, (size_t)n);
+        if (g_aof.feeding)
+        {
+            g_aof.fed[self] -= (size_t)n;
+        }
+        atomic_fetch_add(&g_aof.written, (uint64_t)n);
+    }
+    uint64_t written = atomic_load(&g_aof.written);
+    if (failed)
+    {
+        if (g_aof.policy == AOF_FSYNC_ALWAYS)
+        {
+            fatal("write");
+        }
+        // the rest stays staged and goes out with the next commit
+        if (!g_aof.write_failing)
+        {
+            logError("append-only file %s: write: %s", g_aof.path, strerror(errno));
+        }
+    }
+    else if (g_aof.write_failing)
+    {
+        logInfo("append-only file %s: writes succeed again", g_aof.path);
+    }
+    g_aof.write_failing = failed;
+    pthread_mutex_unlock(&g_aof.write_lock);
+
+    if (g_aof.policy == AOF_FSYNC_ALWAYS)
+    {
+        syncUpTo(written);
+    }
+}
+
+// Holds automatic rewrites off until the file grows by another step.
+static void deferAutoRewrite(void)
+{
+    uint64_t size = atomic_load(&g_aof.written);
+    atomic_store(&g_aof.auto_floor, size + size / 100 * AOF_REWRITE_GROWTH_PERCENT);
+}
+
+static void setCollecting(bool on)
+{
+    pthread_mutex_lock(&g_aof.write_lock);
+    g_aof.collecting = on;
+    g_aof.collect_failed = false;
+    g_aof.rewrite_len = 0;
+    if (!on)
+    {
+        free(g_aof.rewrite_buf);
+        g_aof.rewrite_buf = NULL;
+        g_aof.rewrite_capacity = 0;
+    }
+    pthread_mutex_unlock(&g_aof.write_lock);
+}
+
+AofRewriteResult aofRewrite(int self)
+{
+    if (!g_aof.enabled)
+    {
+        return AOF_REWRITE_DISABLED;
+    }
+    bool expected = false;
+    if (!atomic_compare_exchange_strong(&g_aof.rewriting, &expected, true))
+    {
+        return AOF_REWRITE_BUSY;
+    }
+    if (!pauseWorkers(self))
+    {
+        atomic_store(&g_aof.rewriting, false);
+        return AOF_REWRITE_BUSY;
+    }
+
+    // the others committed at the end of their last iteration; the caller's
+    // records so far belong in the child's image, not in the kept tail
+    uint64_t start = monotonicMs();
+    aofCommit(self);
+    setCollecting(true);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        char tmp[PATH_MAX];
+        rewritePath(tmp, sizeof(tmp), getpid());
+        uint64_t keys = 0;
+        bool ok = writeBase(tmp, g_aof.shards, g_aof.count, &keys);
+        _exit(ok ? 0 : (errno > 0 && errno < 256 ? errno : 255));
+    }
+    int err = errno;
+    resumeWorkers();
+    if (pid < 0)
+    {
+        setCollecting(false);
+        deferAutoRewrite();
+        atomic_store(&g_aof.last_rewrite_ok, false);
+        atomic_store(&g_aof.rewriting, false);
+        logError("append-only file rewrite: fork: %s", strerror(err));
+        return AOF_REWRITE_FAILED;
+    }
+    g_aof.child = pid;
+    g_aof.child_done = false;
+    g_aof.started_ms = start;
+    atomic_store(&g_aof.child_owner, self);
+    logInfo("append-only file rewrite started by pid %d", (int)pid);
+    return AOF_REWRITE_STARTED;
+}
+
+// With every worker paused: appends what was committed since the fork to the
+// child's file, syncs it and puts it in place of the old one.
+static bool installRewrite(const char *tmp)
+{
+    pthread_mutex_lock(&g_aof.sync_lock);
+    pthread_mutex_lock(&g_aof.write_lock);
+    int fd = open(tmp, O_WRONLY | O_APPEND | O_CLOEXEC);
+    struct stat st;
+    bool ok = fd >= 0 && !g_aof.collect_failed && writeAll(fd, g_aof.rewrite_buf, g_aof.rewrite_len) &&
+              fdatasync(fd) == 0 && fstat(fd, &st) == 0 && rename(tmp, g_aof.path) == 0;
+    if (ok)
+    {
+        close(g_aof.fd);
+        g_aof.fd = fd;
+        atomic_store(&g_aof.written, (uint64_t)st.st_size);
+        g_aof.synced = (uint64_t)st.st_size;
+        atomic_store(&g_aof.base_size, (uint64_t)st.st_size);
+    }
+    else
+    {
+        logError("append-only file rewrite: %s", g_aof.collect_failed ? "out of memory" : strerror(errno));
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    pthread_mutex_unlock(&g_aof.write_lock);
+    pthread_mutex_unlock(&g_aof.sync_lock);
+    return ok;
+}
+
+static bool autoRewriteDue(void)
+{
+    uint64_t size = atomic_load(&g_aof.written);
+    uint64_t base = atomic_load(&g_aof.base_size);
+    return size >= AOF_REWRITE_MIN_SIZE && size >= base + base / 100 * AOF_REWRITE_GROWTH_PERCENT &&
+           size >= atomic_load(&g_aof.auto_floor) && !atomic_load(&g_aof.rewriting);
+}
+
+int aofCheckpoint(int self)
+{
+    if (!g_aof.enabled)
+    {
+        return -1;
+    }
+    if (atomic_load_explicit(&g_aof.child_owner, memory_order_relaxed) != self)
+    {
+        // one worker is enough to watch the size
+        if (self != 0 || !autoRewriteDue() || aofRewrite(self) != AOF_REWRITE_STARTED)
+        {
+            return -1;
+        }
+        logInfo("append-only file grew to %llu bytes, rewriting", (unsigned long long)atomic_load(&g_aof.written));
+    }
+
+    if (!g_aof.child_done)
+    {
+        int status = 0;
+        pid_t rv = waitpid(g_aof.child, &status, WNOHANG);
+        if (rv == 0 || (rv < 0 && errno == EINTR))
+        {
+            return AOF_POLL_MS;
+        }
+        g_aof.child_done = true;
+        g_aof.child_ok = rv == g_aof.child && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        if (!g_aof.child_ok && rv == g_aof.child && WIFEXITED(status))
+        {
+            logError("append-only file rewrite failed: %s", strerror(WEXITSTATUS(status)));
+        }
+        else if (!g_aof.child_ok)
+        {
+            logError("append-only file rewrite failed: child killed by signal %d",
+                     WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+        }
+    }
+
+    char tmp[PATH_MAX];
+    rewritePath(tmp, sizeof(tmp), g_aof.child);
+    bool ok = false;
+    if (g_aof.child_ok)
+    {
+        if (!pauseWorkers(self))
+        {
+            // a save holds the workers; this one gets parked and comes back
+            return 0;
+        }
+        ok = installRewrite(tmp);
+        resumeWorkers();
+    }
+    if (ok)
+    {
+        logInfo("append-only file rewrite finished in %llu ms, %llu bytes",
+                (unsigned long long)(monotonicMs() - g_aof.started_ms),
+                (unsigned long long)atomic_load(&g_aof.base_size));
+    }
+    else
+    {
+        unlink(tmp);
+        deferAutoRewrite();
+    }
+    setCollecting(false);
+    atomic_store(&g_aof.last_rewrite_ok, ok);
+    g_aof.child = 0;
+    g_aof.child_done = false;
+    atomic_store(&g_aof.child_owner, -1);
+    atomic_store(&g_aof.rewriting, false);
+    return -1;
+}
+
+void aofStatus(AofStatus *status)
+{
+    status->enabled = g_aof.enabled;
+    status->policy = g_aof.policy;
+    status->rewrite_in_progress = g_aof.enabled && atomic_load(&g_aof.rewriting);
+    status->last_rewrite_ok = !g_aof.enabled || atomic_load(&g_aof.last_rewrite_ok);
+    status->current_size = g_aof.enabled ? atomic_load(&g_aof.written) : 0;
+    status->base_size = g_aof.enabled ? atomic_load(&g_aof.base_size) : 0;
+    status->fsyncs = g_aof.enabled ? atomic_load(&g_aof.fsyncs) : 0;
+}
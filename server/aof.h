@@ -0,0 +1,106 @@
+#ifndef AOF_HEADER
+#define AOF_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "buffer.h"
+#include "keyspace.h"
+
+// The append-only file is a plain sequence of request frames, exactly as
+// clients send them. Every write command that changed something is logged in
+// a form that replays to the same state at any later time: relative TTLs
+// become SET ... PXAT and PEXPIREAT with absolute deadlines, and evictions
+// become DEL.
+#define AOF_DEFAULT_PATH "appendonly.aof"
+// a rewrite starts by itself once the file is this large and has doubled
+// since the last one
+#define AOF_REWRITE_MIN_SIZE (64 << 20)
+#define AOF_REWRITE_GROWTH_PERCENT 100
+// how often the worker that forked a rewrite polls for its exit
+#define AOF_POLL_MS 100
+// members per command when a rewrite logs a container
+#define AOF_REWRITE_ITEMS 64
+
+typedef enum
+{
+    // fsync before the replies of a batch go out
+    AOF_FSYNC_ALWAYS,
+    // fsync from a background thread once a second
+    AOF_FSYNC_EVERYSEC,
+    // leave flushing to the kernel
+    AOF_FSYNC_NO,
+} AofFsync;
+
+bool parseAofFsync(const char *name, AofFsync *policy);
+
+const char *aofFsyncName(AofFsync policy);
+
+// Runs the file's commands against shards[shard_of(hash of the key)]. A
+// frame cut short at the end, as a crash mid-write leaves it, is logged and
+// truncated away. A missing file replays nothing. Returns false, having
+// logged why, when the file cannot be read or holds a malformed frame.
+bool replayAof(const char *path, Keyspace *const *shards, int count, int (*shard_of)(uint64_t hcode));
+
+// Appends the request frames that rebuild the key, TTL included, as a
+// rewrite writes them; nothing for a key whose deadline passed. False when
+// out of memory.
+bool aofAppendKey(Buffer *out, const Node *node);
+
+// Opens the file for appending, first writing the current contents of the
+// shards as its base when it does not exist. Workers are registered by id.
+bool initAof(const char *path, AofFsync policy, Keyspace *const *shards, int count);
+
+bool aofEnabled(void);
+
+// From now on also stages records with the file disabled and hands every
+// commit to replFeed, for replicas. Call with the workers paused.
+bool aofStartFeed(int count);
+
+// Where the worker stages the records of the commands it runs; NULL when the
+// file is disabled and no replica ever attached.
+Buffer *aofBuffer(int self);
+
+// With AOF_FSYNC_ALWAYS a reply may only leave once the records staged
+// before it are on disk.
+bool aofSyncsBeforeReply(void);
+
+// Writes the worker's staged records and, under the always policy, fsyncs.
+// Workers call it once per loop iteration, before any reply goes out, so one
+// write and one fsync cover the whole batch; an fsync of one worker also
+// covers whatever the others wrote before it started.
+void aofCommit(int self);
+
+typedef enum
+{
+    AOF_REWRITE_STARTED,
+    AOF_REWRITE_BUSY,
+    AOF_REWRITE_FAILED,
+    AOF_REWRITE_DISABLED,
+} AofRewriteResult;
+
+// Online compaction. The workers are paused just long enough to fork; the
+// child writes the shards as a fresh base while everything committed
+// meanwhile is also kept in memory. Once the child is done the starting
+// worker pauses them again, appends what was kept and renames the new file
+// over the old one.
+AofRewriteResult aofRewrite(int self);
+
+// Reaps a rewrite this worker started and kicks off automatic ones. Returns
+// the longest the worker may sleep, -1 for no limit.
+int aofCheckpoint(int self);
+
+typedef struct
+{
+    bool enabled;
+    AofFsync policy;
+    bool rewrite_in_progress;
+    bool last_rewrite_ok;
+    uint64_t current_size;
+    uint64_t base_size;
+    uint64_t fsyncs;
+} AofStatus;
+
+void aofStatus(AofStatus *status);
+
+#endif
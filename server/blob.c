@@ -0,0 +1,15 @@
+#include "blob.h"
+#include <string.h>
+
+Blob *newBlob(const uint8_t *data, size_t len)
+{
+    Blob *blob = (Blob *)malloc(sizeof(Blob) + len);
+    if (!blob)
+    {
+        return NULL;
+    }
+    blob->refcount = 1;
+    blob->len = (uint32_t)len;
+    memcpy(blob->data, data, len);
+    return blob;
+}
@@ -0,0 +1,34 @@
+#ifndef BLOB_HEADER
+#define BLOB_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Immutable, reference-counted byte string. Values live in blobs so replies
+// can point at them instead of copying, and an overwrite or delete only
+// drops the keyspace's reference while a pending write still holds its own.
+typedef struct
+{
+    uint32_t refcount;
+    uint32_t len;
+    uint8_t data[];
+} Blob;
+
+Blob *newBlob(const uint8_t *data, size_t len);
+
+static inline Blob *retainBlob(Blob *blob)
+{
+    blob->refcount++;
+    return blob;
+}
+
+static inline void releaseBlob(Blob *blob)
+{
+    if (--blob->refcount == 0)
+    {
+        free(blob);
+    }
+}
+
+#endif
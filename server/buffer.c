@@ -1,63 +1,575 @@
 #include "buffer.h"
-#include <stdio.h>
+#include "log.h"
 #include <string.h>
-#include <sys/errno.h>
+#include <errno.h>
 #include <stdlib.h>
 
+enum
+{
+    SEGMENT_MALLOC,
+    SEGMENT_POOLED,
+    SEGMENT_HEADER,
+};
+
+// Segments never leave the thread that allocated them (forwarded replies come
+// back as blobs), so each thread recycles through its own pools without locks.
+static _Thread_local ObjectPool segment_pool;
+static _Thread_local ObjectPool header_pool;
+static _Thread_local bool pools_ready;
+
+static void initPools(void)
+{
+    if (!pools_ready)
+    {
+        initObjectPool(&segment_pool, sizeof(BufferSegment) + BUFFER_SEGMENT_SIZE, 1, BUFFER_POOL_IDLE);
+        initObjectPool(&header_pool, sizeof(BufferSegment), 1, BUFFER_HEADER_POOL_IDLE);
+        pools_ready = true;
+    }
+}
+
+static BufferSegment *newSegment(size_t capacity)
+{
+    initPools();
+
+    BufferSegment *segment;
+    uint8_t origin = SEGMENT_POOLED;
+    if (capacity <= BUFFER_SEGMENT_SIZE)
+    {
+        capacity = BUFFER_SEGMENT_SIZE;
+        segment = (BufferSegment *)poolAlloc(&segment_pool);
+    }
+    else
+    {
+        origin = SEGMENT_MALLOC;
+        segment = (BufferSegment *)malloc(sizeof(BufferSegment) + capacity);
+    }
+    if (!segment)
+    {
+        logWarn("failed to allocate buffer memory");
+        return NULL;
+    }
+    segment->next = NULL;
+    segment->data_begin = segment->buffer_begin;
+    segment->data_end = segment->buffer_begin;
+    segment->buffer_end = segment->buffer_begin + capacity;
+    segment->blob = NULL;
+    segment->placeholder = false;
+    segment->origin = origin;
+    segment->zc_seq = 0;
+    return segment;
+}
+
+// Header-only segment for blob references and placeholders.
+static BufferSegment *newHeaderSegment(void)
+{
+    initPools();
+
+    BufferSegment *segment = (BufferSegment *)poolAlloc(&header_pool);
+    if (!segment)
+    {
+        return NULL;
+    }
+    segment->next = NULL;
+    segment->blob = NULL;
+    segment->placeholder = false;
+    segment->origin = SEGMENT_HEADER;
+    segment->zc_seq = 0;
+    segment->data_begin = segment->buffer_begin;
+    segment->data_end = segment->buffer_begin;
+    segment->buffer_end = segment->buffer_begin;
+    return segment;
+}
+
+static void freeSegment(BufferSegment *segment)
+{
+    if (segment->blob)
+    {
+        releaseBlob(segment->blob);
+    }
+    switch (segment->origin)
+    {
+    case SEGMENT_POOLED:
+        poolFree(&segment_pool, segment);
+        break;
+    case SEGMENT_HEADER:
+        poolFree(&header_pool, segment);
+        break;
+    default:
+        free(segment);
+        break;
+    }
+}
+
+static size_t segmentMemory(const BufferSegment *segment)
+{
+    size_t memory = sizeof(BufferSegment) + (segment->blob ? segment->blob->len : 0);
+    if (segment->origin != SEGMENT_HEADER)
+    {
+        memory += (size_t)(segment->buffer_end - segment->buffer_begin);
+    }
+    return memory;
+}
+
+// Frees a segment that has left the chain for good.
+static void dropSegment(Buffer *buffer, BufferSegment *segment)
+{
+    buffer->memory -= segmentMemory(segment);
+    freeSegment(segment);
+}
+
+static size_t segmentCapacity(const BufferSegment *segment)
+{
+    return (segment->blob || segment->placeholder) ? 0 : (size_t)(segment->buffer_end - segment->buffer_begin);
+}
+
+static bool segmentInFlight(const Buffer *buffer, const BufferSegment *segment)
+{
+    return segment->zc_seq != 0 && (int32_t)(segment->zc_seq - buffer->zc_completed) > 0;
+}
+
+// Drops a drained segment, parking it if a zero-copy send still uses it.
+static void retireSegment(Buffer *buffer, BufferSegment *segment)
+{
+    if (segmentInFlight(buffer, segment))
+    {
+        segment->next = buffer->retired;
+        buffer->retired = segment;
+        return;
+    }
+    dropSegment(buffer, segment);
+}
+
+static void resetSegment(BufferSegment *segment)
+{
+    segment->data_begin = segment->buffer_begin;
+    segment->data_end = segment->buffer_begin;
+}
+
+static void linkSegment(Buffer *buffer, BufferSegment *segment)
+{
+    buffer->memory += segmentMemory(segment);
+    if (buffer->tail)
+    {
+        buffer->tail->next = segment;
+    }
+    else
+    {
+        buffer->head = segment;
+    }
+    buffer->tail = segment;
+}
+
+// Makes sure the tail segment has at least min_size free bytes.
+static BufferSegment *tailWithSpace(Buffer *buffer, size_t min_size, size_t hint)
+{
+    BufferSegment *tail = buffer->tail;
+    if (tail && (size_t)(tail->buffer_end - tail->data_end) >= min_size)
+    {
+        return tail;
+    }
+
+    // an empty tail can simply be rewound instead of chaining another one
+    if (tail && tail->data_begin == tail->data_end && segmentCapacity(tail) >= min_size &&
+        !segmentInFlight(buffer, tail))
+    {
+        resetSegment(tail);
+        return tail;
+    }
+
+    BufferSegment *segment = newSegment(hint > min_size ? hint : min_size);
+    if (!segment)
+    {
+        return NULL;
+    }
+    linkSegment(buffer, segment);
+    return segment;
+}
+
 bool consumeNewBuffer(Buffer *buffer, size_t data_size)
 {
-    size_t current_data_size = buffer->data_end - buffer->data_begin;
-    if (data_size > current_data_size)
+    if (data_size > buffer->size)
     {
         return false;
     }
-    buffer->data_begin += data_size;
+    buffer->size -= data_size;
 
-    if (buffer->data_begin == buffer->data_end)
+    while (data_size > 0)
     {
-        buffer->data_begin = buffer->buffer_begin;
-        buffer->data_end = buffer->buffer_begin;
+        BufferSegment *head = buffer->head;
+        size_t available = head->data_end - head->data_begin;
+        if (data_size < available)
+        {
+            head->data_begin += data_size;
+            return true;
+        }
+
+        data_size -= available;
+        head->data_begin = head->data_end;
+        if (head == buffer->tail)
+        {
+            break;
+        }
+        buffer->head = head->next;
+        retireSegment(buffer, head);
+    }
+
+    // keep one standard segment around for the next burst, drop big ones,
+    // borrowed ones and any the kernel may still be reading from
+    BufferSegment *head = buffer->head;
+    if (buffer->size == 0 && head && head == buffer->tail && !head->placeholder)
+    {
+        if (segmentCapacity(head) > BUFFER_SEGMENT_SIZE || head->blob || segmentInFlight(buffer, head))
+        {
+            buffer->head = NULL;
+            buffer->tail = NULL;
+            retireSegment(buffer, head);
+        }
+        else
+        {
+            resetSegment(head);
+        }
     }
 
     return true;
 }
 
-
 bool appendToNewBuffer(Buffer *buffer, const uint8_t *data, size_t data_size)
 {
-    size_t available_space = buffer->buffer_end - buffer->data_end;
-    if (data_size > available_space)
+    while (data_size > 0)
+    {
+        BufferSegment *tail = tailWithSpace(buffer, 1, data_size);
+        if (!tail)
+        {
+            return false;
+        }
+
+        size_t chunk = tail->buffer_end - tail->data_end;
+        if (chunk > data_size)
+        {
+            chunk = data_size;
+        }
+        memcpy(tail->data_end, data, chunk);
+        tail->data_end += chunk;
+        buffer->size += chunk;
+        data += chunk;
+        data_size -= chunk;
+    }
+
+    return true;
+}
+
+void initBuffer(Buffer *buffer)
+{
+    // segments are allocated lazily, an idle buffer owns no memory
+    buffer->head = NULL;
+    buffer->tail = NULL;
+    buffer->size = 0;
+    buffer->memory = 0;
+    buffer->placeholders = 0;
+    buffer->retired = NULL;
+    buffer->zc_sent = 0;
+    buffer->zc_completed = 0;
+    buffer->zc_range_count = 0;
+}
+
+static void freeChain(Buffer *buffer, BufferSegment *segment)
+{
+    while (segment)
+    {
+        BufferSegment *next = segment->next;
+        dropSegment(buffer, segment);
+        segment = next;
+    }
+}
+
+void freeBuffer(Buffer *buffer)
+{
+    freeChain(buffer, buffer->head);
+    freeChain(buffer, buffer->retired);
+    buffer->head = NULL;
+    buffer->tail = NULL;
+    buffer->retired = NULL;
+    buffer->size = 0;
+    buffer->memory = 0;
+    buffer->placeholders = 0;
+}
+
+bool copyFromBuffer(const Buffer *buffer, size_t offset, void *out, size_t data_size)
+{
+    if (offset + data_size > buffer->size)
     {
         return false;
     }
 
-    memcpy(buffer->data_end, data, data_size);
-    buffer->data_end += data_size;
+    uint8_t *dst = (uint8_t *)out;
+    for (BufferSegment *segment = buffer->head; segment && data_size > 0; segment = segment->next)
+    {
+        size_t available = segment->data_end - segment->data_begin;
+        if (offset >= available)
+        {
+            offset -= available;
+            continue;
+        }
 
+        size_t chunk = available - offset;
+        if (chunk > data_size)
+        {
+            chunk = data_size;
+        }
+        memcpy(dst, segment->data_begin + offset, chunk);
+        dst += chunk;
+        data_size -= chunk;
+        offset = 0;
+    }
     return true;
 }
 
-void initBuffer(Buffer *buffer)
+const uint8_t *bufferData(Buffer *buffer, size_t data_size)
 {
-    buffer->buffer_begin = (uint8_t *)malloc(MAX_BUFFER_SIZE);
-    if (!buffer->buffer_begin) {
-        fprintf(stderr, "Failed to allocate buffer memory\n");
-        buffer->buffer_end = NULL;
-        buffer->data_begin = NULL;
-        buffer->data_end = NULL;
-        return;
+    if (data_size > buffer->size)
+    {
+        return NULL;
+    }
+
+    BufferSegment *head = buffer->head;
+    if (!head || (size_t)(head->data_end - head->data_begin) >= data_size)
+    {
+        return head ? head->data_begin : NULL;
+    }
+
+    // Gather into a fresh segment placed in front of the chain. Only frames
+    // that straddle a boundary pay for this, and each byte is moved once.
+    BufferSegment *merged = newSegment(data_size);
+    if (!merged)
+    {
+        return NULL;
+    }
+    copyFromBuffer(buffer, 0, merged->data_end, data_size);
+    merged->data_end += data_size;
+
+    size_t remaining = data_size;
+    while (remaining > 0)
+    {
+        BufferSegment *segment = buffer->head;
+        size_t available = segment->data_end - segment->data_begin;
+        if (remaining < available)
+        {
+            segment->data_begin += remaining;
+            break;
+        }
+        remaining -= available;
+        buffer->head = segment->next;
+        if (segment == buffer->tail)
+        {
+            buffer->tail = NULL;
+        }
+        dropSegment(buffer, segment);
+    }
+
+    buffer->memory += segmentMemory(merged);
+    merged->next = buffer->head;
+    buffer->head = merged;
+    if (!buffer->tail)
+    {
+        buffer->tail = merged;
     }
-    buffer->buffer_end = buffer->buffer_begin + MAX_BUFFER_SIZE;
-    buffer->data_begin = buffer->buffer_begin;
-    buffer->data_end = buffer->buffer_begin;
+    return merged->data_begin;
 }
 
-void freeBuffer(Buffer *buffer) {
-    if (buffer->buffer_begin) {
-        free(buffer->buffer_begin);
-        buffer->buffer_begin = NULL;
-        buffer->buffer_end = NULL;
-        buffer->data_begin = NULL;
-        buffer->data_end = NULL;
+bool reserveInBuffer(Buffer *buffer, size_t data_size, BufferMark *mark)
+{
+    BufferSegment *tail = tailWithSpace(buffer, data_size, BUFFER_SEGMENT_SIZE);
+    if (!tail)
+    {
+        return false;
+    }
+    mark->data = tail->data_end;
+    mark->offset = buffer->size;
+    tail->data_end += data_size;
+    buffer->size += data_size;
+    return true;
+}
+
+size_t bytesSinceMark(const Buffer *buffer, const BufferMark *mark, size_t reserved)
+{
+    return buffer->size - mark->offset - reserved;
+}
+
+uint8_t *prepareBufferWrite(Buffer *buffer, size_t min_size, size_t *available)
+{
+    BufferSegment *tail = tailWithSpace(buffer, min_size, BUFFER_SEGMENT_SIZE);
+    if (!tail)
+    {
+        *available = 0;
+        return NULL;
     }
-}
\ No newline at end of file
+    *available = tail->buffer_end - tail->data_end;
+    return tail->data_end;
+}
+
+void commitBufferWrite(Buffer *buffer, size_t data_size)
+{
+    buffer->tail->data_end += data_size;
+    buffer->size += data_size;
+}
+
+int bufferIovecs(const Buffer *buffer, struct iovec *iov, int max_iov)
+{
+    int count = 0;
+    for (BufferSegment *segment = buffer->head; segment && count < max_iov; segment = segment->next)
+    {
+        if (segment->placeholder)
+        {
+            break;
+        }
+        size_t available = segment->data_end - segment->data_begin;
+        if (available == 0)
+        {
+            continue;
+        }
+        iov[count].iov_base = segment->data_begin;
+        iov[count].iov_len = available;
+        count++;
+    }
+    return count;
+}
+
+void releaseBufferIfEmpty(Buffer *buffer)
+{
+    if (bufferDrained(buffer) && buffer->head && !segmentInFlight(buffer, buffer->head))
+    {
+        freeChain(buffer, buffer->head);
+        buffer->head = NULL;
+        buffer->tail = NULL;
+    }
+}
+
+bool appendBlobToBuffer(Buffer *buffer, Blob *blob)
+{
+    if (blob->len == 0)
+    {
+        return true;
+    }
+
+    BufferSegment *segment = newHeaderSegment();
+    if (!segment)
+    {
+        return false;
+    }
+    segment->blob = retainBlob(blob);
+    segment->data_begin = blob->data;
+    segment->data_end = blob->data + blob->len;
+    segment->buffer_end = segment->data_end;
+    linkSegment(buffer, segment);
+    buffer->size += blob->len;
+    return true;
+}
+
+BufferSegment *appendPlaceholderToBuffer(Buffer *buffer)
+{
+    BufferSegment *segment = newHeaderSegment();
+    if (!segment)
+    {
+        return NULL;
+    }
+    segment->placeholder = true;
+    linkSegment(buffer, segment);
+    buffer->placeholders++;
+    return segment;
+}
+
+void fillPlaceholder(Buffer *buffer, BufferSegment *placeholder, Blob *blob)
+{
+    placeholder->placeholder = false;
+    placeholder->blob = blob;
+    placeholder->data_begin = blob->data;
+    placeholder->data_end = blob->data + blob->len;
+    placeholder->buffer_end = placeholder->data_end;
+    buffer->placeholders--;
+    buffer->size += blob->len;
+    buffer->memory += blob->len;
+}
+
+void bufferPoolStats(PoolStats *segments, PoolStats *headers)
+{
+    initPools();
+    *segments = segment_pool.stats;
+    *headers = header_pool.stats;
+}
+
+void markBufferZeroCopySend(Buffer *buffer, size_t data_size)
+{
+    uint32_t seq = ++buffer->zc_sent;
+    for (BufferSegment *segment = buffer->head; segment && data_size > 0; segment = segment->next)
+    {
+        size_t available = segment->data_end - segment->data_begin;
+        if (available == 0)
+        {
+            continue;
+        }
+        segment->zc_seq = seq;
+        data_size -= available < data_size ? available : data_size;
+    }
+}
+
+// Whether send seq, or everything before it, is done.
+static bool zeroCopyReaches(const Buffer *buffer, uint32_t seq)
+{
+    return (int32_t)(seq - buffer->zc_completed) <= 1;
+}
+
+bool completeBufferZeroCopy(Buffer *buffer, uint32_t first, uint32_t last)
+{
+    // the buffer numbers sends from 1
+    uint32_t begin = first + 1;
+    uint32_t end = last + 1;
+    if ((int32_t)(end - buffer->zc_completed) <= 0)
+    {
+        return true;
+    }
+    if (!zeroCopyReaches(buffer, begin))
+    {
+        // an earlier send is still out; park the range until it is done
+        if (buffer->zc_range_count == BUFFER_ZC_RANGES)
+        {
+            return false;
+        }
+        buffer->zc_ranges[buffer->zc_range_count][0] = begin;
+        buffer->zc_ranges[buffer->zc_range_count][1] = end;
+        buffer->zc_range_count++;
+        return true;
+    }
+    buffer->zc_completed = end;
+    // parked ranges that now join the completed sends extend them
+    for (uint32_t i = 0; i < buffer->zc_range_count;)
+    {
+        uint32_t *range = buffer->zc_ranges[i];
+        if (!zeroCopyReaches(buffer, range[0]))
+        {
+            i++;
+            continue;
+        }
+        if ((int32_t)(range[1] - buffer->zc_completed) > 0)
+        {
+            buffer->zc_completed = range[1];
+        }
+        buffer->zc_range_count--;
+        range[0] = buffer->zc_ranges[buffer->zc_range_count][0];
+        range[1] = buffer->zc_ranges[buffer->zc_range_count][1];
+        i = 0;
+    }
+
+    BufferSegment **link = &buffer->retired;
+    while (*link)
+    {
+        BufferSegment *segment = *link;
+        if (segmentInFlight(buffer, segment))
+        {
+            link = &segment->next;
+            continue;
+        }
+        *link = segment->next;
+        dropSegment(buffer, segment);
+    }
+    return true;
+}
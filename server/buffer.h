@@ -1,24 +1,148 @@
 #ifndef UINT_8T_VECTOR
 #define UINT_8T_VECTOR
 #define INITIAL_CAPACITY 4
-#define MAX_BUFFER_SIZE 10000
+#define BUFFER_SEGMENT_SIZE (16 * 1024)
+#define BUFFER_MIN_READ 4096
+// idle segments each thread keeps for reuse
+#define BUFFER_POOL_IDLE 128
+#define BUFFER_HEADER_POOL_IDLE 1024
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <sys/uio.h>
+#include "blob.h"
+#include "pool.h"
 
-typedef struct
+// One link of a buffer chain. Bytes in [data_begin, data_end) are readable,
+// [data_end, buffer_end) is free space for appends. A segment with a blob
+// points into the blob's bytes instead of its own storage and is never
+// appended to. A placeholder holds the spot of bytes that are not known yet;
+// nothing behind it can be read until it has been filled.
+typedef struct BufferSegment
 {
+    struct BufferSegment *next;
     uint8_t *data_begin;
     uint8_t *data_end;
-    uint8_t *buffer_begin;
     uint8_t *buffer_end;
+    Blob *blob;
+    bool placeholder;
+    // which allocator the segment goes back to
+    uint8_t origin;
+    // id + 1 of the last MSG_ZEROCOPY send that covered this segment, 0 if none
+    uint32_t zc_seq;
+    uint8_t buffer_begin[];
+} BufferSegment;
+
+// out-of-order zero-copy completions a buffer keeps track of
+#define BUFFER_ZC_RANGES 4
+
+// A FIFO of bytes stored as a chain of segments. Appends go to the tail and
+// spill into new segments, consumption drops drained segments from the head,
+// so neither side ever moves existing data.
+typedef struct
+{
+    BufferSegment *head;
+    BufferSegment *tail;
+    size_t size;
+    // storage the segments hold, free space and referenced blobs included
+    size_t memory;
+    uint32_t placeholders;
+    // Segments drained while a zero-copy send may still be reading them wait
+    // here until the kernel reports completion.
+    BufferSegment *retired;
+    uint32_t zc_sent;
+    // sends 1..zc_completed are all done
+    uint32_t zc_completed;
+    // completed ranges of sends reported ahead of an earlier one
+    uint32_t zc_ranges[BUFFER_ZC_RANGES][2];
+    uint32_t zc_range_count;
 } Buffer;
 
+// Points at bytes reserved by reserveInBuffer().
+typedef struct
+{
+    uint8_t *data;
+    size_t offset;
+} BufferMark;
+
 bool consumeNewBuffer(Buffer *buffer, size_t data_size);
 
+// Returns false only when memory for a new segment cannot be allocated.
 bool appendToNewBuffer(Buffer *buffer, const uint8_t *data, size_t data_size);
 
-void initBuffer(Buffer* buffer);
+void initBuffer(Buffer *buffer);
 
 void freeBuffer(Buffer *buffer);
 
-#endif
\ No newline at end of file
+static inline size_t bufferSize(const Buffer *buffer)
+{
+    return buffer->size;
+}
+
+// What the buffer costs in memory, which for many small appends behind blob
+// references is far more than its size.
+static inline size_t bufferMemory(const Buffer *buffer)
+{
+    return buffer->memory;
+}
+
+// Copies data_size bytes starting at offset without consuming them.
+bool copyFromBuffer(const Buffer *buffer, size_t offset, void *out, size_t data_size);
+
+// Returns the first data_size bytes as one contiguous run, gathering them into
+// a single segment first when they straddle a segment boundary.
+const uint8_t *bufferData(Buffer *buffer, size_t data_size);
+
+// Appends data_size contiguous bytes to be filled in later, e.g. a length
+// header patched once the payload after it is known.
+bool reserveInBuffer(Buffer *buffer, size_t data_size, BufferMark *mark);
+
+// Bytes appended after the mark, excluding the reservation itself.
+size_t bytesSinceMark(const Buffer *buffer, const BufferMark *mark, size_t reserved);
+
+// Exposes at least min_size bytes of free tail space for a direct read();
+// commitBufferWrite() then accounts for what was actually written.
+uint8_t *prepareBufferWrite(Buffer *buffer, size_t min_size, size_t *available);
+
+void commitBufferWrite(Buffer *buffer, size_t data_size);
+
+// Fills up to max_iov entries describing the readable bytes, returns the count.
+// Stops at the first unfilled placeholder.
+int bufferIovecs(const Buffer *buffer, struct iovec *iov, int max_iov);
+
+// Frees the spare segment kept around after the buffer drained.
+void releaseBufferIfEmpty(Buffer *buffer);
+
+// Appends a reference to the blob's bytes without copying them; the buffer
+// holds its own reference until those bytes have been consumed.
+bool appendBlobToBuffer(Buffer *buffer, Blob *blob);
+
+// Reserves the current position for bytes produced later, e.g. a reply that is
+// being computed by another thread.
+BufferSegment *appendPlaceholderToBuffer(Buffer *buffer);
+
+// Makes the blob's bytes appear where the placeholder was appended. Takes over
+// the caller's reference to the blob.
+void fillPlaceholder(Buffer *buffer, BufferSegment *placeholder, Blob *blob);
+
+// Nothing left to send and nothing still to be filled in.
+static inline bool bufferDrained(const Buffer *buffer)
+{
+    return buffer->size == 0 && buffer->placeholders == 0;
+}
+
+// Pool counters of the calling thread: standard segments and the header-only
+// segments used for blobs and placeholders.
+void bufferPoolStats(PoolStats *segments, PoolStats *headers);
+
+// Records that the first data_size bytes went out in one MSG_ZEROCOPY send.
+void markBufferZeroCopySend(Buffer *buffer, size_t data_size);
+
+// The kernel finished with the zero-copy sends first..last, inclusive and
+// numbered from 0 as in its notifications. Ranges may come in any order; a
+// segment is only dropped once every send up to the last that covered it is
+// done. Returns false when more ranges arrive ahead of a missing one than
+// the buffer can hold; nothing is dropped early then either.
+bool completeBufferZeroCopy(Buffer *buffer, uint32_t first, uint32_t last);
+
+#endif
@@ -0,0 +1,988 @@
+#include "cluster.h"
+#include "aof.h"
+#include "command.h"
+#include "fdio.h"
+#include "log.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NO_NODE 0xFF
+
+// CRC16-CCITT (XMODEM), the polynomial Redis cluster picks slots with.
+static const uint16_t crc16_table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0,};
+
+// A worker's batch goes QUEUED for the migration thread, SENDING while the
+// thread replays it on the target, then DONE or FAILED until the worker
+// takes it back.
+typedef enum
+{
+    BATCH_IDLE,
+    BATCH_QUEUED,
+    BATCH_SENDING,
+    BATCH_DONE,
+    BATCH_FAILED,
+} BatchState;
+
+typedef struct
+{
+    _Atomic int state;
+    // a DEL of each key followed by the frames that rebuild it; the worker
+    // fills it while idle, the thread only reads it
+    Buffer frames;
+    // copies of the keys, for ERR_TRYAGAIN while the batch is out
+    Blob *keys[MIGRATE_BATCH_KEYS];
+    int nkeys;
+    // the migration the scan of the shard belongs to, and where it stands
+    uint64_t job;
+    size_t cursor;
+    uint64_t retry_at;
+    // under the lock: the shard has no keys of migrating slots left
+    bool drained;
+} Mover;
+
+static struct
+{
+    bool enabled;
+    pthread_mutex_t lock;
+    // wakes the migration thread
+    pthread_cond_t changed;
+    char *config_path;
+    // only ever appended to, under the lock; 0 is this node
+    char nodes[CLUSTER_MAX_NODES][CLUSTER_ADDR_LEN];
+    _Atomic int nnodes;
+    // slot map changes are made under the lock and read without it
+    _Atomic uint8_t owner[CLUSTER_SLOTS];
+    // the node an importing slot comes from
+    _Atomic uint8_t importing[CLUSTER_SLOTS];
+    _Atomic bool migrating[CLUSTER_SLOTS];
+    // where the migrating slots go, NO_NODE when nothing migrates; job
+    // counts the migrations started
+    _Atomic int target;
+    _Atomic uint64_t job;
+    Mover *movers;
+    int count;
+    int *wake_fds;
+    uint64_t keys_migrated;
+    uint64_t batches_failed;
+} g_cluster = {.lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER, .target = NO_NODE};
+
+static const Slice asking = {(const uint8_t *)"ASKING", 6};
+
+uint32_t clusterKeySlot(const uint8_t *key, size_t key_len)
+{
+    const uint8_t *open = (const uint8_t *)memchr(key, '{', key_len);
+    if (open)
+    {
+        size_t after = (size_t)(open - key) + 1;
+        const uint8_t *close = (const uint8_t *)memchr(open + 1, '}', key_len - after);
+        if (close && close > open + 1)
+        {
+            key = open + 1;
+            key_len = (size_t)(close - key);
+        }
+    }
+    uint16_t crc = 0;
+    for (size_t i = 0; i < key_len; i++)
+    {
+        crc = (uint16_t)(crc << 8) ^ crc16_table[((crc >> 8) ^ key[i]) & 0xFF];
+    }
+    return crc & (CLUSTER_SLOTS - 1);
+}
+
+// "N" or "N-M", both within the slot range.
+static bool parseSlots(const Slice *arg, int *first, int *last)
+{
+    char text[16];
+    if (arg->len == 0 || arg->len >= sizeof(text))
+    {
+        return false;
+    }
+    memcpy(text, arg->data, arg->len);
+    text[arg->len] = '\0';
+    char *end;
+    long a = strtol(text, &end, 10);
+    long b = a;
+    if (*end == '-')
+    {
+        b = strtol(end + 1, &end, 10);
+    }
+    if (*end != '\0' || end == text || a < 0 || b < a || b >= CLUSTER_SLOTS)
+    {
+        return false;
+    }
+    *first = (int)a;
+    *last = (int)b;
+    return true;
+}
+
+// host:port with a port in range.
+static bool parseAddr(const Slice *arg, char *out)
+{
+    if (arg->len == 0 || arg->len >= CLUSTER_ADDR_LEN)
+    {
+        return false;
+    }
+    memcpy(out, arg->data, arg->len);
+    out[arg->len] = '\0';
+    char *colon = strrchr(out, ':');
+    if (!colon || colon == out || memchr(out, ' ', arg->len))
+    {
+        return false;
+    }
+    char *end;
+    long port = strtol(colon + 1, &end, 10);
+    return *end == '\0' && end != colon + 1 && port > 0 && port < 65536;
+}
+
+// Under the lock: the index of the node at addr, added when new; -1 when
+// the table is full.
+static int nodeIndex(const char *addr)
+{
+    int n = atomic_load(&g_cluster.nnodes);
+    for (int i = 0; i < n; i++)
+    {
+        if (strcmp(g_cluster.nodes[i], addr) == 0)
+        {
+            return i;
+        }
+    }
+    if (n == CLUSTER_MAX_NODES)
+    {
+        return -1;
+    }
+    snprintf(g_cluster.nodes[n], CLUSTER_ADDR_LEN, "%s", addr);
+    atomic_store(&g_cluster.nnodes, n + 1);
+    return n;
+}
+
+// The last slot of the run of slots with the same owner that starts at first.
+static int runEnd(int first)
+{
+    int owner = atomic_load(&g_cluster.owner[first]);
+    int last = first;
+    while (last + 1 < CLUSTER_SLOTS && atomic_load(&g_cluster.owner[last + 1]) == owner)
+    {
+        last++;
+    }
+    return last;
+}
+
+// Under the lock. The slot map as "first-last host:port" lines, written
+// beside the file and renamed over it.
+static bool saveConfig(void)
+{
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g_cluster.config_path);
+    FILE *file = fopen(tmp, "w");
+    if (!file)
+    {
+        logWarn("cluster config %s: %s", tmp, strerror(errno));
+        return false;
+    }
+    for (int first = 0; first < CLUSTER_SLOTS;)
+    {
+        int last = runEnd(first);
+        int owner = atomic_load(&g_cluster.owner[first]);
+        if (owner != NO_NODE)
+        {
+            fprintf(file, "%d-%d %s\n", first, last, g_cluster.nodes[owner]);
+        }
+        first = last + 1;
+    }
+    bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp, g_cluster.config_path) != 0)
+    {
+        logWarn("cluster config %s: %s", g_cluster.config_path, strerror(errno));
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+static bool loadConfig(void)
+{
+    FILE *file = fopen(g_cluster.config_path, "r");
+    if (!file)
+    {
+        if (errno == ENOENT)
+        {
+            return true;
+        }
+        logError("cluster config %s: %s", g_cluster.config_path, strerror(errno));
+        return false;
+    }
+    char line[256];
+    int number = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file))
+    {
+        number++;
+        int first, last, node = -1;
+        char addr[CLUSTER_ADDR_LEN];
+        ok = sscanf(line, "%d-%d %63s", &first, &last, addr) == 3 && first >= 0 && first <= last &&
+             last < CLUSTER_SLOTS && (node = nodeIndex(addr)) >= 0;
+        for (int slot = first; ok && slot <= last; slot++)
+        {
+            atomic_store(&g_cluster.owner[slot], (uint8_t)node);
+        }
+    }
+    fclose(file);
+    if (!ok)
+    {
+        logError("cluster config %s: bad line %d", g_cluster.config_path, number);
+    }
+    return ok;
+}
+
+static bool inBatch(const Mover *m, const Slice *key)
+{
+    if (atomic_load(&m->state) == BATCH_IDLE)
+    {
+        return false;
+    }
+    for (int i = 0; i < m->nkeys; i++)
+    {
+        if (m->keys[i]->len == key->len && memcmp(m->keys[i]->data, key->data, key->len) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool clusterServes(int self, Keyspace *db, const Slice *key, bool asking, uint32_t *code, char *message,
+                   size_t size)
+{
+    uint32_t slot = clusterKeySlot(key->data, key->len);
+    int owner = atomic_load(&g_cluster.owner[slot]);
+    if (owner == 0)
+    {
+        if (!atomic_load(&g_cluster.migrating[slot]) || keyspaceGet(db, key->data, key->len))
+        {
+            return true;
+        }
+        if (inBatch(&g_cluster.movers[self], key))
+        {
+            *code = ERR_TRYAGAIN;
+            snprintf(message, size, "key of slot %u is being migrated", slot);
+            return false;
+        }
+        int target = atomic_load(&g_cluster.target);
+        *code = ERR_ASK;
+        snprintf(message, size, "%u %s", slot, g_cluster.nodes[target]);
+        return false;
+    }
+    if (asking && atomic_load(&g_cluster.importing[slot]) != NO_NODE)
+    {
+        return true;
+    }
+    if (owner == NO_NODE)
+    {
+        *code = ERR_CLUSTERDOWN;
+        snprintf(message, size, "slot %u is not served", slot);
+        return false;
+    }
+    *code = ERR_MOVED;
+    snprintf(message, size, "%u %s", slot, g_cluster.nodes[owner]);
+    return false;
+}
+
+bool clusterEnabled(void)
+{
+    return g_cluster.enabled;
+}
+
+bool clusterIsAsking(const Slice *args, uint32_t nargs)
+{
+    return nargs == 1 && sliceEquals(&args[0], "asking");
+}
+
+// Under the lock: [start, end, host, port] for each run of assigned slots.
+static void replySlots(Buffer *out)
+{
+    uint32_t runs = 0;
+    for (int first = 0; first < CLUSTER_SLOTS; first = runEnd(first) + 1)
+    {
+        runs += atomic_load(&g_cluster.owner[first]) != NO_NODE;
+    }
+    replyArr(out, runs);
+    for (int first = 0; first < CLUSTER_SLOTS;)
+    {
+        int last = runEnd(first);
+        int owner = atomic_load(&g_cluster.owner[first]);
+        if (owner != NO_NODE)
+        {
+            const char *addr = g_cluster.nodes[owner];
+            const char *colon = strrchr(addr, ':');
+            replyArr(out, 4);
+            replyInt(out, first);
+            replyInt(out, last);
+            replyStr(out, (const uint8_t *)addr, (size_t)(colon - addr));
+            replyInt(out, atoi(colon + 1));
+        }
+        first = last + 1;
+    }
+}
+
+// Under the lock. Returns the error for the reply, NULL on success.
+static const char *setSlots(int first, int last, const Slice *how, int node, uint32_t *code, char *message,
+                            size_t size)
+{
+    *code = ERR_SYNTAX;
+    if (sliceEquals(how, "stable"))
+    {
+        for (int slot = first; slot <= last; slot++)
+        {
+            atomic_store(&g_cluster.importing[slot], NO_NODE);
+            atomic_store(&g_cluster.migrating[slot], false);
+        }
+        // with nothing left to move the thread ends the migration; a new job
+        // makes the workers look again without waiting out a retry
+        atomic_fetch_add(&g_cluster.job, 1);
+        for (int i = 0; i < g_cluster.count; i++)
+        {
+            g_cluster.movers[i].drained = false;
+            wakeEventFd(g_cluster.wake_fds[i]);
+        }
+        pthread_cond_signal(&g_cluster.changed);
+        return NULL;
+    }
+    if (node < 0)
+    {
+        return "too many nodes";
+    }
+    if (sliceEquals(how, "node"))
+    {
+        for (int slot = first; slot <= last; slot++)
+        {
+            if (atomic_load(&g_cluster.migrating[slot]))
+            {
+                *code = ERR_BUSY;
+                snprintf(message, size, "slot %d is migrating, set it STABLE first", slot);
+                return message;
+            }
+        }
+        for (int slot = first; slot <= last; slot++)
+        {
+            atomic_store(&g_cluster.owner[slot], (uint8_t)node);
+            atomic_store(&g_cluster.importing[slot], NO_NODE);
+        }
+        saveConfig();
+        return NULL;
+    }
+    bool importing = sliceEquals(how, "importing");
+    if (!importing && !sliceEquals(how, "migrating"))
+    {
+        return "expected NODE, IMPORTING, MIGRATING or STABLE";
+    }
+    if (node == 0)
+    {
+        return "that is this node";
+    }
+    for (int slot = first; slot <= last; slot++)
+    {
+        if ((atomic_load(&g_cluster.owner[slot]) == 0) == importing)
+        {
+            snprintf(message, size, importing ? "slot %d is served here already" : "slot %d is not served here",
+                     slot);
+            return message;
+        }
+    }
+    if (importing)
+    {
+        for (int slot = first; slot <= last; slot++)
+        {
+            atomic_store(&g_cluster.importing[slot], (uint8_t)node);
+        }
+        return NULL;
+    }
+    int target = atomic_load(&g_cluster.target);
+    if (target != NO_NODE)
+    {
+        *code = ERR_BUSY;
+        snprintf(message, size, "slots are migrating to %s already", g_cluster.nodes[target]);
+        return message;
+    }
+    for (int slot = first; slot <= last; slot++)
+    {
+        atomic_store(&g_cluster.migrating[slot], true);
+    }
+    atomic_fetch_add(&g_cluster.job, 1);
+    atomic_store(&g_cluster.target, node);
+    for (int i = 0; i < g_cluster.count; i++)
+    {
+        g_cluster.movers[i].drained = false;
+        wakeEventFd(g_cluster.wake_fds[i]);
+    }
+    logInfo("migrating slots %d-%d to %s", first, last, g_cluster.nodes[node]);
+    return NULL;
+}
+
+void clusterCommand(Buffer *out, const Slice *args, uint32_t nargs)
+{
+    if (nargs == 3 && sliceEquals(&args[1], "keyslot"))
+    {
+        replyInt(out, clusterKeySlot(args[2].data, args[2].len));
+        return;
+    }
+    if (!g_cluster.enabled)
+    {
+        replyErr(out, ERR_UNKNOWN, "cluster support is disabled");
+        return;
+    }
+    if (nargs == 2 && sliceEquals(&args[1], "slots"))
+    {
+        pthread_mutex_lock(&g_cluster.lock);
+        replySlots(out);
+        pthread_mutex_unlock(&g_cluster.lock);
+        return;
+    }
+    int first, last;
+    bool stable = nargs == 4 && sliceEquals(&args[3], "stable");
+    char addr[CLUSTER_ADDR_LEN];
+    if (nargs < 4 || !sliceEquals(&args[1], "setslot") || (!stable && nargs != 5))
+    {
+        replyErr(out, ERR_SYNTAX, "expected KEYSLOT key, SLOTS or SETSLOT slot[-slot] ...");
+        return;
+    }
+    if (!parseSlots(&args[2], &first, &last))
+    {
+        replyErr(out, ERR_SYNTAX, "invalid slot or slot range");
+        return;
+    }
+    if (!stable && !parseAddr(&args[4], addr))
+    {
+        replyErr(out, ERR_SYNTAX, "expected host:port");
+        return;
+    }
+    char message[128];
+    uint32_t code;
+    pthread_mutex_lock(&g_cluster.lock);
+    const char *error = setSlots(first, last, &args[3], stable ? NO_NODE : nodeIndex(addr), &code, message,
+                                 sizeof(message));
+    pthread_mutex_unlock(&g_cluster.lock);
+    if (error)
+    {
+        replyErr(out, code, error);
+        return;
+    }
+    replyNil(out);
+}
+
+// Keys left in the shard of slots that are migrating.
+static uint64_t migratingKeys(const Keyspace *db)
+{
+    uint64_t keys = 0;
+    for (uint32_t slot = 0; slot < CLUSTER_SLOTS; slot++)
+    {
+        if (atomic_load_explicit(&g_cluster.migrating[slot], memory_order_relaxed))
+        {
+            keys += keyspaceSlotKeys(db, slot);
+        }
+    }
+    return keys;
+}
+
+static void dropBatch(Mover *m)
+{
+    consumeNewBuffer(&m->frames, bufferSize(&m->frames));
+    for (int i = 0; i < m->nkeys; i++)
+    {
+        releaseBlob(m->keys[i]);
+    }
+    m->nkeys = 0;
+}
+
+// Picks up keys of migrating slots from where the scan stands, looking at
+// no more than MIGRATE_SCAN_STEP of them, until the batch is full. Returns
+// false when the scan went past the last key.
+static bool collectBatch(Mover *m, Keyspace *db)
+{
+    for (int seen = 0; seen < MIGRATE_SCAN_STEP; seen++)
+    {
+        if (m->nkeys == MIGRATE_BATCH_KEYS || bufferSize(&m->frames) >= MIGRATE_BATCH_BYTES)
+        {
+            return true;
+        }
+        const Node *node = keyspaceNext(db, &m->cursor);
+        if (!node)
+        {
+            return false;
+        }
+        if (!atomic_load_explicit(&g_cluster.migrating[clusterKeySlot(nodeKey(node), node->key_len)],
+                                  memory_order_relaxed))
+        {
+            continue;
+        }
+        Slice del[2] = {{(const uint8_t *)"DEL", 3}, {nodeKey(node), node->key_len}};
+        Blob *key = newBlob(nodeKey(node), node->key_len);
+        if (!key || !appendRequest(&m->frames, del, 2) || !aofAppendKey(&m->frames, node))
+        {
+            // nothing was deleted yet; try again later
+            logError("out of memory for a migration batch");
+            if (key)
+            {
+                releaseBlob(key);
+            }
+            dropBatch(m);
+            m->retry_at = monotonicMs() + MIGRATE_RETRY_MS;
+            return true;
+        }
+        m->keys[m->nkeys++] = key;
+    }
+    return true;
+}
+
+// Takes back a batch the thread is done with. One the target did not take
+// is replayed here; the DELs in front of each key clear the way.
+static void finishBatch(int self, Mover *m, Keyspace *db, Buffer *aof, bool failed)
+{
+    if (failed)
+    {
+        size_t size = bufferSize(&m->frames);
+        const uint8_t *data = bufferData(&m->frames, size);
+        if (!data)
+        {
+            logError("out of memory putting back %d migrating keys, they are lost", m->nkeys);
+        }
+        Buffer replies;
+        initBuffer(&replies);
+        CommandContext ctx = {db, &replies, NULL, self, aof};
+        for (size_t pos = 0; data && pos < size;)
+        {
+            uint32_t len;
+            memcpy(&len, data + pos, 4);
+            executeRequest(&ctx, data + pos + 4, len);
+            consumeNewBuffer(&replies, bufferSize(&replies));
+            pos += 4 + (size_t)len;
+        }
+        freeBuffer(&replies);
+        m->retry_at = monotonicMs() + MIGRATE_RETRY_MS;
+    }
+    pthread_mutex_lock(&g_cluster.lock);
+    if (failed)
+    {
+        g_cluster.batches_failed++;
+    }
+    else
+    {
+        g_cluster.keys_migrated += (uint64_t)m->nkeys;
+    }
+    pthread_mutex_unlock(&g_cluster.lock);
+    dropBatch(m);
+    atomic_store(&m->state, BATCH_IDLE);
+}
+
+int clusterMigrate(int self, Keyspace *db, Buffer *aof)
+{
+    if (!g_cluster.enabled)
+    {
+        return -1;
+    }
+    Mover *m = &g_cluster.movers[self];
+    int state = atomic_load(&m->state);
+    if (state == BATCH_QUEUED || state == BATCH_SENDING)
+    {
+        return -1;
+    }
+    if (state != BATCH_IDLE)
+    {
+        finishBatch(self, m, db, aof, state == BATCH_FAILED);
+    }
+    if (atomic_load(&g_cluster.target) == NO_NODE)
+    {
+        return -1;
+    }
+    uint64_t job = atomic_load(&g_cluster.job);
+    if (m->job != job)
+    {
+        m->job = job;
+        m->cursor = 0;
+        m->retry_at = 0;
+    }
+    uint64_t now = monotonicMs();
+    if (now < m->retry_at)
+    {
+        return (int)(m->retry_at - now);
+    }
+    pthread_mutex_lock(&g_cluster.lock);
+    bool drained = m->drained;
+    pthread_mutex_unlock(&g_cluster.lock);
+    if (drained)
+    {
+        return -1;
+    }
+
+    bool more = collectBatch(m, db);
+    if (m->nkeys > 0)
+    {
+        // gone from here until the target has them: requests for them get
+        // ERR_TRYAGAIN, for the others ERR_ASK
+        for (int i = 0; i < m->nkeys; i++)
+        {
+            Slice del[2] = {{(const uint8_t *)"DEL", 3}, {m->keys[i]->data, m->keys[i]->len}};
+            if (keyspaceDelete(db, del[1].data, del[1].len) && aof && !appendRequest(aof, del, 2))
+            {
+                logError("out of memory for the append-only file");
+            }
+        }
+        atomic_store(&m->state, BATCH_QUEUED);
+        pthread_mutex_lock(&g_cluster.lock);
+        pthread_cond_signal(&g_cluster.changed);
+        pthread_mutex_unlock(&g_cluster.lock);
+        return -1;
+    }
+    if (more || m->retry_at > now)
+    {
+        return more ? 0 : MIGRATE_RETRY_MS;
+    }
+    // past the last key: keys moved by table changes meanwhile may have been
+    // skipped, so start over until the counts say the slots are empty
+    m->cursor = 0;
+    if (migratingKeys(db) > 0)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&g_cluster.lock);
+    if (atomic_load(&g_cluster.job) == job)
+    {
+        m->drained = true;
+        pthread_cond_signal(&g_cluster.changed);
+    }
+    pthread_mutex_unlock(&g_cluster.lock);
+    return -1;
+}
+
+static int connectNode(const char *addr)
+{
+    char host[CLUSTER_ADDR_LEN];
+    snprintf(host, sizeof(host), "%s", addr);
+    char *colon = strrchr(host, ':');
+    *colon = '\0';
+    return connectTcp("migration target", host, atoi(colon + 1), MIGRATE_TIMEOUT_S);
+}
+
+// Reads count replies, all of which have to be something else than errors.
+// The connection is given up on after an error, so its reply is not drained.
+static bool readReplies(int fd, uint64_t count, const char *addr)
+{
+    uint8_t chunk[512];
+    for (uint64_t i = 0; i < count; i++)
+    {
+        uint32_t len;
+        if (!readAll(fd, (uint8_t *)&len, 4))
+        {
+            logWarn("migration target %s: %s", addr, strerror(errno));
+            return false;
+        }
+        for (uint32_t left = len; left > 0;)
+        {
+            uint32_t n = left < sizeof(chunk) ? left : (uint32_t)sizeof(chunk);
+            if (!readAll(fd, chunk, n))
+            {
+                logWarn("migration target %s: %s", addr, strerror(errno));
+                return false;
+            }
+            if (left == len && chunk[0] == TAG_ERR)
+            {
+                uint32_t code = 0, text = n >= 9 ? n - 9 : 0;
+                memcpy(&code, chunk + 1, n >= 5 ? 4 : 0);
+                logWarn("migration target %s refused with error %u: %.*s", addr, code, (int)text,
+                        (const char *)chunk + 9);
+                return false;
+            }
+            left -= n;
+        }
+    }
+    return true;
+}
+
+// Replays a batch on the target, each frame after an ASKING, and waits for
+// every reply.
+static bool replayBatch(int fd, const Mover *m, const char *addr)
+{
+    size_t size = bufferSize(&m->frames);
+    uint8_t *frames = (uint8_t *)malloc(size);
+    Buffer request;
+    initBuffer(&request);
+    bool built = frames && copyFromBuffer(&m->frames, 0, frames, size);
+    uint64_t frame_count = 0;
+    for (size_t pos = 0; built && pos < size; frame_count++)
+    {
+        uint32_t len;
+        memcpy(&len, frames + pos, 4);
+        built = appendRequest(&request, &asking, 1) && appendToNewBuffer(&request, frames + pos, 4 + (size_t)len);
+        pos += 4 + (size_t)len;
+    }
+    free(frames);
+    if (!built)
+    {
+        freeBuffer(&request);
+        logError("migration: out of memory");
+        return false;
+    }
+    bool ok = writeBuffer(fd, &request);
+    freeBuffer(&request);
+    if (!ok)
+    {
+        logWarn("migration target %s: %s", addr, strerror(errno));
+        return false;
+    }
+    return readReplies(fd, 2 * frame_count, addr);
+}
+
+// With every shard drained, tells the target it serves the migrated slots
+// now, then gives them to it here. Connects to the target as needed; none is
+// needed when the slots were set STABLE meanwhile.
+static bool handOver(int *fd, int target, const char *addr)
+{
+    Buffer request;
+    initBuffer(&request);
+    bool built = true;
+    uint64_t ranges = 0;
+    pthread_mutex_lock(&g_cluster.lock);
+    for (int first = 0; built && first < CLUSTER_SLOTS; first++)
+    {
+        if (!atomic_load(&g_cluster.migrating[first]))
+        {
+            continue;
+        }
+        int last = first;
+        while (last + 1 < CLUSTER_SLOTS && atomic_load(&g_cluster.migrating[last + 1]))
+        {
+            last++;
+        }
+        char slots[16];
+        int slots_len = snprintf(slots, sizeof(slots), "%d-%d", first, last);
+        Slice args[5] = {{(const uint8_t *)"CLUSTER", 7},
+                         {(const uint8_t *)"SETSLOT", 7},
+                         {(const uint8_t *)slots, (uint32_t)slots_len},
+                         {(const uint8_t *)"NODE", 4},
+                         {(const uint8_t *)addr, (uint32_t)strlen(addr)}};
+        built = appendRequest(&request, args, 5);
+        ranges++;
+        first = last;
+    }
+    pthread_mutex_unlock(&g_cluster.lock);
+    if (!built)
+    {
+        freeBuffer(&request);
+        logError("migration: out of memory");
+        return false;
+    }
+
+    if (ranges > 0 && *fd < 0)
+    {
+        *fd = connectNode(addr);
+    }
+    bool ok = ranges == 0 || (*fd >= 0 && writeBuffer(*fd, &request) && readReplies(*fd, ranges, addr));
+    freeBuffer(&request);
+    if (!ok)
+    {
+        return false;
+    }
+    pthread_mutex_lock(&g_cluster.lock);
+    int moved = 0;
+    for (int slot = 0; slot < CLUSTER_SLOTS; slot++)
+    {
+        if (atomic_load(&g_cluster.migrating[slot]))
+        {
+            atomic_store(&g_cluster.owner[slot], (uint8_t)target);
+            atomic_store(&g_cluster.migrating[slot], false);
+            moved++;
+        }
+    }
+    atomic_store(&g_cluster.target, NO_NODE);
+    for (int i = 0; i < g_cluster.count; i++)
+    {
+        g_cluster.movers[i].drained = false;
+    }
+    if (moved > 0)
+    {
+        saveConfig();
+    }
+    pthread_mutex_unlock(&g_cluster.lock);
+    logInfo("%d slot(s) now served by %s", moved, addr);
+    return true;
+}
+
+// Replays the workers' batches on the target one at a time over a single
+// connection, and hands the slots over once every shard is drained.
+static void *moveSlots(void *arg)
+{
+    (void)arg;
+    int fd = -1;
+    int fd_node = NO_NODE;
+    pthread_mutex_lock(&g_cluster.lock);
+    while (true)
+    {
+        int target = atomic_load(&g_cluster.target);
+        Mover *batch = NULL;
+        bool drained = target != NO_NODE;
+        for (int i = 0; i < g_cluster.count; i++)
+        {
+            Mover *m = &g_cluster.movers[i];
+            if (!batch && atomic_load(&m->state) == BATCH_QUEUED)
+            {
+                batch = m;
+            }
+            drained = drained && m->drained;
+        }
+        if (fd >= 0 && fd_node != target)
+        {
+            close(fd);
+            fd = -1;
+        }
+        if (target == NO_NODE || (!batch && !drained))
+        {
+            pthread_cond_wait(&g_cluster.changed, &g_cluster.lock);
+            continue;
+        }
+        char addr[CLUSTER_ADDR_LEN];
+        memcpy(addr, g_cluster.nodes[target], sizeof(addr));
+        if (batch)
+        {
+            atomic_store(&batch->state, BATCH_SENDING);
+        }
+        pthread_mutex_unlock(&g_cluster.lock);
+
+        fd_node = target;
+        bool ok;
+        if (batch)
+        {
+            if (fd < 0)
+            {
+                fd = connectNode(addr);
+            }
+            ok = fd >= 0 && replayBatch(fd, batch, addr);
+            atomic_store(&batch->state, ok ? BATCH_DONE : BATCH_FAILED);
+            wakeEventFd(g_cluster.wake_fds[batch - g_cluster.movers]);
+        }
+        else
+        {
+            ok = handOver(&fd, target, addr);
+        }
+        if (!ok && fd >= 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+        if (!ok && !batch)
+        {
+            // the workers pace their own retries, the hand-over is paced here
+            struct timespec retry = {MIGRATE_RETRY_MS / 1000, (MIGRATE_RETRY_MS % 1000) * 1000000L};
+            nanosleep(&retry, NULL);
+        }
+        pthread_mutex_lock(&g_cluster.lock);
+    }
+    return NULL;
+}
+
+bool initCluster(const char *host, int port, const char *config_path, const int *wake_fds, int count)
+{
+    snprintf(g_cluster.nodes[0], CLUSTER_ADDR_LEN, "%s:%d", host, port);
+    atomic_store(&g_cluster.nnodes, 1);
+    for (int slot = 0; slot < CLUSTER_SLOTS; slot++)
+    {
+        atomic_store(&g_cluster.owner[slot], NO_NODE);
+        atomic_store(&g_cluster.importing[slot], NO_NODE);
+        atomic_store(&g_cluster.migrating[slot], false);
+    }
+    g_cluster.config_path = strdup(config_path);
+    g_cluster.movers = (Mover *)calloc((size_t)count, sizeof(Mover));
+    g_cluster.wake_fds = (int *)calloc((size_t)count, sizeof(int));
+    if (!g_cluster.config_path || !g_cluster.movers || !g_cluster.wake_fds)
+    {
+        return false;
+    }
+    g_cluster.count = count;
+    for (int i = 0; i < count; i++)
+    {
+        atomic_init(&g_cluster.movers[i].state, BATCH_IDLE);
+        initBuffer(&g_cluster.movers[i].frames);
+        g_cluster.wake_fds[i] = wake_fds[i];
+    }
+    if (!loadConfig())
+    {
+        return false;
+    }
+    g_cluster.enabled = true;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, moveSlots, NULL) != 0)
+    {
+        return false;
+    }
+    pthread_detach(thread);
+    ClusterStatus status;
+    clusterStatus(&status);
+    logInfo("cluster node %s serving %d of %d assigned slots", status.myself, status.slots_served,
+            status.slots_assigned);
+    return true;
+}
+
+void clusterStatus(ClusterStatus *status)
+{
+    memset(status, 0, sizeof(*status));
+    status->enabled = g_cluster.enabled;
+    if (!g_cluster.enabled)
+    {
+        return;
+    }
+    pthread_mutex_lock(&g_cluster.lock);
+    memcpy(status->myself, g_cluster.nodes[0], sizeof(status->myself));
+    status->nodes = atomic_load(&g_cluster.nnodes);
+    for (int slot = 0; slot < CLUSTER_SLOTS; slot++)
+    {
+        int owner = atomic_load(&g_cluster.owner[slot]);
+        status->slots_assigned += owner != NO_NODE;
+        status->slots_served += owner == 0;
+        status->slots_migrating += atomic_load(&g_cluster.migrating[slot]);
+        status->slots_importing += atomic_load(&g_cluster.importing[slot]) != NO_NODE;
+    }
+    status->ok = status->slots_assigned == CLUSTER_SLOTS;
+    int target = atomic_load(&g_cluster.target);
+    if (target != NO_NODE)
+    {
+        memcpy(status->migrating_to, g_cluster.nodes[target], sizeof(status->migrating_to));
+    }
+    status->keys_migrated = g_cluster.keys_migrated;
+    status->batches_failed = g_cluster.batches_failed;
+    pthread_mutex_unlock(&g_cluster.lock);
+}
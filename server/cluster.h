@@ -0,0 +1,87 @@
+#ifndef CLUSTER_HEADER
+#define CLUSTER_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "buffer.h"
+#include "keyspace.h"
+#include "protocol.h"
+
+// Sharding over several server processes. Keys map to CLUSTER_SLOTS hash
+// slots by CRC16 of the key, or of the part between the first '{' and the
+// next '}' when that is not empty, so related keys can share a slot. Each
+// node is told the whole slot map with CLUSTER SETSLOT, by the client's
+// cluster tool; nodes do not talk to each other about it. A request for a
+// key of a slot served elsewhere gets ERR_MOVED "<slot> <host:port>".
+//
+// Moving slots: the target is told CLUSTER SETSLOT <slots> IMPORTING
+// <source> and then the source CLUSTER SETSLOT <slots> MIGRATING <target>.
+// Every worker of the source hands its keys of those slots, a bounded batch
+// at a time, to a migration thread that replays them on the target, and
+// deletes them locally. Meanwhile the source serves the keys it still has,
+// answers ERR_TRYAGAIN for keys of a batch on its way and ERR_ASK for the
+// rest; the target serves keys of an importing slot to requests preceded by
+// ASKING. Once no worker has keys of the slots left, the target and then
+// the source switch the slots over.
+#define CLUSTER_SLOTS 16384
+#define CLUSTER_MAX_NODES 64
+// "host:port" of a node, terminator included
+#define CLUSTER_ADDR_LEN 64
+#define CLUSTER_CONFIG_DEFAULT "nodes.conf"
+// a worker closes a batch at whichever limit it reaches first; a single key
+// always goes whole
+#define MIGRATE_BATCH_KEYS 256
+#define MIGRATE_BATCH_BYTES (1 << 20)
+// keys a worker looks at per loop iteration while collecting a batch
+#define MIGRATE_SCAN_STEP 4096
+// pause after a batch the target did not take
+#define MIGRATE_RETRY_MS 1000
+// how long the migration thread waits on the target
+#define MIGRATE_TIMEOUT_S 10
+
+uint32_t clusterKeySlot(const uint8_t *key, size_t key_len);
+
+// Turns cluster mode on for a node reachable at host:port and loads the slot
+// map saved in config_path, if there is one. wake_fds holds each worker's
+// eventfd, poked when a migration needs it.
+bool initCluster(const char *host, int port, const char *config_path, const int *wake_fds, int count);
+
+bool clusterEnabled(void);
+
+// Whether a request is ASKING, which lets the connection's next request at
+// an importing slot.
+bool clusterIsAsking(const Slice *args, uint32_t nargs);
+
+// Whether worker self, whose shard is db, serves a request for key. If not,
+// code and message are the error to answer with.
+bool clusterServes(int self, Keyspace *db, const Slice *key, bool asking, uint32_t *code, char *message,
+                   size_t size);
+
+// CLUSTER KEYSLOT key | SLOTS | SETSLOT slot[-slot] NODE|IMPORTING|MIGRATING
+// host:port | SETSLOT slot[-slot] STABLE. Appends the reply value.
+void clusterCommand(Buffer *out, const Slice *args, uint32_t nargs);
+
+// Moves the worker's keys of migrating slots along, one batch at a time, and
+// puts back a batch the target did not take; aof gets what that changes.
+// Returns the longest the worker may sleep, -1 for no limit.
+int clusterMigrate(int self, Keyspace *db, Buffer *aof);
+
+typedef struct
+{
+    bool enabled;
+    char myself[CLUSTER_ADDR_LEN];
+    bool ok;
+    int slots_assigned;
+    int slots_served;
+    int nodes;
+    int slots_migrating;
+    int slots_importing;
+    char migrating_to[CLUSTER_ADDR_LEN];
+    uint64_t keys_migrated;
+    uint64_t batches_failed;
+} ClusterStatus;
+
+void clusterStatus(ClusterStatus *status);
+
+#endif
@@ -0,0 +1,1267 @@
+#include "command.h"
+#include "snapshot.h"
+#include "aof.h"
+#include "cluster.h"
+#include "log.h"
+#include "zset.h"
+#include "hmap.h"
+#include "qlist.h"
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+// Finds the key when it holds the given type, or sets *node to NULL when
+// it does not exist. Replies with an error and returns false when it holds
+// another type.
+static bool lookupTyped(CommandContext *ctx, const Slice *key, ValueType type, Node **node)
+{
+    *node = keyspaceGet(ctx->db, key->data, key->len);
+    if (*node && (*node)->type != type)
+    {
+        replyErr(ctx->out, ERR_WRONGTYPE, "operation against a key holding the wrong kind of value");
+        return false;
+    }
+    return true;
+}
+
+static void cmdGet(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_STRING, &node))
+    {
+        return;
+    }
+    if (!node)
+    {
+        replyNil(ctx->out);
+        return;
+    }
+    Blob *blob = nodeBlob(node);
+    if (blob)
+    {
+        replyBlob(ctx->out, blob);
+        return;
+    }
+    uint8_t buf[KEYSPACE_INT_CHARS];
+    uint32_t len;
+    const uint8_t *value = nodeString(node, buf, &len);
+    replyStr(ctx->out, value, len);
+}
+
+// Strict decimal: optional minus sign, digits only, no overflow.
+static bool parseInt(const Slice *arg, int64_t *out)
+{
+    uint32_t i = 0;
+    bool negative = arg->len > 0 && arg->data[0] == '-';
+    if (negative)
+    {
+        i++;
+    }
+    if (i == arg->len || arg->len - i > 18)
+    {
+        return false;
+    }
+    int64_t value = 0;
+    for (; i < arg->len; i++)
+    {
+        if (arg->data[i] < '0' || arg->data[i] > '9')
+        {
+            return false;
+        }
+        value = value * 10 + (arg->data[i] - '0');
+    }
+    *out = negative ? -value : value;
+    return true;
+}
+
+// Relative seconds or milliseconds to an absolute deadline; anything not in
+// the future becomes "already expired" (1 ms after the epoch).
+static uint64_t deadlineAfter(int64_t amount, int64_t unit_ms)
+{
+    if (amount <= 0)
+    {
+        return 1;
+    }
+    if (amount > INT64_MAX / unit_ms / 2)
+    {
+        amount = INT64_MAX / unit_ms / 2;
+    }
+    return keyspaceClock() + (uint64_t)(amount * unit_ms);
+}
+
+static bool optionIs(const Slice *arg, const char *name)
+{
+    size_t len = strlen(name);
+    if (arg->len != len)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        if ((arg->data[i] | 0x20) != (uint8_t)name[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void propagate(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    if (ctx->aof && !appendRequest(ctx->aof, args, nargs))
+    {
+        logError("out of memory for the append-only file");
+    }
+}
+
+static Slice sliceOf(const char *text, size_t len)
+{
+    Slice slice = {(const uint8_t *)text, (uint32_t)len};
+    return slice;
+}
+
+// Logs a TTL change with its absolute deadline, so a replay at any later
+// time expires the key at the same moment.
+static void propagateDeadline(CommandContext *ctx, const Slice *command, const Slice *key, uint64_t deadline)
+{
+    char digits[24];
+    int len = snprintf(digits, sizeof(digits), "%llu", (unsigned long long)deadline);
+    Slice args[3] = {*command, *key, sliceOf(digits, (size_t)len)};
+    propagate(ctx, args, 3);
+}
+
+static void propagateEviction(const Node *node, void *arg)
+{
+    static const char del[] = "DEL";
+    Slice args[2] = {sliceOf(del, sizeof(del) - 1), {nodeKey(node), node->key_len}};
+    propagate((CommandContext *)arg, args, 2);
+}
+
+// SET key value [EX seconds | PX milliseconds | PXAT unix-milliseconds]
+static void cmdSet(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    uint64_t expires_at = KEYSPACE_NO_EXPIRY;
+    bool absolute = false;
+    if (nargs != 3)
+    {
+        int64_t amount = 0;
+        bool seconds = nargs == 5 && optionIs(&args[3], "ex");
+        absolute = nargs == 5 && optionIs(&args[3], "pxat");
+        if (nargs != 5 || (!seconds && !absolute && !optionIs(&args[3], "px")))
+        {
+            replyErr(ctx->out, ERR_SYNTAX, "syntax error");
+            return;
+        }
+        if (!parseInt(&args[4], &amount) || amount <= 0)
+        {
+            replyErr(ctx->out, ERR_SYNTAX, "invalid expire time");
+            return;
+        }
+        expires_at = absolute ? (uint64_t)amount : deadlineAfter(amount, seconds ? 1000 : 1);
+    }
+
+    if (!keyspaceMakeRoom(ctx->db, ctx->aof ? propagateEviction : NULL, ctx))
+    {
+        replyErr(ctx->out, ERR_OOM, "command not allowed when used memory > 'maxmemory'");
+        return;
+    }
+    if (!keyspaceSet(ctx->db, args[1].data, args[1].len, args[2].data, args[2].len, expires_at))
+    {
+        replyErr(ctx->out, ERR_OOM, "out of memory");
+        return;
+    }
+    if (expires_at == KEYSPACE_NO_EXPIRY || absolute)
+    {
+        propagate(ctx, args, nargs);
+    }
+    else
+    {
+        static const char pxat[] = "PXAT";
+        char digits[24];
+        int len = snprintf(digits, sizeof(digits), "%llu", (unsigned long long)expires_at);
+        Slice logged[5] = {args[0], args[1], args[2], sliceOf(pxat, sizeof(pxat) - 1), sliceOf(digits, (size_t)len)};
+        propagate(ctx, logged, 5);
+    }
+    replyNil(ctx->out);
+}
+
+static void setDeadline(CommandContext *ctx, const Slice *args, uint64_t deadline)
+{
+    static const char pexpireat[] = "PEXPIREAT";
+    bool updated = keyspaceSetExpiry(ctx->db, args[1].data, args[1].len, deadline);
+    if (updated)
+    {
+        Slice command = sliceOf(pexpireat, sizeof(pexpireat) - 1);
+        propagateDeadline(ctx, &command, &args[1], deadline);
+    }
+    replyInt(ctx->out, updated ? 1 : 0);
+}
+
+static void expireWithUnit(CommandContext *ctx, const Slice *args, int64_t unit_ms)
+{
+    int64_t amount = 0;
+    if (!parseInt(&args[2], &amount))
+    {
+        replyErr(ctx->out, ERR_SYNTAX, "value is not an integer");
+        return;
+    }
+    setDeadline(ctx, args, deadlineAfter(amount, unit_ms));
+}
+
+static void cmdExpire(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    expireWithUnit(ctx, args, 1000);
+}
+
+static void cmdPexpire(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    expireWithUnit(ctx, args, 1);
+}
+
+// PEXPIREAT key unix-milliseconds; a deadline not in the future deletes the key
+static void cmdPexpireat(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    int64_t deadline = 0;
+    if (!parseInt(&args[2], &deadline))
+    {
+        replyErr(ctx->out, ERR_SYNTAX, "value is not an integer");
+        return;
+    }
+    setDeadline(ctx, args, deadline > 0 ? (uint64_t)deadline : 1);
+}
+
+static void cmdTtl(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    int64_t ttl = keyspaceTtl(ctx->db, args[1].data, args[1].len);
+    // round up, so a key reported with TTL 0 is really gone
+    replyInt(ctx->out, ttl < 0 ? ttl : (ttl + 999) / 1000);
+}
+
+static void cmdPttl(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    replyInt(ctx->out, keyspaceTtl(ctx->db, args[1].data, args[1].len));
+}
+
+static void cmdPersist(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    bool persisted = keyspacePersist(ctx->db, args[1].data, args[1].len);
+    if (persisted)
+    {
+        propagate(ctx, args, nargs);
+    }
+    replyInt(ctx->out, persisted ? 1 : 0);
+}
+
+static void cmdDel(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    bool deleted = keyspaceDelete(ctx->db, args[1].data, args[1].len);
+    if (deleted)
+    {
+        propagate(ctx, args, nargs);
+    }
+    replyInt(ctx->out, deleted ? 1 : 0);
+}
+
+static void cmdExists(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    replyInt(ctx->out, keyspaceGet(ctx->db, args[1].data, args[1].len) ? 1 : 0);
+}
+
+static void cmdType(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    static const char *const names[] = {
+        [VALUE_STRING] = "string",
+        [VALUE_ZSET] = "zset",
+        [VALUE_HASH] = "hash",
+        [VALUE_LIST] = "list",
+    };
+    Node *node = keyspaceGet(ctx->db, args[1].data, args[1].len);
+    const char *name = node ? names[node->type] : "none";
+    replyStr(ctx->out, (const uint8_t *)name, strlen(name));
+}
+
+// A decimal or "inf" with an optional sign; NaN, blanks and trailing bytes
+// are refused.
+static bool parseScore(const Slice *arg, double *out)
+{
+    char text[64];
+    if (arg->len == 0 || arg->len >= sizeof(text) || isspace(arg->data[0]))
+    {
+        return false;
+    }
+    memcpy(text, arg->data, arg->len);
+    text[arg->len] = '\0';
+    char *end;
+    double value = strtod(text, &end);
+    if (end != text + arg->len || isnan(value))
+    {
+        return false;
+    }
+    *out = value;
+    return true;
+}
+
+// A range end of ZRANGEBYSCORE: a score, exclusive with a leading '('.
+typedef struct
+{
+    double score;
+    bool exclusive;
+} ScoreBound;
+
+static bool parseBound(const Slice *arg, ScoreBound *bound)
+{
+    Slice rest = *arg;
+    bound->exclusive = rest.len > 0 && rest.data[0] == '(';
+    if (bound->exclusive)
+    {
+        rest.data++;
+        rest.len--;
+    }
+    return parseScore(&rest, &bound->score);
+}
+
+// A container that is empty now gives up its key.
+static void dropIfEmpty(CommandContext *ctx, const Slice *key, size_t size)
+{
+    if (size == 0)
+    {
+        keyspaceDelete(ctx->db, key->data, key->len);
+    }
+}
+
+// Adds the key holding a new, empty container of the type. Replies with an
+// error and returns NULL when out of memory.
+static Node *addContainer(CommandContext *ctx, const Slice *key, ValueType type)
+{
+    void *object = NULL;
+    switch (type)
+    {
+    case VALUE_ZSET:
+        object = newZSet();
+        break;
+    case VALUE_HASH:
+        object = newHMap();
+        break;
+    case VALUE_LIST:
+        object = newQList();
+        break;
+    default:
+        break;
+    }
+    Node *node = object ? keyspaceAddObject(ctx->db, key->data, key->len, type, object) : NULL;
+    if (!node)
+    {
+        replyErr(ctx->out, ERR_OOM, "out of memory");
+    }
+    return node;
+}
+
+// Start and stop of ZRANGE and LRANGE, negative ones counting from the end,
+// clipped to a collection of size; false when nothing is left.
+static bool clipRange(int64_t start, int64_t stop, int64_t size, size_t *first, size_t *count)
+{
+    start = start < 0 ? start + size : start;
+    stop = stop < 0 ? stop + size : stop;
+    start = start < 0 ? 0 : start;
+    stop = stop >= size ? size - 1 : stop;
+    if (start > stop)
+    {
+        return false;
+    }
+    *first = (size_t)start;
+    *count = (size_t)(stop - start + 1);
+    return true;
+}
+
+// ZADD key [NX|XX] [CH] score member [score member ...]
+static void cmdZadd(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    bool nx = false, xx = false, ch = false;
+    uint32_t first = 2;
+    for (; first < nargs; first++)
+    {
+        if (optionIs(&args[first], "nx"))
+        {
+            nx = true;
+        }
+        else if (optionIs(&args[first], "xx"))
+        {
+            xx = true;
+        }
+        else if (optionIs(&args[first], "ch"))
+        {
+            ch = true;
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (first == nargs || (nargs - first) % 2 != 0 || (nx && xx))
+    {
+        replyErr(ctx->out, ERR_SYNTAX, "syntax error");
+        return;
+    }
+    // nothing changes unless every score is valid
+    double score;
+    for (uint32_t i = first; i < nargs; i += 2)
+    {
+        if (!parseScore(&args[i], &score))
+        {
+            replyErr(ctx->out, ERR_SYNTAX, "value is not a valid float");
+            return;
+        }
+    }
+
+    if (!keyspaceMakeRoom(ctx->db, ctx->aof ? propagateEviction : NULL, ctx))
+    {
+        replyErr(ctx->out, ERR_OOM, "command not allowed when used memory > 'maxmemory'");
+        return;
+    }
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_ZSET, &node))
+    {
+        return;
+    }
+    if (!node && xx)
+    {
+        replyInt(ctx->out, 0);
+        return;
+    }
+    if (!node && !(node = addContainer(ctx, &args[1], VALUE_ZSET)))
+    {
+        return;
+    }
+
+    ZSet *zset = (ZSet *)nodeObject(node);
+    size_t before = zsetMemory(zset);
+    int64_t added = 0, changed = 0;
+    bool ok = true;
+    for (uint32_t i = first; ok && i < nargs; i += 2)
+    {
+        const Slice *member = &args[i + 1];
+        double old;
+        bool exists = zsetScore(zset, member->data, member->len, &old);
+        if ((nx && exists) || (xx && !exists))
+        {
+            continue;
+        }
+        parseScore(&args[i], &score);
+        bool was_added;
+        ok = zsetAdd(zset, member->data, member->len, score, &was_added);
+        added += ok && was_added;
+        changed += ok && (was_added || old != score);
+    }
+    keyspaceResized(ctx->db, before, zsetMemory(zset));
+    dropIfEmpty(ctx, &args[1], zsetSize(zset));
+    if (changed)
+    {
+        propagate(ctx, args, nargs);
+    }
+    if (!ok)
+    {
+        replyErr(ctx->out, ERR_OOM, "out of memory");
+        return;
+    }
+    replyInt(ctx->out, ch ? changed : added);
+}
+
+// ZREM key member [member ...]
+static void cmdZrem(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_ZSET, &node))
+    {
+        return;
+    }
+    if (!node)
+    {
+        replyInt(ctx->out, 0);
+        return;
+    }
+    ZSet *zset = (ZSet *)nodeObject(node);
+    size_t before = zsetMemory(zset);
+    int64_t removed = 0;
+    for (uint32_t i = 2; i < nargs; i++)
+    {
+        removed += zsetRemove(zset, args[i].data, args[i].len);
+    }
+    keyspaceResized(ctx->db, before, zsetMemory(zset));
+    dropIfEmpty(ctx, &args[1], zsetSize(zset));
+    if (removed)
+    {
+        propagate(ctx, args, nargs);
+    }
+    replyInt(ctx->out, removed);
+}
+
+static void cmdZscore(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_ZSET, &node))
+    {
+        return;
+    }
+    double score;
+    if (!node || !zsetScore((ZSet *)nodeObject(node), args[2].data, args[2].len, &score))
+    {
+        replyNil(ctx->out);
+        return;
+    }
+    replyDbl(ctx->out, score);
+}
+
+static void cmdZrank(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_ZSET, &node))
+    {
+        return;
+    }
+    int64_t rank = node ? zsetRank((ZSet *)nodeObject(node), args[2].data, args[2].len) : -1;
+    if (rank < 0)
+    {
+        replyNil(ctx->out);
+        return;
+    }
+    replyInt(ctx->out, rank);
+}
+
+static void cmdZcard(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_ZSET, &node))
+    {
+        return;
+    }
+    replyInt(ctx->out, node ? (int64_t)zsetSize((ZSet *)nodeObject(node)) : 0);
+}
+
+// Members from rank start on, one descent and then a walk along the leaves.
+static void replyRange(CommandContext *ctx, const ZSet *zset, size_t start, size_t count, bool withscores)
+{
+    replyArr(ctx->out, (uint32_t)(withscores ? count * 2 : count));
+    ZSetIter iter;
+    zsetSeek(zset, start, &iter);
+    const uint8_t *member;
+    uint32_t len;
+    double score;
+    for (size_t i = 0; i < count && zsetNext(&iter, &member, &len, &score); i++)
+    {
+        replyStr(ctx->out, member, len);
+        if (withscores)
+        {
+            replyDbl(ctx->out, score);
+        }
+    }
+}
+
+// ZRANGE key start stop [WITHSCORES]; negative indexes count from the end
+static void cmdZrange(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    int64_t start, stop;
+    bool withscores = nargs == 5 && optionIs(&args[4], "withscores");
+    if (nargs > 5 || (nargs == 5 && !withscores))
+    {
+        replyErr(ctx->out, ERR_SYNTAX, "syntax error");
+        return;
+    }
+    if (!parseInt(&args[2], &start) || !parseInt(&args[3], &stop))
+    {
+        replyErr(ctx->out, ERR_SYNTAX, "value is not an integer");
+        return;
+    }
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_ZSET, &node))
+    {
+        return;
+    }
+    if (!node)
+    {
+        replyArr(ctx->out, 0);
+        return;
+    }
+    const ZSet *zset = (const ZSet *)nodeObject(node);
+    size_t first, count;
+    if (!clipRange(start, stop, (int64_t)zsetSize(zset), &first, &count))
+    {
+        replyArr(ctx->out, 0);
+        return;
+    }
+    replyRange(ctx, zset, first, count, withscores);
+}
+
+// ZRANGEBYSCORE key min max [WITHSCORES] [LIMIT offset count]
+static void cmdZrangebyscore(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    ScoreBound min, max;
+    if (!parseBound(&args[2], &min) || !parseBound(&args[3], &max))
+    {
+        replyErr(ctx->out, ERR_SYNTAX, "min or max is not a float");
+        return;
+    }
+    bool withscores = false;
+    int64_t offset = 0, limit = -1;
+    for (uint32_t i = 4; i < nargs; i++)
+    {
+        if (optionIs(&args[i], "withscores"))
+        {
+            withscores = true;
+        }
+        else if (optionIs(&args[i], "limit") && i + 2 < nargs)
+        {
+            if (!parseInt(&args[i + 1], &offset) || !parseInt(&args[i + 2], &limit))
+            {
+                replyErr(ctx->out, ERR_SYNTAX, "value is not an integer");
+                return;
+            }
+            i += 2;
+        }
+        else
+        {
+            replyErr(ctx->out, ERR_SYNTAX, "syntax error");
+            return;
+        }
+    }
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_ZSET, &node))
+    {
+        return;
+    }
+    if (!node || offset < 0)
+    {
+        replyArr(ctx->out, 0);
+        return;
+    }
+    // the range is every rank between two counts, each one descent
+    const ZSet *zset = (const ZSet *)nodeObject(node);
+    size_t first = zsetCountBelow(zset, min.score, min.exclusive);
+    size_t end = zsetCountBelow(zset, max.score, !max.exclusive);
+    first += (size_t)offset;
+    if (end <= first)
+    {
+        replyArr(ctx->out, 0);
+        return;
+    }
+    size_t count = end - first;
+    if (limit >= 0 && (size_t)limit < count)
+    {
+        count = (size_t)limit;
+    }
+    replyRange(ctx, zset, first, count, withscores);
+}
+
+// HSET key field value [field value ...]
+static void cmdHset(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    if (nargs % 2 != 0)
+    {
+        replyErr(ctx->out, ERR_ARITY, "wrong number of arguments");
+        return;
+    }
+    if (!keyspaceMakeRoom(ctx->db, ctx->aof ? propagateEviction : NULL, ctx))
+    {
+        replyErr(ctx->out, ERR_OOM, "command not allowed when used memory > 'maxmemory'");
+        return;
+    }
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_HASH, &node))
+    {
+        return;
+    }
+    if (!node && !(node = addContainer(ctx, &args[1], VALUE_HASH)))
+    {
+        return;
+    }
+
+    HMap *hmap = (HMap *)nodeObject(node);
+    size_t before = hmapMemory(hmap);
+    int64_t added = 0;
+    bool ok = true;
+    uint32_t i = 2;
+    for (; ok && i < nargs; i += 2)
+    {
+        bool was_added;
+        ok = hmapSet(hmap, args[i].data, args[i].len, args[i + 1].data, args[i + 1].len, &was_added);
+        added += ok && was_added;
+    }
+    keyspaceResized(ctx->db, before, hmapMemory(hmap));
+    dropIfEmpty(ctx, &args[1], hmapSize(hmap));
+    // after a failure only the pairs that went in are logged
+    uint32_t applied = ok ? nargs : i - 2;
+    if (applied > 2)
+    {
+        propagate(ctx, args, applied);
+    }
+    if (!ok)
+    {
+        replyErr(ctx->out, ERR_OOM, "out of memory");
+        return;
+    }
+    replyInt(ctx->out, added);
+}
+
+static void cmdHget(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_HASH, &node))
+    {
+        return;
+    }
+    const uint8_t *value;
+    uint32_t len;
+    if (!node || !hmapGet((const HMap *)nodeObject(node), args[2].data, args[2].len, &value, &len))
+    {
+        replyNil(ctx->out);
+        return;
+    }
+    replyStr(ctx->out, value, len);
+}
+
+static void cmdHexists(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_HASH, &node))
+    {
+        return;
+    }
+    const uint8_t *value;
+    uint32_t len;
+    bool found = node && hmapGet((const HMap *)nodeObject(node), args[2].data, args[2].len, &value, &len);
+    replyInt(ctx->out, found ? 1 : 0);
+}
+
+// HDEL key field [field ...]
+static void cmdHdel(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_HASH, &node))
+    {
+        return;
+    }
+    if (!node)
+    {
+        replyInt(ctx->out, 0);
+        return;
+    }
+    HMap *hmap = (HMap *)nodeObject(node);
+    size_t before = hmapMemory(hmap);
+    int64_t removed = 0;
+    for (uint32_t i = 2; i < nargs; i++)
+    {
+        removed += hmapDelete(hmap, args[i].data, args[i].len);
+    }
+    keyspaceResized(ctx->db, before, hmapMemory(hmap));
+    dropIfEmpty(ctx, &args[1], hmapSize(hmap));
+    if (removed)
+    {
+        propagate(ctx, args, nargs);
+    }
+    replyInt(ctx->out, removed);
+}
+
+static void cmdHlen(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_HASH, &node))
+    {
+        return;
+    }
+    replyInt(ctx->out, node ? (int64_t)hmapSize((const HMap *)nodeObject(node)) : 0);
+}
+
+// Fields and values alternate in the reply.
+static void cmdHgetall(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_HASH, &node))
+    {
+        return;
+    }
+    if (!node)
+    {
+        replyArr(ctx->out, 0);
+        return;
+    }
+    const HMap *hmap = (const HMap *)nodeObject(node);
+    replyArr(ctx->out, (uint32_t)(hmapSize(hmap) * 2));
+    HMapIter iter;
+    hmapIterate(hmap, &iter);
+    const uint8_t *field, *value;
+    uint32_t field_len, value_len;
+    while (hmapNext(&iter, &field, &field_len, &value, &value_len))
+    {
+        replyStr(ctx->out, field, field_len);
+        replyStr(ctx->out, value, value_len);
+    }
+}
+
+// LPUSH and RPUSH key element [element ...]; replies with the new length
+static void pushWith(CommandContext *ctx, const Slice *args, uint32_t nargs, bool tail)
+{
+    if (!keyspaceMakeRoom(ctx->db, ctx->aof ? propagateEviction : NULL, ctx))
+    {
+        replyErr(ctx->out, ERR_OOM, "command not allowed when used memory > 'maxmemory'");
+        return;
+    }
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_LIST, &node))
+    {
+        return;
+    }
+    if (!node && !(node = addContainer(ctx, &args[1], VALUE_LIST)))
+    {
+        return;
+    }
+
+    QList *list = (QList *)nodeObject(node);
+    size_t before = qlistMemory(list);
+    bool ok = true;
+    uint32_t i = 2;
+    for (; ok && i < nargs; i++)
+    {
+        ok = qlistPush(list, tail, args[i].data, args[i].len);
+    }
+    keyspaceResized(ctx->db, before, qlistMemory(list));
+    dropIfEmpty(ctx, &args[1], qlistSize(list));
+    // after a failure only the elements that went in are logged
+    uint32_t applied = ok ? nargs : i - 1;
+    if (applied > 2)
+    {
+        propagate(ctx, args, applied);
+    }
+    if (!ok)
+    {
+        replyErr(ctx->out, ERR_OOM, "out of memory");
+        return;
+    }
+    replyInt(ctx->out, (int64_t)qlistSize(list));
+}
+
+static void cmdLpush(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    pushWith(ctx, args, nargs, false);
+}
+
+static void cmdRpush(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    pushWith(ctx, args, nargs, true);
+}
+
+// LPOP and RPOP key [count]: without a count the element or nil, with one
+// an array of up to count elements, or nil when the key does not exist
+static void popWith(CommandContext *ctx, const Slice *args, uint32_t nargs, bool tail)
+{
+    int64_t count = 1;
+    if (nargs > 3)
+    {
+        replyErr(ctx->out, ERR_ARITY, "wrong number of arguments");
+        return;
+    }
+    if (nargs == 3 && (!parseInt(&args[2], &count) || count < 0))
+    {
+        replyErr(ctx->out, ERR_SYNTAX, "value is out of range, must be positive");
+        return;
+    }
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_LIST, &node))
+    {
+        return;
+    }
+    if (!node)
+    {
+        replyNil(ctx->out);
+        return;
+    }
+    // a count of 0 on an existing list is an empty array, not nil
+    if (nargs == 3 && count == 0)
+    {
+        replyArr(ctx->out, 0);
+        return;
+    }
+
+    QList *list = (QList *)nodeObject(node);
+    size_t before = qlistMemory(list);
+    if ((size_t)count > qlistSize(list))
+    {
+        count = (int64_t)qlistSize(list);
+    }
+    if (nargs == 3)
+    {
+        replyArr(ctx->out, (uint32_t)count);
+    }
+    for (int64_t i = 0; i < count; i++)
+    {
+        const uint8_t *value;
+        uint32_t len;
+        qlistPeek(list, tail, &value, &len);
+        replyStr(ctx->out, value, len);
+        qlistPop(list, tail);
+    }
+    keyspaceResized(ctx->db, before, qlistMemory(list));
+    dropIfEmpty(ctx, &args[1], qlistSize(list));
+    if (count)
+    {
+        propagate(ctx, args, nargs);
+    }
+}
+
+static void cmdLpop(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    popWith(ctx, args, nargs, false);
+}
+
+static void cmdRpop(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    popWith(ctx, args, nargs, true);
+}
+
+static void cmdLlen(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_LIST, &node))
+    {
+        return;
+    }
+    replyInt(ctx->out, node ? (int64_t)qlistSize((const QList *)nodeObject(node)) : 0);
+}
+
+// LINDEX key index; a negative index counts from the end
+static void cmdLindex(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    int64_t index;
+    if (!parseInt(&args[2], &index))
+    {
+        replyErr(ctx->out, ERR_SYNTAX, "value is not an integer");
+        return;
+    }
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_LIST, &node))
+    {
+        return;
+    }
+    size_t first, count;
+    const QList *list = node ? (const QList *)nodeObject(node) : NULL;
+    if (!list || !clipRange(index, index, (int64_t)qlistSize(list), &first, &count))
+    {
+        replyNil(ctx->out);
+        return;
+    }
+    QListIter iter;
+    qlistSeek(list, first, &iter);
+    const uint8_t *value;
+    uint32_t len;
+    qlistNext(&iter, &value, &len);
+    replyStr(ctx->out, value, len);
+}
+
+// LRANGE key start stop; negative indexes count from the end
+static void cmdLrange(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    int64_t start, stop;
+    if (!parseInt(&args[2], &start) || !parseInt(&args[3], &stop))
+    {
+        replyErr(ctx->out, ERR_SYNTAX, "value is not an integer");
+        return;
+    }
+    Node *node;
+    if (!lookupTyped(ctx, &args[1], VALUE_LIST, &node))
+    {
+        return;
+    }
+    size_t first, count;
+    const QList *list = node ? (const QList *)nodeObject(node) : NULL;
+    if (!list || !clipRange(start, stop, (int64_t)qlistSize(list), &first, &count))
+    {
+        replyArr(ctx->out, 0);
+        return;
+    }
+    replyArr(ctx->out, (uint32_t)count);
+    QListIter iter;
+    qlistSeek(list, first, &iter);
+    const uint8_t *value;
+    uint32_t len;
+    for (size_t i = 0; i < count && qlistNext(&iter, &value, &len); i++)
+    {
+        replyStr(ctx->out, value, len);
+    }
+}
+
+// Both pause every worker until the shards are captured; SAVE also keeps
+// them paused while it writes.
+static void saveWith(CommandContext *ctx, bool background)
+{
+    switch (snapshotSave(ctx->worker, background))
+    {
+    case SNAPSHOT_OK:
+        if (background)
+        {
+            static const char started[] = "Background saving started";
+            replyStr(ctx->out, (const uint8_t *)started, sizeof(started) - 1);
+        }
+        else
+        {
+            replyNil(ctx->out);
+        }
+        break;
+    case SNAPSHOT_BUSY:
+        replyErr(ctx->out, ERR_BUSY, "a save is already in progress");
+        break;
+    case SNAPSHOT_FAILED:
+        replyErr(ctx->out, ERR_IO, "save failed, see the server log");
+        break;
+    }
+}
+
+static void cmdSave(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    saveWith(ctx, false);
+}
+
+static void cmdBgsave(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    saveWith(ctx, true);
+}
+
+static void cmdLastsave(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    SnapshotStatus status;
+    snapshotStatus(&status);
+    replyInt(ctx->out, (int64_t)status.last_save);
+}
+
+static void cmdBgrewriteaof(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    switch (aofRewrite(ctx->worker))
+    {
+    case AOF_REWRITE_STARTED:
+    {
+        static const char started[] = "Background append only file rewriting started";
+        replyStr(ctx->out, (const uint8_t *)started, sizeof(started) - 1);
+        break;
+    }
+    case AOF_REWRITE_BUSY:
+        replyErr(ctx->out, ERR_BUSY, "a rewrite is already in progress");
+        break;
+    case AOF_REWRITE_FAILED:
+        replyErr(ctx->out, ERR_IO, "rewrite failed, see the server log");
+        break;
+    case AOF_REWRITE_DISABLED:
+        replyErr(ctx->out, ERR_UNKNOWN, "the append-only file is disabled");
+        break;
+    }
+}
+
+static void cmdCluster(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    clusterCommand(ctx->out, args, nargs);
+}
+
+static void cmdInfo(CommandContext *ctx, const Slice *args, uint32_t nargs);
+
+#define COMMAND(name, arity, first_key, flags, handler) {name, sizeof(name) - 1, arity, first_key, flags, handler}
+
+static const Command command_table[] = {
+    COMMAND("get", 2, 1, 0, cmdGet),
+    COMMAND("set", -3, 1, CMD_WRITE, cmdSet),
+    COMMAND("del", 2, 1, CMD_WRITE, cmdDel),
+    COMMAND("exists", 2, 1, 0, cmdExists),
+    COMMAND("expire", 3, 1, CMD_WRITE, cmdExpire),
+    COMMAND("pexpire", 3, 1, CMD_WRITE, cmdPexpire),
+    COMMAND("pexpireat", 3, 1, CMD_WRITE, cmdPexpireat),
+    COMMAND("ttl", 2, 1, 0, cmdTtl),
+    COMMAND("pttl", 2, 1, 0, cmdPttl),
+    COMMAND("persist", 2, 1, CMD_WRITE, cmdPersist),
+    COMMAND("type", 2, 1, 0, cmdType),
+    COMMAND("zadd", -4, 1, CMD_WRITE, cmdZadd),
+    COMMAND("zrem", -3, 1, CMD_WRITE, cmdZrem),
+    COMMAND("zscore", 3, 1, 0, cmdZscore),
+    COMMAND("zrank", 3, 1, 0, cmdZrank),
+    COMMAND("zcard", 2, 1, 0, cmdZcard),
+    COMMAND("zrange", -4, 1, 0, cmdZrange),
+    COMMAND("zrangebyscore", -4, 1, 0, cmdZrangebyscore),
+    COMMAND("hset", -4, 1, CMD_WRITE, cmdHset),
+    COMMAND("hget", 3, 1, 0, cmdHget),
+    COMMAND("hexists", 3, 1, 0, cmdHexists),
+    COMMAND("hdel", -3, 1, CMD_WRITE, cmdHdel),
+    COMMAND("hlen", 2, 1, 0, cmdHlen),
+    COMMAND("hgetall", 2, 1, 0, cmdHgetall),
+    COMMAND("lpush", -3, 1, CMD_WRITE, cmdLpush),
+    COMMAND("rpush", -3, 1, CMD_WRITE, cmdRpush),
+    COMMAND("lpop", -2, 1, CMD_WRITE, cmdLpop),
+    COMMAND("rpop", -2, 1, CMD_WRITE, cmdRpop),
+    COMMAND("llen", 2, 1, 0, cmdLlen),
+    COMMAND("lindex", 3, 1, 0, cmdLindex),
+    COMMAND("lrange", 4, 1, 0, cmdLrange),
+    COMMAND("save", 1, 0, 0, cmdSave),
+    COMMAND("bgsave", 1, 0, 0, cmdBgsave),
+    COMMAND("lastsave", 1, 0, 0, cmdLastsave),
+    COMMAND("bgrewriteaof", 1, 0, 0, cmdBgrewriteaof),
+    COMMAND("cluster", -2, 0, 0, cmdCluster),
+    COMMAND("info", -1, 0, 0, cmdInfo),
+    COMMAND("stats", -1, 0, 0, cmdInfo),
+};
+
+#define COMMAND_COUNT (sizeof(command_table) / sizeof(command_table[0]))
+
+_Static_assert(COMMAND_COUNT <= STATS_MAX_COMMANDS, "raise STATS_MAX_COMMANDS");
+
+// Latency percentiles, throughput and connection counts of the whole server
+// as "field:value" lines. Any section arguments are accepted and ignored.
+static void cmdInfo(CommandContext *ctx, const Slice *args, uint32_t nargs)
+{
+    const char *names[COMMAND_COUNT];
+    for (size_t i = 0; i < COMMAND_COUNT; i++)
+    {
+        names[i] = command_table[i].name;
+    }
+
+    size_t len = 0;
+    char *report = statsReport(names, COMMAND_COUNT, &len);
+    if (!report)
+    {
+        replyErr(ctx->out, ERR_OOM, "out of memory");
+        return;
+    }
+    replyStr(ctx->out, (const uint8_t *)report, len);
+    free(report);
+}
+
+// Names in the table are lowercase letters, so folding the 0x20 bit of the
+// input is an exact case-insensitive compare.
+static bool nameMatches(const Command *cmd, const Slice *name)
+{
+    if (cmd->name_len != name->len)
+    {
+        return false;
+    }
+    for (uint32_t i = 0; i < name->len; i++)
+    {
+        if ((name->data[i] | 0x20) != (uint8_t)cmd->name[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Open-addressed index of the table by a hash of the name's length, first
+// two and last letters, built on first use. The names spread so that a
+// lookup compares one name, rarely two.
+#define COMMAND_SLOTS 128
+
+_Static_assert(COMMAND_COUNT < COMMAND_SLOTS / 2, "raise COMMAND_SLOTS");
+
+static uint8_t command_slots[COMMAND_SLOTS];
+static pthread_once_t command_slots_once = PTHREAD_ONCE_INIT;
+
+static uint32_t nameSlot(const uint8_t *name, uint32_t len)
+{
+    uint32_t second = len > 1 ? (name[1] | 0x20u) : 0;
+    return (len + (name[0] | 0x20u) + ((name[len - 1] | 0x20u) << 1) + (second << 3)) & (COMMAND_SLOTS - 1);
+}
+
+// Slots hold the table index plus one, 0 when empty.
+static void indexCommands(void)
+{
+    for (size_t i = 0; i < COMMAND_COUNT; i++)
+    {
+        const Command *cmd = &command_table[i];
+        uint32_t slot = nameSlot((const uint8_t *)cmd->name, cmd->name_len);
+        while (command_slots[slot])
+        {
+            slot = (slot + 1) & (COMMAND_SLOTS - 1);
+        }
+        command_slots[slot] = (uint8_t)(i + 1);
+    }
+}
+
+const Command *lookupCommand(const Slice *name)
+{
+    if (name->len == 0)
+    {
+        return NULL;
+    }
+    pthread_once(&command_slots_once, indexCommands);
+    for (uint32_t slot = nameSlot(name->data, name->len); command_slots[slot];
+         slot = (slot + 1) & (COMMAND_SLOTS - 1))
+    {
+        const Command *cmd = &command_table[command_slots[slot] - 1];
+        if (nameMatches(cmd, name))
+        {
+            return cmd;
+        }
+    }
+    return NULL;
+}
+
+static bool arityMatches(const Command *cmd, uint32_t nargs)
+{
+    if (cmd->arity >= 0)
+    {
+        return nargs == (uint32_t)cmd->arity;
+    }
+    return nargs >= (uint32_t)-cmd->arity;
+}
+
+const Slice *requestKey(const Command *cmd, const Slice *args, uint32_t nargs)
+{
+    if (!cmd || cmd->first_key == 0 || !arityMatches(cmd, nargs))
+    {
+        return NULL;
+    }
+    return &args[cmd->first_key];
+}
+
+void executeCommand(CommandContext *ctx, const Command *cmd, const Slice *args, uint32_t nargs)
+{
+    BufferMark header = beginReply(ctx->out);
+    if (!cmd)
+    {
+        replyErr(ctx->out, ERR_UNKNOWN, "unknown command");
+    }
+    else if (!arityMatches(cmd, nargs))
+    {
+        replyErr(ctx->out, ERR_ARITY, "wrong number of arguments");
+    }
+    else if (ctx->stats)
+    {
+        uint64_t start = statsNow();
+        cmd->handler(ctx, args, nargs);
+        uint64_t elapsed = statsNow() - start;
+        recordLatency(&ctx->stats->commands[cmd - command_table], elapsed);
+        recordLatency(&ctx->stats->stages[STAGE_EXECUTE], elapsed);
+    }
+    else
+    {
+        cmd->handler(ctx, args, nargs);
+    }
+    endReply(ctx->out, &header);
+}
+
+bool executeRequest(CommandContext *ctx, const uint8_t *request, size_t len)
+{
+    Slice args[MAX_COMMAND_ARGS];
+    uint32_t nargs = 0;
+    uint64_t start = ctx->stats ? statsNow() : 0;
+    ParseResult parsed = parseRequest(request, len, args, MAX_COMMAND_ARGS, &nargs);
+    if (parsed == PARSE_MALFORMED)
+    {
+        return false;
+    }
+    if (ctx->stats)
+    {
+        recordLatency(&ctx->stats->stages[STAGE_PARSE], statsNow() - start);
+    }
+    if (parsed == PARSE_TOO_MANY_ARGS)
+    {
+        BufferMark header = beginReply(ctx->out);
+        replyErr(ctx->out, ERR_PROTOCOL, "too many arguments");
+        endReply(ctx->out, &header);
+        return true;
+    }
+    executeCommand(ctx, requestCommand(args, nargs), args, nargs);
+    return true;
+}
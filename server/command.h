@@ -0,0 +1,66 @@
+#ifndef COMMAND_HEADER
+#define COMMAND_HEADER
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "buffer.h"
+#include "keyspace.h"
+#include "protocol.h"
+#include "stats.h"
+
+typedef struct
+{
+    Keyspace *db;
+    Buffer *out;
+    // latency and call counters of the executing worker, may be NULL
+    Stats *stats;
+    // id of the executing worker
+    int worker;
+    // where write commands log themselves for the append-only file and for
+    // replicas, NULL when neither takes them or the command is being replayed
+    // from the file
+    Buffer *aof;
+} CommandContext;
+
+typedef void (*CommandHandler)(CommandContext *ctx, const Slice *args, uint32_t nargs);
+
+// may change the keyspace, so a replica refuses it from its clients
+#define CMD_WRITE 1u
+
+// arity counts the command name: N means exactly N arguments, -N at least N.
+// first_key is the argument index of the key the command operates on, or 0
+// for commands that do not touch a key.
+typedef struct
+{
+    const char *name;
+    uint32_t name_len;
+    int32_t arity;
+    uint32_t first_key;
+    uint32_t flags;
+    CommandHandler handler;
+} Command;
+
+// Finds a command by its name, in any case, in constant time. NULL when
+// there is no such command.
+const Command *lookupCommand(const Slice *name);
+
+// The command a parsed request names, or NULL. Callers look it up once and
+// pass it on to requestKey and executeCommand.
+static inline const Command *requestCommand(const Slice *args, uint32_t nargs)
+{
+    return nargs > 0 ? lookupCommand(&args[0]) : NULL;
+}
+
+// The key a well-formed request operates on, or NULL.
+const Slice *requestKey(const Command *cmd, const Slice *args, uint32_t nargs);
+
+// Runs already parsed arguments of the command requestCommand found, which
+// may be NULL, and appends one framed reply to ctx->out.
+void executeCommand(CommandContext *ctx, const Command *cmd, const Slice *args, uint32_t nargs);
+
+// Parses one request payload, runs it and appends exactly one framed reply
+// to ctx->out; one with too many arguments gets an error. Returns false when
+// the payload is malformed and the connection should be dropped.
+bool executeRequest(CommandContext *ctx, const uint8_t *request, size_t len);
+
+#endif
@@ -8,6 +8,14 @@ Connection initConnection()
     conn.want_read = false;
     conn.want_write = false;
     conn.want_close = false;
+    conn.zerocopy = false;
+    conn.generation = 0;
+    conn.bulk_remaining = 0;
+    conn.flush_queued = false;
+    conn.read_queued = false;
+    conn.primary = false;
+    conn.detached = false;
+    conn.asking = false;
 
     return conn;
 }
@@ -23,6 +31,14 @@ void freeConnection(Connection *conn)
         conn->want_read = false;
         conn->want_write = false;
         conn->want_close = false;
+        conn->zerocopy = false;
+        conn->bulk_remaining = 0;
+        conn->flush_queued = false;
+        conn->read_queued = false;
+        conn->primary = false;
+        conn->detached = false;
+        conn->asking = false;
+        conn->generation++;
     }
 }
 
@@ -33,6 +49,14 @@ Connection emptyConnection()
     retConn.want_close = false;
     retConn.want_read = false;
     retConn.want_write = false;
+    retConn.zerocopy = false;
+    retConn.generation = 0;
+    retConn.bulk_remaining = 0;
+    retConn.flush_queued = false;
+    retConn.read_queued = false;
+    retConn.primary = false;
+    retConn.detached = false;
+    retConn.asking = false;
 
     return retConn;
 }
\ No newline at end of file
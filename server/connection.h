@@ -8,6 +8,23 @@ typedef struct
     bool want_read;
     bool want_write;
     bool want_close;
+    // SO_ZEROCOPY is enabled and large writes go out with MSG_ZEROCOPY
+    bool zerocopy;
+    // bumped whenever the slot is freed, so replies from other shards can
+    // tell the connection they belong to apart from a later one on the same fd
+    uint32_t generation;
+    // items of a bulk batch still to come after its header was consumed
+    uint32_t bulk_remaining;
+    // on the worker's end-of-iteration lists, see Worker
+    bool flush_queued;
+    bool read_queued;
+    // a replica's link to its primary: its requests are applied even though
+    // writes are refused elsewhere, and their replies are dropped
+    bool primary;
+    // the socket was handed to the replication thread, which keeps using it
+    bool detached;
+    // the last request was ASKING: the next may use an importing slot
+    bool asking;
     Buffer incoming_buffer;
     Buffer outgoing_buffer;
 } Connection;
@@ -6,7 +6,7 @@ ConnectionVector initConnectionVector()
     ConnectionVector retConnVector;
     retConnVector.size = 0;
     retConnVector.capacity = 1;
-    retConnVector.array = (Connection *)malloc(sizeof(Connection));
+    retConnVector.array = (Connection **)malloc(sizeof(Connection *));
 
     return retConnVector;
 }
@@ -43,7 +43,7 @@ bool resizeConnectionVector(ConnectionVector *vec, size_t new_size, int value)
             }
         }
 
-        Connection *new_array = (Connection *)realloc(vec->array, new_capacity * sizeof(Connection));
+        Connection **new_array = (Connection **)realloc(vec->array, new_capacity * sizeof(Connection *));
         if (new_array == NULL)
         {
             return false;
@@ -55,7 +55,7 @@ bool resizeConnectionVector(ConnectionVector *vec, size_t new_size, int value)
 
     for (size_t i = vec->size; i < new_size; ++i)
     {
-        vec->array[i] = (Connection)emptyConnection();
+        vec->array[i] = NULL;
     }
 
     vec->size = new_size;
@@ -6,7 +6,9 @@ typedef struct
 {
     int size;
     int capacity;
-    Connection *array;
+    // indexed by fd, NULL for fds without a connection; the connections
+    // themselves live in the worker's pool and never move
+    Connection **array;
 
 } ConnectionVector;
 
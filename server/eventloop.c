@@ -0,0 +1,348 @@
+#include "eventloop.h"
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#define INTEREST_REGISTERED 0x80
+#define INITIAL_FIRED_CAPACITY 256
+
+static bool growInterest(EventLoop *loop, int fd)
+{
+    if ((size_t)fd < loop->interest_size)
+    {
+        return true;
+    }
+
+    size_t new_size = loop->interest_size ? loop->interest_size : 64;
+    while (new_size <= (size_t)fd)
+    {
+        new_size *= 2;
+    }
+
+    uint8_t *new_interest = (uint8_t *)realloc(loop->interest, new_size);
+    if (!new_interest)
+    {
+        return false;
+    }
+    memset(new_interest + loop->interest_size, 0, new_size - loop->interest_size);
+    loop->interest = new_interest;
+
+    if (loop->backend == EVENT_BACKEND_POLL)
+    {
+        int *new_index = (int *)realloc(loop->poll_index, new_size * sizeof(int));
+        if (!new_index)
+        {
+            return false;
+        }
+        for (size_t i = loop->interest_size; i < new_size; i++)
+        {
+            new_index[i] = -1;
+        }
+        loop->poll_index = new_index;
+    }
+
+    loop->interest_size = new_size;
+    return true;
+}
+
+static bool growFired(EventLoop *loop, size_t needed)
+{
+    if (needed <= loop->fired_capacity)
+    {
+        return true;
+    }
+
+    size_t new_capacity = loop->fired_capacity * 2;
+    if (new_capacity < needed)
+    {
+        new_capacity = needed;
+    }
+
+    FiredEvent *new_fired = (FiredEvent *)realloc(loop->fired, new_capacity * sizeof(FiredEvent));
+    if (!new_fired)
+    {
+        return false;
+    }
+    loop->fired = new_fired;
+    loop->fired_capacity = new_capacity;
+    return true;
+}
+
+static uint32_t toEpollEvents(uint32_t events)
+{
+    // Edge-triggered: the kernel reports each readiness transition once, so
+    // handlers must drain the socket until EAGAIN.
+    uint32_t ev = EPOLLET;
+    if (events & EVENT_READ)
+    {
+        ev |= EPOLLIN;
+    }
+    if (events & EVENT_WRITE)
+    {
+        ev |= EPOLLOUT;
+    }
+    return ev;
+}
+
+static short toPollEvents(uint32_t events)
+{
+    short ev = POLLERR;
+    if (events & EVENT_READ)
+    {
+        ev |= POLLIN;
+    }
+    if (events & EVENT_WRITE)
+    {
+        ev |= POLLOUT;
+    }
+    return ev;
+}
+
+bool initEventLoop(EventLoop *loop, EventBackend backend)
+{
+    memset(loop, 0, sizeof(*loop));
+    loop->backend = backend;
+    loop->epoll_fd = -1;
+
+    loop->fired_capacity = INITIAL_FIRED_CAPACITY;
+    loop->fired = (FiredEvent *)malloc(loop->fired_capacity * sizeof(FiredEvent));
+    if (!loop->fired)
+    {
+        return false;
+    }
+
+    if (backend == EVENT_BACKEND_EPOLL)
+    {
+        loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epoll_fd < 0)
+        {
+            return false;
+        }
+        loop->backend_events = malloc(loop->fired_capacity * sizeof(struct epoll_event));
+        return loop->backend_events != NULL;
+    }
+
+    initPollFdVector(&loop->poll_args);
+    return loop->poll_args.array != NULL;
+}
+
+void freeEventLoop(EventLoop *loop)
+{
+    if (loop->epoll_fd >= 0)
+    {
+        close(loop->epoll_fd);
+        loop->epoll_fd = -1;
+    }
+    if (loop->backend == EVENT_BACKEND_POLL)
+    {
+        freepollFdVector(&loop->poll_args);
+    }
+    free(loop->poll_index);
+    free(loop->interest);
+    free(loop->fired);
+    free(loop->backend_events);
+    loop->poll_index = NULL;
+    loop->interest = NULL;
+    loop->fired = NULL;
+    loop->backend_events = NULL;
+    loop->interest_size = 0;
+    loop->fired_capacity = 0;
+}
+
+bool eventLoopAdd(EventLoop *loop, int fd, uint32_t events)
+{
+    if (!growInterest(loop, fd))
+    {
+        return false;
+    }
+
+    if (loop->backend == EVENT_BACKEND_EPOLL)
+    {
+        struct epoll_event ev = {};
+        ev.events = toEpollEvents(events);
+        ev.data.fd = fd;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        struct pollfd pfd = {fd, toPollEvents(events), 0};
+        if (!pollVectorPushBack(&loop->poll_args, pfd))
+        {
+            return false;
+        }
+        loop->poll_index[fd] = (int)loop->poll_args.size - 1;
+    }
+
+    loop->interest[fd] = INTEREST_REGISTERED | (uint8_t)events;
+    return true;
+}
+
+bool eventLoopSetInterest(EventLoop *loop, int fd, uint32_t events)
+{
+    if ((size_t)fd >= loop->interest_size || !(loop->interest[fd] & INTEREST_REGISTERED))
+    {
+        return eventLoopAdd(loop, fd, events);
+    }
+
+    uint8_t mask = INTEREST_REGISTERED | (uint8_t)events;
+    if (loop->interest[fd] == mask)
+    {
+        return true;
+    }
+
+    if (loop->backend == EVENT_BACKEND_EPOLL)
+    {
+        struct epoll_event ev = {};
+        ev.events = toEpollEvents(events);
+        ev.data.fd = fd;
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0)
+        {
+            return false;
+        }
+    }
+    else
+    {
+        loop->poll_args.array[loop->poll_index[fd]].events = toPollEvents(events);
+    }
+
+    loop->interest[fd] = mask;
+    return true;
+}
+
+void eventLoopRemove(EventLoop *loop, int fd)
+{
+    if ((size_t)fd >= loop->interest_size || !(loop->interest[fd] & INTEREST_REGISTERED))
+    {
+        return;
+    }
+
+    if (loop->backend == EVENT_BACKEND_EPOLL)
+    {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+    else
+    {
+        // swap the last entry into the hole so removal stays O(1)
+        int index = loop->poll_index[fd];
+        size_t last = loop->poll_args.size - 1;
+        if ((size_t)index != last)
+        {
+            struct pollfd moved = loop->poll_args.array[last];
+            loop->poll_args.array[index] = moved;
+            loop->poll_index[moved.fd] = index;
+        }
+        loop->poll_args.size = last;
+        loop->poll_index[fd] = -1;
+    }
+
+    loop->interest[fd] = 0;
+}
+
+static int waitEpoll(EventLoop *loop, int timeout_ms)
+{
+    struct epoll_event *events = (struct epoll_event *)loop->backend_events;
+    int rv = epoll_wait(loop->epoll_fd, events, (int)loop->fired_capacity, timeout_ms);
+    if (rv <= 0)
+    {
+        return rv;
+    }
+
+    for (int i = 0; i < rv; i++)
+    {
+        uint32_t fired = 0;
+        if (events[i].events & EPOLLIN)
+        {
+            fired |= EVENT_READ;
+        }
+        if (events[i].events & EPOLLOUT)
+        {
+            fired |= EVENT_WRITE;
+        }
+        if (events[i].events & EPOLLERR)
+        {
+            fired |= EVENT_ERROR;
+        }
+        if (events[i].events & EPOLLHUP)
+        {
+            fired |= EVENT_HANGUP;
+        }
+        loop->fired[i].fd = events[i].data.fd;
+        loop->fired[i].events = fired;
+    }
+    return rv;
+}
+
+static int waitPoll(EventLoop *loop, int timeout_ms)
+{
+    int rv = poll(loop->poll_args.array, (nfds_t)loop->poll_args.size, timeout_ms);
+    if (rv <= 0)
+    {
+        return rv;
+    }
+
+    if (!growFired(loop, (size_t)rv))
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    int count = 0;
+    for (size_t i = 0; i < loop->poll_args.size && count < rv; i++)
+    {
+        short revents = loop->poll_args.array[i].revents;
+        if (revents == 0)
+        {
+            continue;
+        }
+
+        uint32_t fired = 0;
+        if (revents & POLLIN)
+        {
+            fired |= EVENT_READ;
+        }
+        if (revents & POLLOUT)
+        {
+            fired |= EVENT_WRITE;
+        }
+        if (revents & POLLERR)
+        {
+            fired |= EVENT_ERROR;
+        }
+        if (revents & (POLLHUP | POLLNVAL))
+        {
+            fired |= EVENT_HANGUP;
+        }
+        loop->fired[count].fd = loop->poll_args.array[i].fd;
+        loop->fired[count].events = fired;
+        count++;
+    }
+    return count;
+}
+
+int eventLoopWait(EventLoop *loop, int timeout_ms)
+{
+    if (loop->backend == EVENT_BACKEND_EPOLL)
+    {
+        return waitEpoll(loop, timeout_ms);
+    }
+    return waitPoll(loop, timeout_ms);
+}
+
+const char *eventBackendName(EventBackend backend)
+{
+    switch (backend)
+    {
+    case EVENT_BACKEND_EPOLL:
+        return "epoll";
+    case EVENT_BACKEND_POLL:
+        return "poll";
+    case EVENT_BACKEND_IO_URING:
+        return "io_uring";
+    }
+    return "unknown";
+}
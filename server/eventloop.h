@@ -0,0 +1,60 @@
+#ifndef EVENT_LOOP_HEADER
+#define EVENT_LOOP_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "pollfdvector.h"
+
+#define EVENT_READ 1
+#define EVENT_WRITE 2
+#define EVENT_ERROR 4
+#define EVENT_HANGUP 8
+
+typedef enum
+{
+    EVENT_BACKEND_EPOLL,
+    EVENT_BACKEND_POLL,
+    // completion based, driven by uring.c instead of this loop
+    EVENT_BACKEND_IO_URING,
+} EventBackend;
+
+typedef struct
+{
+    int fd;
+    uint32_t events;
+} FiredEvent;
+
+typedef struct
+{
+    EventBackend backend;
+    int epoll_fd;
+    // poll backend only: registered fds and fd -> position in poll_args
+    pollFdVector poll_args;
+    int *poll_index;
+    // interest mask currently registered with the kernel, indexed by fd
+    uint8_t *interest;
+    size_t interest_size;
+    // filled by eventLoopWait()
+    FiredEvent *fired;
+    size_t fired_capacity;
+    void *backend_events;
+} EventLoop;
+
+bool initEventLoop(EventLoop *loop, EventBackend backend);
+
+void freeEventLoop(EventLoop *loop);
+
+bool eventLoopAdd(EventLoop *loop, int fd, uint32_t events);
+
+// Only touches the kernel when the mask differs from the registered one.
+bool eventLoopSetInterest(EventLoop *loop, int fd, uint32_t events);
+
+void eventLoopRemove(EventLoop *loop, int fd);
+
+// Returns the number of entries written to loop->fired, or -1 on error.
+int eventLoopWait(EventLoop *loop, int timeout_ms);
+
+const char *eventBackendName(EventBackend backend);
+
+#endif
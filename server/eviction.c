@@ -0,0 +1,166 @@
+#include "eviction.h"
+#include <string.h>
+
+static const char *const policy_names[] = {
+    [EVICT_NOEVICTION] = "noeviction",
+    [EVICT_ALLKEYS_LRU] = "allkeys-lru",
+    [EVICT_ALLKEYS_LFU] = "allkeys-lfu",
+    [EVICT_VOLATILE_TTL] = "volatile-ttl",
+};
+
+bool parseEvictionPolicy(const char *name, EvictionPolicy *policy)
+{
+    for (size_t i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++)
+    {
+        if (strcmp(name, policy_names[i]) == 0)
+        {
+            *policy = (EvictionPolicy)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *evictionPolicyName(EvictionPolicy policy)
+{
+    return policy_names[policy];
+}
+
+uint64_t evictionRandom(uint64_t *state)
+{
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static inline uint32_t lruClock(uint64_t now_ms)
+{
+    return (uint32_t)(now_ms / LRU_RESOLUTION_MS);
+}
+
+static inline uint16_t lfuMinutes(uint64_t now_ms)
+{
+    return (uint16_t)(now_ms / 60000);
+}
+
+// The counter after the decay owed for the minutes since access was stamped.
+static uint8_t lfuDecayed(uint32_t access, uint64_t now_ms)
+{
+    uint16_t elapsed = (uint16_t)(lfuMinutes(now_ms) - (uint16_t)(access >> 8));
+    uint32_t periods = elapsed / LFU_DECAY_MINUTES;
+    uint8_t counter = (uint8_t)access;
+    return periods >= counter ? 0 : (uint8_t)(counter - periods);
+}
+
+uint32_t accessInit(EvictionPolicy policy, uint64_t now_ms)
+{
+    if (policy == EVICT_ALLKEYS_LFU)
+    {
+        return ((uint32_t)lfuMinutes(now_ms) << 8) | LFU_INIT_VAL;
+    }
+    return lruClock(now_ms);
+}
+
+uint32_t accessTouch(EvictionPolicy policy, uint32_t access, uint64_t now_ms, uint64_t *rng)
+{
+    if (policy != EVICT_ALLKEYS_LFU)
+    {
+        return lruClock(now_ms);
+    }
+
+    uint8_t counter = lfuDecayed(access, now_ms);
+    if (counter < 255)
+    {
+        // bump with probability 1 / ((counter - init) * factor + 1), so the
+        // 8 bits reach about a million accesses
+        double r = (double)(evictionRandom(rng) >> 11) / 9007199254740992.0;
+        double base = counter > LFU_INIT_VAL ? counter - LFU_INIT_VAL : 0;
+        if (r < 1.0 / (base * LFU_LOG_FACTOR + 1))
+        {
+            counter++;
+        }
+    }
+    return ((uint32_t)lfuMinutes(now_ms) << 8) | counter;
+}
+
+uint64_t evictionScore(EvictionPolicy policy, uint32_t access, uint64_t now_ms)
+{
+    if (policy == EVICT_ALLKEYS_LFU)
+    {
+        return 255 - lfuDecayed(access, now_ms);
+    }
+    // idle time; the subtraction wraps like the clock does
+    return (uint32_t)(lruClock(now_ms) - access);
+}
+
+bool evictionPoolInsert(EvictionPool *pool, uint64_t score, const uint8_t *key, uint32_t key_len)
+{
+    // the slot the candidate belongs in, entries[0] being the worst
+    int pos = 0;
+    while (pos < pool->size && pool->entries[pos].score < score)
+    {
+        pos++;
+    }
+    for (int i = 0; i < pool->size; i++)
+    {
+        // sampled again before it was used up
+        if (pool->entries[i].key_len == key_len && memcmp(pool->entries[i].key, key, key_len) == 0)
+        {
+            return true;
+        }
+    }
+
+    if (pool->size == EVICTION_POOL_SIZE)
+    {
+        if (pos == 0)
+        {
+            // worse than everything kept
+            return true;
+        }
+        // drop the worst to make room
+        free(pool->entries[0].key);
+        memmove(&pool->entries[0], &pool->entries[1], sizeof(EvictionCandidate) * (size_t)(pos - 1));
+        pos--;
+    }
+    else
+    {
+        memmove(&pool->entries[pos + 1], &pool->entries[pos], sizeof(EvictionCandidate) * (size_t)(pool->size - pos));
+        pool->size++;
+    }
+
+    EvictionCandidate *entry = &pool->entries[pos];
+    entry->key = (uint8_t *)malloc(key_len ? key_len : 1);
+    if (!entry->key)
+    {
+        memmove(&pool->entries[pos], &pool->entries[pos + 1], sizeof(EvictionCandidate) * (size_t)(pool->size - pos - 1));
+        pool->size--;
+        return false;
+    }
+    memcpy(entry->key, key, key_len);
+    entry->key_len = key_len;
+    entry->score = score;
+    return true;
+}
+
+bool evictionPoolPop(EvictionPool *pool, EvictionCandidate *candidate)
+{
+    if (pool->size == 0)
+    {
+        return false;
+    }
+    *candidate = pool->entries[--pool->size];
+    return true;
+}
+
+void freeEvictionPool(EvictionPool *pool)
+{
+    for (int i = 0; i < pool->size; i++)
+    {
+        free(pool->entries[i].key);
+    }
+    pool->size = 0;
+}
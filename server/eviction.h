@@ -0,0 +1,70 @@
+#ifndef EVICTION_HEADER
+#define EVICTION_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Node.access is 32 bits whose meaning depends on the policy:
+//   LRU: the keyspace clock in LRU_RESOLUTION_MS units at the last access
+//   LFU: minutes at the last decay in bits 8-23, a logarithmic access
+//        counter in the low 8 (Redis' Morris counter)
+#define LRU_RESOLUTION_MS 10
+#define LFU_INIT_VAL 5
+#define LFU_LOG_FACTOR 10
+// minutes after which an idle counter loses one step
+#define LFU_DECAY_MINUTES 1
+
+// keys sampled per eviction pass, and the best candidates kept across passes
+#define EVICTION_SAMPLES 5
+#define EVICTION_POOL_SIZE 16
+
+typedef enum
+{
+    EVICT_NOEVICTION,
+    EVICT_ALLKEYS_LRU,
+    EVICT_ALLKEYS_LFU,
+    EVICT_VOLATILE_TTL,
+} EvictionPolicy;
+
+bool parseEvictionPolicy(const char *name, EvictionPolicy *policy);
+
+const char *evictionPolicyName(EvictionPolicy policy);
+
+// Cheap generator for sampling and the LFU counter; state must not be 0.
+uint64_t evictionRandom(uint64_t *state);
+
+// Access bits for a new key and the update on every later access. now_ms is
+// the keyspace's cached clock.
+uint32_t accessInit(EvictionPolicy policy, uint64_t now_ms);
+
+uint32_t accessTouch(EvictionPolicy policy, uint32_t access, uint64_t now_ms, uint64_t *rng);
+
+// Larger means a better eviction candidate.
+uint64_t evictionScore(EvictionPolicy policy, uint32_t access, uint64_t now_ms);
+
+typedef struct
+{
+    uint64_t score;
+    uint8_t *key;
+    uint32_t key_len;
+} EvictionCandidate;
+
+// Candidates sorted by score, best last. Keys are copies: the nodes may be
+// gone by the time a candidate is used.
+typedef struct
+{
+    EvictionCandidate entries[EVICTION_POOL_SIZE];
+    int size;
+} EvictionPool;
+
+// Keeps the candidate if the pool has room or it beats the worst entry.
+// Returns false only when copying the key failed.
+bool evictionPoolInsert(EvictionPool *pool, uint64_t score, const uint8_t *key, uint32_t key_len);
+
+// Takes the best candidate; the caller frees candidate->key.
+bool evictionPoolPop(EvictionPool *pool, EvictionCandidate *candidate);
+
+void freeEvictionPool(EvictionPool *pool);
+
+#endif
@@ -0,0 +1,139 @@
+#include "fdio.h"
+#include "log.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define WRITE_IOV 16
+
+uint64_t monotonicMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+bool writeAll(int fd, const uint8_t *p, size_t len)
+{
+    bool socket = true;
+    while (len > 0)
+    {
+        ssize_t n = socket ? send(fd, p, len, MSG_NOSIGNAL) : write(fd, p, len);
+        if (n < 0)
+        {
+            if (errno == ENOTSOCK && socket)
+            {
+                socket = false;
+                continue;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+bool readAll(int fd, uint8_t *p, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            if (n == 0)
+            {
+                errno = ECONNRESET;
+            }
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+bool writeBuffer(int fd, Buffer *buffer)
+{
+    while (bufferSize(buffer) > 0)
+    {
+        struct iovec iov[WRITE_IOV];
+        int count = bufferIovecs(buffer, iov, WRITE_IOV);
+        if (count == 0)
+        {
+            return false;
+        }
+        size_t written = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (!writeAll(fd, (const uint8_t *)iov[i].iov_base, iov[i].iov_len))
+            {
+                return false;
+            }
+            written += iov[i].iov_len;
+        }
+        consumeNewBuffer(buffer, written);
+    }
+    return true;
+}
+
+void setBlocking(int fd, bool blocking)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags >= 0)
+    {
+        fcntl(fd, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+    }
+}
+
+void wakeEventFd(int fd)
+{
+    uint64_t one = 1;
+    ssize_t rv = write(fd, &one, sizeof(one));
+    (void)rv;
+}
+
+int connectTcp(const char *who, const char *host, int port, int timeout_s)
+{
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    struct addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *found = NULL;
+    int rv = getaddrinfo(host, service, &hints, &found);
+    if (rv != 0)
+    {
+        logWarn("%s %s:%d: %s", who, host, port, gai_strerror(rv));
+        return -1;
+    }
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, found->ai_addr, found->ai_addrlen) != 0)
+    {
+        logWarn("%s %s:%d: connect: %s", who, host, port, strerror(errno));
+        freeaddrinfo(found);
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    freeaddrinfo(found);
+    struct timeval timeout = {timeout_s, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
@@ -0,0 +1,35 @@
+#ifndef FDIO_HEADER
+#define FDIO_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "buffer.h"
+
+// Blocking I/O and clock helpers for the code that works outside the event
+// loops: snapshots, the append-only file, replication and slot migration.
+
+uint64_t monotonicMs(void);
+
+// Writes all of p, retrying after EINTR. A socket is written with
+// MSG_NOSIGNAL, so a peer that went away is an error rather than SIGPIPE.
+bool writeAll(int fd, const uint8_t *p, size_t len);
+
+// Reads exactly len bytes; end of file fails with errno ECONNRESET.
+bool readAll(int fd, uint8_t *p, size_t len);
+
+// Writes everything in the buffer, e.g. frames built with appendRequest, and
+// consumes it.
+bool writeBuffer(int fd, Buffer *buffer);
+
+void setBlocking(int fd, bool blocking);
+
+// Pokes a thread that waits on the eventfd.
+void wakeEventFd(int fd);
+
+// Connects a blocking socket to host:port whose reads and writes give up
+// after timeout_s. Failures are logged as "<who> host:port: ...". Returns
+// the socket, -1 on failure.
+int connectTcp(const char *who, const char *host, int port, int timeout_s);
+
+#endif
@@ -1,5 +1,4 @@
-#include <stdint.h>
-#include <stddef.h>
+#include "fnv.h"
 
 #define FNV_OFFSET_32 2166136261U
 #define FNV_PRIME_32 16777619U
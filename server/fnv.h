@@ -0,0 +1,11 @@
+#ifndef FNV_HEADER
+#define FNV_HEADER
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint32_t fnv1a_32(const void *key, size_t len);
+
+uint64_t fnv1a_64(const void *key, size_t len);
+
+#endif
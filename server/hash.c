@@ -0,0 +1,297 @@
+#include "hash.h"
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define HASH_SECRET_WORDS 16
+#define PRIME32_1 0x9E3779B1U
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+
+// fixed, so checksums stay comparable across processes
+#define CHECKSUM_SEED 0x5EEDC0DEC4EC5ABCULL
+
+typedef struct
+{
+    uint64_t seed;
+    uint64_t secret[HASH_SECRET_WORDS];
+} HashKey;
+
+static HashKey g_key;
+static HashKey g_checksum_key;
+
+static uint64_t hashLongScalar(const HashKey *key, const uint8_t *p, size_t len);
+#if defined(__x86_64__)
+static uint64_t hashLongAvx2(const HashKey *key, const uint8_t *p, size_t len);
+#endif
+static uint64_t (*g_hash_long)(const HashKey *key, const uint8_t *p, size_t len) = hashLongScalar;
+
+static inline uint64_t read64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// 64x64 -> 128 multiply folded back to 64 bits
+static inline uint64_t mix(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void deriveKey(HashKey *key, uint64_t seed)
+{
+    key->seed = seed;
+    uint64_t state = seed;
+    for (int i = 0; i < HASH_SECRET_WORDS; i++)
+    {
+        // odd words keep the multiplies from collapsing to zero
+        key->secret[i] = splitmix64(&state) | 1;
+    }
+}
+
+void setHashSeed(uint64_t seed)
+{
+    deriveKey(&g_key, seed);
+    deriveKey(&g_checksum_key, CHECKSUM_SEED);
+}
+
+void initHashSeed(void)
+{
+    uint64_t seed = 0;
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) != (ssize_t)sizeof(seed))
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        seed = ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec) ^ ((uint64_t)getpid() << 32);
+    }
+    setHashSeed(seed);
+
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        g_hash_long = hashLongAvx2;
+    }
+#endif
+}
+
+const char *hashImplementation(void)
+{
+    return g_hash_long == hashLongScalar ? "scalar" : "avx2";
+}
+
+static inline uint64_t hashWithKey(const HashKey *key, const uint8_t *p, size_t len)
+{
+    if (len > HASH_LONG_INPUT)
+    {
+        return g_hash_long(key, p, len);
+    }
+
+    const uint64_t *secret = key->secret;
+    uint64_t seed = key->seed ^ mix(key->seed ^ secret[0], secret[1]);
+    uint64_t a, b;
+    if (len <= 16)
+    {
+        if (len >= 4)
+        {
+            // two overlapping reads cover every length from 4 to 16
+            size_t step = (len >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + step);
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - step);
+        }
+        else if (len > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else
+        {
+            a = b = 0;
+        }
+    }
+    else
+    {
+        size_t left = len;
+        if (left > 48)
+        {
+            // three independent lanes keep the multipliers busy
+            uint64_t lane1 = seed, lane2 = seed;
+            do
+            {
+                seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+                lane1 = mix(read64(p + 16) ^ secret[2], read64(p + 24) ^ lane1);
+                lane2 = mix(read64(p + 32) ^ secret[3], read64(p + 40) ^ lane2);
+                p += 48;
+                left -= 48;
+            } while (left > 48);
+            seed ^= lane1 ^ lane2;
+        }
+        while (left > 16)
+        {
+            seed = mix(read64(p) ^ secret[1], read64(p + 8) ^ seed);
+            p += 16;
+            left -= 16;
+        }
+        a = read64(p + left - 16);
+        b = read64(p + left - 8);
+    }
+    a ^= secret[1];
+    b ^= seed;
+    __uint128_t r = (__uint128_t)a * b;
+    return mix((uint64_t)r ^ secret[0] ^ len, (uint64_t)(r >> 64) ^ secret[1]);
+}
+
+uint64_t hashBytes(const void *key, size_t len)
+{
+    return hashWithKey(&g_key, (const uint8_t *)key, len);
+}
+
+uint64_t checksumBytes(const void *data, size_t len)
+{
+    return hashWithKey(&g_checksum_key, (const uint8_t *)data, len);
+}
+
+// Long inputs: eight 64-bit accumulators over 64-byte stripes, each lane
+// adding a 32x32 product of its keyed word and the raw word of its neighbour.
+// The accumulators are scrambled every 16 stripes and folded with mix().
+
+static const uint64_t k_acc_init[8] = {
+    0xC2B2AE3DULL,         PRIME64_1,
+    0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL,
+    0x85EBCA77C2B2AE63ULL, 0x85EBCA77ULL,
+    0x27D4EB2F165667C5ULL, 0x9E3779B1ULL,
+};
+
+static inline void accumulateScalar(uint64_t acc[8], const uint8_t *stripe, const uint64_t *secret)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        uint64_t data = read64(stripe + 8 * i);
+        uint64_t keyed = data ^ secret[i];
+        acc[i ^ 1] += data;
+        acc[i] += (keyed & 0xFFFFFFFF) * (keyed >> 32);
+    }
+}
+
+static inline void scrambleScalar(uint64_t acc[8], const uint64_t *secret)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        uint64_t v = acc[i];
+        v ^= v >> 47;
+        v ^= secret[i];
+        acc[i] = v * PRIME32_1;
+    }
+}
+
+static uint64_t finishLong(const HashKey *key, const uint64_t acc[8], size_t len)
+{
+    uint64_t result = (uint64_t)len * PRIME64_1 ^ key->seed;
+    for (int i = 0; i < 4; i++)
+    {
+        result += mix(acc[2 * i] ^ key->secret[2 * i], acc[2 * i + 1] ^ key->secret[2 * i + 1]);
+    }
+    // xxh3 avalanche
+    result ^= result >> 37;
+    result *= 0x165667919E3779F9ULL;
+    return result ^ (result >> 32);
+}
+
+static uint64_t hashLongScalar(const HashKey *key, const uint8_t *p, size_t len)
+{
+    uint64_t acc[8];
+    for (int i = 0; i < 8; i++)
+    {
+        acc[i] = k_acc_init[i] ^ key->seed;
+    }
+    // the last stripe is always read from the end, overlapping if need be
+    size_t stripes = (len - 1) / 64;
+    for (size_t n = 0; n < stripes; n++)
+    {
+        accumulateScalar(acc, p + 64 * n, key->secret + (n & 7));
+        if ((n & 15) == 15)
+        {
+            scrambleScalar(acc, key->secret + 8);
+        }
+    }
+    accumulateScalar(acc, p + len - 64, key->secret + 7);
+    return finishLong(key, acc, len);
+}
+
+#if defined(__x86_64__)
+
+__attribute__((target("avx2"))) static inline void accumulateAvx2(__m256i acc[2], const uint8_t *stripe,
+                                                                  const uint64_t *secret)
+{
+    for (int j = 0; j < 2; j++)
+    {
+        __m256i data = _mm256_loadu_si256((const __m256i *)(stripe + 32 * j));
+        __m256i keyed = _mm256_xor_si256(data, _mm256_loadu_si256((const __m256i *)(secret + 4 * j)));
+        __m256i product = _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32));
+        // swap neighbouring 64-bit lanes: lane i gets the data of lane i ^ 1
+        __m256i swapped = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        acc[j] = _mm256_add_epi64(acc[j], _mm256_add_epi64(product, swapped));
+    }
+}
+
+__attribute__((target("avx2"))) static inline void scrambleAvx2(__m256i acc[2], const uint64_t *secret)
+{
+    const __m256i prime = _mm256_set1_epi32((int)PRIME32_1);
+    for (int j = 0; j < 2; j++)
+    {
+        __m256i v = _mm256_xor_si256(acc[j], _mm256_srli_epi64(acc[j], 47));
+        v = _mm256_xor_si256(v, _mm256_loadu_si256((const __m256i *)(secret + 4 * j)));
+        // 64x32 multiply from two 32x32 halves
+        __m256i low = _mm256_mul_epu32(v, prime);
+        __m256i high = _mm256_mul_epu32(_mm256_srli_epi64(v, 32), prime);
+        acc[j] = _mm256_add_epi64(low, _mm256_slli_epi64(high, 32));
+    }
+}
+
+__attribute__((target("avx2"))) static uint64_t hashLongAvx2(const HashKey *key, const uint8_t *p, size_t len)
+{
+    uint64_t init[8];
+    for (int i = 0; i < 8; i++)
+    {
+        init[i] = k_acc_init[i] ^ key->seed;
+    }
+    __m256i acc[2] = {_mm256_loadu_si256((const __m256i *)init), _mm256_loadu_si256((const __m256i *)(init + 4))};
+
+    size_t stripes = (len - 1) / 64;
+    for (size_t n = 0; n < stripes; n++)
+    {
+        accumulateAvx2(acc, p + 64 * n, key->secret + (n & 7));
+        if ((n & 15) == 15)
+        {
+            scrambleAvx2(acc, key->secret + 8);
+        }
+    }
+    accumulateAvx2(acc, p + len - 64, key->secret + 7);
+
+    uint64_t out[8];
+    _mm256_storeu_si256((__m256i *)out, acc[0]);
+    _mm256_storeu_si256((__m256i *)(out + 4), acc[1]);
+    return finishLong(key, out, len);
+}
+
+#endif
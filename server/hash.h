@@ -0,0 +1,29 @@
+#ifndef HASH_HEADER
+#define HASH_HEADER
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Seeded, binary-safe 64-bit hash. Short inputs take a wyhash-style path
+// that consumes 16 bytes per 128-bit multiply; inputs past HASH_LONG_INPUT
+// bytes accumulate 64-byte stripes xxh3-style, with an AVX2 version picked at
+// startup when the CPU has it. Both versions give identical results.
+#define HASH_LONG_INPUT 256
+
+// Draws the per-process seed and picks the stripe implementation. Call once
+// before anything is hashed; hashes computed earlier use the built-in seed.
+void initHashSeed(void);
+
+// For tests and benchmarks that need reproducible values.
+void setHashSeed(uint64_t seed);
+
+uint64_t hashBytes(const void *key, size_t len);
+
+// The same function under a fixed key, for checksums of data that outlives
+// the process. Valid once initHashSeed or setHashSeed has run.
+uint64_t checksumBytes(const void *data, size_t len);
+
+// "avx2" or "scalar"
+const char *hashImplementation(void);
+
+#endif
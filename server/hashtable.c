@@ -1,39 +1,464 @@
 #include "hashtable.h"
-#include "fnv.c"
-#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-#define TABLE_SIZE 10000
+#define CTRL_EMPTY 0x80
+#define MIN_CAPACITY HASH_GROUP_WIDTH
+// slots visited per operation while a resize is in progress
+#define MIGRATE_BUDGET 128
+// a batch insert buckets home slots by this many top bits
+#define BATCH_RADIX_BITS 16
 
-size_t getIndex(const uint8_t *key)
+static inline size_t homeSlot(uint64_t hcode, size_t mask)
 {
-    uint32_t hash = fnv1a_32(key, strlen(key));
-    return hash % TABLE_SIZE;
+    return (size_t)(hcode >> 7) & mask;
 }
-uint8_t *getFromHahTable(uint8_t *key, HashTable *table)
+
+static inline uint8_t ctrlTag(uint64_t hcode)
+{
+    return (uint8_t)(hcode & 0x7F);
+}
+
+static inline size_t maxLoad(size_t capacity)
+{
+    return capacity - capacity / 8;
+}
+
+// Bit i of the result is set when group[i] == tag.
+static inline uint32_t matchTag(const uint8_t *group, uint8_t tag)
+{
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)tag)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < HASH_GROUP_WIDTH; i++)
+    {
+        mask |= (uint32_t)(group[i] == tag) << i;
+    }
+    return mask;
+#endif
+}
+
+// EMPTY is the only control value with the top bit set.
+static inline uint32_t matchEmpty(const uint8_t *group)
+{
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < HASH_GROUP_WIDTH; i++)
+    {
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    }
+    return mask;
+#endif
+}
+
+static inline void setCtrl(HashArray *array, size_t pos, uint8_t value)
+{
+    array->ctrl[pos] = value;
+    if (pos < HASH_GROUP_WIDTH)
+    {
+        array->ctrl[array->capacity + pos] = value;
+    }
+}
+
+static bool initArray(HashArray *array, size_t capacity)
+{
+    array->ctrl = (uint8_t *)malloc(capacity + HASH_GROUP_WIDTH);
+    array->slots = (HNode **)calloc(capacity, sizeof(HNode *));
+    if (!array->ctrl || !array->slots)
+    {
+        free(array->ctrl);
+        free(array->slots);
+        array->ctrl = NULL;
+        array->slots = NULL;
+        return false;
+    }
+    memset(array->ctrl, CTRL_EMPTY, capacity + HASH_GROUP_WIDTH);
+    array->capacity = capacity;
+    array->size = 0;
+    return true;
+}
+
+static void freeArray(HashArray *array)
+{
+    free(array->ctrl);
+    free(array->slots);
+    array->ctrl = NULL;
+    array->slots = NULL;
+    array->capacity = 0;
+    array->size = 0;
+}
+
+static void arrayInsert(HashArray *array, HNode *node)
+{
+    size_t mask = array->capacity - 1;
+    size_t pos = homeSlot(node->hcode, mask);
+    while (true)
+    {
+        uint32_t empty = matchEmpty(array->ctrl + pos);
+        if (empty)
+        {
+            size_t slot = (pos + (size_t)__builtin_ctz(empty)) & mask;
+            setCtrl(array, slot, ctrlTag(node->hcode));
+            array->slots[slot] = node;
+            array->size++;
+            return;
+        }
+        pos = (pos + HASH_GROUP_WIDTH) & mask;
+    }
+}
+
+// Returns the slot holding the key, or SIZE_MAX.
+static size_t arrayFind(const HashArray *array, const HNode *key, HNodeEq eq)
+{
+    if (!array->slots || array->size == 0)
+    {
+        return SIZE_MAX;
+    }
+
+    size_t mask = array->capacity - 1;
+    size_t pos = homeSlot(key->hcode, mask);
+    uint8_t tag = ctrlTag(key->hcode);
+    while (true)
+    {
+        const uint8_t *group = array->ctrl + pos;
+        uint32_t candidates = matchTag(group, tag);
+        while (candidates)
+        {
+            size_t slot = (pos + (size_t)__builtin_ctz(candidates)) & mask;
+            HNode *node = array->slots[slot];
+            if (node->hcode == key->hcode && eq(node, key))
+            {
+                return slot;
+            }
+            candidates &= candidates - 1;
+        }
+        // a key is always stored before the first empty slot of its cluster
+        if (matchEmpty(group))
+        {
+            return SIZE_MAX;
+        }
+        pos = (pos + HASH_GROUP_WIDTH) & mask;
+    }
+}
+
+static HNode *arrayRemoveAt(HashArray *array, size_t slot)
+{
+    HNode *removed = array->slots[slot];
+    size_t mask = array->capacity - 1;
+    size_t hole = slot;
+    size_t pos = slot;
+
+    // backward-shift deletion: pull later members of the cluster into the
+    // hole whenever that does not move them in front of their home slot
+    while (true)
+    {
+        pos = (pos + 1) & mask;
+        if (array->ctrl[pos] == CTRL_EMPTY)
+        {
+            break;
+        }
+        HNode *node = array->slots[pos];
+        size_t home = homeSlot(node->hcode, mask);
+        if (((pos - home) & mask) >= ((pos - hole) & mask))
+        {
+            setCtrl(array, hole, array->ctrl[pos]);
+            array->slots[hole] = node;
+            hole = pos;
+        }
+    }
+
+    setCtrl(array, hole, CTRL_EMPTY);
+    array->slots[hole] = NULL;
+    array->size--;
+    return removed;
+}
+
+static void migrateStep(HashTable *table, size_t budget)
+{
+    HashArray *older = &table->older;
+    if (!older->slots)
+    {
+        return;
+    }
+
+    size_t mask = older->capacity - 1;
+    while (table->migrate_left > 0 && older->size > 0)
+    {
+        size_t pos = table->migrate_pos;
+        if (older->ctrl[pos] == CTRL_EMPTY)
+        {
+            // only pause between clusters: a half moved cluster would break
+            // probing for the keys left behind in it
+            if (budget == 0)
+            {
+                return;
+            }
+            budget--;
+        }
+        else
+        {
+            HNode *node = older->slots[pos];
+            setCtrl(older, pos, CTRL_EMPTY);
+            older->slots[pos] = NULL;
+            older->size--;
+            arrayInsert(&table->newer, node);
+            if (budget > 0)
+            {
+                budget--;
+            }
+        }
+        table->migrate_pos = (pos + 1) & mask;
+        table->migrate_left--;
+    }
+
+    freeArray(older);
+}
+
+static bool startResize(HashTable *table)
+{
+    // finish any resize still in flight before starting another one
+    migrateStep(table, SIZE_MAX);
+
+    HashArray bigger;
+    if (!initArray(&bigger, table->newer.capacity * 2))
+    {
+        return false;
+    }
+
+    table->older = table->newer;
+    table->newer = bigger;
+    table->migrate_left = table->older.capacity;
+    table->migrate_pos = 0;
+    // begin at an empty slot so migration always starts on a cluster boundary
+    while (table->older.ctrl[table->migrate_pos] != CTRL_EMPTY)
+    {
+        table->migrate_pos++;
+    }
+    return true;
+}
+
+bool initHashTable(HashTable *table, size_t initial_capacity)
+{
+    memset(table, 0, sizeof(*table));
+
+    size_t capacity = MIN_CAPACITY;
+    while (maxLoad(capacity) < initial_capacity)
+    {
+        capacity *= 2;
+    }
+    return initArray(&table->newer, capacity);
+}
+
+void freeHashTable(HashTable *table)
+{
+    freeArray(&table->newer);
+    freeArray(&table->older);
+    table->migrate_pos = 0;
+    table->migrate_left = 0;
+}
+
+HNode *getFromHashTable(HashTable *table, const HNode *key, HNodeEq eq)
+{
+    migrateStep(table, MIGRATE_BUDGET);
+
+    size_t slot = arrayFind(&table->newer, key, eq);
+    if (slot != SIZE_MAX)
+    {
+        return table->newer.slots[slot];
+    }
+    slot = arrayFind(&table->older, key, eq);
+    if (slot != SIZE_MAX)
+    {
+        return table->older.slots[slot];
+    }
+    return NULL;
+}
+
+static bool sameNode(const HNode *lhs, const HNode *rhs)
+{
+    return lhs == rhs;
+}
+
+void replaceInHashTable(HashTable *table, const HNode *old, HNode *node)
+{
+    size_t slot = arrayFind(&table->newer, old, sameNode);
+    if (slot != SIZE_MAX)
+    {
+        table->newer.slots[slot] = node;
+        return;
+    }
+    slot = arrayFind(&table->older, old, sameNode);
+    if (slot != SIZE_MAX)
+    {
+        table->older.slots[slot] = node;
+    }
+}
+
+bool insertIntoHashTable(HashTable *table, HNode *node)
+{
+    migrateStep(table, MIGRATE_BUDGET);
+
+    if (table->newer.size + 1 > maxLoad(table->newer.capacity))
+    {
+        if (!startResize(table))
+        {
+            return false;
+        }
+    }
+
+    arrayInsert(&table->newer, node);
+    return true;
+}
+
+bool insertManyIntoHashTable(HashTable *table, HNode **nodes, size_t n)
 {
-    return table->values[getIndex(key)];
+    HashArray *array = &table->newer;
+    size_t mask = array->capacity - 1;
+    int bits = __builtin_ctzll(array->capacity);
+    int shift = bits > BATCH_RADIX_BITS ? bits - BATCH_RADIX_BITS : 0;
+    size_t buckets = (size_t)1 << (bits - shift);
+
+    // the sort needs a table that will not resize midway
+    size_t *starts = NULL;
+    HNode **sorted = NULL;
+    if (!table->older.slots && array->size + n <= maxLoad(array->capacity))
+    {
+        starts = (size_t *)calloc(buckets + 1, sizeof(size_t));
+        sorted = (HNode **)malloc(sizeof(HNode *) * (n ? n : 1));
+    }
+    if (!starts || !sorted)
+    {
+        free(starts);
+        free(sorted);
+        for (size_t i = 0; i < n; i++)
+        {
+            if (!insertIntoHashTable(table, nodes[i]))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // counting sort by the top bits of the home slot
+    for (size_t i = 0; i < n; i++)
+    {
+        starts[(homeSlot(nodes[i]->hcode, mask) >> shift) + 1]++;
+    }
+    for (size_t b = 1; b <= buckets; b++)
+    {
+        starts[b] += starts[b - 1];
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        sorted[starts[homeSlot(nodes[i]->hcode, mask) >> shift]++] = nodes[i];
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+        arrayInsert(array, sorted[i]);
+    }
+    free(starts);
+    free(sorted);
+    return true;
 }
-int insertIntoHashTable(Node *node, HashTable *table)
+
+HNode *deleteFromHashTable(HashTable *table, const HNode *key, HNodeEq eq)
 {
-    size_t index = getIndex(node->key);
-    table->values[index] = node->value;
+    migrateStep(table, MIGRATE_BUDGET);
 
-    return 0;
+    size_t slot = arrayFind(&table->newer, key, eq);
+    if (slot != SIZE_MAX)
+    {
+        return arrayRemoveAt(&table->newer, slot);
+    }
+    slot = arrayFind(&table->older, key, eq);
+    if (slot != SIZE_MAX)
+    {
+        return arrayRemoveAt(&table->older, slot);
+    }
+    return NULL;
 }
-int deleteFromHashTable(uint8_t *key, HashTable *table)
+
+size_t hashTableSize(const HashTable *table)
+{
+    return table->newer.size + table->older.size;
+}
+
+static size_t arrayMemory(const HashArray *array)
 {
-    size_t index = getIndex(key);
-    table->values[0] = NULL;
+    if (!array->slots)
+    {
+        return 0;
+    }
+    return array->capacity * (1 + sizeof(HNode *)) + HASH_GROUP_WIDTH;
+}
 
-    return 0;
+size_t hashTableMemory(const HashTable *table)
+{
+    return arrayMemory(&table->newer) + arrayMemory(&table->older);
 }
 
-bool init_hash_table(HashTable *hashTable)
+HNode *hashTableSample(const HashTable *table, uint64_t random)
 {
-    Node node;
-    node.value = (uint8_t *)malloc(MAX_MSG_SIZE * sizeof(uint8_t));
-    hashTable->size = TABLE_SIZE;
-    hashTable->values = (Node *)malloc(TABLE_SIZE * sizeof(node));
+    size_t total = hashTableSize(table);
+    if (total == 0)
+    {
+        return NULL;
+    }
+    const HashArray *array = (random >> 32) % total < table->older.size ? &table->older : &table->newer;
+
+    // walk whole groups from a random slot to the first occupied one
+    size_t mask = array->capacity - 1;
+    size_t pos = (size_t)random & mask;
+    for (size_t scanned = 0; scanned < array->capacity + HASH_GROUP_WIDTH; scanned += HASH_GROUP_WIDTH)
+    {
+        uint32_t used = ~matchEmpty(array->ctrl + pos) & ((1U << HASH_GROUP_WIDTH) - 1);
+        if (used)
+        {
+            return array->slots[(pos + (size_t)__builtin_ctz(used)) & mask];
+        }
+        pos = (pos + HASH_GROUP_WIDTH) & mask;
+    }
+    return NULL;
+}
 
+static bool forEachInArray(HashArray *array, bool (*fn)(HNode *, void *), void *arg)
+{
+    for (size_t i = 0; i < array->capacity; i++)
+    {
+        if (array->ctrl[i] != CTRL_EMPTY && !fn(array->slots[i], arg))
+        {
+            return false;
+        }
+    }
     return true;
 }
+
+void hashTableForEach(HashTable *table, bool (*fn)(HNode *node, void *arg), void *arg)
+{
+    if (forEachInArray(&table->newer, fn, arg))
+    {
+        forEachInArray(&table->older, fn, arg);
+    }
+}
+
+HNode *hashTableNext(const HashTable *table, size_t *cursor)
+{
+    for (; *cursor < table->newer.capacity + table->older.capacity; ++*cursor)
+    {
+        const HashArray *array = *cursor < table->newer.capacity ? &table->newer : &table->older;
+        size_t i = *cursor < table->newer.capacity ? *cursor : *cursor - table->newer.capacity;
+        if (array->ctrl[i] != CTRL_EMPTY)
+        {
+            ++*cursor;
+            return array->slots[i];
+        }
+    }
+    return NULL;
+}
@@ -1,28 +1,81 @@
 #ifndef HASH_TABLE
 #define HASH_TABLE
 
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
 
-#define MAX_MSG_SIZE 2048
+#define HASH_GROUP_WIDTH 16
 
+// Intrusive hook: embed it in the stored struct and fill hcode before any
+// table call. The table never touches anything past the hook except through
+// the caller supplied comparison function.
 typedef struct
 {
-    uint8_t *key;
-    uint8_t *value;
-} Node;
+    uint64_t hcode;
+} HNode;
 
+typedef bool (*HNodeEq)(const HNode *lhs, const HNode *rhs);
+
+// One open-addressing array. ctrl holds one metadata byte per slot (7 bits
+// of the hash, or the EMPTY marker) followed by HASH_GROUP_WIDTH bytes that
+// mirror the first group, so a 16-byte probe never has to wrap.
 typedef struct
 {
+    uint8_t *ctrl;
+    HNode **slots;
+    size_t capacity;
     size_t size;
-    uint8_t *values;
+} HashArray;
+
+// Growth is incremental: a resize allocates `newer` and moves whole probe
+// clusters out of `older` a few at a time on every subsequent operation.
+typedef struct
+{
+    HashArray newer;
+    HashArray older;
+    size_t migrate_pos;
+    size_t migrate_left;
 } HashTable;
 
-Node getFromHahTable(Node* node);
-int insertIntoHashTable(Node* node);
-int deleteFromHashTable(Node* node);
-int editFromHashTable(Node* node);
-int hash(uint8_t key);
-bool init_hash_table(Node *nodes, size_t size);
+bool initHashTable(HashTable *table, size_t initial_capacity);
+
+void freeHashTable(HashTable *table);
+
+HNode *getFromHashTable(HashTable *table, const HNode *key, HNodeEq eq);
+
+// The caller must make sure the key is not already present.
+bool insertIntoHashTable(HashTable *table, HNode *node);
+
+// Puts node into the slot that holds old, which must be in the table under
+// the same hcode. Nothing is allocated, so this cannot fail.
+void replaceInHashTable(HashTable *table, const HNode *old, HNode *node);
+
+// Bulk version for nodes that are all absent. When they fit without a resize
+// they go in sorted by home slot, so the arrays are written front to back
+// instead of missing the cache on every node.
+bool insertManyIntoHashTable(HashTable *table, HNode **nodes, size_t n);
+
+// Unlinks and returns the matching node, or NULL. Deletion shifts the rest of
+// the probe cluster back instead of leaving a tombstone.
+HNode *deleteFromHashTable(HashTable *table, const HNode *key, HNodeEq eq);
+
+size_t hashTableSize(const HashTable *table);
+
+// Bytes held by the control and slot arrays, both halves of a resize included.
+size_t hashTableMemory(const HashTable *table);
+
+// Some node chosen by `random`, or NULL for an empty table. Nodes behind long
+// runs of empty slots come up more often; good enough for eviction sampling.
+HNode *hashTableSample(const HashTable *table, uint64_t random);
+
+// Visits every node; stops early when fn returns false.
+void hashTableForEach(HashTable *table, bool (*fn)(HNode *node, void *arg), void *arg);
+
+// Steps a cursor that starts at 0 to the next node, NULL past the last one.
+// The cursor stays usable across other calls on the table, but nodes they
+// move meanwhile may be skipped or come up twice: inserts, deletes and the
+// resize steps lookups take all move nodes.
+HNode *hashTableNext(const HashTable *table, size_t *cursor);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,365 @@
+#include "hmap.h"
+#include "hash.h"
+#include "hashtable.h"
+#include <string.h>
+#include <malloc.h>
+
+// packed record: u8 field length, u8 value length, field, value
+#define PACKED_HEADER 2
+
+typedef struct
+{
+    // hash of the field
+    HNode node;
+    uint32_t field_len;
+    uint32_t value_len;
+    // the field, then the value
+    uint8_t data[];
+} HEntry;
+
+struct HMap
+{
+    size_t size;
+    // usable bytes of the records and entries
+    size_t memory;
+    uint8_t *packed;
+    size_t packed_len;
+    // allocated on conversion, so a small map does not carry an empty table
+    HashTable *fields;
+};
+
+// A field that is not in an entry, for lookups.
+typedef struct
+{
+    HNode node;
+    const uint8_t *field;
+    size_t len;
+} Probe;
+
+static void *allocate(HMap *hmap, size_t size)
+{
+    void *p = malloc(size);
+    if (p)
+    {
+        hmap->memory += malloc_usable_size(p);
+    }
+    return p;
+}
+
+static void release(HMap *hmap, void *p)
+{
+    if (p)
+    {
+        hmap->memory -= malloc_usable_size(p);
+        free(p);
+    }
+}
+
+static bool entryEq(const HNode *lhs, const HNode *rhs)
+{
+    const HEntry *entry = (const HEntry *)lhs;
+    const Probe *probe = (const Probe *)rhs;
+    return entry->field_len == probe->len && memcmp(entry->data, probe->field, probe->len) == 0;
+}
+
+HMap *newHMap(void)
+{
+    return (HMap *)calloc(1, sizeof(HMap));
+}
+
+static bool releaseEntry(HNode *node, void *arg)
+{
+    release((HMap *)arg, node);
+    return true;
+}
+
+static void freeTable(HMap *hmap)
+{
+    hashTableForEach(hmap->fields, releaseEntry, hmap);
+    freeHashTable(hmap->fields);
+    release(hmap, hmap->fields);
+    hmap->fields = NULL;
+}
+
+void freeHMap(HMap *hmap)
+{
+    if (hmap->fields)
+    {
+        freeTable(hmap);
+    }
+    free(hmap->packed);
+    free(hmap);
+}
+
+size_t hmapSize(const HMap *hmap)
+{
+    return hmap->size;
+}
+
+size_t hmapMemory(const HMap *hmap)
+{
+    size_t bytes = malloc_usable_size((void *)hmap) + hmap->memory;
+    return hmap->fields ? bytes + hashTableMemory(hmap->fields) : bytes;
+}
+
+bool hmapPacked(const HMap *hmap)
+{
+    return !hmap->fields;
+}
+
+// --- packed encoding ---
+
+static size_t recordSize(const uint8_t *record)
+{
+    return PACKED_HEADER + record[0] + record[1];
+}
+
+static size_t packedFind(const HMap *hmap, const uint8_t *field, size_t len)
+{
+    for (size_t at = 0; at < hmap->packed_len; at += recordSize(hmap->packed + at))
+    {
+        const uint8_t *record = hmap->packed + at;
+        if (record[0] == len && memcmp(record + PACKED_HEADER, field, len) == 0)
+        {
+            return at;
+        }
+    }
+    return SIZE_MAX;
+}
+
+// Growing can fail; a shrink that fails keeps the larger block.
+static bool packedResize(HMap *hmap, size_t len)
+{
+    size_t before = hmap->packed ? malloc_usable_size(hmap->packed) : 0;
+    uint8_t *resized = (uint8_t *)realloc(hmap->packed, len ? len : 1);
+    if (!resized)
+    {
+        return len <= before;
+    }
+    hmap->packed = resized;
+    hmap->memory += malloc_usable_size(resized) - before;
+    return true;
+}
+
+static void packedAppend(HMap *hmap, const uint8_t *field, size_t field_len, const uint8_t *value, size_t value_len)
+{
+    uint8_t *record = hmap->packed + hmap->packed_len;
+    record[0] = (uint8_t)field_len;
+    record[1] = (uint8_t)value_len;
+    memcpy(record + PACKED_HEADER, field, field_len);
+    memcpy(record + PACKED_HEADER + field_len, value, value_len);
+    hmap->packed_len += PACKED_HEADER + field_len + value_len;
+}
+
+static void packedCut(HMap *hmap, size_t at)
+{
+    size_t size = recordSize(hmap->packed + at);
+    memmove(hmap->packed + at, hmap->packed + at + size, hmap->packed_len - at - size);
+    hmap->packed_len -= size;
+}
+
+// --- table encoding ---
+
+static HEntry *newEntry(HMap *hmap, uint64_t hcode, const uint8_t *field, size_t field_len, const uint8_t *value,
+                        size_t value_len)
+{
+    HEntry *entry = (HEntry *)allocate(hmap, sizeof(HEntry) + field_len + value_len);
+    if (entry)
+    {
+        entry->node.hcode = hcode;
+        entry->field_len = (uint32_t)field_len;
+        entry->value_len = (uint32_t)value_len;
+        memcpy(entry->data, field, field_len);
+        memcpy(entry->data + field_len, value, value_len);
+    }
+    return entry;
+}
+
+static HEntry *findEntry(const HMap *hmap, const uint8_t *field, size_t len)
+{
+    Probe probe = {{hashBytes(field, len)}, field, len};
+    // lookups also advance an incremental resize
+    return (HEntry *)getFromHashTable(hmap->fields, &probe.node, entryEq);
+}
+
+static bool tableSet(HMap *hmap, const uint8_t *field, size_t field_len, const uint8_t *value, size_t value_len,
+                     bool *added)
+{
+    uint64_t hcode = hashBytes(field, field_len);
+    Probe probe = {{hcode}, field, field_len};
+    HEntry *old = (HEntry *)getFromHashTable(hmap->fields, &probe.node, entryEq);
+    HEntry *entry = newEntry(hmap, hcode, field, field_len, value, value_len);
+    if (!entry)
+    {
+        return false;
+    }
+    if (!old && !insertIntoHashTable(hmap->fields, &entry->node))
+    {
+        release(hmap, entry);
+        return false;
+    }
+    if (old)
+    {
+        replaceInHashTable(hmap->fields, &old->node, &entry->node);
+        release(hmap, old);
+    }
+    else
+    {
+        hmap->size++;
+    }
+    *added = !old;
+    return true;
+}
+
+// Moves the packed records into a table; on failure the map stays packed.
+static bool convertToTable(HMap *hmap)
+{
+    hmap->fields = (HashTable *)allocate(hmap, sizeof(HashTable));
+    if (!hmap->fields || !initHashTable(hmap->fields, hmap->size + 1))
+    {
+        release(hmap, hmap->fields);
+        hmap->fields = NULL;
+        return false;
+    }
+    size_t size = hmap->size;
+    hmap->size = 0;
+    bool ok = true;
+    for (size_t at = 0; ok && at < hmap->packed_len; at += recordSize(hmap->packed + at))
+    {
+        const uint8_t *record = hmap->packed + at;
+        bool added;
+        ok = tableSet(hmap, record + PACKED_HEADER, record[0], record + PACKED_HEADER + record[0], record[1], &added);
+    }
+    if (!ok)
+    {
+        freeTable(hmap);
+        hmap->size = size;
+        return false;
+    }
+    release(hmap, hmap->packed);
+    hmap->packed = NULL;
+    hmap->packed_len = 0;
+    return true;
+}
+
+bool hmapSet(HMap *hmap, const uint8_t *field, size_t field_len, const uint8_t *value, size_t value_len, bool *added)
+{
+    if (hmap->fields)
+    {
+        return tableSet(hmap, field, field_len, value, value_len, added);
+    }
+
+    size_t at = packedFind(hmap, field, field_len);
+    bool fits = field_len <= HMAP_PACKED_MAX_VALUE && value_len <= HMAP_PACKED_MAX_VALUE &&
+                (at != SIZE_MAX || hmap->size + 1 <= HMAP_PACKED_MAX_ENTRIES);
+    if (!fits)
+    {
+        if (!convertToTable(hmap))
+        {
+            return false;
+        }
+        return tableSet(hmap, field, field_len, value, value_len, added);
+    }
+
+    size_t old_size = at != SIZE_MAX ? recordSize(hmap->packed + at) : 0;
+    size_t new_size = PACKED_HEADER + field_len + value_len;
+    // grow first so a failure changes nothing
+    if (new_size > old_size && !packedResize(hmap, hmap->packed_len - old_size + new_size))
+    {
+        return false;
+    }
+    if (at != SIZE_MAX)
+    {
+        packedCut(hmap, at);
+    }
+    packedAppend(hmap, field, field_len, value, value_len);
+    if (new_size < old_size)
+    {
+        packedResize(hmap, hmap->packed_len);
+    }
+    hmap->size += at == SIZE_MAX;
+    *added = at == SIZE_MAX;
+    return true;
+}
+
+bool hmapGet(const HMap *hmap, const uint8_t *field, size_t field_len, const uint8_t **value, uint32_t *value_len)
+{
+    if (hmap->fields)
+    {
+        HEntry *entry = findEntry(hmap, field, field_len);
+        if (entry)
+        {
+            *value = entry->data + entry->field_len;
+            *value_len = entry->value_len;
+        }
+        return entry != NULL;
+    }
+    size_t at = packedFind(hmap, field, field_len);
+    if (at != SIZE_MAX)
+    {
+        const uint8_t *record = hmap->packed + at;
+        *value = record + PACKED_HEADER + record[0];
+        *value_len = record[1];
+    }
+    return at != SIZE_MAX;
+}
+
+bool hmapDelete(HMap *hmap, const uint8_t *field, size_t field_len)
+{
+    if (!hmap->fields)
+    {
+        size_t at = packedFind(hmap, field, field_len);
+        if (at == SIZE_MAX)
+        {
+            return false;
+        }
+        packedCut(hmap, at);
+        packedResize(hmap, hmap->packed_len);
+        hmap->size--;
+        return true;
+    }
+    Probe probe = {{hashBytes(field, field_len)}, field, field_len};
+    HNode *node = deleteFromHashTable(hmap->fields, &probe.node, entryEq);
+    if (!node)
+    {
+        return false;
+    }
+    release(hmap, node);
+    hmap->size--;
+    return true;
+}
+
+void hmapIterate(const HMap *hmap, HMapIter *iter)
+{
+    iter->hmap = hmap;
+    iter->offset = 0;
+}
+
+bool hmapNext(HMapIter *iter, const uint8_t **field, uint32_t *field_len, const uint8_t **value, uint32_t *value_len)
+{
+    const HMap *hmap = iter->hmap;
+    if (hmap->fields)
+    {
+        const HEntry *entry = (const HEntry *)hashTableNext(hmap->fields, &iter->offset);
+        if (!entry)
+        {
+            return false;
+        }
+        *field = entry->data;
+        *field_len = entry->field_len;
+        *value = entry->data + entry->field_len;
+        *value_len = entry->value_len;
+        return true;
+    }
+    if (iter->offset >= hmap->packed_len)
+    {
+        return false;
+    }
+    const uint8_t *record = hmap->packed + iter->offset;
+    *field = record + PACKED_HEADER;
+    *field_len = record[0];
+    *value = record + PACKED_HEADER + record[0];
+    *value_len = record[1];
+    iter->offset += recordSize(record);
+    return true;
+}
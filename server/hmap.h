@@ -0,0 +1,52 @@
+#ifndef HMAP_HEADER
+#define HMAP_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Field-value map behind the hash type. A small map is one packed array of
+// (u8 field length, u8 value length, field, value) records searched
+// linearly. Past HMAP_PACKED_MAX_ENTRIES fields, or with a field or value
+// longer than HMAP_PACKED_MAX_VALUE, it turns for good into a hash table of
+// entries that each hold a field and its value in one allocation.
+#define HMAP_PACKED_MAX_ENTRIES 128
+#define HMAP_PACKED_MAX_VALUE 64
+
+typedef struct HMap HMap;
+
+HMap *newHMap(void);
+
+void freeHMap(HMap *hmap);
+
+size_t hmapSize(const HMap *hmap);
+
+// Usable size of every allocation the map holds, itself included.
+size_t hmapMemory(const HMap *hmap);
+
+bool hmapPacked(const HMap *hmap);
+
+// Adds the field or replaces its value; *added tells which. Returns false
+// when out of memory, with the map as it was.
+bool hmapSet(HMap *hmap, const uint8_t *field, size_t field_len, const uint8_t *value, size_t value_len,
+             bool *added);
+
+// The value stays valid until the map changes.
+bool hmapGet(const HMap *hmap, const uint8_t *field, size_t field_len, const uint8_t **value, uint32_t *value_len);
+
+bool hmapDelete(HMap *hmap, const uint8_t *field, size_t field_len);
+
+// Walks the fields in no particular order. Any other call on the map
+// invalidates it.
+typedef struct
+{
+    const HMap *hmap;
+    // packed: byte offset of the next record; table: slot cursor
+    size_t offset;
+} HMapIter;
+
+void hmapIterate(const HMap *hmap, HMapIter *iter);
+
+bool hmapNext(HMapIter *iter, const uint8_t **field, uint32_t *field_len, const uint8_t **value, uint32_t *value_len);
+
+#endif
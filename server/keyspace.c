@@ -0,0 +1,909 @@
+#include "keyspace.h"
+#include "hash.h"
+#include "zset.h"
+#include "hmap.h"
+#include "qlist.h"
+#include "cluster.h"
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+
+// What lookups hash and compare against: a key that is not in a node.
+typedef struct
+{
+    HNode node;
+    const uint8_t *key;
+    uint32_t key_len;
+} Probe;
+
+static bool probeEq(const HNode *lhs, const HNode *rhs)
+{
+    const Node *node = (const Node *)lhs;
+    const Probe *probe = (const Probe *)rhs;
+    return node->key_len == probe->key_len && memcmp(nodeKey(node), probe->key, probe->key_len) == 0;
+}
+
+// For unlinking a node the caller already holds.
+static bool sameNode(const HNode *lhs, const HNode *rhs)
+{
+    return lhs == rhs;
+}
+
+uint64_t keyspaceHash(const uint8_t *key, size_t key_len)
+{
+    return hashBytes(key, key_len);
+}
+
+static void initProbe(Probe *probe, const uint8_t *key, size_t key_len)
+{
+    probe->node.hcode = keyspaceHash(key, key_len);
+    probe->key = key;
+    probe->key_len = (uint32_t)key_len;
+}
+
+uint64_t keyspaceClock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Canonical only, so the integer formats back to exactly these bytes.
+static bool parseCanonicalInt(const uint8_t *data, size_t len, int64_t *out)
+{
+    if (len == 0 || len > KEYSPACE_INT_CHARS)
+    {
+        return false;
+    }
+    bool negative = data[0] == '-';
+    size_t i = negative ? 1 : 0;
+    // no bare sign, no leading zeros and no "-0"
+    if (i == len || (data[i] == '0' && len > 1))
+    {
+        return false;
+    }
+    uint64_t limit = negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX;
+    uint64_t value = 0;
+    for (; i < len; i++)
+    {
+        if (data[i] < '0' || data[i] > '9')
+        {
+            return false;
+        }
+        uint64_t digit = (uint64_t)(data[i] - '0');
+        if (value > (limit - digit) / 10)
+        {
+            return false;
+        }
+        value = value * 10 + digit;
+    }
+    *out = negative ? (int64_t)(0 - value) : (int64_t)value;
+    return true;
+}
+
+static uint32_t formatInt(int64_t value, uint8_t *buf)
+{
+    uint8_t digits[KEYSPACE_INT_CHARS];
+    uint64_t left = value < 0 ? 0 - (uint64_t)value : (uint64_t)value;
+    uint32_t count = 0;
+    do
+    {
+        digits[count++] = (uint8_t)('0' + left % 10);
+        left /= 10;
+    } while (left);
+
+    uint32_t len = 0;
+    if (value < 0)
+    {
+        buf[len++] = '-';
+    }
+    while (count)
+    {
+        buf[len++] = digits[--count];
+    }
+    return len;
+}
+
+static const uint8_t *nodeValue(const Node *node)
+{
+    return nodeKey(node) + node->key_len;
+}
+
+// Embedded lengths are varints, 7 bits a byte, low bits first, so a short
+// string pays one byte for its length.
+static size_t varintSize(uint32_t value)
+{
+    size_t size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static uint8_t *putVarint(uint8_t *p, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        *p++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+    return p;
+}
+
+static const uint8_t *getVarint(const uint8_t *p, uint32_t *value)
+{
+    uint32_t result = 0;
+    for (int shift = 0;; shift += 7)
+    {
+        result |= (uint32_t)(*p & 0x7F) << shift;
+        if (!(*p++ & 0x80))
+        {
+            break;
+        }
+    }
+    *value = result;
+    return p;
+}
+
+// Bytes the value takes up in the node.
+static size_t valueSize(const Node *node)
+{
+    if (node->type != VALUE_STRING)
+    {
+        return sizeof(void *);
+    }
+    switch (node->encoding)
+    {
+    case ENCODING_INT:
+        return sizeof(int64_t);
+    case ENCODING_EMBSTR:
+    {
+        const uint8_t *value = nodeValue(node);
+        uint32_t len;
+        return (size_t)(getVarint(value, &len) - value) + len;
+    }
+    default:
+        return sizeof(Blob *);
+    }
+}
+
+const uint8_t *nodeString(const Node *node, uint8_t *buf, uint32_t *len)
+{
+    const uint8_t *value = nodeValue(node);
+    switch (node->encoding)
+    {
+    case ENCODING_INT:
+    {
+        int64_t integer;
+        memcpy(&integer, value, sizeof(integer));
+        *len = formatInt(integer, buf);
+        return buf;
+    }
+    case ENCODING_EMBSTR:
+        return getVarint(value, len);
+    default:
+    {
+        Blob *blob = nodeBlob(node);
+        *len = blob->len;
+        return blob->data;
+    }
+    }
+}
+
+Blob *nodeBlob(const Node *node)
+{
+    Blob *blob = NULL;
+    if (node->type == VALUE_STRING && node->encoding == ENCODING_RAW)
+    {
+        memcpy(&blob, nodeValue(node), sizeof(blob));
+    }
+    return blob;
+}
+
+void *nodeObject(const Node *node)
+{
+    void *object = NULL;
+    if (node->type != VALUE_STRING)
+    {
+        memcpy(&object, nodeValue(node), sizeof(object));
+    }
+    return object;
+}
+
+static void freeObject(ValueType type, void *object)
+{
+    switch (type)
+    {
+    case VALUE_ZSET:
+        freeZSet((ZSet *)object);
+        break;
+    case VALUE_HASH:
+        freeHMap((HMap *)object);
+        break;
+    case VALUE_LIST:
+        freeQList((QList *)object);
+        break;
+    default:
+        break;
+    }
+}
+
+static size_t objectMemory(ValueType type, const void *object)
+{
+    switch (type)
+    {
+    case VALUE_ZSET:
+        return zsetMemory((const ZSet *)object);
+    case VALUE_HASH:
+        return hmapMemory((const HMap *)object);
+    case VALUE_LIST:
+        return qlistMemory((const QList *)object);
+    default:
+        return 0;
+    }
+}
+
+static void storeExpiry(Node *node, Expiry *expiry)
+{
+    memcpy(node->data, &expiry, sizeof(expiry));
+}
+
+// The caller has unlinked the timer, if any.
+static void freeNode(Node *node)
+{
+    free(nodeExpiry(node));
+    Blob *blob = nodeBlob(node);
+    if (blob)
+    {
+        releaseBlob(blob);
+    }
+    if (node->type != VALUE_STRING)
+    {
+        freeObject((ValueType)node->type, nodeObject(node));
+    }
+    free(node);
+}
+
+// What the allocator handed out for the entry, the node itself included.
+static size_t nodeMemory(const Node *node)
+{
+    size_t bytes = malloc_usable_size((void *)node);
+    Blob *blob = nodeBlob(node);
+    if (blob)
+    {
+        bytes += malloc_usable_size(blob);
+    }
+    if (node->type != VALUE_STRING)
+    {
+        bytes += objectMemory((ValueType)node->type, nodeObject(node));
+    }
+    Expiry *expiry = nodeExpiry(node);
+    if (expiry)
+    {
+        bytes += malloc_usable_size(expiry);
+    }
+    return bytes;
+}
+
+static void countKey(Keyspace *keyspace, const Node *node, int delta)
+{
+    if (keyspace->slot_keys)
+    {
+        keyspace->slot_keys[clusterKeySlot(nodeKey(node), node->key_len)] += (uint32_t)delta;
+    }
+}
+
+static bool freeNodeCallback(HNode *hnode, void *arg)
+{
+    (void)arg;
+    freeNode((Node *)hnode);
+    return true;
+}
+
+bool initKeyspace(Keyspace *keyspace, size_t initial_capacity)
+{
+    initTimerWheel(&keyspace->expiries, keyspaceClock());
+    keyspace->expired = 0;
+    keyspace->used_memory = 0;
+    keyspace->maxmemory = 0;
+    keyspace->policy = EVICT_NOEVICTION;
+    keyspace->pool.size = 0;
+    keyspace->evicted = 0;
+    keyspace->clock_ms = keyspaceClock();
+    // any non-zero seed; sampling only needs to be spread out
+    keyspace->rng = hashBytes((const uint8_t *)&keyspace, sizeof(keyspace)) | 1;
+    keyspace->slot_keys = NULL;
+    return initHashTable(&keyspace->table, initial_capacity);
+}
+
+void freeKeyspace(Keyspace *keyspace)
+{
+    hashTableForEach(&keyspace->table, freeNodeCallback, NULL);
+    freeHashTable(&keyspace->table);
+    freeEvictionPool(&keyspace->pool);
+    free(keyspace->slot_keys);
+}
+
+static bool countExisting(HNode *hnode, void *arg)
+{
+    countKey((Keyspace *)arg, (const Node *)hnode, 1);
+    return true;
+}
+
+bool keyspaceCountSlots(Keyspace *keyspace)
+{
+    if (keyspace->slot_keys)
+    {
+        return true;
+    }
+    keyspace->slot_keys = (uint32_t *)calloc(CLUSTER_SLOTS, sizeof(uint32_t));
+    if (!keyspace->slot_keys)
+    {
+        return false;
+    }
+    hashTableForEach(&keyspace->table, countExisting, keyspace);
+    return true;
+}
+
+bool keyspaceFlush(Keyspace *keyspace, size_t initial_capacity)
+{
+    size_t maxmemory = keyspace->maxmemory;
+    EvictionPolicy policy = keyspace->policy;
+    uint64_t expired = keyspace->expired;
+    uint64_t evicted = keyspace->evicted;
+    bool counting = keyspace->slot_keys != NULL;
+    freeKeyspace(keyspace);
+    bool ok = initKeyspace(keyspace, initial_capacity) && (!counting || keyspaceCountSlots(keyspace));
+    keyspace->maxmemory = maxmemory;
+    keyspace->policy = policy;
+    keyspace->expired = expired;
+    keyspace->evicted = evicted;
+    return ok;
+}
+
+static void clearExpiry(Keyspace *keyspace, Node *node)
+{
+    Expiry *expiry = nodeExpiry(node);
+    if (expiry)
+    {
+        timerWheelRemove(&keyspace->expiries, &expiry->link);
+        free(expiry);
+        storeExpiry(node, NULL);
+    }
+}
+
+// The node must have room for the timer.
+static bool setExpiry(Keyspace *keyspace, Node *node, uint64_t expires_at)
+{
+    if (expires_at == KEYSPACE_NO_EXPIRY)
+    {
+        clearExpiry(keyspace, node);
+        return true;
+    }
+    Expiry *expiry = nodeExpiry(node);
+    if (expiry)
+    {
+        timerWheelRemove(&keyspace->expiries, &expiry->link);
+    }
+    else
+    {
+        expiry = (Expiry *)malloc(sizeof(Expiry));
+        if (!expiry)
+        {
+            return false;
+        }
+        expiry->node = node;
+        storeExpiry(node, expiry);
+    }
+    timerWheelAdd(&keyspace->expiries, &expiry->link, expires_at);
+    return true;
+}
+
+// A detached node for a key that is not in the table yet, with the key
+// copied in and value_size bytes left for the value. NULL when out of
+// memory or the key is too long.
+static Node *allocNode(uint64_t hcode, const uint8_t *key, size_t key_len, size_t value_size, bool expiring)
+{
+    if (key_len > KEYSPACE_MAX_KEY_LEN)
+    {
+        return NULL;
+    }
+    size_t prefix = expiring ? sizeof(Expiry *) : 0;
+    Node *node = (Node *)malloc(sizeof(Node) + prefix + key_len + value_size);
+    if (!node)
+    {
+        return NULL;
+    }
+    node->node.hcode = hcode;
+    node->key_len = (uint32_t)key_len;
+    node->type = VALUE_STRING;
+    node->encoding = 0;
+    node->expiring = expiring;
+    node->access = 0;
+    if (expiring)
+    {
+        storeExpiry(node, NULL);
+    }
+    memcpy(node->data + prefix, key, key_len);
+    return node;
+}
+
+// A string node, with room for a timer when expiring.
+static Node *newNode(uint64_t hcode, const uint8_t *key, size_t key_len, const uint8_t *value, size_t value_len,
+                     bool expiring)
+{
+    int64_t integer;
+    ValueEncoding encoding;
+    size_t value_size;
+    if (parseCanonicalInt(value, value_len, &integer))
+    {
+        encoding = ENCODING_INT;
+        value_size = sizeof(integer);
+    }
+    else if (value_len < KEYSPACE_EMBED_LIMIT)
+    {
+        encoding = ENCODING_EMBSTR;
+        value_size = varintSize((uint32_t)value_len) + value_len;
+    }
+    else
+    {
+        encoding = ENCODING_RAW;
+        value_size = sizeof(Blob *);
+    }
+
+    Node *node = allocNode(hcode, key, key_len, value_size, expiring);
+    if (!node)
+    {
+        return NULL;
+    }
+    node->encoding = encoding;
+    uint8_t *p = (uint8_t *)nodeValue(node);
+    switch (encoding)
+    {
+    case ENCODING_INT:
+        memcpy(p, &integer, sizeof(integer));
+        break;
+    case ENCODING_EMBSTR:
+        memcpy(putVarint(p, (uint32_t)value_len), value, value_len);
+        break;
+    case ENCODING_RAW:
+    {
+        Blob *blob = newBlob(value, value_len);
+        if (!blob)
+        {
+            free(node);
+            return NULL;
+        }
+        memcpy(p, &blob, sizeof(blob));
+        break;
+    }
+    }
+    return node;
+}
+
+// A node holding a container; frees the container when out of memory.
+static Node *newObjectNode(uint64_t hcode, const uint8_t *key, size_t key_len, ValueType type, void *object,
+                           bool expiring)
+{
+    Node *node = allocNode(hcode, key, key_len, sizeof(object), expiring);
+    if (!node)
+    {
+        freeObject(type, object);
+        return NULL;
+    }
+    node->type = type;
+    memcpy((uint8_t *)nodeValue(node), &object, sizeof(object));
+    return node;
+}
+
+// Swaps a copy of the node, with or without room for a timer, into the
+// table; a timer it has moves along. A node losing its room must have no
+// timer. NULL when out of memory, with the node left as it was.
+static Node *reshapeNode(Keyspace *keyspace, Node *node, bool expiring)
+{
+    size_t old_prefix = node->expiring ? sizeof(Expiry *) : 0;
+    size_t new_prefix = expiring ? sizeof(Expiry *) : 0;
+    size_t body = node->key_len + valueSize(node);
+    Node *moved = (Node *)malloc(sizeof(Node) + new_prefix + body);
+    if (!moved)
+    {
+        return NULL;
+    }
+    Expiry *expiry = nodeExpiry(node);
+    *moved = *node;
+    moved->expiring = expiring;
+    memcpy(moved->data + new_prefix, node->data + old_prefix, body);
+    if (expiring)
+    {
+        storeExpiry(moved, expiry);
+        if (expiry)
+        {
+            expiry->node = moved;
+        }
+    }
+    replaceInHashTable(&keyspace->table, &node->node, &moved->node);
+    // the blob, if any, now belongs to the copy
+    free(node);
+    return moved;
+}
+
+static void removeNode(Keyspace *keyspace, Node *node)
+{
+    countKey(keyspace, node, -1);
+    keyspace->used_memory -= nodeMemory(node);
+    clearExpiry(keyspace, node);
+    deleteFromHashTable(&keyspace->table, &node->node, sameNode);
+    freeNode(node);
+}
+
+// The live node for key: one whose deadline passed is deleted on the spot.
+static Node *lookupNode(Keyspace *keyspace, const Probe *probe)
+{
+    Node *node = (Node *)getFromHashTable(&keyspace->table, &probe->node, probeEq);
+    if (node && nodeDeadline(node) != KEYSPACE_NO_EXPIRY && nodeDeadline(node) <= keyspaceClock())
+    {
+        removeNode(keyspace, node);
+        keyspace->expired++;
+        return NULL;
+    }
+    return node;
+}
+
+static void touchNode(Keyspace *keyspace, Node *node)
+{
+    if (keyspace->policy == EVICT_ALLKEYS_LRU || keyspace->policy == EVICT_ALLKEYS_LFU)
+    {
+        node->access = accessTouch(keyspace->policy, node->access, keyspace->clock_ms, &keyspace->rng);
+    }
+}
+
+Node *keyspaceGet(Keyspace *keyspace, const uint8_t *key, size_t key_len)
+{
+    Probe probe;
+    initProbe(&probe, key, key_len);
+    Node *node = lookupNode(keyspace, &probe);
+    if (node)
+    {
+        touchNode(keyspace, node);
+    }
+    return node;
+}
+
+bool keyspaceSet(Keyspace *keyspace, const uint8_t *key, size_t key_len,
+                 const uint8_t *value, size_t value_len, uint64_t expires_at)
+{
+    Probe probe;
+    initProbe(&probe, key, key_len);
+
+    Node *node = newNode(probe.node.hcode, key, key_len, value, value_len, expires_at != KEYSPACE_NO_EXPIRY);
+    if (!node)
+    {
+        return false;
+    }
+    Node *old = lookupNode(keyspace, &probe);
+    node->access = old ? old->access : accessInit(keyspace->policy, keyspace->clock_ms);
+    if (!setExpiry(keyspace, node, expires_at))
+    {
+        freeNode(node);
+        return false;
+    }
+
+    if (old)
+    {
+        // the new node takes the old one's slot; readers still holding the
+        // old blob keep it alive
+        touchNode(keyspace, node);
+        keyspace->used_memory -= nodeMemory(old);
+        clearExpiry(keyspace, old);
+        replaceInHashTable(&keyspace->table, &old->node, &node->node);
+        freeNode(old);
+    }
+    else if (!insertIntoHashTable(&keyspace->table, &node->node))
+    {
+        clearExpiry(keyspace, node);
+        freeNode(node);
+        return false;
+    }
+    else
+    {
+        countKey(keyspace, node, 1);
+    }
+    keyspace->used_memory += nodeMemory(node);
+    return true;
+}
+
+Node *keyspaceAddObject(Keyspace *keyspace, const uint8_t *key, size_t key_len, ValueType type, void *object)
+{
+    Node *node = newObjectNode(keyspaceHash(key, key_len), key, key_len, type, object, false);
+    if (!node)
+    {
+        return NULL;
+    }
+    node->access = accessInit(keyspace->policy, keyspace->clock_ms);
+    if (!insertIntoHashTable(&keyspace->table, &node->node))
+    {
+        freeNode(node);
+        return NULL;
+    }
+    countKey(keyspace, node, 1);
+    keyspace->used_memory += nodeMemory(node);
+    return node;
+}
+
+void keyspaceResized(Keyspace *keyspace, size_t before, size_t after)
+{
+    keyspace->used_memory += after - before;
+}
+
+Node *keyspaceLoadNode(Keyspace *keyspace, uint64_t hcode, const uint8_t *key, size_t key_len,
+                       const uint8_t *value, size_t value_len, uint64_t expires_at)
+{
+    Node *node = newNode(hcode, key, key_len, value, value_len, expires_at != KEYSPACE_NO_EXPIRY);
+    if (!node)
+    {
+        return NULL;
+    }
+    node->access = accessInit(keyspace->policy, keyspace->clock_ms);
+    if (!setExpiry(keyspace, node, expires_at))
+    {
+        freeNode(node);
+        return NULL;
+    }
+    keyspace->used_memory += nodeMemory(node);
+    return node;
+}
+
+Node *keyspaceLoadObject(Keyspace *keyspace, uint64_t hcode, const uint8_t *key, size_t key_len, ValueType type,
+                         void *object, uint64_t expires_at)
+{
+    Node *node = newObjectNode(hcode, key, key_len, type, object, expires_at != KEYSPACE_NO_EXPIRY);
+    if (!node)
+    {
+        return NULL;
+    }
+    node->access = accessInit(keyspace->policy, keyspace->clock_ms);
+    if (!setExpiry(keyspace, node, expires_at))
+    {
+        freeNode(node);
+        return NULL;
+    }
+    keyspace->used_memory += nodeMemory(node);
+    return node;
+}
+
+bool keyspaceAddLoaded(Keyspace *keyspace, Node **nodes, size_t n)
+{
+    // Node starts with its HNode
+    if (!insertManyIntoHashTable(&keyspace->table, (HNode **)nodes, n))
+    {
+        return false;
+    }
+    for (size_t i = 0; keyspace->slot_keys && i < n; i++)
+    {
+        countKey(keyspace, nodes[i], 1);
+    }
+    return true;
+}
+
+bool keyspaceDelete(Keyspace *keyspace, const uint8_t *key, size_t key_len)
+{
+    Probe probe;
+    initProbe(&probe, key, key_len);
+
+    // a key past its deadline is expired rather than deleted, and not counted
+    Node *node = lookupNode(keyspace, &probe);
+    if (!node)
+    {
+        return false;
+    }
+    removeNode(keyspace, node);
+    return true;
+}
+
+bool keyspaceSetExpiry(Keyspace *keyspace, const uint8_t *key, size_t key_len, uint64_t expires_at)
+{
+    Probe probe;
+    initProbe(&probe, key, key_len);
+    Node *node = lookupNode(keyspace, &probe);
+    if (!node)
+    {
+        return false;
+    }
+    if (expires_at <= keyspaceClock())
+    {
+        removeNode(keyspace, node);
+        keyspace->expired++;
+        return true;
+    }
+    keyspace->used_memory -= nodeMemory(node);
+    Node *moved = node->expiring ? node : reshapeNode(keyspace, node, true);
+    bool ok = moved && setExpiry(keyspace, moved, expires_at);
+    keyspace->used_memory += nodeMemory(moved ? moved : node);
+    return ok;
+}
+
+bool keyspacePersist(Keyspace *keyspace, const uint8_t *key, size_t key_len)
+{
+    Probe probe;
+    initProbe(&probe, key, key_len);
+    Node *node = lookupNode(keyspace, &probe);
+    if (!node || !nodeExpiry(node))
+    {
+        return false;
+    }
+    keyspace->used_memory -= nodeMemory(node);
+    clearExpiry(keyspace, node);
+    // out of memory just leaves the unused room
+    Node *moved = reshapeNode(keyspace, node, false);
+    keyspace->used_memory += nodeMemory(moved ? moved : node);
+    return true;
+}
+
+int64_t keyspaceTtl(Keyspace *keyspace, const uint8_t *key, size_t key_len)
+{
+    Probe probe;
+    initProbe(&probe, key, key_len);
+    Node *node = lookupNode(keyspace, &probe);
+    if (!node)
+    {
+        return -2;
+    }
+    uint64_t deadline = nodeDeadline(node);
+    if (deadline == KEYSPACE_NO_EXPIRY)
+    {
+        return -1;
+    }
+    uint64_t now = keyspaceClock();
+    return deadline > now ? (int64_t)(deadline - now) : 0;
+}
+
+static void expireNode(TimerLink *link, void *arg)
+{
+    Keyspace *keyspace = (Keyspace *)arg;
+    Expiry *expiry = (Expiry *)link;
+    Node *node = expiry->node;
+    countKey(keyspace, node, -1);
+    keyspace->used_memory -= nodeMemory(node);
+    // the wheel already unlinked the timer
+    deleteFromHashTable(&keyspace->table, &node->node, sameNode);
+    freeNode(node);
+    keyspace->expired++;
+}
+
+bool keyspaceExpireDue(Keyspace *keyspace, uint64_t budget_ns)
+{
+    keyspace->clock_ms = keyspaceClock();
+    return timerWheelAdvance(&keyspace->expiries, keyspace->clock_ms, budget_ns, expireNode, keyspace);
+}
+
+uint64_t keyspaceNextExpiry(const Keyspace *keyspace)
+{
+    return timerWheelNextTick(&keyspace->expiries);
+}
+
+typedef struct
+{
+    bool (*fn)(const Node *node, void *arg);
+    void *arg;
+} ForEachArgs;
+
+static bool forEachCallback(HNode *hnode, void *arg)
+{
+    ForEachArgs *args = (ForEachArgs *)arg;
+    return args->fn((const Node *)hnode, args->arg);
+}
+
+void keyspaceForEach(Keyspace *keyspace, bool (*fn)(const Node *node, void *arg), void *arg)
+{
+    ForEachArgs args = {fn, arg};
+    hashTableForEach(&keyspace->table, forEachCallback, &args);
+}
+
+const Node *keyspaceNext(Keyspace *keyspace, size_t *cursor)
+{
+    return (const Node *)hashTableNext(&keyspace->table, cursor);
+}
+
+size_t keyspaceSize(const Keyspace *keyspace)
+{
+    return hashTableSize(&keyspace->table);
+}
+
+void keyspaceSetMaxMemory(Keyspace *keyspace, size_t maxmemory, EvictionPolicy policy)
+{
+    keyspace->maxmemory = maxmemory;
+    keyspace->policy = policy;
+}
+
+size_t keyspaceMemory(const Keyspace *keyspace)
+{
+    return keyspace->used_memory + hashTableMemory(&keyspace->table);
+}
+
+// Samples a few keys into the pool and returns the best candidate that still
+// exists, NULL when there is nothing to sample.
+static Node *pickCandidate(Keyspace *keyspace)
+{
+    while (true)
+    {
+        for (int i = 0; i < EVICTION_SAMPLES; i++)
+        {
+            Node *node = (Node *)hashTableSample(&keyspace->table, evictionRandom(&keyspace->rng));
+            if (!node)
+            {
+                return NULL;
+            }
+            uint64_t score = evictionScore(keyspace->policy, node->access, keyspace->clock_ms);
+            if (!evictionPoolInsert(&keyspace->pool, score, nodeKey(node), node->key_len))
+            {
+                return NULL;
+            }
+        }
+
+        // entries sampled in earlier rounds may have been deleted since
+        EvictionCandidate candidate;
+        while (evictionPoolPop(&keyspace->pool, &candidate))
+        {
+            Probe probe;
+            initProbe(&probe, candidate.key, candidate.key_len);
+            Node *node = (Node *)getFromHashTable(&keyspace->table, &probe.node, probeEq);
+            free(candidate.key);
+            if (node)
+            {
+                return node;
+            }
+        }
+    }
+}
+
+// Frees one key by the policy. Returns false when there is none to free.
+static bool evictOne(Keyspace *keyspace, KeyEvicted evicted, void *arg)
+{
+    Node *victim = NULL;
+    switch (keyspace->policy)
+    {
+    case EVICT_NOEVICTION:
+        return false;
+    case EVICT_VOLATILE_TTL:
+    {
+        // the wheel already orders keys by deadline; no sampling needed
+        TimerLink *link = timerWheelEarliest(&keyspace->expiries);
+        victim = link ? ((Expiry *)link)->node : NULL;
+        break;
+    }
+    case EVICT_ALLKEYS_LRU:
+    case EVICT_ALLKEYS_LFU:
+        victim = pickCandidate(keyspace);
+        break;
+    }
+    if (!victim)
+    {
+        return false;
+    }
+    if (evicted)
+    {
+        evicted(victim, arg);
+    }
+    removeNode(keyspace, victim);
+    keyspace->evicted++;
+    return true;
+}
+
+bool keyspaceMakeRoom(Keyspace *keyspace, KeyEvicted evicted, void *arg)
+{
+    if (keyspace->maxmemory == 0)
+    {
+        return true;
+    }
+    while (keyspaceMemory(keyspace) > keyspace->maxmemory)
+    {
+        if (!evictOne(keyspace, evicted, arg))
+        {
+            return false;
+        }
+    }
+    return true;
+}
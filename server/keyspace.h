@@ -0,0 +1,222 @@
+#ifndef KEYSPACE_HEADER
+#define KEYSPACE_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "hashtable.h"
+#include "timerwheel.h"
+#include "eviction.h"
+#include "blob.h"
+
+// Deadlines are wall-clock milliseconds since the epoch, like the values
+// clients pass to EXPIRE and friends.
+#define KEYSPACE_NO_EXPIRY 0
+
+struct Node;
+
+// Timer of a key with a TTL; only such keys pay for one.
+typedef struct
+{
+    TimerLink link;
+    struct Node *node;
+} Expiry;
+
+// Anything but a string is a container: the node holds a pointer to the
+// type's own structure, which picks its encoding itself (see zset.h,
+// hmap.h and qlist.h). Node.type has room for no more than these four.
+typedef enum
+{
+    VALUE_STRING,
+    VALUE_ZSET,
+    VALUE_HASH,
+    VALUE_LIST,
+} ValueType;
+
+// How a string value is stored. Canonical decimals ("-12", but not "+12" or
+// "012") that fit 64 bits become an integer, which prints back to the same
+// bytes. Other short strings are embedded in the node. Long ones stay in a
+// blob so replies can reference them.
+typedef enum
+{
+    ENCODING_INT,
+    ENCODING_EMBSTR,
+    ENCODING_RAW,
+} ValueEncoding;
+
+// strings this long or longer are kept as blobs; replies reference only
+// the ones of at least REPLY_REFERENCE_MIN
+#define KEYSPACE_EMBED_LIMIT 1024
+// requests are capped well below this
+#define KEYSPACE_MAX_KEY_LEN ((1u << 26) - 1)
+// room for a formatted int64, sign included
+#define KEYSPACE_INT_CHARS 20
+
+// Keys and values are binary safe: lengths are explicit and no terminator is
+// stored or expected. Each key is a single allocation: this header, then in
+// data the Expiry pointer when the node has room for one, the key bytes and
+// the value. The value is an int64, a varint length and the bytes, or a
+// Blob pointer, by encoding. Nothing in data is aligned; use the accessors.
+// Writes rebuild nodes instead of resizing them in place, so a Node pointer
+// is only good until the next write to its keyspace.
+typedef struct Node
+{
+    HNode node;
+    uint32_t key_len : 26;
+    uint32_t type : 2;
+    uint32_t encoding : 3;
+    // data starts with an Expiry pointer, possibly NULL
+    uint32_t expiring : 1;
+    // LRU clock or LFU counter, see eviction.h
+    uint32_t access;
+    uint8_t data[];
+} Node;
+
+static inline Expiry *nodeExpiry(const Node *node)
+{
+    Expiry *expiry = NULL;
+    if (node->expiring)
+    {
+        memcpy(&expiry, node->data, sizeof(expiry));
+    }
+    return expiry;
+}
+
+static inline uint64_t nodeDeadline(const Node *node)
+{
+    Expiry *expiry = nodeExpiry(node);
+    return expiry ? expiry->link.deadline : KEYSPACE_NO_EXPIRY;
+}
+
+static inline const uint8_t *nodeKey(const Node *node)
+{
+    return node->data + (node->expiring ? sizeof(Expiry *) : 0);
+}
+
+// The bytes of a string value. An integer is formatted into buf, which must
+// hold KEYSPACE_INT_CHARS bytes.
+const uint8_t *nodeString(const Node *node, uint8_t *buf, uint32_t *len);
+
+// The blob of an ENCODING_RAW value, NULL for the other encodings.
+Blob *nodeBlob(const Node *node);
+
+// The container of a non-string node, NULL for a string.
+void *nodeObject(const Node *node);
+
+// Expired keys vanish lazily when a lookup finds them, or actively when the
+// owning event loop advances the wheel. used_memory counts the allocator's
+// usable size of every node, blob, container and timer; the table arrays
+// are added on top by keyspaceMemory().
+typedef struct
+{
+    HashTable table;
+    TimerWheel expiries;
+    uint64_t expired;
+    size_t used_memory;
+    // 0 means unlimited
+    size_t maxmemory;
+    EvictionPolicy policy;
+    EvictionPool pool;
+    uint64_t evicted;
+    // wall clock as of the last keyspaceExpireDue, for the access bits
+    uint64_t clock_ms;
+    uint64_t rng;
+    // keys per cluster hash slot, NULL outside cluster mode
+    uint32_t *slot_keys;
+} Keyspace;
+
+// The hash the keyspace indexes by; shards are picked from it as well.
+uint64_t keyspaceHash(const uint8_t *key, size_t key_len);
+
+uint64_t keyspaceClock(void);
+
+bool initKeyspace(Keyspace *keyspace, size_t initial_capacity);
+
+void freeKeyspace(Keyspace *keyspace);
+
+// Keeps count of the keys in each cluster hash slot (see cluster.h) from now
+// on, starting with those already there. False when out of memory.
+bool keyspaceCountSlots(Keyspace *keyspace);
+
+static inline uint32_t keyspaceSlotKeys(const Keyspace *keyspace, uint32_t slot)
+{
+    return keyspace->slot_keys ? keyspace->slot_keys[slot] : 0;
+}
+
+// Drops every key and starts over with room for initial_capacity, keeping
+// the memory limit, the slot counting and the expired and evicted counts.
+bool keyspaceFlush(Keyspace *keyspace, size_t initial_capacity);
+
+Node *keyspaceGet(Keyspace *keyspace, const uint8_t *key, size_t key_len);
+
+// Inserts or overwrites, replacing any TTL with expires_at (or none for
+// KEYSPACE_NO_EXPIRY). Returns false on allocation failure or a key over
+// KEYSPACE_MAX_KEY_LEN.
+bool keyspaceSet(Keyspace *keyspace, const uint8_t *key, size_t key_len,
+                 const uint8_t *value, size_t value_len, uint64_t expires_at);
+
+// Adds a key holding a container, which the keyspace takes over (and frees
+// on failure). The key must not exist. NULL when out of memory.
+Node *keyspaceAddObject(Keyspace *keyspace, const uint8_t *key, size_t key_len, ValueType type, void *object);
+
+// Containers change in place; callers report their memory before and after
+// so used_memory stays exact.
+void keyspaceResized(Keyspace *keyspace, size_t before, size_t after);
+
+// Sets the key's deadline; a deadline already past deletes it. Returns false
+// when the key does not exist or there is no memory for the timer.
+bool keyspaceSetExpiry(Keyspace *keyspace, const uint8_t *key, size_t key_len, uint64_t expires_at);
+
+// Drops the key's TTL. Returns false when it had none or does not exist.
+bool keyspacePersist(Keyspace *keyspace, const uint8_t *key, size_t key_len);
+
+// Milliseconds left, -1 for a key without TTL, -2 for a missing key.
+int64_t keyspaceTtl(Keyspace *keyspace, const uint8_t *key, size_t key_len);
+
+// Deletes keys whose deadline passed for at most budget_ns. Returns false
+// when it stopped with expired keys left.
+bool keyspaceExpireDue(Keyspace *keyspace, uint64_t budget_ns);
+
+void keyspaceSetMaxMemory(Keyspace *keyspace, size_t maxmemory, EvictionPolicy policy);
+
+size_t keyspaceMemory(const Keyspace *keyspace);
+
+// Told about each evicted key just before it is freed.
+typedef void (*KeyEvicted)(const Node *node, void *arg);
+
+// Evicts keys by the configured policy until the keyspace is within
+// maxmemory. Returns false when it is over the limit and the policy allows
+// nothing (more) to be evicted; the caller should refuse to grow it.
+// evicted may be NULL.
+bool keyspaceMakeRoom(Keyspace *keyspace, KeyEvicted evicted, void *arg);
+
+// When keyspaceExpireDue has work next, UINT64_MAX if no key has a TTL.
+uint64_t keyspaceNextExpiry(const Keyspace *keyspace);
+
+// Bulk loads build detached nodes for keys known to be absent, under their
+// precomputed keyspaceHash, and then add them all at once in table order.
+// Expiry timers start with the node, so add every node that was built.
+Node *keyspaceLoadNode(Keyspace *keyspace, uint64_t hcode, const uint8_t *key, size_t key_len,
+                       const uint8_t *value, size_t value_len, uint64_t expires_at);
+
+Node *keyspaceLoadObject(Keyspace *keyspace, uint64_t hcode, const uint8_t *key, size_t key_len, ValueType type,
+                         void *object, uint64_t expires_at);
+
+bool keyspaceAddLoaded(Keyspace *keyspace, Node **nodes, size_t n);
+
+bool keyspaceDelete(Keyspace *keyspace, const uint8_t *key, size_t key_len);
+
+// Visits every key, expired or not, without touching any; stops early when
+// fn returns false.
+void keyspaceForEach(Keyspace *keyspace, bool (*fn)(const Node *node, void *arg), void *arg);
+
+// Steps a cursor that starts at 0 to the next key, NULL past the last one.
+// The cursor stays usable across other calls on the keyspace, but keys they
+// move meanwhile may be skipped or come up twice: writes, expiry and the
+// resize steps lookups take all move keys. See hashTableNext.
+const Node *keyspaceNext(Keyspace *keyspace, size_t *cursor);
+
+size_t keyspaceSize(const Keyspace *keyspace);
+
+#endif
@@ -0,0 +1,248 @@
+#include "log.h"
+#include <errno.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define LOG_WRITE_BATCH (64 * 1024)
+#define LOG_IDLE_SLEEP_NS (5 * 1000 * 1000)
+
+LogLevel g_log_level = LOG_INFO;
+
+// Bounded multi-producer queue in the style of Vyukov's: a slot is free for
+// position p when its seq equals p and holds a message once seq is p + 1.
+// The writer thread is the only consumer.
+typedef struct
+{
+    _Atomic size_t seq;
+    uint8_t level;
+    uint16_t len;
+    struct timespec ts;
+    char text[LOG_LINE_MAX];
+} LogSlot;
+
+static struct
+{
+    LogSlot *slots;
+    _Alignas(64) _Atomic size_t enqueue_pos;
+    _Alignas(64) _Atomic size_t dequeue_pos;
+    _Atomic uint64_t dropped;
+    int fd;
+    pthread_t writer;
+    bool writer_running;
+} g_log;
+
+static const char *const level_names[] = {"debug", "info", "warn", "error"};
+static const char level_tags[] = {'D', 'I', 'W', 'E'};
+
+void logWrite(LogLevel level, const char *fmt, ...)
+{
+    if (!g_log.slots)
+    {
+        return;
+    }
+
+    LogSlot *slot;
+    size_t pos = atomic_load_explicit(&g_log.enqueue_pos, memory_order_relaxed);
+    while (true)
+    {
+        slot = &g_log.slots[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&g_log.enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // the writer is a whole ring behind
+            atomic_fetch_add_explicit(&g_log.dropped, 1, memory_order_relaxed);
+            return;
+        }
+        else
+        {
+            pos = atomic_load_explicit(&g_log.enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    // vsnprintf takes no stdio lock and clock_gettime goes through the vDSO
+    clock_gettime(CLOCK_REALTIME, &slot->ts);
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(slot->text, sizeof(slot->text), fmt, args);
+    va_end(args);
+    if (len < 0)
+    {
+        len = 0;
+    }
+    slot->len = (uint16_t)(len < LOG_LINE_MAX ? len : LOG_LINE_MAX - 1);
+    slot->level = (uint8_t)level;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+static void writeAll(const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t rv = write(g_log.fd, data, len);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv <= 0)
+        {
+            return;
+        }
+        data += rv;
+        len -= (size_t)rv;
+    }
+}
+
+// Moves every finished message into one write. Returns how many were taken.
+static size_t drainRing(void)
+{
+    static char out[LOG_WRITE_BATCH];
+    size_t used = 0;
+    size_t count = 0;
+
+    size_t pos = atomic_load_explicit(&g_log.dequeue_pos, memory_order_relaxed);
+    while (true)
+    {
+        LogSlot *slot = &g_log.slots[pos & (LOG_RING_SIZE - 1)];
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + 1)
+        {
+            break;
+        }
+
+        if (used + LOG_LINE_MAX + 32 > sizeof(out))
+        {
+            writeAll(out, used);
+            used = 0;
+        }
+        struct tm tm;
+        localtime_r(&slot->ts.tv_sec, &tm);
+        used += (size_t)snprintf(out + used, sizeof(out) - used, "%02d:%02d:%02d.%03ld %c ",
+                                 tm.tm_hour, tm.tm_min, tm.tm_sec, slot->ts.tv_nsec / 1000000,
+                                 level_tags[slot->level]);
+        memcpy(out + used, slot->text, slot->len);
+        used += slot->len;
+        out[used++] = '\n';
+
+        atomic_store_explicit(&slot->seq, pos + LOG_RING_SIZE, memory_order_release);
+        pos++;
+        count++;
+    }
+    atomic_store_explicit(&g_log.dequeue_pos, pos, memory_order_release);
+
+    if (used > 0)
+    {
+        writeAll(out, used);
+    }
+    return count;
+}
+
+static void *writerMain(void *arg)
+{
+    (void)arg;
+    uint64_t reported = 0;
+    while (true)
+    {
+        size_t count = drainRing();
+
+        uint64_t dropped = atomic_load_explicit(&g_log.dropped, memory_order_relaxed);
+        if (dropped != reported)
+        {
+            char line[64];
+            int len = snprintf(line, sizeof(line), "log ring full, %llu message(s) dropped\n",
+                               (unsigned long long)(dropped - reported));
+            writeAll(line, (size_t)len);
+            reported = dropped;
+        }
+
+        // nobody signals the writer, producers stay syscall free; poll instead
+        if (count == 0)
+        {
+            struct timespec idle = {0, LOG_IDLE_SLEEP_NS};
+            nanosleep(&idle, NULL);
+        }
+    }
+    return NULL;
+}
+
+bool initLogging(LogLevel level, int fd)
+{
+    g_log_level = level;
+    g_log.fd = fd;
+    g_log.slots = (LogSlot *)calloc(LOG_RING_SIZE, sizeof(LogSlot));
+    if (!g_log.slots)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < LOG_RING_SIZE; i++)
+    {
+        atomic_init(&g_log.slots[i].seq, i);
+    }
+    atomic_init(&g_log.enqueue_pos, 0);
+    atomic_init(&g_log.dequeue_pos, 0);
+    atomic_init(&g_log.dropped, 0);
+
+    if (pthread_create(&g_log.writer, NULL, writerMain, NULL))
+    {
+        return false;
+    }
+    g_log.writer_running = true;
+    return true;
+}
+
+void logFlush(void)
+{
+    if (!g_log.slots)
+    {
+        return;
+    }
+    if (!g_log.writer_running)
+    {
+        drainRing();
+        return;
+    }
+
+    // give the writer up to a second to catch up with what is queued now
+    size_t target = atomic_load_explicit(&g_log.enqueue_pos, memory_order_relaxed);
+    for (int i = 0; i < 1000; i++)
+    {
+        if ((intptr_t)(atomic_load_explicit(&g_log.dequeue_pos, memory_order_acquire) - target) >= 0)
+        {
+            return;
+        }
+        struct timespec pause = {0, 1000 * 1000};
+        nanosleep(&pause, NULL);
+    }
+}
+
+bool parseLogLevel(const char *name, LogLevel *level)
+{
+    for (int i = LOG_DEBUG; i <= LOG_ERROR; i++)
+    {
+        if (strcasecmp(name, level_names[i]) == 0)
+        {
+            *level = (LogLevel)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+uint64_t logDropped(void)
+{
+    return atomic_load_explicit(&g_log.dropped, memory_order_relaxed);
+}
@@ -0,0 +1,60 @@
+#ifndef LOG_HEADER
+#define LOG_HEADER
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef enum
+{
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARN,
+    LOG_ERROR,
+} LogLevel;
+
+// Calls below this level are compiled out entirely, e.g. build with
+// -DLOG_COMPILE_LEVEL=LOG_INFO to drop the per-request debug lines.
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_RING_SIZE 4096
+#define LOG_LINE_MAX 240
+
+// Runtime threshold. Set once at startup, before any worker thread exists.
+extern LogLevel g_log_level;
+
+// The arguments are only evaluated and formatted when the level is enabled.
+// An enabled call formats into a slot of a lock-free ring and returns; a
+// background thread does the write(2). A full ring drops the message rather
+// than stall the caller.
+#define logEnabled(level) ((level) >= LOG_COMPILE_LEVEL && (level) >= g_log_level)
+
+#define LOG_AT(level, ...)                  \
+    do                                      \
+    {                                       \
+        if (logEnabled(level))              \
+        {                                   \
+            logWrite((level), __VA_ARGS__); \
+        }                                   \
+    } while (0)
+
+#define logDebug(...) LOG_AT(LOG_DEBUG, __VA_ARGS__)
+#define logInfo(...) LOG_AT(LOG_INFO, __VA_ARGS__)
+#define logWarn(...) LOG_AT(LOG_WARN, __VA_ARGS__)
+#define logError(...) LOG_AT(LOG_ERROR, __VA_ARGS__)
+
+// Must run before the first message; starts the writer thread draining to fd.
+bool initLogging(LogLevel level, int fd);
+
+void logWrite(LogLevel level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Blocks until everything logged so far has been written, e.g. before abort().
+void logFlush(void);
+
+bool parseLogLevel(const char *name, LogLevel *level);
+
+// Messages lost to a full ring since startup.
+uint64_t logDropped(void);
+
+#endif
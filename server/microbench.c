@@ -0,0 +1,961 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <math.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "fnv.h"
+#include "hash.h"
+#include "buffer.h"
+#include "pollfdvector.h"
+#include "connectionvector.h"
+#include "hashtable.h"
+#include "keyspace.h"
+#include "protocol.h"
+#include "command.h"
+
+// Microbenchmarks for the core data structures, run by `make bench`. Every
+// case is calibrated during warmup until one repetition takes --min-time, then
+// repeated --reps times; the table goes to stdout and --json FILE writes the
+// same numbers for comparing commits. A few checks on what the cases cannot
+// see run first, and a failed one stops the run.
+
+#define MAX_REPS 64
+#define PERF_COUNTERS 4
+
+typedef struct
+{
+    const char *name;
+    // key/value size or element count, depending on the case
+    size_t param;
+    // units of work per iteration, ns/op is per unit
+    size_t ops_per_iter;
+    void *(*setup)(size_t param);
+    void (*run)(void *state, uint64_t iters);
+    void (*teardown)(void *state);
+} BenchCase;
+
+static struct
+{
+    int reps;
+    double min_time_ms;
+    const char *filter;
+    const char *json_path;
+} g_opt = {9, 20, NULL, NULL};
+
+// results must look used or the compiler drops the work
+static volatile uint64_t g_sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t read_tsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1Dull;
+}
+
+// Hardware counters as one perf group, so they are scheduled together. Any
+// failure (no PMU in a VM, perf_event_paranoid) leaves them off and cycles
+// fall back to the TSC.
+static const char *k_counter_names[PERF_COUNTERS] = {"cycles", "instructions", "cache_misses", "branch_misses"};
+static const uint64_t k_counter_configs[PERF_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+static int g_perf_fds[PERF_COUNTERS] = {-1, -1, -1, -1};
+static bool g_perf_enabled;
+
+static void open_perf_counters(void)
+{
+    for (int i = 0; i < PERF_COUNTERS; i++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = k_counter_configs[i];
+        attr.disabled = i == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, i == 0 ? -1 : g_perf_fds[0], 0);
+        if (fd < 0)
+        {
+            for (int j = 0; j < i; j++)
+            {
+                close(g_perf_fds[j]);
+                g_perf_fds[j] = -1;
+            }
+            return;
+        }
+        g_perf_fds[i] = fd;
+    }
+    g_perf_enabled = true;
+}
+
+static void start_perf_counters(void)
+{
+    if (g_perf_enabled)
+    {
+        ioctl(g_perf_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(g_perf_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+static void stop_perf_counters(uint64_t counts[PERF_COUNTERS])
+{
+    if (!g_perf_enabled)
+    {
+        return;
+    }
+    ioctl(g_perf_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    uint64_t values[1 + PERF_COUNTERS];
+    if (read(g_perf_fds[0], values, sizeof(values)) == (ssize_t)sizeof(values))
+    {
+        for (int i = 0; i < PERF_COUNTERS; i++)
+        {
+            counts[i] += values[1 + i];
+        }
+    }
+}
+
+// --- hashing ---
+
+typedef struct
+{
+    uint8_t *data;
+    size_t len;
+} ByteState;
+
+static void *setup_bytes(size_t len)
+{
+    ByteState *state = (ByteState *)malloc(sizeof(ByteState));
+    state->data = (uint8_t *)malloc(len);
+    state->len = len;
+    uint64_t rng = 42;
+    for (size_t i = 0; i < len; i++)
+    {
+        state->data[i] = (uint8_t)next_random(&rng);
+    }
+    return state;
+}
+
+static void teardown_bytes(void *arg)
+{
+    ByteState *state = (ByteState *)arg;
+    free(state->data);
+    free(state);
+}
+
+static void run_fnv32(void *arg, uint64_t iters)
+{
+    ByteState *state = (ByteState *)arg;
+    uint64_t acc = 0;
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        acc += fnv1a_32(state->data, state->len);
+        state->data[0] = (uint8_t)acc;
+    }
+    g_sink = acc;
+}
+
+static void run_fnv64(void *arg, uint64_t iters)
+{
+    ByteState *state = (ByteState *)arg;
+    uint64_t acc = 0;
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        acc += fnv1a_64(state->data, state->len);
+        state->data[0] = (uint8_t)acc;
+    }
+    g_sink = acc;
+}
+
+static void run_hash_bytes(void *arg, uint64_t iters)
+{
+    ByteState *state = (ByteState *)arg;
+    uint64_t acc = 0;
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        acc += hashBytes(state->data, state->len);
+        state->data[0] = (uint8_t)acc;
+    }
+    g_sink = acc;
+}
+
+static void run_keyspace_hash(void *arg, uint64_t iters)
+{
+    ByteState *state = (ByteState *)arg;
+    uint64_t acc = 0;
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        acc += keyspaceHash(state->data, state->len);
+        state->data[0] = (uint8_t)acc;
+    }
+    g_sink = acc;
+}
+
+// --- Buffer ---
+
+typedef struct
+{
+    Buffer buffer;
+    uint8_t *data;
+    size_t len;
+} BufferState;
+
+static void *setup_buffer(size_t len)
+{
+    BufferState *state = (BufferState *)malloc(sizeof(BufferState));
+    initBuffer(&state->buffer);
+    state->data = (uint8_t *)calloc(1, len);
+    state->len = len;
+    return state;
+}
+
+static void teardown_buffer(void *arg)
+{
+    BufferState *state = (BufferState *)arg;
+    freeBuffer(&state->buffer);
+    free(state->data);
+    free(state);
+}
+
+// one reply's worth of bytes in, then straight out again
+static void run_buffer_append_consume(void *arg, uint64_t iters)
+{
+    BufferState *state = (BufferState *)arg;
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        appendToNewBuffer(&state->buffer, state->data, state->len);
+        consumeNewBuffer(&state->buffer, state->len);
+    }
+    g_sink = bufferSize(&state->buffer);
+}
+
+// a pipelined batch: 64 appends queue up before one drain
+static void run_buffer_batch(void *arg, uint64_t iters)
+{
+    BufferState *state = (BufferState *)arg;
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        for (int j = 0; j < 64; j++)
+        {
+            appendToNewBuffer(&state->buffer, state->data, state->len);
+        }
+        consumeNewBuffer(&state->buffer, 64 * state->len);
+    }
+    g_sink = bufferSize(&state->buffer);
+}
+
+// the read path: reserve space in place, fill it, parse it back out
+static void run_buffer_prepare_commit(void *arg, uint64_t iters)
+{
+    BufferState *state = (BufferState *)arg;
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        size_t available = 0;
+        uint8_t *dst = prepareBufferWrite(&state->buffer, state->len, &available);
+        memcpy(dst, state->data, state->len);
+        commitBufferWrite(&state->buffer, state->len);
+        g_sink = bufferData(&state->buffer, state->len)[0];
+        consumeNewBuffer(&state->buffer, state->len);
+    }
+}
+
+// --- vectors ---
+
+static void *setup_count(size_t count)
+{
+    return (void *)count;
+}
+
+static void run_pollfd_push(void *arg, uint64_t iters)
+{
+    size_t count = (size_t)arg;
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        pollFdVector vector;
+        initPollFdVector(&vector);
+        for (size_t j = 0; j < count; j++)
+        {
+            struct pollfd pfd = {(int)j, POLLIN, 0};
+            pollVectorPushBack(&vector, pfd);
+        }
+        g_sink = vector.size;
+        freepollFdVector(&vector);
+    }
+}
+
+// grows one fd at a time, the way accept() hands them out
+static void run_connvector_grow(void *arg, uint64_t iters)
+{
+    size_t count = (size_t)arg;
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        ConnectionVector vector = initConnectionVector();
+        for (size_t j = 1; j <= count; j++)
+        {
+            resizeConnectionVector(&vector, j, 0);
+        }
+        g_sink = (uint64_t)vector.size;
+        freeConnectionVector(&vector);
+    }
+}
+
+// --- hash table and keyspace ---
+
+typedef struct
+{
+    HNode node;
+    uint64_t key;
+} IntEntry;
+
+static bool int_entry_eq(const HNode *lhs, const HNode *rhs)
+{
+    return ((const IntEntry *)lhs)->key == ((const IntEntry *)rhs)->key;
+}
+
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    return x;
+}
+
+typedef struct
+{
+    HashTable table;
+    IntEntry *entries;
+    size_t count;
+    // lookup order, shuffled so probes do not walk memory in sequence
+    uint32_t *order;
+} TableState;
+
+static void *setup_table(size_t count)
+{
+    TableState *state = (TableState *)calloc(1, sizeof(TableState));
+    state->count = count;
+    state->entries = (IntEntry *)malloc(count * sizeof(IntEntry));
+    state->order = (uint32_t *)malloc(count * sizeof(uint32_t));
+    initHashTable(&state->table, 4);
+    for (size_t i = 0; i < count; i++)
+    {
+        state->entries[i].key = i;
+        state->entries[i].node.hcode = mix64(i);
+        insertIntoHashTable(&state->table, &state->entries[i].node);
+        state->order[i] = (uint32_t)i;
+    }
+    uint64_t rng = 7;
+    for (size_t i = count; i > 1; i--)
+    {
+        size_t j = next_random(&rng) % i;
+        uint32_t tmp = state->order[i - 1];
+        state->order[i - 1] = state->order[j];
+        state->order[j] = tmp;
+    }
+    return state;
+}
+
+static void teardown_table(void *arg)
+{
+    TableState *state = (TableState *)arg;
+    freeHashTable(&state->table);
+    free(state->entries);
+    free(state->order);
+    free(state);
+}
+
+// builds a table of `count` from empty, resizes included
+static void run_table_insert(void *arg, uint64_t iters)
+{
+    TableState *state = (TableState *)arg;
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        HashTable table;
+        initHashTable(&table, 4);
+        for (size_t j = 0; j < state->count; j++)
+        {
+            insertIntoHashTable(&table, &state->entries[j].node);
+        }
+        g_sink = hashTableSize(&table);
+        freeHashTable(&table);
+    }
+}
+
+static void run_table_hit(void *arg, uint64_t iters)
+{
+    TableState *state = (TableState *)arg;
+    uint64_t found = 0;
+    size_t pos = 0;
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        IntEntry probe;
+        probe.key = state->order[pos];
+        probe.node.hcode = mix64(probe.key);
+        found += getFromHashTable(&state->table, &probe.node, int_entry_eq) != NULL;
+        pos = pos + 1 == state->count ? 0 : pos + 1;
+    }
+    g_sink = found;
+}
+
+static void run_table_miss(void *arg, uint64_t iters)
+{
+    TableState *state = (TableState *)arg;
+    uint64_t found = 0;
+    size_t pos = 0;
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        IntEntry probe;
+        probe.key = state->count + state->order[pos];
+        probe.node.hcode = mix64(probe.key);
+        found += getFromHashTable(&state->table, &probe.node, int_entry_eq) != NULL;
+        pos = pos + 1 == state->count ? 0 : pos + 1;
+    }
+    g_sink = found;
+}
+
+// delete + reinsert at a steady size: exercises the backward-shift delete
+static void run_table_churn(void *arg, uint64_t iters)
+{
+    TableState *state = (TableState *)arg;
+    size_t pos = 0;
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        IntEntry *entry = &state->entries[state->order[pos]];
+        HNode *node = deleteFromHashTable(&state->table, &entry->node, int_entry_eq);
+        insertIntoHashTable(&state->table, node);
+        pos = pos + 1 == state->count ? 0 : pos + 1;
+    }
+    g_sink = hashTableSize(&state->table);
+}
+
+#define KEYSPACE_KEYS 100000
+
+typedef struct
+{
+    Keyspace keyspace;
+    uint8_t *keys;
+    size_t key_len;
+    uint8_t *value;
+    size_t value_len;
+} KeyspaceState;
+
+static void fill_key(uint8_t *dst, size_t len, uint64_t index)
+{
+    memset(dst, 'k', len);
+    for (size_t i = 0; i < len && i < 8; i++)
+    {
+        dst[len - 1 - i] = (uint8_t)('0' + index % 10);
+        index /= 10;
+    }
+}
+
+static void *setup_keyspace(size_t key_len, size_t value_len)
+{
+    KeyspaceState *state = (KeyspaceState *)calloc(1, sizeof(KeyspaceState));
+    state->key_len = key_len;
+    state->value_len = value_len;
+    state->keys = (uint8_t *)malloc(KEYSPACE_KEYS * key_len);
+    state->value = (uint8_t *)calloc(1, value_len);
+    initKeyspace(&state->keyspace, 4);
+    for (size_t i = 0; i < KEYSPACE_KEYS; i++)
+    {
+        uint8_t *key = state->keys + i * key_len;
+        fill_key(key, key_len, mix64(i) % 100000000);
+        keyspaceSet(&state->keyspace, key, key_len, state->value, value_len, KEYSPACE_NO_EXPIRY);
+    }
+    return state;
+}
+
+// keyspace cases encode the key size in param; values stay 32 bytes
+static void *setup_keyspace_key(size_t key_len)
+{
+    return setup_keyspace(key_len, 32);
+}
+
+// and these the value size, with 16-byte keys
+static void *setup_keyspace_value(size_t value_len)
+{
+    return setup_keyspace(16, value_len);
+}
+
+static void teardown_keyspace(void *arg)
+{
+    KeyspaceState *state = (KeyspaceState *)arg;
+    freeKeyspace(&state->keyspace);
+    free(state->keys);
+    free(state->value);
+    free(state);
+}
+
+static void run_keyspace_get(void *arg, uint64_t iters)
+{
+    KeyspaceState *state = (KeyspaceState *)arg;
+    uint64_t found = 0;
+    size_t pos = 0;
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        found += keyspaceGet(&state->keyspace, state->keys + pos * state->key_len, state->key_len) != NULL;
+        pos = (pos + 7919) % KEYSPACE_KEYS;
+    }
+    g_sink = found;
+}
+
+static void run_keyspace_set(void *arg, uint64_t iters)
+{
+    KeyspaceState *state = (KeyspaceState *)arg;
+    size_t pos = 0;
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        keyspaceSet(&state->keyspace, state->keys + pos * state->key_len, state->key_len, state->value,
+                    state->value_len, KEYSPACE_NO_EXPIRY);
+        pos = (pos + 7919) % KEYSPACE_KEYS;
+    }
+    g_sink = keyspaceSize(&state->keyspace);
+}
+
+// --- commands ---
+
+static const char *const k_command_names[] = {
+    "get", "set", "del", "exists", "expire", "pexpire", "pexpireat", "ttl", "pttl", "persist", "type",
+    "zadd", "zrem", "zscore", "zrank", "zcard", "zrange", "zrangebyscore",
+    "hset", "hget", "hexists", "hdel", "hlen", "hgetall",
+    "lpush", "rpush", "lpop", "rpop", "llen", "lindex", "lrange",
+    "save", "bgsave", "lastsave", "bgrewriteaof", "cluster", "info", "stats",
+};
+
+#define COMMAND_NAMES (sizeof(k_command_names) / sizeof(k_command_names[0]))
+
+static void run_command_lookup(void *arg, uint64_t iters)
+{
+    (void)arg;
+    Slice names[COMMAND_NAMES];
+    for (size_t i = 0; i < COMMAND_NAMES; i++)
+    {
+        names[i].data = (const uint8_t *)k_command_names[i];
+        names[i].len = (uint32_t)strlen(k_command_names[i]);
+    }
+    uint64_t found = 0;
+    size_t pos = 0;
+    for (uint64_t i = 0; i < iters; i++)
+    {
+        found += lookupCommand(&names[pos]) != NULL;
+        pos = pos + 1 == COMMAND_NAMES ? 0 : pos + 1;
+    }
+    g_sink = found;
+}
+
+static const BenchCase k_cases[] = {
+    {"fnv1a_32", 8, 1, setup_bytes, run_fnv32, teardown_bytes},
+    {"fnv1a_32", 64, 1, setup_bytes, run_fnv32, teardown_bytes},
+    {"fnv1a_32", 1024, 1, setup_bytes, run_fnv32, teardown_bytes},
+    {"fnv1a_64", 8, 1, setup_bytes, run_fnv64, teardown_bytes},
+    {"fnv1a_64", 16, 1, setup_bytes, run_fnv64, teardown_bytes},
+    {"fnv1a_64", 64, 1, setup_bytes, run_fnv64, teardown_bytes},
+    {"fnv1a_64", 256, 1, setup_bytes, run_fnv64, teardown_bytes},
+    {"fnv1a_64", 1024, 1, setup_bytes, run_fnv64, teardown_bytes},
+    {"fnv1a_64", 4096, 1, setup_bytes, run_fnv64, teardown_bytes},
+    {"hash_bytes", 8, 1, setup_bytes, run_hash_bytes, teardown_bytes},
+    {"hash_bytes", 16, 1, setup_bytes, run_hash_bytes, teardown_bytes},
+    {"hash_bytes", 40, 1, setup_bytes, run_hash_bytes, teardown_bytes},
+    {"hash_bytes", 64, 1, setup_bytes, run_hash_bytes, teardown_bytes},
+    {"hash_bytes", 128, 1, setup_bytes, run_hash_bytes, teardown_bytes},
+    {"hash_bytes", 200, 1, setup_bytes, run_hash_bytes, teardown_bytes},
+    {"hash_bytes", 1024, 1, setup_bytes, run_hash_bytes, teardown_bytes},
+    {"hash_bytes", 4096, 1, setup_bytes, run_hash_bytes, teardown_bytes},
+    {"keyspace_hash", 16, 1, setup_bytes, run_keyspace_hash, teardown_bytes},
+    {"keyspace_hash", 64, 1, setup_bytes, run_keyspace_hash, teardown_bytes},
+    {"keyspace_hash", 200, 1, setup_bytes, run_keyspace_hash, teardown_bytes},
+    {"buffer_append_consume", 16, 1, setup_buffer, run_buffer_append_consume, teardown_buffer},
+    {"buffer_append_consume", 256, 1, setup_buffer, run_buffer_append_consume, teardown_buffer},
+    {"buffer_append_consume", 4096, 1, setup_buffer, run_buffer_append_consume, teardown_buffer},
+    {"buffer_append_consume", 65536, 1, setup_buffer, run_buffer_append_consume, teardown_buffer},
+    {"buffer_batch64", 16, 64, setup_buffer, run_buffer_batch, teardown_buffer},
+    {"buffer_batch64", 256, 64, setup_buffer, run_buffer_batch, teardown_buffer},
+    {"buffer_batch64", 4096, 64, setup_buffer, run_buffer_batch, teardown_buffer},
+    {"buffer_prepare_commit", 64, 1, setup_buffer, run_buffer_prepare_commit, teardown_buffer},
+    {"buffer_prepare_commit", 4096, 1, setup_buffer, run_buffer_prepare_commit, teardown_buffer},
+    {"pollfd_push_back", 64, 64, setup_count, run_pollfd_push, NULL},
+    {"pollfd_push_back", 16384, 16384, setup_count, run_pollfd_push, NULL},
+    {"connvector_grow", 64, 64, setup_count, run_connvector_grow, NULL},
+    {"connvector_grow", 16384, 16384, setup_count, run_connvector_grow, NULL},
+    {"hashtable_insert", 1024, 1024, setup_table, run_table_insert, teardown_table},
+    {"hashtable_insert", 1 << 20, 1 << 20, setup_table, run_table_insert, teardown_table},
+    {"hashtable_get_hit", 1024, 1, setup_table, run_table_hit, teardown_table},
+    {"hashtable_get_hit", 1 << 20, 1, setup_table, run_table_hit, teardown_table},
+    {"hashtable_get_miss", 1024, 1, setup_table, run_table_miss, teardown_table},
+    {"hashtable_get_miss", 1 << 20, 1, setup_table, run_table_miss, teardown_table},
+    {"hashtable_churn", 1024, 1, setup_table, run_table_churn, teardown_table},
+    {"hashtable_churn", 1 << 20, 1, setup_table, run_table_churn, teardown_table},
+    {"keyspace_get_keylen", 16, 1, setup_keyspace_key, run_keyspace_get, teardown_keyspace},
+    {"keyspace_get_keylen", 64, 1, setup_keyspace_key, run_keyspace_get, teardown_keyspace},
+    {"keyspace_get_keylen", 256, 1, setup_keyspace_key, run_keyspace_get, teardown_keyspace},
+    {"keyspace_set_vallen", 16, 1, setup_keyspace_value, run_keyspace_set, teardown_keyspace},
+    {"keyspace_set_vallen", 512, 1, setup_keyspace_value, run_keyspace_set, teardown_keyspace},
+    {"keyspace_set_vallen", 16384, 1, setup_keyspace_value, run_keyspace_set, teardown_keyspace},
+    {"command_lookup", COMMAND_NAMES, 1, setup_count, run_command_lookup, NULL},
+};
+
+typedef struct
+{
+    const BenchCase *bench;
+    uint64_t iters;
+    double ns_per_op[MAX_REPS];
+    double median;
+    double min;
+    double stddev;
+    double cycles_per_op;
+    // per op, only meaningful when g_perf_enabled
+    double counters[PERF_COUNTERS];
+} BenchResult;
+
+static int compare_double(const void *lhs, const void *rhs)
+{
+    double a = *(const double *)lhs, b = *(const double *)rhs;
+    return (a > b) - (a < b);
+}
+
+static void run_case(const BenchCase *bench, BenchResult *result)
+{
+    void *state = bench->setup(bench->param);
+    result->bench = bench;
+
+    // warmup doubles as calibration: grow the iteration count until one
+    // repetition takes min_time
+    uint64_t iters = 1;
+    uint64_t target = (uint64_t)(g_opt.min_time_ms * 1e6);
+    while (true)
+    {
+        uint64_t start = now_ns();
+        bench->run(state, iters);
+        uint64_t elapsed = now_ns() - start;
+        if (elapsed >= target)
+        {
+            break;
+        }
+        uint64_t scale = elapsed > 0 ? target / elapsed + 1 : 16;
+        iters *= scale < 2 ? 2 : (scale > 16 ? 16 : scale);
+    }
+    result->iters = iters;
+
+    uint64_t counts[PERF_COUNTERS] = {0};
+    uint64_t tsc_total = 0;
+    double ops = (double)iters * (double)bench->ops_per_iter;
+    double sum = 0;
+    for (int rep = 0; rep < g_opt.reps; rep++)
+    {
+        start_perf_counters();
+        uint64_t tsc = read_tsc();
+        uint64_t start = now_ns();
+        bench->run(state, iters);
+        uint64_t elapsed = now_ns() - start;
+        tsc_total += read_tsc() - tsc;
+        stop_perf_counters(counts);
+        result->ns_per_op[rep] = (double)elapsed / ops;
+        sum += result->ns_per_op[rep];
+    }
+
+    double mean = sum / g_opt.reps;
+    double variance = 0;
+    for (int rep = 0; rep < g_opt.reps; rep++)
+    {
+        variance += (result->ns_per_op[rep] - mean) * (result->ns_per_op[rep] - mean);
+    }
+    result->stddev = sqrt(variance / g_opt.reps);
+
+    double sorted[MAX_REPS];
+    memcpy(sorted, result->ns_per_op, sizeof(double) * (size_t)g_opt.reps);
+    qsort(sorted, (size_t)g_opt.reps, sizeof(double), compare_double);
+    result->median = sorted[g_opt.reps / 2];
+    result->min = sorted[0];
+
+    double total_ops = ops * g_opt.reps;
+    for (int i = 0; i < PERF_COUNTERS; i++)
+    {
+        result->counters[i] = (double)counts[i] / total_ops;
+    }
+    result->cycles_per_op = g_perf_enabled ? result->counters[0] : (double)tsc_total / total_ops;
+
+    if (bench->teardown)
+    {
+        bench->teardown(state);
+    }
+}
+
+static void write_json(FILE *out, const BenchResult *results, size_t count)
+{
+    fprintf(out, "{\"reps\":%d,\"min_time_ms\":%.1f,\"cycles_source\":\"%s\",\"hash\":\"%s\",\"results\":[\n",
+            g_opt.reps, g_opt.min_time_ms, g_perf_enabled ? "perf" : "tsc", hashImplementation());
+    for (size_t i = 0; i < count; i++)
+    {
+        const BenchResult *r = &results[i];
+        fprintf(out,
+                "  {\"name\":\"%s\",\"param\":%zu,\"iters\":%llu,\"ns_per_op\":%.3f,\"min_ns_per_op\":%.3f,"
+                "\"stddev_ns\":%.3f,\"cycles_per_op\":%.2f",
+                r->bench->name, r->bench->param, (unsigned long long)r->iters, r->median, r->min, r->stddev,
+                r->cycles_per_op);
+        if (g_perf_enabled)
+        {
+            for (int c = 1; c < PERF_COUNTERS; c++)
+            {
+                fprintf(out, ",\"%s_per_op\":%.4f", k_counter_names[c], r->counters[c]);
+            }
+        }
+        fprintf(out, "}%s\n", i + 1 < count ? "," : "");
+    }
+    fprintf(out, "]}\n");
+}
+
+#define CHECK_REPLIES 1000
+
+static bool check_failed(const char *what)
+{
+    fprintf(stderr, "check failed: %s\n", what);
+    return false;
+}
+
+// Pipelined GET replies must not cost much more memory than their bytes:
+// values shorter than a segment pack the segments about as tightly as
+// copies, longer ones cost at most a segment of their own besides the blob.
+static bool check_reply_memory(void)
+{
+    static const size_t k_lens[] = {1024, 1100, 4096, 8192, 16383, 16384, 65536};
+    for (size_t i = 0; i < sizeof(k_lens) / sizeof(k_lens[0]); i++)
+    {
+        size_t len = k_lens[i];
+        uint8_t *data = (uint8_t *)calloc(1, len);
+        Blob *blob = newBlob(data, len);
+        Buffer out;
+        initBuffer(&out);
+        for (int r = 0; r < CHECK_REPLIES; r++)
+        {
+            BufferMark header = beginReply(&out);
+            replyBlob(&out, blob);
+            endReply(&out, &header);
+        }
+        size_t per_reply = bufferMemory(&out) / CHECK_REPLIES;
+        size_t frame = 4 + 5 + len;
+        size_t limit = len < BUFFER_SEGMENT_SIZE ? frame + frame / 8 + sizeof(BufferSegment)
+                                                 : len + BUFFER_SEGMENT_SIZE + 2 * sizeof(BufferSegment);
+        // and all of it comes back once the replies are sent
+        consumeNewBuffer(&out, bufferSize(&out));
+        releaseBufferIfEmpty(&out);
+        size_t left = bufferMemory(&out);
+        freeBuffer(&out);
+        releaseBlob(blob);
+        free(data);
+        if (per_reply > limit)
+        {
+            fprintf(stderr, "%zu-byte values take %zu bytes per reply, over %zu\n", len, per_reply, limit);
+            return check_failed("reply memory");
+        }
+        if (left != 0)
+        {
+            return check_failed("buffer memory accounting");
+        }
+    }
+    return true;
+}
+
+// DEL of a key whose deadline passed before the timing wheel reclaimed it
+// expires the key and reports nothing deleted, as a lookup would.
+static bool check_delete_expired(void)
+{
+    Keyspace keyspace;
+    initKeyspace(&keyspace, 4);
+    uint64_t deadline = keyspaceClock() + 1;
+    bool ok = keyspaceSet(&keyspace, (const uint8_t *)"k", 1, (const uint8_t *)"v", 1, deadline);
+    while (keyspaceClock() <= deadline)
+    {
+    }
+    ok = ok && !keyspaceDelete(&keyspace, (const uint8_t *)"k", 1) && keyspace.expired == 1 &&
+         keyspaceSize(&keyspace) == 0;
+    freeKeyspace(&keyspace);
+    return ok || check_failed("DEL of an expired key");
+}
+
+// Every command is found by its name in any case, and nothing else is.
+static bool check_command_lookup(void)
+{
+    for (size_t i = 0; i < COMMAND_NAMES; i++)
+    {
+        char upper[32];
+        size_t len = strlen(k_command_names[i]);
+        for (size_t c = 0; c <= len; c++)
+        {
+            upper[c] = (char)toupper((unsigned char)k_command_names[i][c]);
+        }
+        Slice lower_name = {(const uint8_t *)k_command_names[i], (uint32_t)len};
+        Slice upper_name = {(const uint8_t *)upper, (uint32_t)len};
+        const Command *cmd = lookupCommand(&lower_name);
+        if (!cmd || strcmp(cmd->name, k_command_names[i]) != 0 || lookupCommand(&upper_name) != cmd)
+        {
+            fprintf(stderr, "%s not found\n", k_command_names[i]);
+            return check_failed("command lookup");
+        }
+    }
+    static const char *const k_unknown[] = {"", "g", "ge", "gets", "zrangebyscor", "hgetal", "asking", "psync"};
+    for (size_t i = 0; i < sizeof(k_unknown) / sizeof(k_unknown[0]); i++)
+    {
+        Slice name = {(const uint8_t *)k_unknown[i], (uint32_t)strlen(k_unknown[i])};
+        if (lookupCommand(&name))
+        {
+            fprintf(stderr, "\"%s\" found\n", k_unknown[i]);
+            return check_failed("command lookup");
+        }
+    }
+    return true;
+}
+
+// Segments of zero-copy sends stay until every send up to theirs completed,
+// whatever order the kernel reports the sends in.
+static bool check_zerocopy_ranges(void)
+{
+    static uint8_t data[BUFFER_SEGMENT_SIZE];
+    Buffer out;
+    initBuffer(&out);
+    // one send per segment, kernel ids 0, 1 and 2
+    for (int i = 0; i < 3; i++)
+    {
+        appendToNewBuffer(&out, data, sizeof(data));
+        markBufferZeroCopySend(&out, sizeof(data));
+        consumeNewBuffer(&out, sizeof(data));
+    }
+    size_t sent = bufferMemory(&out);
+    bool ok = completeBufferZeroCopy(&out, 1, 2) && bufferMemory(&out) == sent;
+    ok = ok && completeBufferZeroCopy(&out, 0, 0);
+    releaseBufferIfEmpty(&out);
+    ok = ok && bufferMemory(&out) == 0;
+    // ranges parked behind a missing send are bounded
+    for (uint32_t i = 0; ok && i < BUFFER_ZC_RANGES; i++)
+    {
+        ok = completeBufferZeroCopy(&out, 10 + 2 * i, 10 + 2 * i);
+    }
+    ok = ok && !completeBufferZeroCopy(&out, 30, 30);
+    freeBuffer(&out);
+    return ok || check_failed("zero-copy completion ranges");
+}
+
+static bool run_checks(void)
+{
+    return check_reply_memory() && check_delete_expired() && check_command_lookup() && check_zerocopy_ranges();
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [--reps N] [--min-time MS] [--filter SUBSTRING] [--json FILE]\n"
+            "  --reps N        timed repetitions per case (9, at most %d)\n"
+            "  --min-time MS   length of one repetition after calibration (20)\n"
+            "  --filter S      only run cases whose name contains S\n"
+            "  --json FILE     also write the results as JSON (- for stdout)\n",
+            prog, MAX_REPS);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 >= argc)
+        {
+            usage(argv[0]);
+        }
+        if (strcmp(argv[i], "--reps") == 0)
+        {
+            g_opt.reps = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--min-time") == 0)
+        {
+            g_opt.min_time_ms = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--filter") == 0)
+        {
+            g_opt.filter = argv[++i];
+        }
+        else if (strcmp(argv[i], "--json") == 0)
+        {
+            g_opt.json_path = argv[++i];
+        }
+        else
+        {
+            usage(argv[0]);
+        }
+    }
+    if (g_opt.reps < 1 || g_opt.reps > MAX_REPS || g_opt.min_time_ms <= 0)
+    {
+        usage(argv[0]);
+    }
+
+    initHashSeed();
+    if (!run_checks())
+    {
+        return 1;
+    }
+    open_perf_counters();
+    size_t total = sizeof(k_cases) / sizeof(k_cases[0]);
+    BenchResult *results = (BenchResult *)calloc(total, sizeof(BenchResult));
+    size_t count = 0;
+
+    bool to_stdout = g_opt.json_path && strcmp(g_opt.json_path, "-") == 0;
+    FILE *table = to_stdout ? stderr : stdout;
+    fprintf(table, "%-24s %8s %12s %12s %10s %12s\n", "case", "param", "ns/op", "min ns/op", "stddev",
+            g_perf_enabled ? "cycles/op" : "tsc/op");
+    for (size_t i = 0; i < total; i++)
+    {
+        if (g_opt.filter && !strstr(k_cases[i].name, g_opt.filter))
+        {
+            continue;
+        }
+        BenchResult *r = &results[count++];
+        run_case(&k_cases[i], r);
+        fprintf(table, "%-24s %8zu %12.2f %12.2f %10.2f %12.1f\n", r->bench->name, r->bench->param, r->median,
+                r->min, r->stddev, r->cycles_per_op);
+    }
+
+    if (g_opt.json_path)
+    {
+        FILE *out = to_stdout ? stdout : fopen(g_opt.json_path, "w");
+        if (!out)
+        {
+            perror(g_opt.json_path);
+            return 1;
+        }
+        write_json(out, results, count);
+        if (!to_stdout)
+        {
+            fclose(out);
+        }
+    }
+    free(results);
+    return 0;
+}
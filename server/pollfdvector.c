@@ -68,11 +68,13 @@ void clearPollFdVector(pollFdVector *vector)
     vector->size = 0; // Reset size to indicate an empty vector
 }
 
-void pollVectorPushBack(pollFdVector *vector, pollfd value)
+bool pollVectorPushBack(pollFdVector *vector, pollfd value)
 {
-    if (vector->size >= vector->capacity)
+    // resizing already counts the new slot, it only needs filling in
+    if (!resizePollFdVector(vector, vector->size + 1, 0))
     {
-        resizePollFdVector(vector, vector->size + 1, 0);
+        return false;
     }
-    vector->array[vector->size++] = value;
+    vector->array[vector->size - 1] = value;
+    return true;
 }
\ No newline at end of file
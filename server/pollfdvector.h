@@ -23,6 +23,7 @@ bool resizePollFdVector(pollFdVector *vec, size_t new_size, int value);
 
 void clearPollFdVector(pollFdVector *vector);
 
-void pollVectorPushBack(pollFdVector *vector, pollfd value);
+// Returns false, leaving the vector as it was, when it cannot grow.
+bool pollVectorPushBack(pollFdVector *vector, pollfd value);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,122 @@
+#include "pool.h"
+
+struct PoolSlab
+{
+    PoolSlab *next;
+    // objects follow, aligned like anything malloc returns
+    max_align_t objects[];
+};
+
+typedef struct FreeObject
+{
+    struct FreeObject *next;
+} FreeObject;
+
+void initObjectPool(ObjectPool *pool, size_t object_size, size_t slab_objects, size_t max_idle)
+{
+    // every object must be able to hold the free list link, and slab members
+    // must stay aligned
+    size_t align = sizeof(max_align_t);
+    if (object_size < sizeof(FreeObject))
+    {
+        object_size = sizeof(FreeObject);
+    }
+    pool->object_size = (object_size + align - 1) / align * align;
+    pool->slab_objects = slab_objects ? slab_objects : 1;
+    pool->max_idle = max_idle;
+    pool->free_list = NULL;
+    pool->slabs = NULL;
+    pool->stats.hits = 0;
+    pool->stats.misses = 0;
+    pool->stats.in_use = 0;
+    pool->stats.idle = 0;
+}
+
+void freeObjectPool(ObjectPool *pool)
+{
+    if (pool->slab_objects == 1)
+    {
+        FreeObject *object = (FreeObject *)pool->free_list;
+        while (object)
+        {
+            FreeObject *next = object->next;
+            free(object);
+            object = next;
+        }
+    }
+    while (pool->slabs)
+    {
+        PoolSlab *next = pool->slabs->next;
+        free(pool->slabs);
+        pool->slabs = next;
+    }
+    pool->free_list = NULL;
+    pool->stats.idle = 0;
+}
+
+static bool carveSlab(ObjectPool *pool)
+{
+    PoolSlab *slab = (PoolSlab *)malloc(sizeof(PoolSlab) + pool->slab_objects * pool->object_size);
+    if (!slab)
+    {
+        return false;
+    }
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    // thread back to front so objects are handed out in address order
+    uint8_t *base = (uint8_t *)slab->objects;
+    for (size_t i = pool->slab_objects; i-- > 0;)
+    {
+        FreeObject *object = (FreeObject *)(base + i * pool->object_size);
+        object->next = (FreeObject *)pool->free_list;
+        pool->free_list = object;
+    }
+    pool->stats.idle += pool->slab_objects;
+    return true;
+}
+
+void *poolAlloc(ObjectPool *pool)
+{
+    if (pool->free_list)
+    {
+        pool->stats.hits++;
+    }
+    else
+    {
+        pool->stats.misses++;
+        if (pool->slab_objects == 1)
+        {
+            void *object = malloc(pool->object_size);
+            if (object)
+            {
+                pool->stats.in_use++;
+            }
+            return object;
+        }
+        if (!carveSlab(pool))
+        {
+            return NULL;
+        }
+    }
+
+    FreeObject *object = (FreeObject *)pool->free_list;
+    pool->free_list = object->next;
+    pool->stats.idle--;
+    pool->stats.in_use++;
+    return object;
+}
+
+void poolFree(ObjectPool *pool, void *object)
+{
+    pool->stats.in_use--;
+    if (pool->slab_objects == 1 && pool->stats.idle >= pool->max_idle)
+    {
+        free(object);
+        return;
+    }
+    FreeObject *link = (FreeObject *)object;
+    link->next = (FreeObject *)pool->free_list;
+    pool->free_list = link;
+    pool->stats.idle++;
+}
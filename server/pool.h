@@ -0,0 +1,44 @@
+#ifndef POOL_HEADER
+#define POOL_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Fixed-size object pool owned by a single thread. Freed objects go onto an
+// intrusive free list and are handed out again before touching malloc.
+//
+// With slab_objects > 1 a miss carves a whole slab of objects at once; slabs
+// stay with the pool until freeObjectPool(). With slab_objects == 1 objects are
+// malloc'd one by one and at most max_idle of them are kept around idle.
+typedef struct PoolSlab PoolSlab;
+
+typedef struct
+{
+    uint64_t hits;
+    uint64_t misses;
+    // objects currently handed out / parked on the free list
+    size_t in_use;
+    size_t idle;
+} PoolStats;
+
+typedef struct
+{
+    size_t object_size;
+    size_t slab_objects;
+    size_t max_idle;
+    void *free_list;
+    PoolSlab *slabs;
+    PoolStats stats;
+} ObjectPool;
+
+void initObjectPool(ObjectPool *pool, size_t object_size, size_t slab_objects, size_t max_idle);
+
+void freeObjectPool(ObjectPool *pool);
+
+void *poolAlloc(ObjectPool *pool);
+
+void poolFree(ObjectPool *pool, void *object);
+
+#endif
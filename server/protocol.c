@@ -0,0 +1,163 @@
+#include "protocol.h"
+#include <string.h>
+
+ParseResult parseRequest(const uint8_t *data, size_t len, Slice *args, uint32_t max_args, uint32_t *nargs)
+{
+    if (len < 4)
+    {
+        return PARSE_MALFORMED;
+    }
+
+    uint32_t count = 0;
+    memcpy(&count, data, 4);
+
+    const uint8_t *cur = data + 4;
+    const uint8_t *end = data + len;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if ((size_t)(end - cur) < 4)
+        {
+            return PARSE_MALFORMED;
+        }
+        uint32_t arg_len = 0;
+        memcpy(&arg_len, cur, 4);
+        cur += 4;
+        if ((size_t)(end - cur) < arg_len)
+        {
+            return PARSE_MALFORMED;
+        }
+        if (count <= max_args)
+        {
+            args[i].data = cur;
+            args[i].len = arg_len;
+        }
+        cur += arg_len;
+    }
+
+    // trailing garbage means the client and server disagree on framing
+    if (cur != end)
+    {
+        return PARSE_MALFORMED;
+    }
+    if (count > max_args)
+    {
+        return PARSE_TOO_MANY_ARGS;
+    }
+
+    *nargs = count;
+    return PARSE_OK;
+}
+
+bool sliceEquals(const Slice *slice, const char *lower)
+{
+    size_t len = strlen(lower);
+    if (slice->len != len)
+    {
+        return false;
+    }
+    for (size_t i = 0; i < len; i++)
+    {
+        if ((slice->data[i] | 0x20) != (uint8_t)lower[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool appendRequest(Buffer *out, const Slice *args, uint32_t nargs)
+{
+    uint32_t len = 4;
+    for (uint32_t i = 0; i < nargs; i++)
+    {
+        len += 4 + args[i].len;
+    }
+    bool ok = appendToNewBuffer(out, (const uint8_t *)&len, 4) && appendToNewBuffer(out, (const uint8_t *)&nargs, 4);
+    for (uint32_t i = 0; ok && i < nargs; i++)
+    {
+        ok = appendToNewBuffer(out, (const uint8_t *)&args[i].len, 4) &&
+             appendToNewBuffer(out, args[i].data, args[i].len);
+    }
+    return ok;
+}
+
+BufferMark beginReply(Buffer *out)
+{
+    BufferMark header;
+    if (!reserveInBuffer(out, 4, &header))
+    {
+        header.data = NULL;
+    }
+    return header;
+}
+
+void endReply(Buffer *out, const BufferMark *header)
+{
+    if (!header->data)
+    {
+        return;
+    }
+    uint32_t len = (uint32_t)bytesSinceMark(out, header, 4);
+    memcpy(header->data, &len, 4);
+}
+
+static void appendTag(Buffer *out, uint8_t tag)
+{
+    appendToNewBuffer(out, &tag, 1);
+}
+
+static void appendU32(Buffer *out, uint32_t value)
+{
+    appendToNewBuffer(out, (const uint8_t *)&value, 4);
+}
+
+void replyNil(Buffer *out)
+{
+    appendTag(out, TAG_NIL);
+}
+
+void replyErr(Buffer *out, uint32_t code, const char *message)
+{
+    uint32_t len = (uint32_t)strlen(message);
+    appendTag(out, TAG_ERR);
+    appendU32(out, code);
+    appendU32(out, len);
+    appendToNewBuffer(out, (const uint8_t *)message, len);
+}
+
+void replyStr(Buffer *out, const uint8_t *data, size_t len)
+{
+    appendTag(out, TAG_STR);
+    appendU32(out, (uint32_t)len);
+    appendToNewBuffer(out, data, len);
+}
+
+void replyBlob(Buffer *out, Blob *blob)
+{
+    if (blob->len < REPLY_REFERENCE_MIN)
+    {
+        replyStr(out, blob->data, blob->len);
+        return;
+    }
+    appendTag(out, TAG_STR);
+    appendU32(out, blob->len);
+    appendBlobToBuffer(out, blob);
+}
+
+void replyInt(Buffer *out, int64_t value)
+{
+    appendTag(out, TAG_INT);
+    appendToNewBuffer(out, (const uint8_t *)&value, 8);
+}
+
+void replyDbl(Buffer *out, double value)
+{
+    appendTag(out, TAG_DBL);
+    appendToNewBuffer(out, (const uint8_t *)&value, 8);
+}
+
+void replyArr(Buffer *out, uint32_t count)
+{
+    appendTag(out, TAG_ARR);
+    appendU32(out, count);
+}
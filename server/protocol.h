@@ -0,0 +1,99 @@
+#ifndef PROTOCOL_HEADER
+#define PROTOCOL_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "buffer.h"
+
+// Request payload:  u32 nargs, then nargs x (u32 len, bytes)
+// Response payload: one tagged value, arrays nest further values
+enum
+{
+    TAG_NIL = 0, // nothing
+    TAG_ERR = 1, // u32 code, u32 len, message
+    TAG_STR = 2, // u32 len, bytes
+    TAG_INT = 3, // i64
+    TAG_DBL = 4, // double
+    TAG_ARR = 5, // u32 count, then count values
+};
+
+enum
+{
+    ERR_UNKNOWN = 1,
+    ERR_ARITY = 2,
+    ERR_PROTOCOL = 3,
+    ERR_OOM = 4,
+    ERR_SYNTAX = 5,
+    // another operation of the kind is still running
+    ERR_BUSY = 6,
+    ERR_IO = 7,
+    // the key holds a value of another type
+    ERR_WRONGTYPE = 8,
+    // a write sent to a replica
+    ERR_READONLY = 9,
+    // cluster redirects, with "<slot> <host:port>" as the message: the slot
+    // lives on that node now, or the key has to be asked for there once
+    ERR_MOVED = 10,
+    ERR_ASK = 11,
+    // the key is being moved to another node, retry shortly
+    ERR_TRYAGAIN = 12,
+    // no node serves the slot
+    ERR_CLUSTERDOWN = 13,
+};
+
+#define MAX_COMMAND_ARGS 1024
+// string replies at least this long reference the stored blob instead of
+// copying it into the outgoing buffer. The reply after a reference starts a
+// new segment, so anything shorter than one costs more than the copy.
+#define REPLY_REFERENCE_MIN BUFFER_SEGMENT_SIZE
+
+// A view into a request payload; never owns its bytes.
+typedef struct
+{
+    const uint8_t *data;
+    uint32_t len;
+} Slice;
+
+typedef enum
+{
+    PARSE_OK,
+    // well framed, but over max_args arguments; args is left unfilled
+    PARSE_TOO_MANY_ARGS,
+    // the framing is broken, so nothing after it can be trusted either
+    PARSE_MALFORMED,
+} ParseResult;
+
+// Fills args with slices pointing straight into data. A request with too
+// many arguments is still checked for its framing, so the caller can answer
+// it and carry on.
+ParseResult parseRequest(const uint8_t *data, size_t len, Slice *args, uint32_t max_args, uint32_t *nargs);
+
+// Whether the argument is the lowercase word, ignoring its case.
+bool sliceEquals(const Slice *slice, const char *lower);
+
+// Appends a whole request frame, length header included, as a client would
+// send it.
+bool appendRequest(Buffer *out, const Slice *args, uint32_t nargs);
+
+// Reserves the 4-byte length header of a response frame; endReply patches it
+// once the payload has been written.
+BufferMark beginReply(Buffer *out);
+
+void endReply(Buffer *out, const BufferMark *header);
+
+void replyNil(Buffer *out);
+
+void replyErr(Buffer *out, uint32_t code, const char *message);
+
+void replyStr(Buffer *out, const uint8_t *data, size_t len);
+
+void replyBlob(Buffer *out, Blob *blob);
+
+void replyInt(Buffer *out, int64_t value);
+
+void replyDbl(Buffer *out, double value);
+
+void replyArr(Buffer *out, uint32_t count);
+
+#endif
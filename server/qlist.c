@@ -0,0 +1,326 @@
+#include "qlist.h"
+#include <string.h>
+#include <malloc.h>
+
+// a chunk starts at the size of its first record and doubles up to
+// QLIST_CHUNK_BYTES; pops shrink it no further than this
+#define CHUNK_MIN_BYTES 64
+
+typedef struct Chunk
+{
+    struct Chunk *prev;
+    struct Chunk *next;
+    uint32_t count;
+    uint32_t used;
+    uint8_t data[];
+} Chunk;
+
+struct QList
+{
+    size_t size;
+    // usable bytes of the chunks
+    size_t memory;
+    size_t chunks;
+    Chunk *head;
+    Chunk *tail;
+};
+
+// Lengths are varints, 7 bits a byte, low bits first.
+static size_t varintSize(uint32_t value)
+{
+    size_t size = 1;
+    while (value >= 0x80)
+    {
+        value >>= 7;
+        size++;
+    }
+    return size;
+}
+
+static uint8_t *putVarint(uint8_t *p, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        *p++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (uint8_t)value;
+    return p;
+}
+
+static const uint8_t *getVarint(const uint8_t *p, uint32_t *value)
+{
+    uint32_t result = 0;
+    for (int shift = 0;; shift += 7)
+    {
+        uint8_t byte = *p++;
+        result |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            break;
+        }
+    }
+    *value = result;
+    return p;
+}
+
+// The trailing copy holds the same groups in reverse, every byte but the
+// first flagged, so it decodes from the end of the record backwards.
+static void putBackLen(uint8_t *p, uint32_t value, size_t size)
+{
+    for (size_t i = size; i-- > 0;)
+    {
+        p[i] = (uint8_t)((value & 0x7f) | (i > 0 ? 0x80 : 0));
+        value >>= 7;
+    }
+}
+
+// Start of the record that ends at end.
+static const uint8_t *recordBefore(const uint8_t *end)
+{
+    uint32_t len = 0;
+    const uint8_t *p = end;
+    for (int shift = 0;; shift += 7)
+    {
+        uint8_t byte = *--p;
+        len |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            break;
+        }
+    }
+    return p - len - varintSize(len);
+}
+
+static size_t recordSize(size_t len)
+{
+    return 2 * varintSize((uint32_t)len) + len;
+}
+
+static void putRecord(uint8_t *p, const uint8_t *value, size_t len)
+{
+    uint8_t *bytes = putVarint(p, (uint32_t)len);
+    memcpy(bytes, value, len);
+    putBackLen(bytes + len, (uint32_t)len, varintSize((uint32_t)len));
+}
+
+// Reads the record at p; returns where the next one starts.
+static const uint8_t *getRecord(const uint8_t *p, const uint8_t **value, uint32_t *len)
+{
+    p = getVarint(p, len);
+    *value = p;
+    return p + *len + varintSize(*len);
+}
+
+static size_t chunkCapacity(const Chunk *chunk)
+{
+    return malloc_usable_size((void *)chunk) - sizeof(Chunk);
+}
+
+QList *newQList(void)
+{
+    return (QList *)calloc(1, sizeof(QList));
+}
+
+void freeQList(QList *list)
+{
+    Chunk *chunk = list->head;
+    while (chunk)
+    {
+        Chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(list);
+}
+
+size_t qlistSize(const QList *list)
+{
+    return list->size;
+}
+
+size_t qlistMemory(const QList *list)
+{
+    return malloc_usable_size((void *)list) + list->memory;
+}
+
+bool qlistPacked(const QList *list)
+{
+    return list->chunks <= 1;
+}
+
+// Reallocates a linked chunk and points its neighbours at the new address;
+// NULL when out of memory, with the chunk untouched.
+static Chunk *resizeChunk(QList *list, Chunk *chunk, size_t capacity)
+{
+    size_t before = malloc_usable_size(chunk);
+    Chunk *moved = (Chunk *)realloc(chunk, sizeof(Chunk) + capacity);
+    if (!moved)
+    {
+        return NULL;
+    }
+    list->memory += malloc_usable_size(moved) - before;
+    *(moved->prev ? &moved->prev->next : &list->head) = moved;
+    *(moved->next ? &moved->next->prev : &list->tail) = moved;
+    return moved;
+}
+
+// The end chunk with room for size more bytes, grown if needed, or a new
+// one linked at that end.
+static Chunk *chunkFor(QList *list, bool tail, size_t size)
+{
+    Chunk *chunk = tail ? list->tail : list->head;
+    if (chunk && chunk->used + size <= QLIST_CHUNK_BYTES)
+    {
+        if (chunk->used + size <= chunkCapacity(chunk))
+        {
+            return chunk;
+        }
+        size_t capacity = chunkCapacity(chunk) * 2;
+        capacity = capacity > QLIST_CHUNK_BYTES ? QLIST_CHUNK_BYTES : capacity;
+        capacity = capacity < chunk->used + size ? chunk->used + size : capacity;
+        return resizeChunk(list, chunk, capacity);
+    }
+
+    Chunk *fresh = (Chunk *)malloc(sizeof(Chunk) + size);
+    if (!fresh)
+    {
+        return NULL;
+    }
+    list->memory += malloc_usable_size(fresh);
+    fresh->count = 0;
+    fresh->used = 0;
+    fresh->prev = tail ? list->tail : NULL;
+    fresh->next = tail ? NULL : list->head;
+    *(fresh->prev ? &fresh->prev->next : &list->head) = fresh;
+    *(fresh->next ? &fresh->next->prev : &list->tail) = fresh;
+    list->chunks++;
+    return fresh;
+}
+
+bool qlistPush(QList *list, bool tail, const uint8_t *value, size_t len)
+{
+    size_t size = recordSize(len);
+    Chunk *chunk = chunkFor(list, tail, size);
+    if (!chunk)
+    {
+        return false;
+    }
+    if (tail)
+    {
+        putRecord(chunk->data + chunk->used, value, len);
+    }
+    else
+    {
+        memmove(chunk->data + size, chunk->data, chunk->used);
+        putRecord(chunk->data, value, len);
+    }
+    chunk->used += (uint32_t)size;
+    chunk->count++;
+    list->size++;
+    return true;
+}
+
+bool qlistPeek(const QList *list, bool tail, const uint8_t **value, uint32_t *len)
+{
+    if (list->size == 0)
+    {
+        return false;
+    }
+    const Chunk *chunk = tail ? list->tail : list->head;
+    getRecord(tail ? recordBefore(chunk->data + chunk->used) : chunk->data, value, len);
+    return true;
+}
+
+void qlistPop(QList *list, bool tail)
+{
+    Chunk *chunk = tail ? list->tail : list->head;
+    if (--chunk->count == 0)
+    {
+        *(chunk->prev ? &chunk->prev->next : &list->head) = chunk->next;
+        *(chunk->next ? &chunk->next->prev : &list->tail) = chunk->prev;
+        list->memory -= malloc_usable_size(chunk);
+        free(chunk);
+        list->chunks--;
+        list->size--;
+        return;
+    }
+    if (tail)
+    {
+        chunk->used = (uint32_t)(recordBefore(chunk->data + chunk->used) - chunk->data);
+    }
+    else
+    {
+        const uint8_t *value;
+        uint32_t len;
+        size_t size = (size_t)(getRecord(chunk->data, &value, &len) - chunk->data);
+        memmove(chunk->data, chunk->data + size, chunk->used - size);
+        chunk->used -= (uint32_t)size;
+    }
+    list->size--;
+    // give back a chunk that drained to a quarter; a failed shrink changes
+    // nothing
+    if (chunk->used < chunkCapacity(chunk) / 4 && chunkCapacity(chunk) > CHUNK_MIN_BYTES)
+    {
+        size_t capacity = chunk->used * 2;
+        resizeChunk(list, chunk, capacity < CHUNK_MIN_BYTES ? CHUNK_MIN_BYTES : capacity);
+    }
+}
+
+void qlistSeek(const QList *list, size_t index, QListIter *iter)
+{
+    iter->chunk = NULL;
+    iter->offset = 0;
+    if (index >= list->size)
+    {
+        return;
+    }
+    // whole chunks are skipped by count from the nearer end
+    const Chunk *chunk;
+    if (index < list->size / 2)
+    {
+        chunk = list->head;
+        while (index >= chunk->count)
+        {
+            index -= chunk->count;
+            chunk = chunk->next;
+        }
+    }
+    else
+    {
+        size_t from_end = list->size - 1 - index;
+        chunk = list->tail;
+        while (from_end >= chunk->count)
+        {
+            from_end -= chunk->count;
+            chunk = chunk->prev;
+        }
+        index = chunk->count - 1 - from_end;
+    }
+    const uint8_t *p = chunk->data;
+    const uint8_t *value;
+    uint32_t len;
+    while (index-- > 0)
+    {
+        p = getRecord(p, &value, &len);
+    }
+    iter->chunk = chunk;
+    iter->offset = (size_t)(p - chunk->data);
+}
+
+bool qlistNext(QListIter *iter, const uint8_t **value, uint32_t *len)
+{
+    const Chunk *chunk = (const Chunk *)iter->chunk;
+    if (chunk && iter->offset == chunk->used)
+    {
+        chunk = chunk->next;
+        iter->chunk = chunk;
+        iter->offset = 0;
+    }
+    if (!chunk)
+    {
+        return false;
+    }
+    iter->offset = (size_t)(getRecord(chunk->data + iter->offset, value, len) - chunk->data);
+    return true;
+}
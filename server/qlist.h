@@ -0,0 +1,51 @@
+#ifndef QLIST_HEADER
+#define QLIST_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Sequence behind the list type: a doubly linked chain of chunks, each one
+// packed array of (varint length, bytes, length again) records. The
+// trailing length is stored backwards, so a chunk reads from either end. A
+// short list is a single chunk, which is its packed encoding. A push that
+// would take an end chunk past QLIST_CHUNK_BYTES starts a new one, so
+// pushes and pops touch one end chunk and an index skips whole chunks by
+// their counts before it scans one.
+#define QLIST_CHUNK_BYTES 8192
+
+typedef struct QList QList;
+
+QList *newQList(void);
+
+void freeQList(QList *list);
+
+size_t qlistSize(const QList *list);
+
+// Usable size of every allocation the list holds, itself included.
+size_t qlistMemory(const QList *list);
+
+bool qlistPacked(const QList *list);
+
+// Returns false when out of memory, with the list as it was.
+bool qlistPush(QList *list, bool tail, const uint8_t *value, size_t len);
+
+// The end element stays valid until the list changes; false when empty.
+bool qlistPeek(const QList *list, bool tail, const uint8_t **value, uint32_t *len);
+
+// Drops the end element of a non-empty list.
+void qlistPop(QList *list, bool tail);
+
+// Walks elements in order from an index. Any change to the list
+// invalidates it.
+typedef struct
+{
+    const void *chunk;
+    size_t offset;
+} QListIter;
+
+void qlistSeek(const QList *list, size_t index, QListIter *iter);
+
+bool qlistNext(QListIter *iter, const uint8_t **value, uint32_t *len);
+
+#endif
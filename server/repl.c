@@ -0,0 +1,772 @@
+#include "repl.h"
+#include "aof.h"
+#include "fdio.h"
+#include "log.h"
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+// the longest handshake reply either side accepts
+#define MAX_HANDSHAKE 256
+// a replica gives up on a primary that goes this long silent during a sync
+#define SYNC_TIMEOUT_S 60
+
+typedef struct
+{
+    int fd;
+    char addr[48];
+    // a full sync's child is still writing the snapshot
+    bool syncing;
+    pid_t child;
+    // the next byte of the command log to send
+    uint64_t offset;
+    uint64_t ack_offset;
+    uint64_t last_ack_ms;
+    // a CONTINUE reply not fully sent yet
+    uint8_t preamble[MAX_HANDSHAKE];
+    size_t preamble_len;
+    size_t preamble_sent;
+    // acknowledgements read so far
+    uint8_t input[MAX_HANDSHAKE];
+    size_t input_len;
+} Replica;
+
+static struct
+{
+    pthread_mutex_t lock;
+    char replid[REPL_ID_LEN + 1];
+    Keyspace **shards;
+    int count;
+    // the last backlog_size bytes of the command log; offset counts every
+    // byte ever fed and the ring holds [offset - backlog_len, offset)
+    uint8_t *backlog;
+    size_t backlog_size;
+    uint64_t backlog_len;
+    uint64_t offset;
+    // appended by the workers, removed only by the sender thread
+    Replica replicas[REPL_MAX_REPLICAS];
+    int nreplicas;
+    // wakes the sender thread
+    int wake_fd;
+
+    bool replica;
+    char *host;
+    int port;
+    int worker_wake_fd;
+    // signalled when worker 0 takes the link or loses it
+    pthread_cond_t changed;
+    bool link_pending;
+    bool link_up;
+    bool sync_in_progress;
+    ReplLink link;
+    // what the pending link continues from
+    char link_replid[REPL_ID_LEN + 1];
+    uint64_t link_offset;
+    // bytes of the primary's log applied, and when the link was last read
+    _Atomic uint64_t applied;
+    _Atomic uint64_t last_io_ms;
+} g_repl = {.lock = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER, .wake_fd = -1};
+
+// A string reply frame, as beginReply and replyStr would lay it out.
+static size_t encodeReply(uint8_t *out, const char *text)
+{
+    uint32_t len = (uint32_t)strlen(text);
+    uint32_t payload = 1 + 4 + len;
+    memcpy(out, &payload, 4);
+    out[4] = TAG_STR;
+    memcpy(out + 5, &len, 4);
+    memcpy(out + 9, text, len);
+    return 4 + payload;
+}
+
+// A decimal offset; false for anything else, "-1" included.
+static bool parseOffset(const Slice *slice, uint64_t *offset)
+{
+    if (slice->len == 0 || slice->len > 20)
+    {
+        return false;
+    }
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < slice->len; i++)
+    {
+        if (slice->data[i] < '0' || slice->data[i] > '9')
+        {
+            return false;
+        }
+        value = value * 10 + (uint64_t)(slice->data[i] - '0');
+    }
+    *offset = value;
+    return true;
+}
+
+static void newReplid(char *out)
+{
+    uint8_t bytes[REPL_ID_LEN / 2];
+    if (getrandom(bytes, sizeof(bytes), 0) != (ssize_t)sizeof(bytes))
+    {
+        uint64_t seed = monotonicMs() ^ ((uint64_t)getpid() << 32);
+        for (size_t i = 0; i < sizeof(bytes); i++)
+        {
+            seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+            bytes[i] = (uint8_t)(seed >> 56);
+        }
+    }
+    for (size_t i = 0; i < sizeof(bytes); i++)
+    {
+        snprintf(out + 2 * i, 3, "%02x", bytes[i]);
+    }
+}
+
+static void peerName(int fd, char *out, size_t size)
+{
+    struct sockaddr_in addr = {};
+    socklen_t len = sizeof(addr);
+    if (getpeername(fd, (struct sockaddr *)&addr, &len) != 0 || addr.sin_family != AF_INET)
+    {
+        snprintf(out, size, "fd %d", fd);
+        return;
+    }
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    snprintf(out, size, "%s:%u", ip, ntohs(addr.sin_port));
+}
+
+// Under the lock.
+static uint64_t backlogFirst(void)
+{
+    return g_repl.offset - g_repl.backlog_len;
+}
+
+// Under the lock; the sender thread is the only one that removes replicas.
+static void dropReplica(int i)
+{
+    Replica *r = &g_repl.replicas[i];
+    if (r->syncing)
+    {
+        kill(r->child, SIGKILL);
+        waitpid(r->child, NULL, 0);
+    }
+    close(r->fd);
+    g_repl.replicas[i] = g_repl.replicas[--g_repl.nreplicas];
+}
+
+// Takes in REPLCONF ACK <offset> frames. Returns false when the replica
+// hung up or sent something else than small request frames.
+static bool readAcks(Replica *r)
+{
+    while (true)
+    {
+        ssize_t n = read(r->fd, r->input + r->input_len, sizeof(r->input) - r->input_len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN)
+        {
+            return true;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        r->input_len += (size_t)n;
+
+        size_t used = 0;
+        while (r->input_len - used >= 4)
+        {
+            uint32_t len;
+            memcpy(&len, r->input + used, 4);
+            if (len > sizeof(r->input) - 4)
+            {
+                return false;
+            }
+            if (r->input_len - used - 4 < len)
+            {
+                break;
+            }
+            Slice args[3];
+            uint32_t nargs = 0;
+            uint64_t offset;
+            if (parseRequest(r->input + used + 4, len, args, 3, &nargs) == PARSE_OK && nargs == 3 &&
+                sliceEquals(&args[0], "replconf") && sliceEquals(&args[1], "ack") && parseOffset(&args[2], &offset))
+            {
+                pthread_mutex_lock(&g_repl.lock);
+                r->ack_offset = offset;
+                r->last_ack_ms = monotonicMs();
+                pthread_mutex_unlock(&g_repl.lock);
+            }
+            used += 4 + len;
+        }
+        memmove(r->input, r->input + used, r->input_len - used);
+        r->input_len -= used;
+    }
+}
+
+// Sends what the replica is missing until the socket fills up. Returns false
+// when it has to be dropped.
+static bool sendLog(Replica *r, uint8_t *chunk)
+{
+    while (r->preamble_sent < r->preamble_len)
+    {
+        ssize_t n = send(r->fd, r->preamble + r->preamble_sent, r->preamble_len - r->preamble_sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN)
+        {
+            return true;
+        }
+        if (n < 0)
+        {
+            return false;
+        }
+        r->preamble_sent += (size_t)n;
+    }
+    while (true)
+    {
+        // copy out under the lock, send without it
+        pthread_mutex_lock(&g_repl.lock);
+        if (r->offset < backlogFirst())
+        {
+            pthread_mutex_unlock(&g_repl.lock);
+            logWarn("replica %s fell out of the backlog, dropping it", r->addr);
+            return false;
+        }
+        size_t len = g_repl.offset - r->offset;
+        if (len > REPL_SEND_CHUNK)
+        {
+            len = REPL_SEND_CHUNK;
+        }
+        size_t start = (size_t)(r->offset % g_repl.backlog_size);
+        size_t first = g_repl.backlog_size - start < len ? g_repl.backlog_size - start : len;
+        memcpy(chunk, g_repl.backlog + start, first);
+        memcpy(chunk + first, g_repl.backlog, len - first);
+        pthread_mutex_unlock(&g_repl.lock);
+        if (len == 0)
+        {
+            return true;
+        }
+
+        ssize_t n = send(r->fd, chunk, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN)
+        {
+            return true;
+        }
+        if (n < 0)
+        {
+            return false;
+        }
+        pthread_mutex_lock(&g_repl.lock);
+        r->offset += (uint64_t)n;
+        pthread_mutex_unlock(&g_repl.lock);
+    }
+}
+
+// Under the lock: a replica whose snapshot child exited goes online, or is
+// dropped when the child failed.
+static bool reapSync(Replica *r)
+{
+    int status = 0;
+    pid_t rv = waitpid(r->child, &status, WNOHANG);
+    if (rv == 0 || (rv < 0 && errno == EINTR))
+    {
+        return true;
+    }
+    r->syncing = false;
+    if (rv != r->child || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        logWarn("full sync of replica %s failed: %s", r->addr,
+                rv == r->child && WIFEXITED(status) ? strerror(WEXITSTATUS(status)) : "child killed");
+        return false;
+    }
+    setBlocking(r->fd, false);
+    r->last_ack_ms = monotonicMs();
+    logInfo("replica %s synced, streaming from offset %llu", r->addr, (unsigned long long)r->offset);
+    return true;
+}
+
+// Streams the backlog to every online replica and reads their acks; polls
+// for the snapshot children of the ones still syncing.
+static void *sendToReplicas(void *arg)
+{
+    (void)arg;
+    uint8_t *chunk = (uint8_t *)malloc(REPL_SEND_CHUNK);
+    if (!chunk)
+    {
+        logError("replication: out of memory");
+        return NULL;
+    }
+    while (true)
+    {
+        struct pollfd fds[1 + REPL_MAX_REPLICAS];
+        fds[0].fd = g_repl.wake_fd;
+        fds[0].events = POLLIN;
+        int timeout = -1;
+        pthread_mutex_lock(&g_repl.lock);
+        int count = g_repl.nreplicas;
+        for (int i = 0; i < count; i++)
+        {
+            Replica *r = &g_repl.replicas[i];
+            fds[1 + i].fd = r->syncing ? -1 : r->fd;
+            fds[1 + i].events = POLLIN;
+            if (r->preamble_sent < r->preamble_len || r->offset < g_repl.offset)
+            {
+                fds[1 + i].events |= POLLOUT;
+            }
+            fds[1 + i].revents = 0;
+            if (r->syncing)
+            {
+                timeout = REPL_POLL_MS;
+            }
+        }
+        pthread_mutex_unlock(&g_repl.lock);
+
+        if (poll(fds, (nfds_t)(1 + count), timeout) < 0 && errno != EINTR)
+        {
+            logError("replication: poll: %s", strerror(errno));
+            continue;
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            uint64_t value;
+            ssize_t rv = read(g_repl.wake_fd, &value, sizeof(value));
+            (void)rv;
+        }
+
+        // backwards, so a drop only moves a replica already visited
+        for (int i = count - 1; i >= 0; i--)
+        {
+            Replica *r = &g_repl.replicas[i];
+            bool ok = true;
+            if (r->syncing)
+            {
+                pthread_mutex_lock(&g_repl.lock);
+                ok = reapSync(r);
+                pthread_mutex_unlock(&g_repl.lock);
+                if (ok && !r->syncing)
+                {
+                    ok = sendLog(r, chunk);
+                }
+            }
+            else
+            {
+                if (fds[1 + i].revents & (POLLIN | POLLERR | POLLHUP))
+                {
+                    ok = readAcks(r);
+                    if (!ok)
+                    {
+                        logInfo("replica %s disconnected", r->addr);
+                    }
+                }
+                if (ok && (fds[1 + i].revents & POLLOUT))
+                {
+                    ok = sendLog(r, chunk);
+                }
+            }
+            if (!ok)
+            {
+                pthread_mutex_lock(&g_repl.lock);
+                dropReplica(i);
+                pthread_mutex_unlock(&g_repl.lock);
+            }
+        }
+    }
+    return NULL;
+}
+
+bool initReplication(size_t backlog_size, Keyspace *const *shards, int count)
+{
+    newReplid(g_repl.replid);
+    g_repl.backlog_size = backlog_size;
+    g_repl.count = count;
+    g_repl.shards = (Keyspace **)calloc((size_t)count, sizeof(Keyspace *));
+    g_repl.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!g_repl.shards || g_repl.wake_fd < 0 || backlog_size == 0)
+    {
+        return false;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        g_repl.shards[i] = shards[i];
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, sendToReplicas, NULL) != 0)
+    {
+        return false;
+    }
+    pthread_detach(thread);
+    return true;
+}
+
+bool replIsSync(const Slice *args, uint32_t nargs)
+{
+    return nargs > 0 && sliceEquals(&args[0], "psync");
+}
+
+// Under the lock.
+static Replica *addReplica(int fd, uint64_t offset)
+{
+    Replica *r = &g_repl.replicas[g_repl.nreplicas++];
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->offset = offset;
+    r->ack_offset = offset;
+    r->last_ack_ms = monotonicMs();
+    peerName(fd, r->addr, sizeof(r->addr));
+    return r;
+}
+
+ReplSyncResult replAttach(int self, int fd, const Slice *args, uint32_t nargs)
+{
+    uint64_t offset = 0;
+    bool has_offset = nargs == 3 && parseOffset(&args[2], &offset);
+    char text[MAX_HANDSHAKE - 16];
+
+    pthread_mutex_lock(&g_repl.lock);
+    if (g_repl.nreplicas == REPL_MAX_REPLICAS)
+    {
+        pthread_mutex_unlock(&g_repl.lock);
+        logWarn("refusing a replica: already serving %d", REPL_MAX_REPLICAS);
+        return REPL_SYNC_FAILED;
+    }
+    if (g_repl.backlog && has_offset && args[1].len == REPL_ID_LEN &&
+        memcmp(args[1].data, g_repl.replid, REPL_ID_LEN) == 0 && offset >= backlogFirst() && offset <= g_repl.offset)
+    {
+        Replica *r = addReplica(fd, offset);
+        snprintf(text, sizeof(text), "CONTINUE %s %llu", g_repl.replid, (unsigned long long)offset);
+        r->preamble_len = encodeReply(r->preamble, text);
+        logInfo("replica %s continues from offset %llu", r->addr, (unsigned long long)offset);
+        pthread_mutex_unlock(&g_repl.lock);
+        wakeEventFd(g_repl.wake_fd);
+        return REPL_SYNC_PARTIAL;
+    }
+    pthread_mutex_unlock(&g_repl.lock);
+
+    // the snapshot and the offset it continues from have to agree, so take
+    // both with every worker between commands
+    if (!pauseWorkers(self))
+    {
+        return REPL_SYNC_BUSY;
+    }
+    if (!g_repl.backlog)
+    {
+        g_repl.backlog = (uint8_t *)malloc(g_repl.backlog_size);
+    }
+    if (!g_repl.backlog || !aofStartFeed(g_repl.count))
+    {
+        resumeWorkers();
+        logError("replication: out of memory for the backlog");
+        return REPL_SYNC_FAILED;
+    }
+    // the others committed at the end of their last iteration
+    aofCommit(self);
+    pthread_mutex_lock(&g_repl.lock);
+    offset = g_repl.offset;
+    pthread_mutex_unlock(&g_repl.lock);
+    snprintf(text, sizeof(text), "FULLRESYNC %s %llu", g_repl.replid, (unsigned long long)offset);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        signal(SIGPIPE, SIG_IGN);
+        setBlocking(fd, true);
+        uint8_t preamble[MAX_HANDSHAKE];
+        size_t len = encodeReply(preamble, text);
+        bool ok = writeAll(fd, preamble, len) && streamSnapshot(fd, g_repl.shards, g_repl.count);
+        _exit(ok ? 0 : (errno > 0 && errno < 256 ? errno : 255));
+    }
+    int err = errno;
+    resumeWorkers();
+    if (pid < 0)
+    {
+        logError("replica full sync: fork: %s", strerror(err));
+        return REPL_SYNC_FAILED;
+    }
+
+    pthread_mutex_lock(&g_repl.lock);
+    Replica *r = addReplica(fd, offset);
+    r->syncing = true;
+    r->child = pid;
+    logInfo("full sync of replica %s started by pid %d at offset %llu", r->addr, (int)pid,
+            (unsigned long long)offset);
+    pthread_mutex_unlock(&g_repl.lock);
+    wakeEventFd(g_repl.wake_fd);
+    return REPL_SYNC_FULL;
+}
+
+void replFeed(const Buffer *staged, size_t from, size_t len)
+{
+    if (len == 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&g_repl.lock);
+    size_t size = g_repl.backlog_size;
+    // only the tail of a batch larger than the ring survives anyway
+    if (len > size)
+    {
+        from += len - size;
+        g_repl.offset += len - size;
+        len = size;
+    }
+    size_t start = (size_t)(g_repl.offset % size);
+    size_t first = size - start < len ? size - start : len;
+    copyFromBuffer(staged, from, g_repl.backlog + start, first);
+    copyFromBuffer(staged, from + first, g_repl.backlog, len - first);
+    g_repl.offset += len;
+    g_repl.backlog_len = g_repl.backlog_len + len > size ? size : g_repl.backlog_len + len;
+    bool any = g_repl.nreplicas > 0;
+    pthread_mutex_unlock(&g_repl.lock);
+    if (any)
+    {
+        wakeEventFd(g_repl.wake_fd);
+    }
+}
+
+// Sends PSYNC and reads the answer, then the snapshot of a full sync.
+static bool syncWithPrimary(int fd, ReplLink *link, char *replid, uint64_t *offset)
+{
+    char request_offset[24];
+    pthread_mutex_lock(&g_repl.lock);
+    bool known = g_repl.replid[0] != '\0';
+    snprintf(request_offset, sizeof(request_offset), "%llu", (unsigned long long)atomic_load(&g_repl.applied));
+    Slice args[3] = {{(const uint8_t *)"PSYNC", 5},
+                     {(const uint8_t *)(known ? g_repl.replid : "?"), known ? REPL_ID_LEN : 1},
+                     {(const uint8_t *)(known ? request_offset : "-1"), (uint32_t)(known ? strlen(request_offset) : 2)}};
+    Buffer request;
+    initBuffer(&request);
+    bool built = appendRequest(&request, args, 3);
+    pthread_mutex_unlock(&g_repl.lock);
+    bool sent = built && writeBuffer(fd, &request);
+    freeBuffer(&request);
+    if (!sent)
+    {
+        logWarn("primary %s:%d: %s", g_repl.host, g_repl.port, built ? strerror(errno) : "out of memory");
+        return false;
+    }
+
+    uint32_t len = 0;
+    uint8_t reply[MAX_HANDSHAKE];
+    bool framed = readAll(fd, (uint8_t *)&len, 4);
+    bool bad_frame = framed && (len < 5 || len >= sizeof(reply));
+    if (!framed || bad_frame || !readAll(fd, reply, len))
+    {
+        logWarn("primary %s:%d: no valid answer to PSYNC: %s", g_repl.host, g_repl.port,
+                bad_frame ? "bad frame" : strerror(errno));
+        return false;
+    }
+    uint32_t text_len;
+    memcpy(&text_len, reply + 1 + (reply[0] == TAG_ERR ? 4 : 0), 4);
+    size_t header = reply[0] == TAG_ERR ? 9 : 5;
+    if (text_len != len - header)
+    {
+        logWarn("primary %s:%d: malformed answer to PSYNC", g_repl.host, g_repl.port);
+        return false;
+    }
+    char text[MAX_HANDSHAKE];
+    memcpy(text, reply + header, text_len);
+    text[text_len] = '\0';
+    if (reply[0] != TAG_STR)
+    {
+        logWarn("primary %s:%d refused to sync: %s", g_repl.host, g_repl.port, text);
+        return false;
+    }
+
+    char kind[16], id[REPL_ID_LEN + 1];
+    unsigned long long start;
+    if (sscanf(text, "%15s %40s %llu", kind, id, &start) != 3 || strlen(id) != REPL_ID_LEN ||
+        (strcmp(kind, "FULLRESYNC") != 0 && strcmp(kind, "CONTINUE") != 0))
+    {
+        logWarn("primary %s:%d: unexpected answer to PSYNC: %s", g_repl.host, g_repl.port, text);
+        return false;
+    }
+    memcpy(replid, id, REPL_ID_LEN + 1);
+    *offset = start;
+    link->full = strcmp(kind, "FULLRESYNC") == 0;
+    if (!link->full)
+    {
+        logInfo("continuing replication from %s:%d at offset %llu", g_repl.host, g_repl.port, start);
+        return true;
+    }
+
+    logInfo("full sync from %s:%d at offset %llu", g_repl.host, g_repl.port, start);
+    uint64_t begin = monotonicMs();
+    if (!receiveSnapshot(fd, &link->snapshot))
+    {
+        return false;
+    }
+    logInfo("received %zu snapshot bytes in %llu ms", link->snapshot.size,
+            (unsigned long long)(monotonicMs() - begin));
+    return true;
+}
+
+// Keeps a link to the primary: syncs, hands the socket to worker 0 and waits
+// for it to close, then reconnects after REPL_RETRY_MS.
+static void *followPrimary(void *arg)
+{
+    (void)arg;
+    while (true)
+    {
+        int fd = connectTcp("primary", g_repl.host, g_repl.port, SYNC_TIMEOUT_S);
+        if (fd >= 0)
+        {
+            pthread_mutex_lock(&g_repl.lock);
+            g_repl.sync_in_progress = true;
+            pthread_mutex_unlock(&g_repl.lock);
+
+            ReplLink link = {};
+            link.fd = fd;
+            char replid[REPL_ID_LEN + 1];
+            uint64_t offset = 0;
+            bool ok = syncWithPrimary(fd, &link, replid, &offset);
+
+            pthread_mutex_lock(&g_repl.lock);
+            g_repl.sync_in_progress = false;
+            if (ok)
+            {
+                g_repl.link = link;
+                memcpy(g_repl.link_replid, replid, sizeof(replid));
+                g_repl.link_offset = offset;
+                g_repl.link_pending = true;
+                wakeEventFd(g_repl.worker_wake_fd);
+                while (g_repl.link_pending || g_repl.link_up)
+                {
+                    pthread_cond_wait(&g_repl.changed, &g_repl.lock);
+                }
+            }
+            pthread_mutex_unlock(&g_repl.lock);
+            if (!ok)
+            {
+                close(fd);
+            }
+        }
+        struct timespec retry = {REPL_RETRY_MS / 1000, (REPL_RETRY_MS % 1000) * 1000000L};
+        nanosleep(&retry, NULL);
+    }
+    return NULL;
+}
+
+bool initReplica(const char *host, int port, int wake_fd)
+{
+    g_repl.host = strdup(host);
+    g_repl.port = port;
+    g_repl.worker_wake_fd = wake_fd;
+    g_repl.replid[0] = '\0';
+    if (!g_repl.host)
+    {
+        return false;
+    }
+    g_repl.replica = true;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, followPrimary, NULL) != 0)
+    {
+        return false;
+    }
+    pthread_detach(thread);
+    logInfo("replicating %s:%d", host, port);
+    return true;
+}
+
+bool replIsReplica(void)
+{
+    return g_repl.replica;
+}
+
+bool replTakeLink(ReplLink *link)
+{
+    if (!g_repl.replica)
+    {
+        return false;
+    }
+    pthread_mutex_lock(&g_repl.lock);
+    bool pending = g_repl.link_pending;
+    if (pending)
+    {
+        *link = g_repl.link;
+        g_repl.link_pending = false;
+        g_repl.link_up = true;
+        memcpy(g_repl.replid, g_repl.link_replid, sizeof(g_repl.replid));
+        atomic_store(&g_repl.applied, g_repl.link_offset);
+        atomic_store(&g_repl.last_io_ms, monotonicMs());
+    }
+    pthread_mutex_unlock(&g_repl.lock);
+    return pending;
+}
+
+void replApplied(uint64_t bytes)
+{
+    atomic_fetch_add_explicit(&g_repl.applied, bytes, memory_order_relaxed);
+    atomic_store_explicit(&g_repl.last_io_ms, monotonicMs(), memory_order_relaxed);
+}
+
+bool replAppendAck(Buffer *out)
+{
+    char offset[24];
+    int len = snprintf(offset, sizeof(offset), "%llu", (unsigned long long)atomic_load(&g_repl.applied));
+    Slice args[3] = {{(const uint8_t *)"REPLCONF", 8}, {(const uint8_t *)"ACK", 3}, {(const uint8_t *)offset, (uint32_t)len}};
+    return appendRequest(out, args, 3);
+}
+
+void replLinkLost(bool full)
+{
+    pthread_mutex_lock(&g_repl.lock);
+    g_repl.link_up = false;
+    if (full)
+    {
+        g_repl.replid[0] = '\0';
+    }
+    pthread_cond_signal(&g_repl.changed);
+    pthread_mutex_unlock(&g_repl.lock);
+    logWarn("lost the link to the primary %s:%d", g_repl.host, g_repl.port);
+}
+
+void replStatus(ReplStatus *status)
+{
+    memset(status, 0, sizeof(*status));
+    uint64_t now = monotonicMs();
+    pthread_mutex_lock(&g_repl.lock);
+    status->replica = g_repl.replica;
+    memcpy(status->replid, g_repl.replid, sizeof(status->replid));
+    if (g_repl.replica)
+    {
+        status->offset = atomic_load(&g_repl.applied);
+        snprintf(status->primary, sizeof(status->primary), "%s:%d", g_repl.host, g_repl.port);
+        status->link_up = g_repl.link_up;
+        status->sync_in_progress = g_repl.sync_in_progress || g_repl.link_pending;
+        status->last_io_seconds = (now - atomic_load(&g_repl.last_io_ms)) / 1000;
+    }
+    else
+    {
+        status->offset = g_repl.offset;
+        status->backlog_size = g_repl.backlog ? g_repl.backlog_size : 0;
+        status->backlog_first = backlogFirst();
+        status->backlog_len = g_repl.backlog_len;
+        status->replicas = g_repl.nreplicas;
+        for (int i = 0; i < g_repl.nreplicas; i++)
+        {
+            const Replica *r = &g_repl.replicas[i];
+            ReplicaStatus *out = &status->replica_status[i];
+            memcpy(out->addr, r->addr, sizeof(out->addr));
+            out->online = !r->syncing;
+            out->ack_offset = r->ack_offset;
+            out->lag = (now - r->last_ack_ms) / 1000;
+        }
+    }
+    pthread_mutex_unlock(&g_repl.lock);
+}
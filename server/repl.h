@@ -0,0 +1,114 @@
+#ifndef REPL_HEADER
+#define REPL_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "buffer.h"
+#include "keyspace.h"
+#include "protocol.h"
+#include "snapshot.h"
+
+// Primary/replica replication. A replica connects like a client and sends
+// PSYNC replid offset ("?" and -1 the first time). The primary answers with
+// a string reply, then the data:
+//   FULLRESYNC <replid> <offset>  a streamSnapshot of every shard, then the
+//                                 command log from offset
+//   CONTINUE <replid> <offset>    the command log from the replica's offset
+// The command log is what the append-only file would get: request frames
+// with absolute deadlines. Every byte of it ever produced has an offset, and
+// the last --repl-backlog-size bytes stay in a ring, so a replica that comes
+// back before its offset is overwritten only gets what it missed. The
+// replica applies the frames as requests from a trusted connection and
+// sends REPLCONF ACK <offset> request frames back every REPL_ACK_MS.
+#define REPL_BACKLOG_DEFAULT (16 << 20)
+#define REPL_ID_LEN 40
+#define REPL_MAX_REPLICAS 16
+// bytes a replica gets per send
+#define REPL_SEND_CHUNK (256 << 10)
+// how often the sender thread reaps sync children and a replica acks
+#define REPL_POLL_MS 100
+#define REPL_ACK_MS 1000
+#define REPL_RETRY_MS 1000
+
+// Primary side: the sender thread and, once the first replica attaches, the
+// backlog.
+bool initReplication(size_t backlog_size, Keyspace *const *shards, int count);
+
+// Whether a request is PSYNC, which takes over the connection.
+bool replIsSync(const Slice *args, uint32_t nargs);
+
+typedef enum
+{
+    REPL_SYNC_FULL,
+    REPL_SYNC_PARTIAL,
+    REPL_SYNC_BUSY,
+    REPL_SYNC_FAILED,
+} ReplSyncResult;
+
+// Takes over fd, a connection whose PSYNC is its last request, and streams
+// to it from the sender thread. A full sync pauses the workers to fork a
+// child that writes the snapshot. Unless the result is FULL or PARTIAL the
+// caller still owns fd and replies with an error.
+ReplSyncResult replAttach(int self, int fd, const Slice *args, uint32_t nargs);
+
+// Appends len staged bytes from offset from to the backlog.
+void replFeed(const Buffer *staged, size_t from, size_t len);
+
+// Replica side: a thread that connects to the primary, receives a full sync
+// into memory and hands the socket over to worker 0, whose wake_fd it pokes.
+bool initReplica(const char *host, int port, int wake_fd);
+
+bool replIsReplica(void);
+
+// A link the thread has ready, taken over by worker 0 at the top of its
+// loop. With a full sync the snapshot replaces every shard first.
+typedef struct
+{
+    int fd;
+    bool full;
+    SnapshotFile snapshot;
+} ReplLink;
+
+bool replTakeLink(ReplLink *link);
+
+// Worker 0 ran or forwarded a frame of the link.
+void replApplied(uint64_t bytes);
+
+// The request frame to send the primary as an acknowledgement.
+bool replAppendAck(Buffer *out);
+
+// The link closed; full tells the thread its next sync must start over.
+void replLinkLost(bool full);
+
+typedef struct
+{
+    char addr[48];
+    bool online;
+    uint64_t ack_offset;
+    // seconds since the last acknowledgement
+    uint64_t lag;
+} ReplicaStatus;
+
+typedef struct
+{
+    bool replica;
+    char replid[REPL_ID_LEN + 1];
+    // bytes of the command log produced, or applied on a replica
+    uint64_t offset;
+    // primary
+    size_t backlog_size;
+    uint64_t backlog_first;
+    uint64_t backlog_len;
+    int replicas;
+    ReplicaStatus replica_status[REPL_MAX_REPLICAS];
+    // replica
+    char primary[64];
+    bool link_up;
+    bool sync_in_progress;
+    uint64_t last_io_seconds;
+} ReplStatus;
+
+void replStatus(ReplStatus *status);
+
+#endif
@@ -1,5 +1,6 @@
 #include <assert.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <errno.h>
@@ -13,23 +14,33 @@
 #include "connection.h"
 #include "pollfdvector.h"
 #include "connectionvector.h"
-#include <sys/time.h>
+#include "eventloop.h"
+#include "keyspace.h"
+#include "hash.h"
+#include "snapshot.h"
+#include "aof.h"
+#include "repl.h"
+#include "cluster.h"
+#include "command.h"
+#include "spscqueue.h"
+#include "worker.h"
+#include "log.h"
+#include <time.h>
+#include <sys/uio.h>
+#include <linux/errqueue.h>
+#include <sys/eventfd.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#ifdef HAVE_LIBURING
+#include "uring.h"
+#endif
 
 const uint32_t BULK_REQUEST_MARKER = 0xFFFFFFFF;
 
-static void msg(const char *msg)
-{
-    fprintf(stderr, "%s\n", msg);
-}
-
-static void msg_errno(const char *msg)
-{
-    fprintf(stderr, "[errno:%d] %s\n", errno, msg);
-}
-
 static void die(const char *msg)
 {
-    fprintf(stderr, "[%d] %s\n", errno, msg);
+    logError("[errno:%d] %s", errno, msg);
+    logFlush();
     abort();
 }
 
@@ -55,335 +66,2158 @@ static void fd_set_nb(int fd)
 
 const size_t k_max_msg = 32 << 20;
 
-static void handle_accept(int fd, ConnectionVector *fd2conn)
+// global server state: one worker per thread, each owning a keyspace shard,
+// and the n x n matrix of queues between them (queues[from * n + to])
+static struct
 {
-    struct sockaddr_in client_addr = {};
-    socklen_t socklen = sizeof(client_addr);
-    int connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen);
-    if (connfd < 0)
-    {
-        msg_errno("accept() error");
-        return;
-    }
-    uint32_t ip = client_addr.sin_addr.s_addr;
-    fprintf(stderr, "new client from %u.%u.%u.%u:%u\n",
-            ip & 255, (ip >> 8) & 255, (ip >> 16) & 255, ip >> 24,
-            ntohs(client_addr.sin_port));
+    Worker *workers;
+    int nworkers;
+    SpscQueue *queues;
+} g_data;
+
+static struct
+{
+    EventBackend backend;
+    // writes of at least this many bytes use MSG_ZEROCOPY, 0 disables it
+    size_t zerocopy_threshold;
+    int threads;
+    LogLevel log_level;
+    // split evenly between the workers' keyspaces, 0 means unlimited
+    size_t maxmemory;
+    EvictionPolicy maxmemory_policy;
+    // loaded at startup, written by SAVE and BGSAVE
+    const char *snapshot_path;
+    // when on, the append-only file takes the snapshot's place at startup
+    bool appendonly;
+    AofFsync appendfsync;
+    const char *aof_path;
+    // unsent reply bytes past which a client is not read, and past which it
+    // is disconnected; 0 disables either
+    size_t output_pause;
+    size_t output_limit;
+    int port;
+    // set to follow a primary; the ring kept for replicas that reconnect
+    const char *replicaof_host;
+    int replicaof_port;
+    size_t repl_backlog_size;
+    // serve only the hash slots assigned here; the address other nodes and
+    // clients are sent to for this one, and where the slot map is kept
+    bool cluster_enabled;
+    const char *cluster_announce_ip;
+    const char *cluster_config_file;
+} g_config = {EVENT_BACKEND_EPOLL, 0, 1, LOG_INFO, 0, EVICT_NOEVICTION, SNAPSHOT_DEFAULT_PATH,
+              false, AOF_FSYNC_EVERYSEC, AOF_DEFAULT_PATH, OUTPUT_PAUSE_DEFAULT, OUTPUT_LIMIT_DEFAULT,
+              1234, NULL, 0, REPL_BACKLOG_DEFAULT, false, "127.0.0.1", CLUSTER_CONFIG_DEFAULT};
+
+// On a replica, worker 0's connection to the primary, and a full sync
+// waiting for the other workers to park.
+static struct
+{
+    int fd;
+    uint64_t last_ack_ms;
+    bool loading;
+    ReplLink pending;
+} g_primary = {-1};
+
+static SpscQueue *shard_queue(int from, int to)
+{
+    return &g_data.queues[from * g_data.nworkers + to];
+}
+
+// Multiply-shift over the high hash bits; the low bits are what the keyspace
+// table itself probes with.
+static int hash_shard(uint64_t hcode)
+{
+    return (int)(((hcode >> 32) * (uint64_t)g_data.nworkers) >> 32);
+}
+
+static int key_shard(const Slice *key)
+{
+    return hash_shard(keyspaceHash(key->data, key->len));
+}
+
+// Takes a connection from the worker's pool for a freshly accepted socket.
+// Closes the socket and returns NULL if there is no memory for it.
+static Connection *setup_connection(Worker *w, int connfd)
+{
+    ConnectionVector *fd2conn = &w->fd2conn;
 
     fd_set_nb(connfd);
 
-    if (fd2conn->size <= (size_t)connfd)
+    Connection *conn = NULL;
+    if (fd2conn->size > connfd || resizeConnectionVector(fd2conn, connfd + 1, 0))
     {
-        resizeConnectionVector(fd2conn, connfd + 1, 0);
+        conn = (Connection *)poolAlloc(&w->conn_pool);
     }
+    if (!conn)
+    {
+        logWarn("out of memory");
+        close(connfd);
+        return NULL;
+    }
+    fd2conn->array[connfd] = conn;
+    statAdd(&w->stats->connections_accepted, 1);
 
-    Connection *conn = &fd2conn->array[connfd];
+    *conn = initConnection();
     conn->fd = connfd;
     conn->want_read = true;
-    conn->want_write = false;
-    conn->want_close = false;
+    conn->generation = ++w->next_generation;
+    if (g_config.zerocopy_threshold > 0 && !w->uring)
+    {
+        int one = 1;
+        conn->zerocopy = setsockopt(connfd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    }
     initBuffer(&conn->incoming_buffer);
     initBuffer(&conn->outgoing_buffer);
+    return conn;
 }
 
-// Helper function to process individual requests within a bulk
-static bool process_individual_request(Connection *conn)
+// Closes the socket and returns the connection to the pool.
+static void release_connection(Worker *w, Connection *conn)
 {
-    size_t incoming_buffer_size = conn->incoming_buffer.data_end - conn->incoming_buffer.data_begin;
-    if (incoming_buffer_size < 4)
+    if (conn->primary)
     {
-        return false;
+        g_primary.fd = -1;
+        replLinkLost(false);
     }
+    w->fd2conn.array[conn->fd] = NULL;
+    statAdd(&w->stats->connections_closed, 1);
+    freeConnection(conn);
+    poolFree(&w->conn_pool, conn);
+}
 
-    uint32_t len = 0;
-    memcpy(&len, conn->incoming_buffer.data_begin, 4);
+static void handle_accept(Worker *w)
+{
+    int fd = w->listen_fd;
 
-    if (len > k_max_msg)
+    // the listener is edge-triggered under epoll, so drain the accept queue
+    while (true)
     {
-        msg("too long");
-        conn->want_close = true;
-        return false;
-    }
+        struct sockaddr_in client_addr = {};
+        socklen_t socklen = sizeof(client_addr);
+        int connfd = accept(fd, (struct sockaddr *)&client_addr, &socklen);
+        if (connfd < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (connfd < 0)
+        {
+            if (errno != EAGAIN)
+            {
+                logWarn("[errno:%d] accept() error", errno);
+            }
+            return;
+        }
+        uint32_t ip = client_addr.sin_addr.s_addr;
+        logDebug("new client from %u.%u.%u.%u:%u",
+                ip & 255, (ip >> 8) & 255, (ip >> 16) & 255, ip >> 24,
+                ntohs(client_addr.sin_port));
 
-    if (4 + len > incoming_buffer_size)
-    {
-        return false;
+        Connection *conn = setup_connection(w, connfd);
+        if (conn && !eventLoopAdd(&w->loop, connfd, EVENT_READ))
+        {
+            logWarn("[errno:%d] event loop registration error", errno);
+            release_connection(w, conn);
+        }
     }
-
-    const uint8_t *request = &conn->incoming_buffer.data_begin[4];
-
-    printf("bulk request item: len:%d data:%.*s\n",
-           len, len < 100 ? len : 100, request);
-
-    appendToNewBuffer(&conn->outgoing_buffer, (const uint8_t *)&len, 4);
-    appendToNewBuffer(&conn->outgoing_buffer, request, len);
-
-    consumeNewBuffer(&conn->incoming_buffer, 4 + len);
-    return true;
 }
 
-static bool try_one_request(Connection *conn)
+static void queue_message(Worker *w, int target, const ShardMessage *message)
 {
-    size_t incoming_buffer_size = conn->incoming_buffer.data_end - conn->incoming_buffer.data_begin;
-    if (incoming_buffer_size < 4)
+    ShardBacklog *backlog = &w->backlog[target];
+    // keep FIFO order: once something is backlogged, everything queues behind it
+    bool hold = w->hold_replies && message->kind == SHARD_REPLY;
+    if (backlog->size == 0 && !hold && spscPush(shard_queue(w->id, target), message))
     {
-        return false;
+        w->notify[target] = true;
+        return;
     }
 
-    uint32_t len = 0;
-    memcpy(&len, conn->incoming_buffer.data_begin, 4);
-
-    // Check if this is a bulk request
-    if (len == BULK_REQUEST_MARKER)
+    if (backlog->size == backlog->capacity)
     {
-        // Need at least 8 bytes (marker + num_requests)
-        if (incoming_buffer_size < 8)
-        {
-            return false;
-        }
-
-        // Get number of requests in the bulk
-        uint32_t num_requests = 0;
-        memcpy(&num_requests, conn->incoming_buffer.data_begin + 4, 4);
-
-        // Validate number of requests (add reasonable limit)
-        if (num_requests > 1000) // Arbitrary limit
+        size_t capacity = backlog->capacity ? backlog->capacity * 2 : 64;
+        ShardMessage *items = (ShardMessage *)realloc(backlog->items, capacity * sizeof(ShardMessage));
+        if (!items)
         {
-            msg("Too many requests in bulk");
-            conn->want_close = true;
-            return false;
+            die("out of memory");
         }
+        backlog->items = items;
+        backlog->capacity = capacity;
+    }
+    backlog->items[backlog->size++] = *message;
+}
 
-        printf("Received bulk request with %u requests\n", num_requests);
-
-        // Skip the marker and num_requests fields
-        consumeNewBuffer(&conn->incoming_buffer, 8);
-
-        // Process each request in the bulk
-        bool all_processed = true;
-        for (uint32_t i = 0; i < num_requests; i++)
+static void fd_list_push(FdList *list, int fd)
+{
+    if (list->size == list->capacity)
+    {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        int *fds = (int *)realloc(list->fds, capacity * sizeof(int));
+        if (!fds)
         {
-            // Process individual request
-            if (!process_individual_request(conn))
-            {
-                all_processed = false;
-                break;
-            }
+            die("out of memory");
         }
-
-        return all_processed;
+        list->fds = fds;
+        list->capacity = capacity;
     }
+    list->fds[list->size++] = fd;
+}
 
-    // Handle regular (non-bulk) request
-    if (len > k_max_msg)
+// Schedules the connection's replies for the end-of-iteration flush.
+static void queue_flush(Worker *w, Connection *conn)
+{
+#ifdef HAVE_LIBURING
+    if (w->uring)
     {
-        msg("too long");
-        conn->want_close = true;
-        return false;
+        if (!uringQueueFlush(w->uring, conn->fd))
+        {
+            die("out of memory");
+        }
+        return;
     }
-
-    if (4 + len > incoming_buffer_size)
+#endif
+    if (!conn->flush_queued)
     {
-        return false;
+        conn->flush_queued = true;
+        fd_list_push(&w->flush, conn->fd);
     }
+}
 
-    const uint8_t *request = &conn->incoming_buffer.data_begin[4];
+// What unsent replies cost: the segments holding them, not just their bytes.
+// A drained buffer's spare segment does not count.
+static size_t output_memory(const Connection *conn)
+{
+    return bufferDrained(&conn->outgoing_buffer) ? 0 : bufferMemory(&conn->outgoing_buffer);
+}
 
-    printf("client says: len:%d data:%.*s\n",
-           len, len < 100 ? len : 100, request);
+// Replies are piling up faster than the client takes them. Requests
+// forwarded to other shards count too, since their replies are still to come.
+static bool output_paused(const Connection *conn)
+{
+    return (g_config.output_pause > 0 && output_memory(conn) >= g_config.output_pause) ||
+           conn->outgoing_buffer.placeholders >= REQUEST_BUDGET;
+}
 
-    appendToNewBuffer(&conn->outgoing_buffer, (const uint8_t *)&len, 4);
-    appendToNewBuffer(&conn->outgoing_buffer, request, len);
+// Lists the connection for another turn at the start of the next iteration.
+static void defer_read(Worker *w, Connection *conn)
+{
+    if (!conn->read_queued)
+    {
+        conn->read_queued = true;
+        fd_list_push(&w->unread, conn->fd);
+    }
+}
 
-    consumeNewBuffer(&conn->incoming_buffer, 4 + len);
-    return true;
+// A connection that stopped short of its input either waits for its replies
+// to drain or gets its next turn in the following iteration.
+static void stop_reading(Worker *w, Connection *conn)
+{
+    if (output_paused(conn))
+    {
+        conn->want_read = false;
+    }
+    else
+    {
+        defer_read(w, conn);
+    }
 }
 
-static void handle_write(Connection *conn)
+// Called wherever a client's output shrinks: a paused one goes back to
+// reading, starting with the requests it has buffered.
+static void unpause_reads(Worker *w, Connection *conn)
 {
-    size_t outgoing_buffer_size = conn->outgoing_buffer.data_end - conn->outgoing_buffer.data_begin;
-    if (outgoing_buffer_size == 0)
+    if (!conn->want_read && !conn->want_close && !output_paused(conn))
     {
         conn->want_read = true;
-        conn->want_write = false;
-        return;
+        defer_read(w, conn);
     }
-    ssize_t rv = write(conn->fd, conn->outgoing_buffer.data_begin, outgoing_buffer_size);
-    if (rv < 0 && errno == EAGAIN)
+}
+
+// Hands the request to the worker owning its key. The reply will be dropped
+// into a placeholder so it still goes out in request order; a request from
+// the primary gets none and its reply is never sent back.
+static bool forward_request(Worker *w, Connection *conn, int owner, const uint8_t *request, uint32_t len,
+                            bool asking)
+{
+    ShardMessage message;
+    message.kind = SHARD_REQUEST;
+    message.fd = conn->fd;
+    message.generation = conn->generation;
+    message.payload = newBlob(request, len);
+    message.placeholder = NULL;
+    message.asking = asking;
+    if (message.payload && !conn->primary)
     {
-        return;
+        message.placeholder = appendPlaceholderToBuffer(&conn->outgoing_buffer);
     }
-    if (rv < 0)
+    if (!message.payload || (!conn->primary && !message.placeholder))
     {
-        msg_errno("write() error");
+        if (message.payload)
+        {
+            releaseBlob(message.payload);
+        }
+        logWarn("out of memory");
         conn->want_close = true;
-        return;
+        return false;
     }
+    queue_message(w, owner, &message);
+    return true;
+}
 
-    consumeNewBuffer(&conn->outgoing_buffer, (size_t)rv);
+static void reply_error(Connection *conn, uint32_t code, const char *message)
+{
+    BufferMark header = beginReply(&conn->outgoing_buffer);
+    replyErr(&conn->outgoing_buffer, code, message);
+    endReply(&conn->outgoing_buffer, &header);
+}
 
-    if (outgoing_buffer_size == 0)
+// In cluster mode, a request for a key of a slot this node does not serve
+// gets a redirect framed into out instead of running. Returns true then.
+static bool cluster_redirects(Worker *w, Buffer *out, const Command *cmd, const Slice *args, uint32_t nargs,
+                              bool asking)
+{
+    const Slice *key = requestKey(cmd, args, nargs);
+    uint32_t code;
+    char message[CLUSTER_ADDR_LEN + 64];
+    if (!key || clusterServes(w->id, &w->db, key, asking, &code, message, sizeof(message)))
     {
-        conn->want_read = true;
-        conn->want_write = false;
+        return false;
     }
+    BufferMark header = beginReply(out);
+    replyErr(out, code, message);
+    endReply(out, &header);
+    return true;
 }
 
-static void handle_read(Connection *conn)
+// PSYNC hands the socket over to the replication thread, so it has to be the
+// last request the client sent, with every earlier reply gone out. The
+// worker then closes its own descriptor. Returns false once it is handed over.
+static bool attach_replica(Worker *w, Connection *conn, const Slice *args, uint32_t nargs, uint32_t len)
 {
-    struct timeval start, end;
-    gettimeofday(&start, NULL);
-
-    uint8_t buf[64 * 1024];
-    ssize_t rv = read(conn->fd, buf, sizeof(buf));
-
-    if (rv < 0 && errno == EAGAIN)
+    if (replIsReplica())
     {
-        return;
+        reply_error(conn, ERR_UNKNOWN, "a replica does not take replicas of its own");
+        return true;
+    }
+    if (nargs != 3)
+    {
+        reply_error(conn, ERR_ARITY, "wrong number of arguments");
+        return true;
+    }
+    if (!bufferDrained(&conn->outgoing_buffer) || bufferSize(&conn->incoming_buffer) != 4 + (size_t)len)
+    {
+        reply_error(conn, ERR_PROTOCOL, "PSYNC must be sent alone");
+        return true;
+    }
+    int fd = fcntl(conn->fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        reply_error(conn, ERR_IO, "cannot take the replica, see the server log");
+        logWarn("[errno:%d] dup() error", errno);
+        return true;
     }
-    if (rv < 0)
+    switch (replAttach(w->id, fd, args, nargs))
     {
-        msg_errno("read() error");
+    case REPL_SYNC_FULL:
+    case REPL_SYNC_PARTIAL:
+        conn->detached = true;
         conn->want_close = true;
-        return;
+        return false;
+    case REPL_SYNC_BUSY:
+        reply_error(conn, ERR_BUSY, "the workers are paused by a save, try again");
+        break;
+    case REPL_SYNC_FAILED:
+        reply_error(conn, ERR_IO, "cannot take the replica, see the server log");
+        break;
+    }
+    close(fd);
+    return true;
+}
+
+// Runs one request payload straight out of the incoming buffer and frames the
+// reply into the outgoing buffer, or forwards it to the shard owning the key.
+static bool dispatch_request(Worker *w, Connection *conn, const uint8_t *request, uint32_t len)
+{
+    Slice args[MAX_COMMAND_ARGS];
+    uint32_t nargs = 0;
+    uint64_t start = statsNow();
+    ParseResult parsed = parseRequest(request, len, args, MAX_COMMAND_ARGS, &nargs);
+    if (parsed == PARSE_MALFORMED)
+    {
+        logWarn("bad request");
+        conn->want_close = true;
+        return false;
     }
-    if (rv == 0)
+    recordLatency(&w->stats->stages[STAGE_PARSE], statsNow() - start);
+    // only broken framing costs the connection; the primary gets no replies
+    if (parsed == PARSE_TOO_MANY_ARGS)
     {
-        size_t incoming_buffer_size = conn->incoming_buffer.data_end - conn->incoming_buffer.data_begin;
-        if (incoming_buffer_size == 0)
+        if (!conn->primary)
         {
-            msg("client closed");
+            reply_error(conn, ERR_PROTOCOL, "too many arguments");
         }
-        else
+        return true;
+    }
+
+    if (!conn->primary && replIsSync(args, nargs))
+    {
+        return attach_replica(w, conn, args, nargs, len);
+    }
+    const Command *cmd = requestCommand(args, nargs);
+    if (!conn->primary && replIsReplica() && cmd && (cmd->flags & CMD_WRITE))
+    {
+        reply_error(conn, ERR_READONLY, "write commands are not allowed on a replica");
+        return true;
+    }
+    // the flag only covers the request right after ASKING
+    bool asking = conn->asking;
+    conn->asking = false;
+    if (g_config.cluster_enabled && !conn->primary && clusterIsAsking(args, nargs))
+    {
+        conn->asking = true;
+        BufferMark header = beginReply(&conn->outgoing_buffer);
+        replyNil(&conn->outgoing_buffer);
+        endReply(&conn->outgoing_buffer, &header);
+        return true;
+    }
+
+    if (g_data.nworkers > 1)
+    {
+        const Slice *key = requestKey(cmd, args, nargs);
+        if (key)
         {
-            msg("unexpected EOF");
+            int owner = key_shard(key);
+            if (owner != w->id)
+            {
+                return forward_request(w, conn, owner, request, len, asking);
+            }
         }
-        conn->want_close = true;
-        return;
+    }
+    // the slot check needs the shard owning the key, so it runs there
+    if (g_config.cluster_enabled && !conn->primary &&
+        cluster_redirects(w, &conn->outgoing_buffer, cmd, args, nargs, asking))
+    {
+        return true;
     }
 
-    appendToNewBuffer(&conn->incoming_buffer, buf, (size_t)rv);
-
-    bool processed_any = false;
-    while (try_one_request(conn))
+    if (conn->primary)
     {
-        processed_any = true;
+        CommandContext ctx = {&w->db, &w->scratch, w->stats, w->id, aofBuffer(w->id)};
+        executeCommand(&ctx, cmd, args, nargs);
+        consumeNewBuffer(&w->scratch, bufferSize(&w->scratch));
+        return true;
     }
+    CommandContext ctx = {&w->db, &conn->outgoing_buffer, w->stats, w->id, aofBuffer(w->id)};
+    executeCommand(&ctx, cmd, args, nargs);
+    return true;
+}
 
-    size_t outgoing_buffer_size = conn->outgoing_buffer.data_end - conn->outgoing_buffer.data_begin;
-    if (outgoing_buffer_size > 0)
+// Consumes the next complete frame of the incoming buffer: a request, which
+// is run or forwarded, or the header of a bulk batch. The items of a batch
+// are ordinary request frames; the count of those still to come lives on the
+// connection, so a batch may span any number of reads. Returns false when no
+// complete frame is buffered or the connection should be dropped.
+static bool try_one_request(Worker *w, Connection *conn)
+{
+    size_t incoming_buffer_size = bufferSize(&conn->incoming_buffer);
+    if (incoming_buffer_size < 4)
     {
-        conn->want_read = false;
-        conn->want_write = true;
+        return false;
+    }
 
-        if (processed_any)
-        {
-            gettimeofday(&end, NULL);
-            double time_taken = (end.tv_sec - start.tv_sec) * 1e6;
-            time_taken = (time_taken + (end.tv_usec - start.tv_usec)) * 1e-6;
+    uint32_t len = 0;
+    copyFromBuffer(&conn->incoming_buffer, 0, &len, 4);
 
-            printf("Request processed in %.6f seconds\n", time_taken);
+    if (len == BULK_REQUEST_MARKER && conn->bulk_remaining == 0)
+    {
+        // marker and item count
+        if (incoming_buffer_size < 8)
+        {
+            return false;
+        }
+        uint32_t num_requests = 0;
+        copyFromBuffer(&conn->incoming_buffer, 4, &num_requests, 4);
+        if (num_requests > MAX_BULK_REQUESTS)
+        {
+            logWarn("Too many requests in bulk");
+            conn->want_close = true;
+            return false;
         }
+        logDebug("received bulk request with %u requests", num_requests);
+        consumeNewBuffer(&conn->incoming_buffer, 8);
+        conn->bulk_remaining = num_requests;
+        return true;
     }
-}
 
-int main()
-{
+    // a marker inside a batch is caught here too: batches do not nest
+    if (len > k_max_msg)
+    {
+        logWarn("too long");
+        conn->want_close = true;
+        return false;
+    }
 
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0)
+    if (4 + len > incoming_buffer_size)
     {
-        die("socket()");
+        return false;
     }
-    int val = 1;
-    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
 
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = ntohs(1234);
-    addr.sin_addr.s_addr = ntohl(0); // wildcard address 0.0.0.0
-    int rv = bind(fd, (const struct sockaddr *)&addr, sizeof(addr));
-    if (rv)
+    const uint8_t *frame = bufferData(&conn->incoming_buffer, 4 + len);
+    if (!frame)
     {
-        die("bind()");
+        logWarn("out of memory");
+        conn->want_close = true;
+        return false;
     }
+    const uint8_t *request = frame + 4;
 
-    fd_set_nb(fd);
+    logDebug("client says: len:%u data:%.*s", len, (int)(len < 100 ? len : 100), request);
 
-    rv = listen(fd, SOMAXCONN);
-    if (rv)
+    if (!dispatch_request(w, conn, request, len))
     {
-        die("listen()");
+        return false;
+    }
+
+    consumeNewBuffer(&conn->incoming_buffer, 4 + len);
+    if (conn->bulk_remaining > 0)
+    {
+        conn->bulk_remaining--;
+    }
+    if (conn->primary)
+    {
+        replApplied(4 + (uint64_t)len);
     }
+    return true;
+}
+
+#define MAX_WRITE_IOV 128
 
-    ConnectionVector fd2conn = initConnectionVector();
-    pollFdVector poll_args;
-    initPollFdVector(&poll_args);
+static void handle_write(Worker *w, Connection *conn)
+{
+    // replies to requests read in this same iteration may be on their way
+    if (w->hold_replies)
+    {
+        aofCommit(w->id);
+    }
     while (true)
     {
-        clearPollFdVector(&poll_args);
-        struct pollfd pfd = {fd, POLLIN, 0};
-        pollVectorPushBack(&poll_args, pfd);
-        size_t size = fd2conn.size;
-        for (int i = 0; i < size; i++)
+        if (bufferDrained(&conn->outgoing_buffer))
         {
-            Connection *conn = &fd2conn.array[i];
-            if (!conn)
-            {
-                continue;
-            }
-            struct pollfd pfd = {conn->fd, POLLERR, 0};
-            if (conn->want_read)
-            {
-                pfd.events |= POLLIN;
-            }
-            if (conn->want_write)
-            {
-                pfd.events |= POLLOUT;
-            }
-            pollVectorPushBack(&poll_args, pfd);
+            conn->want_write = false;
+            releaseBufferIfEmpty(&conn->outgoing_buffer);
+            return;
+        }
+
+        // protocol headers come from the buffer's own segments, large values
+        // straight from their blobs
+        struct iovec iov[MAX_WRITE_IOV];
+        int iovcnt = bufferIovecs(&conn->outgoing_buffer, iov, MAX_WRITE_IOV);
+        if (iovcnt == 0)
+        {
+            // everything sendable is out, the rest waits on another shard
+            return;
+        }
+        size_t total = 0;
+        for (int i = 0; i < iovcnt; i++)
+        {
+            total += iov[i].iov_len;
+        }
+
+        struct msghdr message = {};
+        message.msg_iov = iov;
+        message.msg_iovlen = (size_t)iovcnt;
+        int flags = MSG_NOSIGNAL;
+        bool zerocopy = conn->zerocopy && total >= g_config.zerocopy_threshold;
+        if (zerocopy)
+        {
+            flags |= MSG_ZEROCOPY;
         }
 
-        int rv = poll(poll_args.array, (nfds_t)poll_args.size, -1);
+        uint64_t start = statsNow();
+        ssize_t rv = sendmsg(conn->fd, &message, flags);
+        recordLatency(&w->stats->stages[STAGE_WRITE], statsNow() - start);
         if (rv < 0 && errno == EINTR)
         {
             continue;
         }
+        if (rv < 0 && errno == EAGAIN)
+        {
+            return;
+        }
+        if (rv < 0 && errno == ENOBUFS && zerocopy)
+        {
+            // out of optmem for page pinning, fall back to a copying send
+            conn->zerocopy = false;
+            continue;
+        }
         if (rv < 0)
         {
-            die("poll");
+            logWarn("[errno:%d] write() error", errno);
+            conn->want_close = true;
+            return;
+        }
+
+        statAdd(&w->stats->bytes_out, (uint64_t)rv);
+        if (zerocopy)
+        {
+            markBufferZeroCopySend(&conn->outgoing_buffer, (size_t)rv);
         }
+        consumeNewBuffer(&conn->outgoing_buffer, (size_t)rv);
+        unpause_reads(w, conn);
+    }
+}
 
-        if (poll_args.array[0].revents)
+// MSG_ZEROCOPY completions arrive on the socket error queue. Returns false if
+// the error event was a genuine socket error.
+static bool handle_zerocopy_completions(Connection *conn)
+{
+    while (true)
+    {
+        uint8_t control[128];
+        struct msghdr message = {};
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        if (recvmsg(conn->fd, &message, MSG_ERRQUEUE) < 0)
         {
-            handle_accept(fd, &fd2conn);
+            break;
         }
 
-        for (size_t i = 1; i < poll_args.size; ++i)
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&message); cm; cm = CMSG_NXTHDR(&message, cm))
         {
-            uint32_t ready = poll_args.array[i].revents;
-            if (ready == 0)
+            bool is_recverr = (cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                              (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR);
+            if (!is_recverr)
             {
                 continue;
             }
-
-            Connection *conn = &fd2conn.array[poll_args.array[i].fd];
-            if (ready & POLLIN)
+            struct sock_extended_err *err = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
             {
-                assert(conn->want_read);
-                handle_read(conn);
+                continue;
             }
-            if (ready & POLLOUT)
+            // the kernel copied anyway (e.g. loopback): stop paying for pinning
+            if (err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
             {
-                assert(conn->want_write);
-                handle_write(conn);
+                conn->zerocopy = false;
             }
-
-            if ((ready & POLLERR) || conn->want_close)
+            // notifications cover the inclusive id range [ee_info, ee_data]
+            if (!completeBufferZeroCopy(&conn->outgoing_buffer, err->ee_info, err->ee_data))
             {
-                freeConnection(conn);
+                logWarn("too many zero-copy completions out of order");
+                return false;
             }
         }
     }
-    return 0;
-}
\ No newline at end of file
+
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+    {
+        return false;
+    }
+    return error == 0;
+}
+
+// Runs the complete requests sitting in the incoming buffer, drawing on the
+// turn's request budget, until the buffer runs dry or the client's replies
+// reach the pause mark. Returns false when the connection has to stop for
+// this turn with requests possibly left over.
+static bool process_incoming(Worker *w, Connection *conn, uint32_t *budget)
+{
+    while (true)
+    {
+        if (*budget == 0 || output_paused(conn))
+        {
+            return false;
+        }
+        if (!try_one_request(w, conn))
+        {
+            return true;
+        }
+        (*budget)--;
+    }
+}
+
+static void handle_read(Worker *w, Connection *conn)
+{
+    // keep reading until EAGAIN: with edge-triggered epoll there will be no
+    // further notification for data that is already queued on the socket.
+    // A client that keeps the socket full yields after READ_BUDGET bytes or
+    // REQUEST_BUDGET requests and gets its next turn in the following
+    // iteration; one whose replies are over the pause mark waits for them to
+    // drain. Input left from an earlier turn runs first.
+    size_t budget = READ_BUDGET;
+    uint32_t requests = REQUEST_BUDGET;
+    bool more = process_incoming(w, conn, &requests);
+    while (!conn->want_close)
+    {
+        if (!more || budget == 0)
+        {
+            stop_reading(w, conn);
+            break;
+        }
+
+        // read straight into the tail of the incoming buffer
+        size_t available = 0;
+        uint8_t *dst = prepareBufferWrite(&conn->incoming_buffer, BUFFER_MIN_READ, &available);
+        if (!dst)
+        {
+            logWarn("out of memory");
+            conn->want_close = true;
+            return;
+        }
+
+        ssize_t rv = read(conn->fd, dst, available < budget ? available : budget);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv < 0 && errno == EAGAIN)
+        {
+            break;
+        }
+        if (rv < 0)
+        {
+            logWarn("[errno:%d] read() error", errno);
+            conn->want_close = true;
+            return;
+        }
+        if (rv == 0)
+        {
+            size_t incoming_buffer_size = bufferSize(&conn->incoming_buffer);
+            if (incoming_buffer_size == 0)
+            {
+                logDebug("client closed");
+            }
+            else
+            {
+                logInfo("unexpected EOF");
+            }
+            conn->want_close = true;
+            return;
+        }
+
+        commitBufferWrite(&conn->incoming_buffer, (size_t)rv);
+        statAdd(&w->stats->bytes_in, (uint64_t)rv);
+        budget -= (size_t)rv;
+
+        more = process_incoming(w, conn, &requests);
+    }
+    if (conn->want_close)
+    {
+        return;
+    }
+
+    // nothing buffered in either direction: give the segments back
+    releaseBufferIfEmpty(&conn->incoming_buffer);
+
+    if (!bufferDrained(&conn->outgoing_buffer))
+    {
+        queue_flush(w, conn);
+    }
+}
+
+static uint32_t connection_interest(const Connection *conn)
+{
+    uint32_t events = 0;
+    if (conn->want_read)
+    {
+        events |= EVENT_READ;
+    }
+    if (conn->want_write)
+    {
+        events |= EVENT_WRITE;
+    }
+    return events;
+}
+
+static void close_connection(Worker *w, Connection *conn)
+{
+    eventLoopRemove(&w->loop, conn->fd);
+    release_connection(w, conn);
+}
+
+static void update_interest(Worker *w, Connection *conn)
+{
+    if (!eventLoopSetInterest(&w->loop, conn->fd, connection_interest(conn)))
+    {
+        logWarn("[errno:%d] event loop update error", errno);
+        close_connection(w, conn);
+    }
+}
+
+// Runs a request forwarded by another worker against the local shard and
+// sends the framed reply back.
+static void serve_remote_request(Worker *w, int origin, ShardMessage *message)
+{
+    CommandContext ctx = {&w->db, &w->scratch, w->stats, w->id, aofBuffer(w->id)};
+    Slice args[MAX_COMMAND_ARGS];
+    uint32_t nargs = 0;
+    if (parseRequest(message->payload->data, message->payload->len, args, MAX_COMMAND_ARGS, &nargs) != PARSE_OK)
+    {
+        // the origin already parsed it, so this cannot happen; answer anyway
+        BufferMark header = beginReply(&w->scratch);
+        replyErr(&w->scratch, ERR_PROTOCOL, "bad request");
+        endReply(&w->scratch, &header);
+    }
+    else
+    {
+        const Command *cmd = requestCommand(args, nargs);
+        // requests from the primary carry no placeholder and are never redirected
+        if (!g_config.cluster_enabled || !message->placeholder ||
+            !cluster_redirects(w, &w->scratch, cmd, args, nargs, message->asking))
+        {
+            executeCommand(&ctx, cmd, args, nargs);
+        }
+    }
+    releaseBlob(message->payload);
+
+    // flatten: blob references in the scratch buffer belong to this thread
+    size_t len = bufferSize(&w->scratch);
+    if (!message->placeholder)
+    {
+        // applied for the primary, nobody waits for the reply
+        consumeNewBuffer(&w->scratch, len);
+        return;
+    }
+    Blob *reply = (Blob *)malloc(sizeof(Blob) + len);
+    if (!reply)
+    {
+        die("out of memory");
+    }
+    reply->refcount = 1;
+    reply->len = (uint32_t)len;
+    copyFromBuffer(&w->scratch, 0, reply->data, len);
+    consumeNewBuffer(&w->scratch, len);
+
+    message->kind = SHARD_REPLY;
+    message->payload = reply;
+    queue_message(w, origin, message);
+}
+
+static void accept_remote_reply(Worker *w, ShardMessage *message)
+{
+    Connection *conn = NULL;
+    if (message->fd < w->fd2conn.size)
+    {
+        conn = w->fd2conn.array[message->fd];
+    }
+    if (!conn || conn->generation != message->generation)
+    {
+        // the client went away while its request was in flight
+        releaseBlob(message->payload);
+        return;
+    }
+
+    fillPlaceholder(&conn->outgoing_buffer, message->placeholder, message->payload);
+    unpause_reads(w, conn);
+    // goes out with the end-of-iteration flush
+    queue_flush(w, conn);
+}
+
+static bool process_shard_messages(Worker *w)
+{
+    bool any = false;
+    for (int from = 0; from < g_data.nworkers; from++)
+    {
+        if (from == w->id)
+        {
+            continue;
+        }
+        SpscQueue *queue = shard_queue(from, w->id);
+        ShardMessage message;
+        while (spscPop(queue, &message))
+        {
+            any = true;
+            if (message.kind == SHARD_REQUEST)
+            {
+                serve_remote_request(w, from, &message);
+            }
+            else
+            {
+                accept_remote_reply(w, &message);
+            }
+        }
+    }
+    return any;
+}
+
+static void wake_worker(Worker *target)
+{
+    uint64_t one = 1;
+    ssize_t rv = write(target->wake_fd, &one, sizeof(one));
+    (void)rv;
+}
+
+// Moves backlogged messages into rings that have room again and wakes every
+// worker that received something this iteration.
+static void flush_shard_messages(Worker *w)
+{
+    for (int target = 0; target < g_data.nworkers; target++)
+    {
+        ShardBacklog *backlog = &w->backlog[target];
+        size_t sent = 0;
+        while (sent < backlog->size && spscPush(shard_queue(w->id, target), &backlog->items[sent]))
+        {
+            sent++;
+        }
+        if (sent > 0)
+        {
+            memmove(backlog->items, backlog->items + sent, (backlog->size - sent) * sizeof(ShardMessage));
+            backlog->size -= sent;
+            w->notify[target] = true;
+        }
+
+        if (!w->notify[target])
+        {
+            continue;
+        }
+        w->notify[target] = false;
+
+        // pairs with the fence in has_shard_messages(): either the target sees
+        // our push before sleeping or we see it asleep and wake it
+        atomic_thread_fence(memory_order_seq_cst);
+        if (atomic_load_explicit(&g_data.workers[target].sleeping, memory_order_relaxed))
+        {
+            wake_worker(&g_data.workers[target]);
+        }
+    }
+}
+
+static bool has_shard_messages(Worker *w)
+{
+    for (int from = 0; from < g_data.nworkers; from++)
+    {
+        if (from != w->id && !spscEmpty(shard_queue(from, w->id)))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool has_backlog(Worker *w)
+{
+    for (int target = 0; target < g_data.nworkers; target++)
+    {
+        if (w->backlog[target].size > 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Drops a client whose unsent replies went past the hard limit.
+static void check_output_limit(Worker *w, Connection *conn)
+{
+    size_t pending = output_memory(conn);
+    if (g_config.output_limit > 0 && pending > g_config.output_limit)
+    {
+        logWarn("closing fd %d: %zu bytes of unsent replies, over the output limit", conn->fd, pending);
+        statAdd(&w->stats->output_limit_disconnections, 1);
+        conn->want_close = true;
+    }
+}
+
+// Sends everything the iteration produced for each connection in one
+// writev, after the append-only file has the writes behind it. A client
+// whose unsent replies pile up past the pause mark is not read until they
+// drain, and one past the limit is dropped.
+static void flush_connections(Worker *w)
+{
+    for (size_t i = 0; i < w->flush.size; i++)
+    {
+        Connection *conn = w->fd2conn.array[w->flush.fds[i]];
+        if (!conn || !conn->flush_queued)
+        {
+            continue;
+        }
+        conn->flush_queued = false;
+        handle_write(w, conn);
+        if (!conn->want_close && !bufferDrained(&conn->outgoing_buffer))
+        {
+            conn->want_write = true;
+            conn->want_read = conn->want_read && !output_paused(conn);
+            check_output_limit(w, conn);
+        }
+        if (conn->want_close)
+        {
+            close_connection(w, conn);
+            continue;
+        }
+        update_interest(w, conn);
+    }
+    w->flush.size = 0;
+}
+
+// Gives the connections that stopped short of their input last iteration
+// another turn; any that use up a budget again wait for the next one.
+static void resume_reads(Worker *w)
+{
+    size_t count = w->unread.size;
+    for (size_t i = 0; i < count; i++)
+    {
+        Connection *conn = w->fd2conn.array[w->unread.fds[i]];
+        if (!conn || !conn->read_queued)
+        {
+            continue;
+        }
+        conn->read_queued = false;
+        // a paused client is read again once its replies drain
+        if (conn->want_read && !conn->want_close)
+        {
+            handle_read(w, conn);
+        }
+        if (conn->want_close)
+        {
+            close_connection(w, conn);
+        }
+    }
+    memmove(w->unread.fds, w->unread.fds + count, (w->unread.size - count) * sizeof(int));
+    w->unread.size -= count;
+}
+
+// The pools and the keyspace are thread-private; INFO reads these copies
+// instead.
+static void publish_worker_stats(Worker *w)
+{
+    PoolStats segments, headers;
+    bufferPoolStats(&segments, &headers);
+    statSet(&w->stats->conn_pool_hits, w->conn_pool.stats.hits);
+    statSet(&w->stats->conn_pool_misses, w->conn_pool.stats.misses);
+    statSet(&w->stats->segment_pool_hits, segments.hits + headers.hits);
+    statSet(&w->stats->segment_pool_misses, segments.misses + headers.misses);
+    statSet(&w->stats->keys, keyspaceSize(&w->db));
+    statSet(&w->stats->expires, timerWheelSize(&w->db.expiries));
+    statSet(&w->stats->expired_keys, w->db.expired);
+    statSet(&w->stats->evicted_keys, w->db.evicted);
+    statSet(&w->stats->used_memory, keyspaceMemory(&w->db));
+    statSet(&w->stats->maxmemory, w->db.maxmemory);
+    statSet(&w->stats->maxmemory_policy, w->db.policy);
+}
+
+// Of two wait timeouts where -1 means none, the one that ends first.
+static int earlier_timeout(int a, int b)
+{
+    if (a < 0)
+    {
+        return b;
+    }
+    return b < 0 || a < b ? a : b;
+}
+
+// Active expiry, run once per loop iteration under EXPIRE_BUDGET_NS so that
+// mass expiry is spread over iterations instead of stalling clients. Returns
+// the wait timeout until the next deadline: 0 when expired keys are left
+// over, -1 when no key has a TTL.
+static int expire_keys(Worker *w)
+{
+    if (!keyspaceExpireDue(&w->db, EXPIRE_BUDGET_NS))
+    {
+        return 0;
+    }
+    uint64_t next = keyspaceNextExpiry(&w->db);
+    if (next == UINT64_MAX)
+    {
+        return -1;
+    }
+    uint64_t now = keyspaceClock();
+    if (next <= now)
+    {
+        return 0;
+    }
+    // cap it: a long wait gains nothing and the wall clock may be stepped
+    return next - now > EXPIRE_MAX_WAIT_MS ? EXPIRE_MAX_WAIT_MS : (int)(next - now);
+}
+
+// Registers a connection the worker did not accept itself.
+static bool watch_connection(Worker *w, Connection *conn)
+{
+#ifdef HAVE_LIBURING
+    if (w->uring)
+    {
+        UringConn *state = uringConn(w->uring, conn->fd);
+        if (!state || !uringArmRecv(w->uring, conn->fd, conn->generation))
+        {
+            return false;
+        }
+        state->recv_armed = true;
+        return true;
+    }
+#endif
+    return eventLoopAdd(&w->loop, conn->fd, EVENT_READ);
+}
+
+// Replaces every shard with the primary's snapshot; the other workers are
+// parked.
+static bool load_primary_snapshot(const SnapshotFile *snapshot)
+{
+    int n = g_data.nworkers;
+    size_t capacity = (size_t)(snapshot->keys / (uint64_t)n);
+    capacity += capacity / 8;
+    Keyspace *shards[MAX_WORKERS];
+    for (int i = 0; i < n; i++)
+    {
+        shards[i] = &g_data.workers[i].db;
+        if (!keyspaceFlush(shards[i], capacity))
+        {
+            return false;
+        }
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return loadSnapshot(snapshot, shards, n, hash_shard, cpus > 0 ? (int)cpus : 1);
+}
+
+// On a replica, worker 0 takes over each link the replication thread sets
+// up, first loading the snapshot of a full sync, and acknowledges what it
+// applied every REPL_ACK_MS. Returns the longest the worker may sleep.
+static int follow_primary(Worker *w)
+{
+    if (w->id != 0 || !replIsReplica())
+    {
+        return -1;
+    }
+    if (!g_primary.loading && g_primary.fd < 0 && replTakeLink(&g_primary.pending))
+    {
+        g_primary.loading = true;
+    }
+    if (g_primary.loading)
+    {
+        ReplLink *link = &g_primary.pending;
+        if (link->full)
+        {
+            if (!pauseWorkers(w->id))
+            {
+                // a save holds the workers; this one gets parked and comes back
+                return 0;
+            }
+            bool ok = load_primary_snapshot(&link->snapshot);
+            resumeWorkers();
+            closeSnapshot(&link->snapshot);
+            link->full = false;
+            if (!ok)
+            {
+                close(link->fd);
+                g_primary.loading = false;
+                replLinkLost(true);
+                return -1;
+            }
+            // the file has to start over from the new data set
+            if (aofEnabled() && aofRewrite(w->id) != AOF_REWRITE_STARTED)
+            {
+                logWarn("could not rewrite the append-only file after a full sync");
+            }
+        }
+        g_primary.loading = false;
+
+        Connection *conn = setup_connection(w, link->fd);
+        if (!conn)
+        {
+            replLinkLost(false);
+            return -1;
+        }
+        conn->primary = true;
+        if (!watch_connection(w, conn))
+        {
+            logWarn("[errno:%d] event loop registration error", errno);
+            release_connection(w, conn);
+            return -1;
+        }
+        g_primary.fd = conn->fd;
+        g_primary.last_ack_ms = statsNow() / 1000000;
+    }
+    if (g_primary.fd < 0)
+    {
+        return -1;
+    }
+
+    uint64_t now = statsNow() / 1000000;
+    if (now - g_primary.last_ack_ms >= REPL_ACK_MS)
+    {
+        Connection *conn = w->fd2conn.array[g_primary.fd];
+        if (!replAppendAck(&conn->outgoing_buffer))
+        {
+            logWarn("out of memory");
+        }
+        queue_flush(w, conn);
+        g_primary.last_ack_ms = now;
+    }
+    return (int)(REPL_ACK_MS - (now - g_primary.last_ack_ms));
+}
+
+static int bind_listener(bool reuseport)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        die("socket()");
+    }
+    int val = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)))
+    {
+        die("SO_REUSEPORT");
+    }
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = ntohs((uint16_t)g_config.port);
+    addr.sin_addr.s_addr = ntohl(0); // wildcard address 0.0.0.0
+    int rv = bind(fd, (const struct sockaddr *)&addr, sizeof(addr));
+    if (rv)
+    {
+        die("bind()");
+    }
+    return fd;
+}
+
+// SO_REUSEPORT would just as well join the listeners of another server
+// already on the port, and split the clients between two keyspaces. A bind
+// without it fails with EADDRINUSE then, so the workers' listeners are only
+// created once it succeeded.
+static void check_port_free(void)
+{
+    close(bind_listener(false));
+}
+
+static int create_listener(bool reuseport)
+{
+    int fd = bind_listener(reuseport);
+    fd_set_nb(fd);
+
+    int rv = listen(fd, SOMAXCONN);
+    if (rv)
+    {
+        die("listen()");
+    }
+    return fd;
+}
+
+static void init_worker(Worker *w, int id, size_t capacity)
+{
+    w->id = id;
+    // with several workers the kernel spreads new connections over one
+    // SO_REUSEPORT listener per worker
+    w->listen_fd = create_listener(g_data.nworkers > 1);
+    w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w->wake_fd < 0)
+    {
+        die("eventfd()");
+    }
+    atomic_init(&w->sleeping, 0);
+
+    if (!initKeyspace(&w->db, capacity))
+    {
+        die("keyspace");
+    }
+    registerSnapshotShard(id, &w->db, w->wake_fd);
+    w->hold_replies = g_config.appendonly && g_config.appendfsync == AOF_FSYNC_ALWAYS;
+    keyspaceSetMaxMemory(&w->db, g_config.maxmemory / (size_t)g_data.nworkers, g_config.maxmemory_policy);
+    if (g_config.backend == EVENT_BACKEND_IO_URING)
+    {
+#ifdef HAVE_LIBURING
+        w->uring = (UringLoop *)malloc(sizeof(UringLoop));
+        if (!w->uring || !initUringLoop(w->uring))
+        {
+            die("io_uring setup");
+        }
+#endif
+    }
+    else
+    {
+        if (!initEventLoop(&w->loop, g_config.backend))
+        {
+            die("event loop");
+        }
+        if (!eventLoopAdd(&w->loop, w->listen_fd, EVENT_READ) ||
+            !eventLoopAdd(&w->loop, w->wake_fd, EVENT_READ))
+        {
+            die("event loop listener");
+        }
+    }
+    w->stats = (Stats *)calloc(1, sizeof(Stats));
+    if (!w->stats)
+    {
+        die("out of memory");
+    }
+    registerStats(w->stats);
+    w->fd2conn = initConnectionVector();
+    initObjectPool(&w->conn_pool, sizeof(Connection), CONNECTION_SLAB, 0);
+    initBuffer(&w->scratch);
+    w->backlog = (ShardBacklog *)calloc(g_data.nworkers, sizeof(ShardBacklog));
+    w->notify = (bool *)calloc(g_data.nworkers, sizeof(bool));
+    if (!w->backlog || !w->notify)
+    {
+        die("out of memory");
+    }
+}
+
+#ifdef HAVE_LIBURING
+// The io_uring worker reuses the request path above but replaces readiness
+// handling with completions: one multishot accept per listener, one multishot
+// recv per connection drawing from the provided buffer ring, and replies sent
+// as linked sendmsg chains once per batch of completions. Each loop iteration
+// is a single io_uring_enter() however many requests it served.
+
+// Frees the connection once the kernel holds nothing of it any more.
+static void uring_close(Worker *w, Connection *conn)
+{
+    UringConn *state = uringConn(w->uring, conn->fd);
+    if (state && (state->recv_armed || state->sends_inflight > 0))
+    {
+        // in-flight sends still point into the output segments; the shutdown
+        // ends the recv and fails the sends, and the last completion comes back
+        // here
+        if (!state->closing)
+        {
+            state->closing = true;
+            // a socket handed to the replication thread must stay up
+            if (!conn->detached)
+            {
+                shutdown(conn->fd, SHUT_RDWR);
+            }
+            else if (state->recv_armed && !uringCancelRecv(w->uring, conn->fd, conn->generation))
+            {
+                die("io_uring cancel");
+            }
+        }
+        return;
+    }
+    releaseUringConn(w->uring, conn->fd);
+    release_connection(w, conn);
+}
+
+static void uring_flush(Worker *w, Connection *conn)
+{
+    UringConn *state = uringConn(w->uring, conn->fd);
+    // one chain in flight per connection keeps the bytes in order
+    if (!state || state->closing || state->sends_inflight > 0)
+    {
+        return;
+    }
+
+    struct iovec iov[URING_SEND_CHAIN * URING_IOV_PER_SEND];
+    int iovcnt = bufferIovecs(&conn->outgoing_buffer, iov, URING_SEND_CHAIN * URING_IOV_PER_SEND);
+    if (iovcnt == 0)
+    {
+        releaseBufferIfEmpty(&conn->outgoing_buffer);
+        return;
+    }
+    state->send_started = statsNow();
+    if (uringSend(w->uring, conn->fd, conn->generation, iov, iovcnt) == 0)
+    {
+        logWarn("io_uring submission error");
+        conn->want_close = true;
+    }
+}
+
+static Connection *uring_connection(Worker *w, const UringCompletion *c)
+{
+    if (c->fd >= w->fd2conn.size)
+    {
+        return NULL;
+    }
+    Connection *conn = w->fd2conn.array[c->fd];
+    if (!conn || (conn->generation & 0xFFFFFF) != c->generation)
+    {
+        return NULL;
+    }
+    return conn;
+}
+
+static void uring_accept(Worker *w, const UringCompletion *c)
+{
+    if (!(c->flags & IORING_CQE_F_MORE) && !uringArmAccept(w->uring, w->listen_fd))
+    {
+        die("io_uring accept");
+    }
+    if (c->res < 0)
+    {
+        errno = -c->res;
+        logWarn("[errno:%d] accept() error", errno);
+        return;
+    }
+
+    logDebug("new client on fd %d", c->res);
+    Connection *conn = setup_connection(w, c->res);
+    if (!conn)
+    {
+        return;
+    }
+    UringConn *state = uringConn(w->uring, conn->fd);
+    if (!state || !uringArmRecv(w->uring, conn->fd, conn->generation))
+    {
+        logWarn("io_uring registration error");
+        release_connection(w, conn);
+        return;
+    }
+    state->recv_armed = true;
+}
+
+// Cancels the recv so the socket pushes back on the client.
+static void uring_pause_recv(Worker *w, Connection *conn, UringConn *state)
+{
+    if (state->recv_paused)
+    {
+        return;
+    }
+    state->recv_paused = true;
+    if (state->recv_armed && !uringCancelRecv(w->uring, conn->fd, conn->generation))
+    {
+        logWarn("io_uring submission error");
+        conn->want_close = true;
+    }
+}
+
+static void uring_resume_recv(Worker *w, Connection *conn, UringConn *state)
+{
+    if (!state->recv_paused)
+    {
+        return;
+    }
+    state->recv_paused = false;
+    // a cancel still in flight ends the recv later, and it is re-armed then
+    if (!state->recv_armed)
+    {
+        if (!uringArmRecv(w->uring, conn->fd, conn->generation))
+        {
+            logWarn("io_uring submission error");
+            conn->want_close = true;
+            return;
+        }
+        state->recv_armed = true;
+    }
+}
+
+// Runs the connection's buffered requests under a fresh request budget. The
+// recv stays off while the client is paused or a turn's worth of requests is
+// already waiting.
+static void uring_process(Worker *w, Connection *conn, UringConn *state)
+{
+    uint32_t requests = REQUEST_BUDGET;
+    bool done = process_incoming(w, conn, &requests);
+    if (!done)
+    {
+        stop_reading(w, conn);
+    }
+    if (!conn->want_read || (!done && bufferSize(&conn->incoming_buffer) >= READ_BUDGET))
+    {
+        uring_pause_recv(w, conn, state);
+    }
+    else
+    {
+        uring_resume_recv(w, conn, state);
+    }
+}
+
+static void uring_recv(Worker *w, const UringCompletion *c)
+{
+    Connection *conn = uring_connection(w, c);
+    UringConn *state = conn ? uringConn(w->uring, conn->fd) : NULL;
+    if (c->has_buffer)
+    {
+        // copy into the connection's chain and hand the buffer straight back,
+        // so the ring never runs dry because of one slow connection
+        if (state && !state->closing && c->res > 0)
+        {
+            statAdd(&w->stats->bytes_in, (uint64_t)c->res);
+            if (!appendToNewBuffer(&conn->incoming_buffer, c->data, (size_t)c->res))
+            {
+                logWarn("out of memory");
+                conn->want_close = true;
+            }
+            else if (!conn->read_queued && !state->recv_paused)
+            {
+                uring_process(w, conn, state);
+            }
+            // a connection waiting for its next turn, or paused, only buffers
+            else if (bufferSize(&conn->incoming_buffer) >= READ_BUDGET)
+            {
+                uring_pause_recv(w, conn, state);
+            }
+        }
+        uringRecycleBuffer(w->uring, c->buffer_id);
+    }
+    if (!state)
+    {
+        return;
+    }
+
+    bool more = (c->flags & IORING_CQE_F_MORE) != 0;
+    if (!more)
+    {
+        state->recv_armed = false;
+    }
+
+    if (c->res == 0)
+    {
+        if (bufferSize(&conn->incoming_buffer) == 0)
+        {
+            logDebug("client closed");
+        }
+        else
+        {
+            logInfo("unexpected EOF");
+        }
+        conn->want_close = true;
+    }
+    else if (c->res < 0 && c->res != -ENOBUFS && c->res != -ECANCELED)
+    {
+        // -ENOBUFS only means the buffer ring ran dry, and -ECANCELED that
+        // the connection was paused; the data waits in the socket until the
+        // recv is re-armed
+        errno = -c->res;
+        logWarn("[errno:%d] read() error", errno);
+        conn->want_close = true;
+    }
+
+    if (conn->want_close || state->closing)
+    {
+        uring_close(w, conn);
+        return;
+    }
+    if (!more && !state->recv_paused)
+    {
+        if (!uringArmRecv(w->uring, conn->fd, conn->generation))
+        {
+            logWarn("io_uring submission error");
+            uring_close(w, conn);
+            return;
+        }
+        state->recv_armed = true;
+    }
+    releaseBufferIfEmpty(&conn->incoming_buffer);
+    if (bufferSize(&conn->outgoing_buffer) > 0)
+    {
+        queue_flush(w, conn);
+    }
+}
+
+static void uring_sent(Worker *w, const UringCompletion *c)
+{
+    Connection *conn = uring_connection(w, c);
+    UringConn *state = conn ? uringConn(w->uring, conn->fd) : NULL;
+    if (!state)
+    {
+        return;
+    }
+    state->sends_inflight--;
+
+    if (c->res > 0 && !state->closing)
+    {
+        statAdd(&w->stats->bytes_out, (uint64_t)c->res);
+        consumeNewBuffer(&conn->outgoing_buffer, (size_t)c->res);
+        unpause_reads(w, conn);
+        check_output_limit(w, conn);
+    }
+    else if (c->res < 0 && c->res != -ECANCELED)
+    {
+        // -ECANCELED is the rest of a chain after a short send; the bytes are
+        // still in the buffer and go out with the next flush
+        errno = -c->res;
+        if (!state->closing)
+        {
+            logWarn("[errno:%d] write() error", errno);
+        }
+        conn->want_close = true;
+    }
+
+    if (conn->want_close || state->closing)
+    {
+        uring_close(w, conn);
+        return;
+    }
+    if (state->sends_inflight > 0)
+    {
+        return;
+    }
+    // submission to completion of the whole chain
+    recordLatency(&w->stats->stages[STAGE_WRITE], statsNow() - state->send_started);
+    if (!uringQueueFlush(w->uring, conn->fd))
+    {
+        die("out of memory");
+    }
+}
+
+// The io_uring counterpart of resume_reads.
+static void uring_resume_reads(Worker *w)
+{
+    size_t count = w->unread.size;
+    for (size_t i = 0; i < count; i++)
+    {
+        Connection *conn = w->fd2conn.array[w->unread.fds[i]];
+        if (!conn || !conn->read_queued)
+        {
+            continue;
+        }
+        conn->read_queued = false;
+        UringConn *state = uringConn(w->uring, conn->fd);
+        if (!state || state->closing)
+        {
+            continue;
+        }
+        uring_process(w, conn, state);
+        if (conn->want_close)
+        {
+            uring_close(w, conn);
+            continue;
+        }
+        releaseBufferIfEmpty(&conn->incoming_buffer);
+        if (bufferSize(&conn->outgoing_buffer) > 0)
+        {
+            queue_flush(w, conn);
+        }
+    }
+    memmove(w->unread.fds, w->unread.fds + count, (w->unread.size - count) * sizeof(int));
+    w->unread.size -= count;
+}
+
+static void flush_uring_connections(Worker *w)
+{
+    UringLoop *ring = w->uring;
+    for (size_t i = 0; i < ring->flush_size; i++)
+    {
+        int fd = ring->flush_fds[i];
+        ring->conns[fd]->flush_queued = false;
+        Connection *conn = w->fd2conn.array[fd];
+        if (!conn)
+        {
+            continue;
+        }
+        // bytes of a chain still in flight count as unsent
+        check_output_limit(w, conn);
+        if (!conn->want_close)
+        {
+            uring_flush(w, conn);
+        }
+        if (conn->want_close)
+        {
+            uring_close(w, conn);
+        }
+    }
+    ring->flush_size = 0;
+}
+
+static void *run_uring_worker(Worker *w)
+{
+    UringLoop *ring = w->uring;
+    if (!uringArmAccept(ring, w->listen_fd) ||
+        !uringArmRead(ring, w->wake_fd, &ring->wake_value, sizeof(ring->wake_value)))
+    {
+        die("io_uring listener");
+    }
+
+    while (true)
+    {
+        int timeout = earlier_timeout(snapshotCheckpoint(w->id), expire_keys(w));
+        timeout = earlier_timeout(aofCheckpoint(w->id), timeout);
+        timeout = earlier_timeout(follow_primary(w), timeout);
+        timeout = earlier_timeout(clusterMigrate(w->id, &w->db, aofBuffer(w->id)), timeout);
+        publish_worker_stats(w);
+        if (g_data.nworkers > 1)
+        {
+            atomic_store_explicit(&w->sleeping, 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (has_shard_messages(w) || has_backlog(w))
+            {
+                timeout = 0;
+            }
+        }
+
+        if (w->unread.size > 0)
+        {
+            timeout = 0;
+        }
+
+        int rv = uringWait(ring, timeout);
+        atomic_store_explicit(&w->sleeping, 0, memory_order_relaxed);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv < 0)
+        {
+            die("io_uring wait");
+        }
+
+        uring_resume_reads(w);
+
+        for (int i = 0; i < rv; i++)
+        {
+            const UringCompletion *c = &ring->completions[i];
+            switch (c->op)
+            {
+            case URING_OP_ACCEPT:
+                uring_accept(w, c);
+                break;
+            case URING_OP_RECV:
+                uring_recv(w, c);
+                break;
+            case URING_OP_SEND:
+                uring_sent(w, c);
+                break;
+            case URING_OP_CANCEL:
+                // the cancelled recv reports on its own
+                break;
+            case URING_OP_WAKE:
+                if (!uringArmRead(ring, w->wake_fd, &ring->wake_value, sizeof(ring->wake_value)))
+                {
+                    die("io_uring wake");
+                }
+                break;
+            }
+        }
+
+        if (g_data.nworkers > 1)
+        {
+            process_shard_messages(w);
+        }
+        // one write, and under appendfsync always one fsync, for everything
+        // this iteration changed, before replies to other workers leave
+        aofCommit(w->id);
+        if (g_data.nworkers > 1)
+        {
+            flush_shard_messages(w);
+        }
+        flush_uring_connections(w);
+    }
+    return NULL;
+}
+#endif
+
+static void *run_worker(void *arg)
+{
+    Worker *w = (Worker *)arg;
+#ifdef HAVE_LIBURING
+    if (w->uring)
+    {
+        return run_uring_worker(w);
+    }
+#endif
+    while (true)
+    {
+        // announce the nap, then re-check the rings so a message pushed just
+        // before the announcement is not slept through; without messages the
+        // nearest key deadline bounds the wait
+        int timeout = earlier_timeout(snapshotCheckpoint(w->id), expire_keys(w));
+        timeout = earlier_timeout(aofCheckpoint(w->id), timeout);
+        timeout = earlier_timeout(follow_primary(w), timeout);
+        timeout = earlier_timeout(clusterMigrate(w->id, &w->db, aofBuffer(w->id)), timeout);
+        publish_worker_stats(w);
+        if (g_data.nworkers > 1)
+        {
+            atomic_store_explicit(&w->sleeping, 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_seq_cst);
+            if (has_shard_messages(w) || has_backlog(w))
+            {
+                timeout = 0;
+            }
+        }
+
+        if (w->unread.size > 0)
+        {
+            timeout = 0;
+        }
+
+        int rv = eventLoopWait(&w->loop, timeout);
+        atomic_store_explicit(&w->sleeping, 0, memory_order_relaxed);
+        if (rv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rv < 0)
+        {
+            die("event loop wait");
+        }
+
+        resume_reads(w);
+
+        for (int i = 0; i < rv; ++i)
+        {
+            FiredEvent *ev = &w->loop.fired[i];
+            if (ev->fd == w->listen_fd)
+            {
+                handle_accept(w);
+                continue;
+            }
+            if (ev->fd == w->wake_fd)
+            {
+                uint64_t count = 0;
+                ssize_t n = read(w->wake_fd, &count, sizeof(count));
+                (void)n;
+                continue;
+            }
+
+            Connection *conn = w->fd2conn.array[ev->fd];
+            if (!conn)
+            {
+                continue;
+            }
+            if ((ev->events & EVENT_READ) && conn->want_read)
+            {
+                handle_read(w, conn);
+            }
+            if ((ev->events & EVENT_WRITE) && conn->want_write && !conn->want_close)
+            {
+                handle_write(w, conn);
+            }
+
+            if ((ev->events & EVENT_ERROR) && !handle_zerocopy_completions(conn))
+            {
+                conn->want_close = true;
+            }
+
+            if ((ev->events & EVENT_HANGUP) || conn->want_close)
+            {
+                close_connection(w, conn);
+                continue;
+            }
+
+            update_interest(w, conn);
+        }
+
+        if (g_data.nworkers > 1)
+        {
+            process_shard_messages(w);
+        }
+        // one write, and under appendfsync always one fsync, for everything
+        // this iteration changed, before replies to other workers leave
+        aofCommit(w->id);
+        if (g_data.nworkers > 1)
+        {
+            flush_shard_messages(w);
+        }
+        flush_connections(w);
+    }
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [--event-backend epoll|poll|io_uring] [--zerocopy-threshold BYTES] [--threads N]\n"
+                    "          [--log-level debug|info|warn|error] [--maxmemory BYTES[k|m|g]]\n"
+                    "          [--maxmemory-policy noeviction|allkeys-lru|allkeys-lfu|volatile-ttl]\n"
+                    "          [--snapshot PATH] [--appendonly yes|no] [--appendfsync always|everysec|no]\n"
+                    "          [--appendfilename PATH] [--output-pause BYTES[k|m|g]] [--output-limit BYTES[k|m|g]]\n"
+                    "          [--port N] [--replicaof HOST PORT] [--repl-backlog-size BYTES[k|m|g]]\n"
+                    "          [--cluster-enabled yes|no] [--cluster-announce-ip IP] [--cluster-config-file PATH]\n",
+            prog);
+    exit(1);
+}
+
+// A byte count with an optional k, m or g suffix (powers of 1024).
+static bool parse_bytes(const char *text, size_t *bytes)
+{
+    char *end = NULL;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (errno || end == text)
+    {
+        return false;
+    }
+    switch (tolower((unsigned char)*end))
+    {
+    case 'g':
+        value <<= 10;
+        // fall through
+    case 'm':
+        value <<= 10;
+        // fall through
+    case 'k':
+        value <<= 10;
+        end++;
+        break;
+    }
+    if (*end != '\0')
+    {
+        return false;
+    }
+    *bytes = (size_t)value;
+    return true;
+}
+
+static void parse_args(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--event-backend") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            if (strcmp(name, "poll") == 0)
+            {
+                g_config.backend = EVENT_BACKEND_POLL;
+            }
+            else if (strcmp(name, "epoll") == 0)
+            {
+                g_config.backend = EVENT_BACKEND_EPOLL;
+            }
+            else if (strcmp(name, "io_uring") == 0)
+            {
+#ifdef HAVE_LIBURING
+                g_config.backend = EVENT_BACKEND_IO_URING;
+#else
+                fprintf(stderr, "built without io_uring support (liburing was not found)\n");
+                exit(1);
+#endif
+            }
+            else
+            {
+                fprintf(stderr, "unknown event backend: %s\n", name);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--zerocopy-threshold") == 0 && i + 1 < argc)
+        {
+            g_config.zerocopy_threshold = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--log-level") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            if (!parseLogLevel(name, &g_config.log_level))
+            {
+                fprintf(stderr, "unknown log level: %s\n", name);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            g_config.threads = atoi(argv[++i]);
+            if (g_config.threads < 1 || g_config.threads > MAX_WORKERS)
+            {
+                fprintf(stderr, "--threads must be between 1 and %d\n", MAX_WORKERS);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--maxmemory") == 0 && i + 1 < argc)
+        {
+            if (!parse_bytes(argv[++i], &g_config.maxmemory))
+            {
+                fprintf(stderr, "invalid --maxmemory: %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--output-pause") == 0 && i + 1 < argc)
+        {
+            if (!parse_bytes(argv[++i], &g_config.output_pause))
+            {
+                fprintf(stderr, "invalid --output-pause: %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--output-limit") == 0 && i + 1 < argc)
+        {
+            if (!parse_bytes(argv[++i], &g_config.output_limit))
+            {
+                fprintf(stderr, "invalid --output-limit: %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc)
+        {
+            g_config.port = atoi(argv[++i]);
+            if (g_config.port < 1 || g_config.port > 65535)
+            {
+                fprintf(stderr, "invalid --port: %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--replicaof") == 0 && i + 2 < argc)
+        {
+            g_config.replicaof_host = argv[++i];
+            g_config.replicaof_port = atoi(argv[++i]);
+            if (g_config.replicaof_port < 1 || g_config.replicaof_port > 65535)
+            {
+                fprintf(stderr, "invalid --replicaof port: %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--repl-backlog-size") == 0 && i + 1 < argc)
+        {
+            if (!parse_bytes(argv[++i], &g_config.repl_backlog_size) || g_config.repl_backlog_size == 0)
+            {
+                fprintf(stderr, "invalid --repl-backlog-size: %s\n", argv[i]);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--cluster-enabled") == 0 && i + 1 < argc)
+        {
+            const char *value = argv[++i];
+            if (strcmp(value, "yes") != 0 && strcmp(value, "no") != 0)
+            {
+                fprintf(stderr, "--cluster-enabled must be yes or no\n");
+                exit(1);
+            }
+            g_config.cluster_enabled = strcmp(value, "yes") == 0;
+        }
+        else if (strcmp(argv[i], "--cluster-announce-ip") == 0 && i + 1 < argc)
+        {
+            g_config.cluster_announce_ip = argv[++i];
+        }
+        else if (strcmp(argv[i], "--cluster-config-file") == 0 && i + 1 < argc)
+        {
+            g_config.cluster_config_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc)
+        {
+            g_config.snapshot_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--appendonly") == 0 && i + 1 < argc)
+        {
+            const char *value = argv[++i];
+            if (strcmp(value, "yes") != 0 && strcmp(value, "no") != 0)
+            {
+                fprintf(stderr, "--appendonly must be yes or no\n");
+                exit(1);
+            }
+            g_config.appendonly = strcmp(value, "yes") == 0;
+        }
+        else if (strcmp(argv[i], "--appendfsync") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            if (!parseAofFsync(name, &g_config.appendfsync))
+            {
+                fprintf(stderr, "unknown appendfsync policy: %s\n", name);
+                exit(1);
+            }
+        }
+        else if (strcmp(argv[i], "--appendfilename") == 0 && i + 1 < argc)
+        {
+            g_config.aof_path = argv[++i];
+        }
+        else if (strcmp(argv[i], "--maxmemory-policy") == 0 && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            if (!parseEvictionPolicy(name, &g_config.maxmemory_policy))
+            {
+                fprintf(stderr, "unknown maxmemory policy: %s\n", name);
+                exit(1);
+            }
+        }
+        else
+        {
+            usage(argv[0]);
+        }
+    }
+    if (g_config.cluster_enabled && g_config.replicaof_host)
+    {
+        // a replica follows all of its primary's keys, whatever their slot
+        fprintf(stderr, "--replicaof cannot be combined with --cluster-enabled yes\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    parse_args(argc, argv);
+    if (!initLogging(g_config.log_level, STDERR_FILENO))
+    {
+        fprintf(stderr, "failed to start logging\n");
+        return 1;
+    }
+    // before any keyspace exists: the seed decides every key's slot and shard
+    initHashSeed();
+    logInfo("hashing with the %s implementation", hashImplementation());
+
+    int n = g_config.threads;
+    g_data.nworkers = n;
+    g_data.workers = (Worker *)calloc(n, sizeof(Worker));
+    g_data.queues = (SpscQueue *)calloc((size_t)n * n, sizeof(SpscQueue));
+    if (!g_data.workers || !g_data.queues)
+    {
+        die("out of memory");
+    }
+    for (int from = 0; from < n; from++)
+    {
+        for (int to = 0; to < n; to++)
+        {
+            if (from != to && !initSpscQueue(shard_queue(from, to), SHARD_QUEUE_CAPACITY))
+            {
+                die("out of memory");
+            }
+        }
+    }
+    // an existing append-only file holds the latest state; the snapshot is
+    // only read without one
+    bool replay = g_config.appendonly && access(g_config.aof_path, F_OK) == 0;
+    // presize the shards for the snapshot, with headroom for an uneven split
+    SnapshotFile snapshot = {};
+    if ((!replay && !openSnapshot(g_config.snapshot_path, &snapshot)) || !initSnapshots(g_config.snapshot_path, n))
+    {
+        die("snapshot");
+    }
+    size_t capacity = (size_t)(snapshot.keys / (uint64_t)n);
+    capacity += capacity / 8;
+    Keyspace *shards[MAX_WORKERS];
+    if (n > 1)
+    {
+        check_port_free();
+    }
+    for (int i = 0; i < n; i++)
+    {
+        init_worker(&g_data.workers[i], i, capacity);
+        shards[i] = &g_data.workers[i].db;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (replay && !replayAof(g_config.aof_path, shards, n, hash_shard))
+    {
+        die("append-only file");
+    }
+    if (!replay && !loadSnapshot(&snapshot, shards, n, hash_shard, cpus > 0 ? (int)cpus : 1))
+    {
+        die("snapshot");
+    }
+    closeSnapshot(&snapshot);
+    if (g_config.appendonly && !initAof(g_config.aof_path, g_config.appendfsync, shards, n))
+    {
+        die("append-only file");
+    }
+    if (g_config.cluster_enabled)
+    {
+        // counted from here on, so slots can tell when they are empty
+        int wake_fds[MAX_WORKERS];
+        for (int i = 0; i < n; i++)
+        {
+            if (!keyspaceCountSlots(shards[i]))
+            {
+                die("out of memory");
+            }
+            wake_fds[i] = g_data.workers[i].wake_fd;
+        }
+        if (!initCluster(g_config.cluster_announce_ip, g_config.port, g_config.cluster_config_file, wake_fds, n))
+        {
+            die("cluster");
+        }
+    }
+    if (!initReplication(g_config.repl_backlog_size, shards, n))
+    {
+        die("replication");
+    }
+    if (g_config.replicaof_host &&
+        !initReplica(g_config.replicaof_host, g_config.replicaof_port, g_data.workers[0].wake_fd))
+    {
+        die("replication");
+    }
+    logInfo("using %s event backend, %d worker thread(s)", eventBackendName(g_config.backend), n);
+#ifdef LIBURING_SHIM
+    if (g_config.backend == EVENT_BACKEND_IO_URING)
+    {
+        logWarn("io_uring backend built against the test-only liburing stand-in, not liburing");
+    }
+#endif
+    if (g_config.maxmemory)
+    {
+        logInfo("maxmemory %zu bytes, policy %s", g_config.maxmemory, evictionPolicyName(g_config.maxmemory_policy));
+    }
+
+    // worker 0 runs on the main thread
+    for (int i = 1; i < n; i++)
+    {
+        if (pthread_create(&g_data.workers[i].thread, NULL, run_worker, &g_data.workers[i]))
+        {
+            die("pthread_create()");
+        }
+    }
+    run_worker(&g_data.workers[0]);
+    return 0;
+}
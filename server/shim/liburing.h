@@ -0,0 +1,317 @@
+#ifndef SHIM_LIBURING_HEADER
+#define SHIM_LIBURING_HEADER
+
+// TEST-ONLY stand-in for liburing, built with `make LIBURING=shim` where
+// liburing is not installed. It covers only the calls uring.c makes, with
+// their liburing 2.4 signatures, on the raw io_uring system calls of
+// <linux/io_uring.h>, and nothing checks it against the real library. It
+// is for compile checks and local runs of the io_uring backend; the backend
+// is only supported built and run against liburing 2.4 or newer.
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct io_uring_sq
+{
+    unsigned *khead;
+    unsigned *ktail;
+    unsigned *kring_mask;
+    unsigned *kring_entries;
+    unsigned *array;
+    struct io_uring_sqe *sqes;
+    // entries handed out by io_uring_get_sqe but not yet submitted
+    unsigned sqe_head;
+    unsigned sqe_tail;
+    size_t ring_sz;
+    void *ring_ptr;
+};
+
+struct io_uring_cq
+{
+    unsigned *khead;
+    unsigned *ktail;
+    unsigned *kring_mask;
+    struct io_uring_cqe *cqes;
+};
+
+struct io_uring
+{
+    struct io_uring_sq sq;
+    struct io_uring_cq cq;
+    int ring_fd;
+    unsigned sq_entries;
+};
+
+static inline int shimSyscall(long rv)
+{
+    return rv < 0 ? -errno : (int)rv;
+}
+
+static inline int io_uring_queue_init_params(unsigned entries, struct io_uring *ring, struct io_uring_params *p)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->ring_fd = -1;
+    int fd = shimSyscall(syscall(__NR_io_uring_setup, entries, p));
+    if (fd < 0)
+    {
+        return fd;
+    }
+    // the SQ and CQ rings share one mapping (IORING_FEAT_SINGLE_MMAP)
+    size_t sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    size_t cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+    size_t size = sq_size > cq_size ? sq_size : cq_size;
+    char *ptr = (char *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED)
+    {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+    size_t sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+    void *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+    {
+        int err = -errno;
+        munmap(ptr, size);
+        close(fd);
+        return err;
+    }
+    ring->ring_fd = fd;
+    ring->sq_entries = p->sq_entries;
+    ring->sq.ring_ptr = ptr;
+    ring->sq.ring_sz = size;
+    ring->sq.khead = (unsigned *)(ptr + p->sq_off.head);
+    ring->sq.ktail = (unsigned *)(ptr + p->sq_off.tail);
+    ring->sq.kring_mask = (unsigned *)(ptr + p->sq_off.ring_mask);
+    ring->sq.kring_entries = (unsigned *)(ptr + p->sq_off.ring_entries);
+    ring->sq.array = (unsigned *)(ptr + p->sq_off.array);
+    ring->sq.sqes = (struct io_uring_sqe *)sqes;
+    for (unsigned i = 0; i < p->sq_entries; i++)
+    {
+        ring->sq.array[i] = i;
+    }
+    ring->sq.sqe_head = ring->sq.sqe_tail = *ring->sq.ktail;
+    ring->cq.khead = (unsigned *)(ptr + p->cq_off.head);
+    ring->cq.ktail = (unsigned *)(ptr + p->cq_off.tail);
+    ring->cq.kring_mask = (unsigned *)(ptr + p->cq_off.ring_mask);
+    ring->cq.cqes = (struct io_uring_cqe *)(ptr + p->cq_off.cqes);
+    return 0;
+}
+
+static inline void io_uring_queue_exit(struct io_uring *ring)
+{
+    if (ring->ring_fd < 0)
+    {
+        return;
+    }
+    munmap(ring->sq.sqes, ring->sq_entries * sizeof(struct io_uring_sqe));
+    munmap(ring->sq.ring_ptr, ring->sq.ring_sz);
+    close(ring->ring_fd);
+    ring->ring_fd = -1;
+}
+
+static inline unsigned io_uring_sq_space_left(struct io_uring *ring)
+{
+    return *ring->sq.kring_entries - (ring->sq.sqe_tail - __atomic_load_n(ring->sq.khead, __ATOMIC_ACQUIRE));
+}
+
+static inline struct io_uring_sqe *io_uring_get_sqe(struct io_uring *ring)
+{
+    if (io_uring_sq_space_left(ring) == 0)
+    {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sq.sqes[ring->sq.sqe_tail & *ring->sq.kring_mask];
+    ring->sq.sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// Publishes the entries handed out since the last call; returns how many.
+static inline unsigned shimFlushSq(struct io_uring *ring)
+{
+    unsigned count = ring->sq.sqe_tail - ring->sq.sqe_head;
+    __atomic_store_n(ring->sq.ktail, ring->sq.sqe_tail, __ATOMIC_RELEASE);
+    ring->sq.sqe_head = ring->sq.sqe_tail;
+    return count;
+}
+
+static inline int shimEnter(struct io_uring *ring, unsigned submit, unsigned wait_nr, unsigned flags, void *arg,
+                            size_t arg_size)
+{
+    return shimSyscall(syscall(__NR_io_uring_enter, ring->ring_fd, submit, wait_nr, flags, arg, arg_size));
+}
+
+static inline int io_uring_submit_and_wait(struct io_uring *ring, unsigned wait_nr)
+{
+    unsigned count = shimFlushSq(ring);
+    if (count == 0 && wait_nr == 0)
+    {
+        return 0;
+    }
+    return shimEnter(ring, count, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, _NSIG / 8);
+}
+
+static inline int io_uring_submit(struct io_uring *ring)
+{
+    return io_uring_submit_and_wait(ring, 0);
+}
+
+// Unlike liburing's, this leaves *cqe_ptr alone and ignores the signal
+// mask: uring.c reaps completions with io_uring_for_each_cqe instead and
+// passes no mask.
+static inline int io_uring_submit_and_wait_timeout(struct io_uring *ring, struct io_uring_cqe **cqe_ptr,
+                                                   unsigned wait_nr, struct __kernel_timespec *ts, sigset_t *sigmask)
+{
+    (void)cqe_ptr;
+    (void)sigmask;
+    unsigned count = shimFlushSq(ring);
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)ts;
+    arg.sigmask_sz = _NSIG / 8;
+    return shimEnter(ring, count, wait_nr, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+}
+
+#define io_uring_for_each_cqe(ring, head, cqe)                                                                   \
+    for (head = *(ring)->cq.khead;                                                                               \
+         (cqe = head != __atomic_load_n((ring)->cq.ktail, __ATOMIC_ACQUIRE)                                      \
+                    ? &(ring)->cq.cqes[head & *(ring)->cq.kring_mask]                                            \
+                    : NULL);                                                                                     \
+         head++)
+
+static inline void io_uring_cq_advance(struct io_uring *ring, unsigned nr)
+{
+    if (nr)
+    {
+        __atomic_store_n(ring->cq.khead, *ring->cq.khead + nr, __ATOMIC_RELEASE);
+    }
+}
+
+static inline void io_uring_sqe_set_data64(struct io_uring_sqe *sqe, uint64_t data)
+{
+    sqe->user_data = data;
+}
+
+static inline uint64_t io_uring_cqe_get_data64(const struct io_uring_cqe *cqe)
+{
+    return cqe->user_data;
+}
+
+static inline void shimPrep(struct io_uring_sqe *sqe, int op, int fd, const void *addr, unsigned len, uint64_t off)
+{
+    sqe->opcode = (uint8_t)op;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+}
+
+static inline void io_uring_prep_multishot_accept(struct io_uring_sqe *sqe, int fd, struct sockaddr *addr,
+                                                  socklen_t *addrlen, int flags)
+{
+    shimPrep(sqe, IORING_OP_ACCEPT, fd, addr, 0, (uint64_t)(uintptr_t)addrlen);
+    sqe->accept_flags = (uint32_t)flags;
+    sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+}
+
+static inline void io_uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, void *buf, size_t len, int flags)
+{
+    shimPrep(sqe, IORING_OP_RECV, fd, buf, (unsigned)len, 0);
+    sqe->msg_flags = (uint32_t)flags;
+    sqe->ioprio |= IORING_RECV_MULTISHOT;
+}
+
+static inline void io_uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, unsigned flags)
+{
+    shimPrep(sqe, IORING_OP_SENDMSG, fd, msg, 1, 0);
+    sqe->msg_flags = flags;
+}
+
+static inline void io_uring_prep_cancel64(struct io_uring_sqe *sqe, uint64_t user_data, int flags)
+{
+    shimPrep(sqe, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, 0);
+    sqe->addr = user_data;
+    sqe->cancel_flags = (uint32_t)flags;
+}
+
+static inline void io_uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf, unsigned nbytes, uint64_t offset)
+{
+    shimPrep(sqe, IORING_OP_READ, fd, buf, nbytes, offset);
+}
+
+static inline int io_uring_buf_ring_mask(uint32_t ring_entries)
+{
+    return (int)(ring_entries - 1);
+}
+
+static inline void io_uring_buf_ring_init(struct io_uring_buf_ring *br)
+{
+    br->tail = 0;
+}
+
+static inline void io_uring_buf_ring_add(struct io_uring_buf_ring *br, void *addr, unsigned int len,
+                                         unsigned short bid, int mask, int buf_offset)
+{
+    struct io_uring_buf *buf = &br->bufs[(br->tail + buf_offset) & mask];
+    buf->addr = (uint64_t)(uintptr_t)addr;
+    buf->len = len;
+    buf->bid = bid;
+}
+
+static inline void io_uring_buf_ring_advance(struct io_uring_buf_ring *br, int count)
+{
+    __atomic_store_n(&br->tail, (unsigned short)(br->tail + count), __ATOMIC_RELEASE);
+}
+
+static inline struct io_uring_buf_ring *io_uring_setup_buf_ring(struct io_uring *ring, unsigned int nentries,
+                                                                int bgid, unsigned int flags, int *ret)
+{
+    (void)flags;
+    size_t size = nentries * sizeof(struct io_uring_buf);
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ptr == MAP_FAILED)
+    {
+        *ret = -errno;
+        return NULL;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ptr;
+    reg.ring_entries = nentries;
+    reg.bgid = (uint16_t)bgid;
+    int rv = shimSyscall(syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1));
+    if (rv < 0)
+    {
+        *ret = rv;
+        munmap(ptr, size);
+        return NULL;
+    }
+    io_uring_buf_ring_init((struct io_uring_buf_ring *)ptr);
+    return (struct io_uring_buf_ring *)ptr;
+}
+
+static inline int io_uring_free_buf_ring(struct io_uring *ring, struct io_uring_buf_ring *br, unsigned int nentries,
+                                         int bgid)
+{
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.bgid = (uint16_t)bgid;
+    int rv = shimSyscall(syscall(__NR_io_uring_register, ring->ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1));
+    if (rv < 0)
+    {
+        return rv;
+    }
+    munmap(br, nentries * sizeof(struct io_uring_buf));
+    return 0;
+}
+
+#endif
@@ -0,0 +1,1095 @@
+#include "snapshot.h"
+#include "fdio.h"
+#include "hash.h"
+#include "log.h"
+#include "zset.h"
+#include "hmap.h"
+#include "qlist.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define HEADER_SIZE 40
+#define BLOCK_HEADER_SIZE 24
+#define ENTRY_HEADER_SIZE 20
+// version 1 entries had no type
+#define V1_ENTRY_HEADER_SIZE 16
+// loader threads for the checksum and hashing pass
+#define MAX_LOAD_THREADS 64
+
+static const char k_magic[8] = "CRDBSNAP";
+
+static inline void put32(uint8_t *p, uint32_t v)
+{
+    memcpy(p, &v, 4);
+}
+
+static inline void put64(uint8_t *p, uint64_t v)
+{
+    memcpy(p, &v, 8);
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint64_t get64(const uint8_t *p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static void fillHeader(uint8_t *header, uint64_t blocks, uint64_t keys)
+{
+    memcpy(header, k_magic, sizeof(k_magic));
+    put32(header + 8, SNAPSHOT_VERSION);
+    put32(header + 12, 0);
+    put64(header + 16, blocks);
+    put64(header + 24, keys);
+    put64(header + 32, checksumBytes(header, 32));
+}
+
+typedef struct
+{
+    int fd;
+    // block header followed by the payload
+    uint8_t *buf;
+    size_t capacity;
+    size_t used;
+    uint32_t entries;
+    uint64_t blocks;
+    uint64_t keys;
+    uint64_t now;
+    bool failed;
+} Writer;
+
+static bool flushBlock(Writer *w)
+{
+    if (w->entries == 0)
+    {
+        return true;
+    }
+    put32(w->buf, w->entries);
+    put32(w->buf + 4, 0);
+    put64(w->buf + 8, w->used);
+    put64(w->buf + 16, checksumBytes(w->buf + BLOCK_HEADER_SIZE, w->used));
+    if (!writeAll(w->fd, w->buf, BLOCK_HEADER_SIZE + w->used))
+    {
+        return false;
+    }
+    w->blocks++;
+    w->entries = 0;
+    w->used = 0;
+    return true;
+}
+
+static size_t entryHeaderSize(uint32_t version)
+{
+    return version == 1 ? V1_ENTRY_HEADER_SIZE : ENTRY_HEADER_SIZE;
+}
+
+// Serialized size of a container: the count, then per item the score of a
+// sorted set member and the length-prefixed strings.
+static size_t objectSize(const Node *node)
+{
+    size_t size = 4;
+    const void *object = nodeObject(node);
+    const uint8_t *bytes, *value;
+    uint32_t len, value_len;
+    double score;
+    if (node->type == VALUE_ZSET)
+    {
+        ZSetIter iter;
+        zsetSeek((const ZSet *)object, 0, &iter);
+        while (zsetNext(&iter, &bytes, &len, &score))
+        {
+            size += 8 + 4 + len;
+        }
+    }
+    else if (node->type == VALUE_HASH)
+    {
+        HMapIter iter;
+        hmapIterate((const HMap *)object, &iter);
+        while (hmapNext(&iter, &bytes, &len, &value, &value_len))
+        {
+            size += 4 + len + 4 + value_len;
+        }
+    }
+    else
+    {
+        QListIter iter;
+        qlistSeek((const QList *)object, 0, &iter);
+        while (qlistNext(&iter, &bytes, &len))
+        {
+            size += 4 + len;
+        }
+    }
+    return size;
+}
+
+static uint8_t *putBytes(uint8_t *p, const uint8_t *bytes, uint32_t len)
+{
+    put32(p, len);
+    memcpy(p + 4, bytes, len);
+    return p + 4 + len;
+}
+
+static void serializeObject(const Node *node, uint8_t *p)
+{
+    const void *object = nodeObject(node);
+    const uint8_t *bytes, *value;
+    uint32_t len, value_len;
+    double score;
+    if (node->type == VALUE_ZSET)
+    {
+        put32(p, (uint32_t)zsetSize((const ZSet *)object));
+        p += 4;
+        ZSetIter iter;
+        zsetSeek((const ZSet *)object, 0, &iter);
+        while (zsetNext(&iter, &bytes, &len, &score))
+        {
+            memcpy(p, &score, 8);
+            p = putBytes(p + 8, bytes, len);
+        }
+    }
+    else if (node->type == VALUE_HASH)
+    {
+        put32(p, (uint32_t)hmapSize((const HMap *)object));
+        p += 4;
+        HMapIter iter;
+        hmapIterate((const HMap *)object, &iter);
+        while (hmapNext(&iter, &bytes, &len, &value, &value_len))
+        {
+            p = putBytes(putBytes(p, bytes, len), value, value_len);
+        }
+    }
+    else
+    {
+        put32(p, (uint32_t)qlistSize((const QList *)object));
+        p += 4;
+        QListIter iter;
+        qlistSeek((const QList *)object, 0, &iter);
+        while (qlistNext(&iter, &bytes, &len))
+        {
+            p = putBytes(p, bytes, len);
+        }
+    }
+}
+
+// Reads a length-prefixed string that must end by end.
+static bool takeBytes(const uint8_t **p, const uint8_t *end, const uint8_t **bytes, uint32_t *len)
+{
+    if ((size_t)(end - *p) < 4 || (size_t)(end - *p) - 4 < get32(*p))
+    {
+        return false;
+    }
+    *len = get32(*p);
+    *bytes = *p + 4;
+    *p += 4 + *len;
+    return true;
+}
+
+static void freeContainer(ValueType type, void *object)
+{
+    if (type == VALUE_ZSET)
+    {
+        freeZSet((ZSet *)object);
+    }
+    else if (type == VALUE_HASH)
+    {
+        freeHMap((HMap *)object);
+    }
+    else
+    {
+        freeQList((QList *)object);
+    }
+}
+
+// Rebuilds a container. Returns false when the payload is malformed; *out
+// is NULL when memory ran out.
+static bool decodeObject(ValueType type, const uint8_t *p, size_t size, void **out)
+{
+    *out = NULL;
+    // an empty container is never stored
+    if (size < 4 || get32(p) == 0)
+    {
+        return false;
+    }
+    uint32_t count = get32(p);
+    const uint8_t *end = p + size;
+    p += 4;
+    void *object = type == VALUE_ZSET ? (void *)newZSet() : type == VALUE_HASH ? (void *)newHMap() : (void *)newQList();
+    if (!object)
+    {
+        return true;
+    }
+    bool valid = true, stored = true;
+    for (uint32_t i = 0; valid && stored && i < count; i++)
+    {
+        const uint8_t *bytes, *value;
+        uint32_t len, value_len;
+        double score;
+        bool added;
+        if (type == VALUE_ZSET)
+        {
+            valid = (size_t)(end - p) >= 8;
+            if (valid)
+            {
+                memcpy(&score, p, 8);
+                p += 8;
+                valid = !isnan(score) && takeBytes(&p, end, &bytes, &len);
+            }
+            stored = !valid || zsetAdd((ZSet *)object, bytes, len, score, &added);
+        }
+        else if (type == VALUE_HASH)
+        {
+            valid = takeBytes(&p, end, &bytes, &len) && takeBytes(&p, end, &value, &value_len);
+            stored = !valid || hmapSet((HMap *)object, bytes, len, value, value_len, &added);
+        }
+        else
+        {
+            valid = takeBytes(&p, end, &bytes, &len);
+            stored = !valid || qlistPush((QList *)object, true, bytes, len);
+        }
+    }
+    if (!stored)
+    {
+        freeContainer(type, object);
+        return true;
+    }
+    // a repeated member or field leaves the container short
+    size_t loaded = type == VALUE_ZSET   ? zsetSize((const ZSet *)object)
+                    : type == VALUE_HASH ? hmapSize((const HMap *)object)
+                                         : qlistSize((const QList *)object);
+    if (!valid || p != end || loaded != count)
+    {
+        freeContainer(type, object);
+        return false;
+    }
+    *out = object;
+    return true;
+}
+
+static bool appendEntry(const Node *node, void *arg)
+{
+    Writer *w = (Writer *)arg;
+    uint64_t deadline = nodeDeadline(node);
+    if (deadline != KEYSPACE_NO_EXPIRY && deadline <= w->now)
+    {
+        return true;
+    }
+
+    uint8_t buf[KEYSPACE_INT_CHARS];
+    const uint8_t *value = NULL;
+    uint32_t value_len = 0;
+    size_t value_size;
+    if (node->type == VALUE_STRING)
+    {
+        value = nodeString(node, buf, &value_len);
+        value_size = value_len;
+    }
+    else
+    {
+        value_size = objectSize(node);
+        if (value_size > UINT32_MAX)
+        {
+            errno = EFBIG;
+            w->failed = true;
+            return false;
+        }
+    }
+    size_t size = ENTRY_HEADER_SIZE + node->key_len + value_size;
+    if (w->used + size > SNAPSHOT_BLOCK_SIZE && !flushBlock(w))
+    {
+        w->failed = true;
+        return false;
+    }
+    if (size > w->capacity)
+    {
+        // only ever with an empty block: the entry is larger than a block
+        uint8_t *grown = (uint8_t *)realloc(w->buf, BLOCK_HEADER_SIZE + size);
+        if (!grown)
+        {
+            w->failed = true;
+            return false;
+        }
+        w->buf = grown;
+        w->capacity = size;
+    }
+
+    uint8_t *p = w->buf + BLOCK_HEADER_SIZE + w->used;
+    put32(p, node->key_len);
+    put32(p + 4, (uint32_t)value_size);
+    put64(p + 8, deadline);
+    put32(p + 16, node->type);
+    memcpy(p + ENTRY_HEADER_SIZE, nodeKey(node), node->key_len);
+    if (value)
+    {
+        memcpy(p + ENTRY_HEADER_SIZE + node->key_len, value, value_len);
+    }
+    else
+    {
+        serializeObject(node, p + ENTRY_HEADER_SIZE + node->key_len);
+    }
+    w->used += size;
+    w->entries++;
+    w->keys++;
+    return true;
+}
+
+static bool writeBlocks(Writer *w, Keyspace *const *shards, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        keyspaceForEach(shards[i], appendEntry, w);
+        if (w->failed)
+        {
+            return false;
+        }
+    }
+    return flushBlock(w);
+}
+
+bool writeSnapshot(const char *path, Keyspace *const *shards, int count)
+{
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp-%d", path, (int)getpid()) >= (int)sizeof(tmp))
+    {
+        errno = ENAMETOOLONG;
+        return false;
+    }
+
+    Writer w = {};
+    w.now = keyspaceClock();
+    w.capacity = SNAPSHOT_BLOCK_SIZE;
+    w.buf = (uint8_t *)malloc(BLOCK_HEADER_SIZE + w.capacity);
+    if (!w.buf)
+    {
+        return false;
+    }
+    w.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (w.fd < 0)
+    {
+        free(w.buf);
+        return false;
+    }
+
+    // the real header goes in last, once the counts are known
+    uint8_t header[HEADER_SIZE] = {};
+    bool ok = writeAll(w.fd, header, HEADER_SIZE) && writeBlocks(&w, shards, count);
+    if (ok)
+    {
+        fillHeader(header, w.blocks, w.keys);
+        ok = pwrite(w.fd, header, HEADER_SIZE, 0) == HEADER_SIZE && fsync(w.fd) == 0;
+    }
+
+    int saved = errno;
+    if (close(w.fd) != 0 && ok)
+    {
+        ok = false;
+        saved = errno;
+    }
+    if (ok && rename(tmp, path) != 0)
+    {
+        ok = false;
+        saved = errno;
+    }
+    if (!ok)
+    {
+        unlink(tmp);
+    }
+    free(w.buf);
+    errno = saved;
+    return ok;
+}
+
+bool streamSnapshot(int fd, Keyspace *const *shards, int count)
+{
+    Writer w = {};
+    w.fd = fd;
+    w.now = keyspaceClock();
+    w.capacity = SNAPSHOT_BLOCK_SIZE;
+    w.buf = (uint8_t *)malloc(BLOCK_HEADER_SIZE + w.capacity);
+    if (!w.buf)
+    {
+        return false;
+    }
+    uint8_t header[HEADER_SIZE];
+    fillHeader(header, 0, 0);
+    uint8_t end[BLOCK_HEADER_SIZE] = {};
+    bool ok = writeAll(fd, header, HEADER_SIZE) && writeBlocks(&w, shards, count) &&
+              writeAll(fd, end, BLOCK_HEADER_SIZE);
+    int saved = errno;
+    free(w.buf);
+    errno = saved;
+    return ok;
+}
+
+bool receiveSnapshot(int fd, SnapshotFile *file)
+{
+    memset(file, 0, sizeof(*file));
+    size_t capacity = SNAPSHOT_BLOCK_SIZE;
+    uint8_t *data = (uint8_t *)malloc(capacity);
+    if (!data)
+    {
+        logError("snapshot stream: out of memory");
+        return false;
+    }
+    size_t size = HEADER_SIZE;
+    uint64_t blocks = 0, keys = 0;
+    bool ok = readAll(fd, data, HEADER_SIZE);
+    if (ok && (memcmp(data, k_magic, sizeof(k_magic)) != 0 || get64(data + 32) != checksumBytes(data, 32) ||
+               get32(data + 8) != SNAPSHOT_VERSION))
+    {
+        logError("snapshot stream: not a snapshot or an unsupported version");
+        free(data);
+        return false;
+    }
+    while (ok)
+    {
+        uint8_t block[BLOCK_HEADER_SIZE];
+        ok = readAll(fd, block, BLOCK_HEADER_SIZE);
+        if (!ok || get32(block) == 0)
+        {
+            break;
+        }
+        // only a block of one entry may be larger than SNAPSHOT_BLOCK_SIZE
+        uint64_t bytes = get64(block + 8);
+        if (bytes > SNAPSHOT_BLOCK_SIZE && (get32(block) != 1 || bytes > ENTRY_HEADER_SIZE + 2ull * UINT32_MAX))
+        {
+            logError("snapshot stream: corrupt block header");
+            free(data);
+            return false;
+        }
+        if (size + BLOCK_HEADER_SIZE + bytes > capacity)
+        {
+            while (capacity < size + BLOCK_HEADER_SIZE + bytes)
+            {
+                capacity *= 2;
+            }
+            uint8_t *grown = (uint8_t *)realloc(data, capacity);
+            if (!grown)
+            {
+                logError("snapshot stream: out of memory");
+                free(data);
+                return false;
+            }
+            data = grown;
+        }
+        memcpy(data + size, block, BLOCK_HEADER_SIZE);
+        ok = readAll(fd, data + size + BLOCK_HEADER_SIZE, bytes);
+        size += BLOCK_HEADER_SIZE + bytes;
+        blocks++;
+        keys += get32(block);
+    }
+    if (!ok)
+    {
+        logError("snapshot stream: %s", strerror(errno));
+        free(data);
+        return false;
+    }
+    // the counts a file would have had in its header
+    fillHeader(data, blocks, keys);
+    file->data = data;
+    file->size = size;
+    file->version = SNAPSHOT_VERSION;
+    file->blocks = blocks;
+    file->keys = keys;
+    file->allocated = true;
+    return true;
+}
+
+bool openSnapshot(const char *path, SnapshotFile *file)
+{
+    memset(file, 0, sizeof(*file));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno == ENOENT)
+        {
+            return true;
+        }
+        logError("snapshot %s: %s", path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        logError("snapshot %s: %s", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    if ((size_t)st.st_size < HEADER_SIZE)
+    {
+        logError("snapshot %s: truncated header", path);
+        close(fd);
+        return false;
+    }
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        logError("snapshot %s: mmap: %s", path, strerror(errno));
+        return false;
+    }
+    // the load reads blocks out of order on several threads; start readahead
+    // of the whole file now
+    madvise(data, (size_t)st.st_size, MADV_WILLNEED);
+    file->data = (const uint8_t *)data;
+    file->size = (size_t)st.st_size;
+
+    const uint8_t *header = file->data;
+    if (memcmp(header, k_magic, sizeof(k_magic)) != 0 || get64(header + 32) != checksumBytes(header, 32))
+    {
+        logError("snapshot %s: not a snapshot or a damaged header", path);
+        closeSnapshot(file);
+        return false;
+    }
+    if (get32(header + 8) == 0 || get32(header + 8) > SNAPSHOT_VERSION)
+    {
+        logError("snapshot %s: unsupported version %u", path, get32(header + 8));
+        closeSnapshot(file);
+        return false;
+    }
+    file->version = get32(header + 8);
+    file->blocks = get64(header + 16);
+    file->keys = get64(header + 24);
+    return true;
+}
+
+void closeSnapshot(SnapshotFile *file)
+{
+    if (file->allocated)
+    {
+        free((void *)file->data);
+    }
+    else if (file->data)
+    {
+        munmap((void *)file->data, file->size);
+    }
+    memset(file, 0, sizeof(*file));
+}
+
+typedef struct
+{
+    const SnapshotFile *file;
+    Keyspace *const *shards;
+    int count;
+    int (*shard_of)(uint64_t hcode);
+    // per block: where its header starts and the index of its first key
+    size_t *offsets;
+    uint64_t *first_key;
+    // keyspaceHash of every key, in file order
+    uint64_t *hcodes;
+    _Atomic uint64_t next_block;
+    _Atomic bool corrupt;
+    uint64_t now;
+} Load;
+
+typedef struct
+{
+    Load *load;
+    int shard;
+    bool ok;
+    // a container that would not decode
+    bool corrupt;
+    uint64_t loaded;
+    uint64_t expired;
+} ShardFill;
+
+// Finds the blocks without reading their payloads.
+static bool indexBlocks(Load *load)
+{
+    const SnapshotFile *file = load->file;
+    size_t offset = HEADER_SIZE;
+    uint64_t keys = 0;
+    for (uint64_t b = 0; b < file->blocks; b++)
+    {
+        if (file->size - offset < BLOCK_HEADER_SIZE)
+        {
+            return false;
+        }
+        const uint8_t *block = file->data + offset;
+        uint64_t bytes = get64(block + 8);
+        if (bytes > file->size - offset - BLOCK_HEADER_SIZE)
+        {
+            return false;
+        }
+        load->offsets[b] = offset;
+        load->first_key[b] = keys;
+        keys += get32(block);
+        offset += BLOCK_HEADER_SIZE + bytes;
+    }
+    return offset == file->size && keys == file->keys;
+}
+
+static void *checkBlocks(void *arg)
+{
+    Load *load = (Load *)arg;
+    while (!atomic_load_explicit(&load->corrupt, memory_order_relaxed))
+    {
+        uint64_t b = atomic_fetch_add_explicit(&load->next_block, 1, memory_order_relaxed);
+        if (b >= load->file->blocks)
+        {
+            break;
+        }
+        const uint8_t *block = load->file->data + load->offsets[b];
+        uint32_t entries = get32(block);
+        uint64_t bytes = get64(block + 8);
+        const uint8_t *p = block + BLOCK_HEADER_SIZE;
+        const uint8_t *end = p + bytes;
+        bool ok = checksumBytes(p, bytes) == get64(block + 16);
+
+        uint64_t *hcodes = load->hcodes + load->first_key[b];
+        size_t header_size = entryHeaderSize(load->file->version);
+        for (uint32_t i = 0; ok && i < entries; i++)
+        {
+            if ((size_t)(end - p) < header_size)
+            {
+                ok = false;
+                break;
+            }
+            uint64_t key_len = get32(p);
+            uint64_t value_len = get32(p + 4);
+            if ((size_t)(end - p) - header_size < key_len + value_len ||
+                (header_size == ENTRY_HEADER_SIZE && get32(p + 16) > VALUE_LIST))
+            {
+                ok = false;
+                break;
+            }
+            hcodes[i] = keyspaceHash(p + header_size, key_len);
+            p += header_size + key_len + value_len;
+        }
+        if (!ok || p != end)
+        {
+            atomic_store_explicit(&load->corrupt, true, memory_order_relaxed);
+        }
+    }
+    return NULL;
+}
+
+// Builds the nodes of one shard, then adds them in one batch; the blocks
+// were checked.
+static void *fillShard(void *arg)
+{
+    ShardFill *fill = (ShardFill *)arg;
+    Load *load = fill->load;
+    Keyspace *keyspace = load->shards[fill->shard];
+    size_t capacity = load->file->keys / (uint64_t)load->count + 1;
+    Node **nodes = (Node **)malloc(sizeof(Node *) * capacity);
+    fill->ok = nodes != NULL;
+    for (uint64_t b = 0; fill->ok && b < load->file->blocks; b++)
+    {
+        const uint8_t *block = load->file->data + load->offsets[b];
+        uint32_t entries = get32(block);
+        const uint8_t *p = block + BLOCK_HEADER_SIZE;
+        const uint64_t *hcodes = load->hcodes + load->first_key[b];
+        size_t header_size = entryHeaderSize(load->file->version);
+        for (uint32_t i = 0; i < entries; i++)
+        {
+            uint32_t key_len = get32(p);
+            uint32_t value_len = get32(p + 4);
+            uint64_t deadline = get64(p + 8);
+            ValueType type = header_size == ENTRY_HEADER_SIZE ? (ValueType)get32(p + 16) : VALUE_STRING;
+            const uint8_t *key = p + header_size;
+            p += header_size + key_len + value_len;
+
+            if (load->shard_of(hcodes[i]) != fill->shard)
+            {
+                continue;
+            }
+            if (deadline != KEYSPACE_NO_EXPIRY && deadline <= load->now)
+            {
+                fill->expired++;
+                continue;
+            }
+            if (fill->loaded == capacity)
+            {
+                Node **grown = (Node **)realloc(nodes, sizeof(Node *) * capacity * 2);
+                if (!grown)
+                {
+                    fill->ok = false;
+                    break;
+                }
+                nodes = grown;
+                capacity *= 2;
+            }
+            if (type == VALUE_STRING)
+            {
+                nodes[fill->loaded] =
+                    keyspaceLoadNode(keyspace, hcodes[i], key, key_len, key + key_len, value_len, deadline);
+            }
+            else
+            {
+                void *object;
+                if (!decodeObject(type, key + key_len, value_len, &object))
+                {
+                    fill->corrupt = true;
+                    fill->ok = false;
+                    break;
+                }
+                nodes[fill->loaded] =
+                    object ? keyspaceLoadObject(keyspace, hcodes[i], key, key_len, type, object, deadline) : NULL;
+            }
+            if (!nodes[fill->loaded])
+            {
+                fill->ok = false;
+                break;
+            }
+            fill->loaded++;
+        }
+    }
+    // built nodes go in even after a failure, so freeing the keyspace frees them
+    if (nodes && !keyspaceAddLoaded(keyspace, nodes, fill->loaded))
+    {
+        fill->ok = false;
+    }
+    free(nodes);
+    return NULL;
+}
+
+// Runs fn over args[0..n) on n - 1 extra threads and the calling one.
+static void runParallel(void *(*fn)(void *), void *args, size_t arg_size, int n)
+{
+    pthread_t threads[MAX_LOAD_THREADS];
+    int started = 0;
+    for (int i = 1; i < n; i++)
+    {
+        if (pthread_create(&threads[started], NULL, fn, (uint8_t *)args + (size_t)i * arg_size) != 0)
+        {
+            // whatever did not start is done on this thread
+            fn((uint8_t *)args + (size_t)i * arg_size);
+            continue;
+        }
+        started++;
+    }
+    fn(args);
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+bool loadSnapshot(const SnapshotFile *file, Keyspace *const *shards, int count, int (*shard_of)(uint64_t hcode),
+                  int threads)
+{
+    if (!file->data)
+    {
+        return true;
+    }
+    uint64_t start = monotonicMs();
+    // bound what a damaged header can make us allocate
+    if (file->blocks > file->size / BLOCK_HEADER_SIZE || file->keys > file->size / entryHeaderSize(file->version))
+    {
+        logError("snapshot: corrupt header counts");
+        return false;
+    }
+
+    Load load = {};
+    load.file = file;
+    load.shards = shards;
+    load.count = count;
+    load.shard_of = shard_of;
+    load.now = keyspaceClock();
+    load.offsets = (size_t *)malloc(sizeof(size_t) * (file->blocks ? file->blocks : 1));
+    load.first_key = (uint64_t *)malloc(sizeof(uint64_t) * (file->blocks ? file->blocks : 1));
+    load.hcodes = (uint64_t *)malloc(sizeof(uint64_t) * (file->keys ? file->keys : 1));
+    ShardFill *fills = (ShardFill *)calloc((size_t)count, sizeof(ShardFill));
+    bool ok = load.offsets && load.first_key && load.hcodes && fills;
+    if (!ok)
+    {
+        logError("snapshot: out of memory");
+    }
+    else if (!indexBlocks(&load))
+    {
+        logError("snapshot: truncated or corrupt block list");
+        ok = false;
+    }
+
+    if (ok)
+    {
+        if (threads > MAX_LOAD_THREADS)
+        {
+            threads = MAX_LOAD_THREADS;
+        }
+        if ((uint64_t)threads > file->blocks)
+        {
+            threads = file->blocks ? (int)file->blocks : 1;
+        }
+        // the threads pull blocks off a shared counter
+        pthread_t helpers[MAX_LOAD_THREADS];
+        int started = 0;
+        for (int i = 1; i < threads; i++)
+        {
+            if (pthread_create(&helpers[started], NULL, checkBlocks, &load) == 0)
+            {
+                started++;
+            }
+        }
+        checkBlocks(&load);
+        for (int i = 0; i < started; i++)
+        {
+            pthread_join(helpers[i], NULL);
+        }
+        if (atomic_load(&load.corrupt))
+        {
+            logError("snapshot: block checksum mismatch or malformed entry");
+            ok = false;
+        }
+    }
+
+    uint64_t loaded = 0, expired = 0;
+    bool corrupt = false;
+    if (ok)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            fills[i].load = &load;
+            fills[i].shard = i;
+        }
+        runParallel(fillShard, fills, sizeof(ShardFill), count);
+        for (int i = 0; i < count; i++)
+        {
+            ok = ok && fills[i].ok;
+            corrupt = corrupt || fills[i].corrupt;
+            loaded += fills[i].loaded;
+            expired += fills[i].expired;
+        }
+        if (corrupt)
+        {
+            logError("snapshot: malformed value");
+        }
+        else if (!ok)
+        {
+            logError("snapshot: out of memory while loading");
+        }
+    }
+    if (ok)
+    {
+        logInfo("loaded %llu keys (%llu already expired) from %llu blocks in %llu ms", (unsigned long long)loaded,
+                (unsigned long long)expired, (unsigned long long)file->blocks,
+                (unsigned long long)(monotonicMs() - start));
+    }
+
+    free(load.offsets);
+    free(load.first_key);
+    free(load.hcodes);
+    free(fills);
+    return ok;
+}
+
+static struct
+{
+    char *path;
+    int count;
+    Keyspace **shards;
+    int *wake_fds;
+    pthread_barrier_t barrier;
+    // set while a save keeps the other workers parked
+    _Atomic bool pausing;
+    // held by whichever worker is parking the others
+    _Atomic bool paused;
+    // held by a SAVE for its duration and by a BGSAVE until its child is reaped
+    _Atomic bool busy;
+    // the worker that forked the running child, -1 without one; only that
+    // worker touches child and started_ms
+    _Atomic int child_owner;
+    pid_t child;
+    uint64_t started_ms;
+    _Atomic bool last_ok;
+    _Atomic uint64_t last_save;
+    _Atomic uint64_t last_duration_ms;
+} g_snapshots;
+
+bool initSnapshots(const char *path, int count)
+{
+    g_snapshots.path = strdup(path);
+    g_snapshots.count = count;
+    g_snapshots.shards = (Keyspace **)calloc((size_t)count, sizeof(Keyspace *));
+    g_snapshots.wake_fds = (int *)calloc((size_t)count, sizeof(int));
+    if (!g_snapshots.path || !g_snapshots.shards || !g_snapshots.wake_fds)
+    {
+        return false;
+    }
+    if (count > 1 && pthread_barrier_init(&g_snapshots.barrier, NULL, (unsigned)count) != 0)
+    {
+        return false;
+    }
+    atomic_init(&g_snapshots.pausing, false);
+    atomic_init(&g_snapshots.paused, false);
+    atomic_init(&g_snapshots.busy, false);
+    atomic_init(&g_snapshots.child_owner, -1);
+    atomic_init(&g_snapshots.last_ok, true);
+    atomic_init(&g_snapshots.last_save, 0);
+    atomic_init(&g_snapshots.last_duration_ms, 0);
+    return true;
+}
+
+void registerSnapshotShard(int id, Keyspace *db, int wake_fd)
+{
+    g_snapshots.shards[id] = db;
+    g_snapshots.wake_fds[id] = wake_fd;
+}
+
+bool pauseWorkers(int self)
+{
+    bool expected = false;
+    if (!atomic_compare_exchange_strong(&g_snapshots.paused, &expected, true))
+    {
+        return false;
+    }
+    if (g_snapshots.count == 1)
+    {
+        return true;
+    }
+    atomic_store(&g_snapshots.pausing, true);
+    for (int i = 0; i < g_snapshots.count; i++)
+    {
+        if (i != self)
+        {
+            uint64_t one = 1;
+            ssize_t rv = write(g_snapshots.wake_fds[i], &one, sizeof(one));
+            (void)rv;
+        }
+    }
+    pthread_barrier_wait(&g_snapshots.barrier);
+    return true;
+}
+
+void resumeWorkers(void)
+{
+    if (g_snapshots.count > 1)
+    {
+        atomic_store(&g_snapshots.pausing, false);
+        pthread_barrier_wait(&g_snapshots.barrier);
+    }
+    atomic_store(&g_snapshots.paused, false);
+}
+
+static void finishSave(bool ok, uint64_t started_ms)
+{
+    atomic_store(&g_snapshots.last_ok, ok);
+    atomic_store(&g_snapshots.last_duration_ms, monotonicMs() - started_ms);
+    if (ok)
+    {
+        atomic_store(&g_snapshots.last_save, (uint64_t)time(NULL));
+    }
+}
+
+SnapshotResult snapshotSave(int self, bool background)
+{
+    bool expected = false;
+    if (!atomic_compare_exchange_strong(&g_snapshots.busy, &expected, true))
+    {
+        return SNAPSHOT_BUSY;
+    }
+    if (!pauseWorkers(self))
+    {
+        // an append-only file rewrite is switching files
+        atomic_store(&g_snapshots.busy, false);
+        return SNAPSHOT_BUSY;
+    }
+    uint64_t start = monotonicMs();
+
+    if (!background)
+    {
+        bool ok = writeSnapshot(g_snapshots.path, g_snapshots.shards, g_snapshots.count);
+        int err = errno;
+        resumeWorkers();
+        finishSave(ok, start);
+        atomic_store(&g_snapshots.busy, false);
+        if (!ok)
+        {
+            logError("save to %s failed: %s", g_snapshots.path, strerror(err));
+            return SNAPSHOT_FAILED;
+        }
+        logInfo("saved %s in %llu ms", g_snapshots.path, (unsigned long long)(monotonicMs() - start));
+        return SNAPSHOT_OK;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // the exit status carries errno back to the parent
+        bool ok = writeSnapshot(g_snapshots.path, g_snapshots.shards, g_snapshots.count);
+        _exit(ok ? 0 : (errno > 0 && errno < 256 ? errno : 255));
+    }
+    int err = errno;
+    resumeWorkers();
+    if (pid < 0)
+    {
+        finishSave(false, start);
+        atomic_store(&g_snapshots.busy, false);
+        logError("background save: fork: %s", strerror(err));
+        return SNAPSHOT_FAILED;
+    }
+    g_snapshots.child = pid;
+    g_snapshots.started_ms = start;
+    atomic_store(&g_snapshots.child_owner, self);
+    logInfo("background save started by pid %d after %llu ms", (int)pid,
+            (unsigned long long)(monotonicMs() - start));
+    return SNAPSHOT_OK;
+}
+
+int snapshotCheckpoint(int self)
+{
+    if (atomic_load_explicit(&g_snapshots.pausing, memory_order_acquire))
+    {
+        // once to let the save start, once to wait for the go-ahead
+        pthread_barrier_wait(&g_snapshots.barrier);
+        pthread_barrier_wait(&g_snapshots.barrier);
+    }
+    if (atomic_load_explicit(&g_snapshots.child_owner, memory_order_relaxed) != self)
+    {
+        return -1;
+    }
+
+    int status = 0;
+    pid_t rv = waitpid(g_snapshots.child, &status, WNOHANG);
+    if (rv == 0 || (rv < 0 && errno == EINTR))
+    {
+        return SNAPSHOT_POLL_MS;
+    }
+    bool ok = rv == g_snapshots.child && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    finishSave(ok, g_snapshots.started_ms);
+    if (ok)
+    {
+        logInfo("background save to %s finished in %llu ms", g_snapshots.path,
+                (unsigned long long)atomic_load(&g_snapshots.last_duration_ms));
+    }
+    else if (rv == g_snapshots.child && WIFEXITED(status))
+    {
+        logError("background save to %s failed: %s", g_snapshots.path, strerror(WEXITSTATUS(status)));
+    }
+    else
+    {
+        logError("background save to %s failed: child killed by signal %d", g_snapshots.path,
+                 WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+    }
+    g_snapshots.child = 0;
+    atomic_store(&g_snapshots.child_owner, -1);
+    atomic_store(&g_snapshots.busy, false);
+    return -1;
+}
+
+void snapshotStatus(SnapshotStatus *status)
+{
+    status->in_progress = atomic_load(&g_snapshots.child_owner) >= 0;
+    status->last_ok = atomic_load(&g_snapshots.last_ok);
+    status->last_save = atomic_load(&g_snapshots.last_save);
+    status->last_duration_ms = atomic_load(&g_snapshots.last_duration_ms);
+}
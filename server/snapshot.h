@@ -0,0 +1,111 @@
+#ifndef SNAPSHOT_HEADER
+#define SNAPSHOT_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include "keyspace.h"
+
+// Snapshot file layout, all integers little-endian:
+//   header  "CRDBSNAP", u32 version, u32 reserved, u64 block count,
+//           u64 key count, u64 checksum of the preceding 32 bytes
+//   blocks  u32 entry count, u32 reserved, u64 payload bytes, u64 checksum
+//           of the payload, then the entries back to back: u32 key length,
+//           u32 value length, u64 deadline (KEYSPACE_NO_EXPIRY without a
+//           TTL), u32 ValueType, key bytes, value bytes
+// A string value is its bytes. A container is a u32 item count, then per
+// item the strings as a u32 length and the bytes: a sorted set member in
+// order after its f64 score, a hash field then its value, a list element.
+// Version 1 files, which hold only strings and have no type field, still
+// load.
+// Blocks are self-contained so a load can check and hash them in parallel.
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_DEFAULT_PATH "dump.crdb"
+// payload size at which a block is closed; a larger entry gets one alone
+#define SNAPSHOT_BLOCK_SIZE (1 << 20)
+// how often the worker that forked a background save polls for its exit
+#define SNAPSHOT_POLL_MS 100
+
+// Writes every unexpired key of the shards to a temporary file, fsyncs it
+// and renames it over path. It does not log, so a forked child may call it;
+// on failure errno tells why.
+bool writeSnapshot(const char *path, Keyspace *const *shards, int count);
+
+// The same layout written to a socket for a replica. A stream cannot seek
+// back to the header, so its counts are zero and a block header of zeros
+// ends it. Does not log; on failure errno tells why.
+bool streamSnapshot(int fd, Keyspace *const *shards, int count);
+
+// A snapshot mapped, or received into memory, for loading.
+typedef struct
+{
+    const uint8_t *data;
+    size_t size;
+    uint32_t version;
+    uint64_t blocks;
+    uint64_t keys;
+    // data is heap memory rather than a mapping
+    bool allocated;
+} SnapshotFile;
+
+// Reads a streamSnapshot from a blocking socket up to its end marker and
+// fills in the header counts, so it loads like a file. Logs and returns
+// false when the stream breaks off or is malformed.
+bool receiveSnapshot(int fd, SnapshotFile *file);
+
+// Maps the file and checks its header. A missing file opens as an empty
+// snapshot; an unreadable or malformed one is logged and returns false.
+bool openSnapshot(const char *path, SnapshotFile *file);
+
+// Checks every block and inserts each unexpired key into
+// shards[shard_of(hash)]. Blocks are checksummed and their keys hashed on
+// up to `threads` threads, then every shard is filled by a thread of its own.
+// Logs and returns false when the file is corrupt.
+bool loadSnapshot(const SnapshotFile *file, Keyspace *const *shards, int count, int (*shard_of)(uint64_t hcode),
+                  int threads);
+
+void closeSnapshot(SnapshotFile *file);
+
+// Saving while serving. Each worker registers its shard and wake eventfd at
+// startup and calls snapshotCheckpoint at the top of its loop, where no
+// command is half done. A save parks every other worker there, so all
+// shards are consistent at once. SAVE then writes the file on the calling
+// thread. BGSAVE forks a child that writes from its copy-on-write image, and
+// the workers resume at once.
+typedef enum
+{
+    SNAPSHOT_OK,
+    SNAPSHOT_BUSY,
+    SNAPSHOT_FAILED,
+} SnapshotResult;
+
+bool initSnapshots(const char *path, int count);
+
+void registerSnapshotShard(int id, Keyspace *db, int wake_fd);
+
+SnapshotResult snapshotSave(int self, bool background);
+
+// Parks every other worker in snapshotCheckpoint until resumeWorkers, for
+// anything else that must see all shards between commands. Returns false
+// when another worker holds the pause; the caller should back off to the top
+// of its loop, where it gets parked in turn.
+bool pauseWorkers(int self);
+
+void resumeWorkers(void);
+
+// Parks the worker while another one saves and reaps a background save this
+// worker started. Returns the longest the worker may sleep, -1 for no limit.
+int snapshotCheckpoint(int self);
+
+typedef struct
+{
+    bool in_progress;
+    bool last_ok;
+    // unix seconds, 0 before the first save
+    uint64_t last_save;
+    uint64_t last_duration_ms;
+} SnapshotStatus;
+
+void snapshotStatus(SnapshotStatus *status);
+
+#endif
@@ -0,0 +1,68 @@
+#include "spscqueue.h"
+
+bool initSpscQueue(SpscQueue *queue, size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+    {
+        size *= 2;
+    }
+
+    queue->slots = (ShardMessage *)malloc(size * sizeof(ShardMessage));
+    if (!queue->slots)
+    {
+        return false;
+    }
+    queue->mask = size - 1;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    queue->cached_head = 0;
+    queue->cached_tail = 0;
+    return true;
+}
+
+void freeSpscQueue(SpscQueue *queue)
+{
+    free(queue->slots);
+    queue->slots = NULL;
+}
+
+bool spscPush(SpscQueue *queue, const ShardMessage *message)
+{
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    if (tail - queue->cached_head > queue->mask)
+    {
+        queue->cached_head = atomic_load_explicit(&queue->head, memory_order_acquire);
+        if (tail - queue->cached_head > queue->mask)
+        {
+            return false;
+        }
+    }
+
+    queue->slots[tail & queue->mask] = *message;
+    atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+bool spscPop(SpscQueue *queue, ShardMessage *message)
+{
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    if (head == queue->cached_tail)
+    {
+        queue->cached_tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+        if (head == queue->cached_tail)
+        {
+            return false;
+        }
+    }
+
+    *message = queue->slots[head & queue->mask];
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+    return true;
+}
+
+bool spscEmpty(SpscQueue *queue)
+{
+    return atomic_load_explicit(&queue->head, memory_order_acquire) ==
+           atomic_load_explicit(&queue->tail, memory_order_acquire);
+}
@@ -0,0 +1,55 @@
+#ifndef SPSC_QUEUE_HEADER
+#define SPSC_QUEUE_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "blob.h"
+#include "buffer.h"
+
+enum
+{
+    SHARD_REQUEST = 1, // payload is a request, run it on the receiving shard
+    SHARD_REPLY = 2,   // payload is a framed reply for the placeholder
+};
+
+// A request forwarded to the shard that owns its key, or the reply coming
+// back. Ownership of the payload moves with the message.
+typedef struct
+{
+    uint32_t kind;
+    int fd;
+    uint32_t generation;
+    BufferSegment *placeholder;
+    Blob *payload;
+    // the request followed an ASKING, see cluster.h
+    bool asking;
+} ShardMessage;
+
+// Bounded lock-free ring with exactly one producer and one consumer thread.
+// Each side caches the other's index so the shared cache lines are only
+// touched when the cached view says the ring is full or empty.
+typedef struct
+{
+    _Alignas(64) _Atomic size_t head;
+    size_t cached_tail;
+    _Alignas(64) _Atomic size_t tail;
+    size_t cached_head;
+    _Alignas(64) size_t mask;
+    ShardMessage *slots;
+} SpscQueue;
+
+bool initSpscQueue(SpscQueue *queue, size_t capacity);
+
+void freeSpscQueue(SpscQueue *queue);
+
+// Producer side; returns false when the ring is full.
+bool spscPush(SpscQueue *queue, const ShardMessage *message);
+
+// Consumer side; returns false when the ring is empty.
+bool spscPop(SpscQueue *queue, ShardMessage *message);
+
+bool spscEmpty(SpscQueue *queue);
+
+#endif
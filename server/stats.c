@@ -0,0 +1,337 @@
+#include "stats.h"
+#include "eviction.h"
+#include "snapshot.h"
+#include "aof.h"
+#include "repl.h"
+#include "cluster.h"
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+static struct
+{
+    Stats *workers[STATS_MAX_WORKERS];
+    int count;
+    uint64_t started;
+    // ops/sec is measured between consecutive reports
+    pthread_mutex_t report_lock;
+    uint64_t last_report;
+    uint64_t last_ops;
+} g_stats = {.report_lock = PTHREAD_MUTEX_INITIALIZER};
+
+uint64_t statsNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static size_t bucketIndex(uint64_t value)
+{
+    if (value < HIST_SUB)
+    {
+        return (size_t)value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - (HIST_SUB_BITS - 1);
+    size_t index = HIST_SUB + (size_t)(shift - 1) * HIST_HALF + (size_t)((value >> shift) - HIST_HALF);
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+// Highest value that lands in the bucket.
+static uint64_t bucketHigh(size_t index)
+{
+    if (index < HIST_SUB)
+    {
+        return index;
+    }
+    size_t shift = (index - HIST_SUB) / HIST_HALF + 1;
+    uint64_t sub = (index - HIST_SUB) % HIST_HALF + HIST_HALF;
+    return ((sub + 1) << shift) - 1;
+}
+
+void recordLatency(Histogram *histogram, uint64_t ns)
+{
+    statAdd(&histogram->counts[bucketIndex(ns)], 1);
+    statAdd(&histogram->total, 1);
+    if (ns > atomic_load_explicit(&histogram->max, memory_order_relaxed))
+    {
+        statSet(&histogram->max, ns);
+    }
+}
+
+void registerStats(Stats *stats)
+{
+    if (g_stats.count == 0)
+    {
+        g_stats.started = statsNow();
+        g_stats.last_report = g_stats.started;
+    }
+    if (g_stats.count < STATS_MAX_WORKERS)
+    {
+        g_stats.workers[g_stats.count++] = stats;
+    }
+}
+
+static uint64_t load(const StatCounter *counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+// Sum of one histogram over all workers.
+typedef struct
+{
+    uint64_t total;
+    uint64_t max;
+    uint64_t counts[HIST_BUCKETS];
+} MergedHistogram;
+
+static void mergeHistogram(MergedHistogram *merged, size_t offset)
+{
+    memset(merged, 0, sizeof(*merged));
+    for (int w = 0; w < g_stats.count; w++)
+    {
+        const Histogram *histogram = (const Histogram *)((const uint8_t *)g_stats.workers[w] + offset);
+        merged->total += load(&histogram->total);
+        uint64_t max = load(&histogram->max);
+        if (max > merged->max)
+        {
+            merged->max = max;
+        }
+        for (size_t i = 0; i < HIST_BUCKETS; i++)
+        {
+            merged->counts[i] += load(&histogram->counts[i]);
+        }
+    }
+}
+
+static uint64_t percentile(const MergedHistogram *merged, double p)
+{
+    // the bucket counts may run slightly ahead of total while workers record
+    uint64_t target = (uint64_t)(p * (double)merged->total + 0.5);
+    if (target == 0)
+    {
+        target = 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += merged->counts[i];
+        if (seen >= target)
+        {
+            uint64_t high = bucketHigh(i);
+            return high < merged->max ? high : merged->max;
+        }
+    }
+    return merged->max;
+}
+
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t capacity;
+} Text;
+
+__attribute__((format(printf, 2, 3))) static void appendf(Text *text, const char *fmt, ...)
+{
+    while (true)
+    {
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(text->data ? text->data + text->len : NULL,
+                          text->data ? text->capacity - text->len : 0, fmt, args);
+        va_end(args);
+        if (n < 0)
+        {
+            return;
+        }
+        if (text->data && text->len + (size_t)n < text->capacity)
+        {
+            text->len += (size_t)n;
+            return;
+        }
+        size_t capacity = text->capacity ? text->capacity * 2 : 4096;
+        while (capacity <= text->len + (size_t)n)
+        {
+            capacity *= 2;
+        }
+        char *data = (char *)realloc(text->data, capacity);
+        if (!data)
+        {
+            return;
+        }
+        text->data = data;
+        text->capacity = capacity;
+    }
+}
+
+static void appendLatency(Text *text, const char *label, const MergedHistogram *merged)
+{
+    appendf(text, "%s:calls=%llu,p50=%.3f,p99=%.3f,p999=%.3f,max=%.3f\r\n", label,
+            (unsigned long long)merged->total,
+            percentile(merged, 0.50) / 1000.0, percentile(merged, 0.99) / 1000.0,
+            percentile(merged, 0.999) / 1000.0, merged->max / 1000.0);
+}
+
+static uint64_t sumCounter(size_t offset)
+{
+    uint64_t sum = 0;
+    for (int w = 0; w < g_stats.count; w++)
+    {
+        sum += load((const StatCounter *)((const uint8_t *)g_stats.workers[w] + offset));
+    }
+    return sum;
+}
+
+#define SUM(field) sumCounter(offsetof(Stats, field))
+
+char *statsReport(const char *const *command_names, size_t command_count, size_t *len)
+{
+    Text text = {};
+    MergedHistogram *merged = (MergedHistogram *)malloc(sizeof(MergedHistogram));
+    if (!merged)
+    {
+        return NULL;
+    }
+
+    uint64_t now = statsNow();
+    uint64_t ops = 0;
+    for (size_t i = 0; i < command_count; i++)
+    {
+        ops += sumCounter(offsetof(Stats, commands) + i * sizeof(Histogram) + offsetof(Histogram, total));
+    }
+
+    pthread_mutex_lock(&g_stats.report_lock);
+    uint64_t elapsed = now - g_stats.last_report;
+    double ops_per_sec = elapsed ? (double)(ops - g_stats.last_ops) * 1e9 / (double)elapsed : 0.0;
+    g_stats.last_report = now;
+    g_stats.last_ops = ops;
+    pthread_mutex_unlock(&g_stats.report_lock);
+
+    uint64_t accepted = SUM(connections_accepted);
+    appendf(&text, "# Server\r\n");
+    appendf(&text, "uptime_in_seconds:%llu\r\n", (unsigned long long)((now - g_stats.started) / 1000000000ull));
+    appendf(&text, "worker_threads:%d\r\n", g_stats.count);
+    appendf(&text, "# Clients\r\n");
+    appendf(&text, "connected_clients:%llu\r\n", (unsigned long long)(accepted - SUM(connections_closed)));
+    appendf(&text, "total_connections_received:%llu\r\n", (unsigned long long)accepted);
+    appendf(&text, "client_output_buffer_limit_disconnections:%llu\r\n",
+            (unsigned long long)SUM(output_limit_disconnections));
+    appendf(&text, "# Stats\r\n");
+    appendf(&text, "total_commands_processed:%llu\r\n", (unsigned long long)ops);
+    appendf(&text, "ops_per_sec:%.1f\r\n", ops_per_sec);
+    appendf(&text, "total_net_input_bytes:%llu\r\n", (unsigned long long)SUM(bytes_in));
+    appendf(&text, "total_net_output_bytes:%llu\r\n", (unsigned long long)SUM(bytes_out));
+    appendf(&text, "conn_pool_hits:%llu\r\n", (unsigned long long)SUM(conn_pool_hits));
+    appendf(&text, "conn_pool_misses:%llu\r\n", (unsigned long long)SUM(conn_pool_misses));
+    appendf(&text, "segment_pool_hits:%llu\r\n", (unsigned long long)SUM(segment_pool_hits));
+    appendf(&text, "segment_pool_misses:%llu\r\n", (unsigned long long)SUM(segment_pool_misses));
+    appendf(&text, "expired_keys:%llu\r\n", (unsigned long long)SUM(expired_keys));
+    appendf(&text, "evicted_keys:%llu\r\n", (unsigned long long)SUM(evicted_keys));
+    appendf(&text, "# Memory\r\n");
+    appendf(&text, "used_memory:%llu\r\n", (unsigned long long)SUM(used_memory));
+    appendf(&text, "maxmemory:%llu\r\n", (unsigned long long)SUM(maxmemory));
+    appendf(&text, "maxmemory_policy:%s\r\n",
+            evictionPolicyName((EvictionPolicy)(g_stats.count ? load(&g_stats.workers[0]->maxmemory_policy) : 0)));
+    SnapshotStatus snapshot;
+    snapshotStatus(&snapshot);
+    appendf(&text, "# Persistence\r\n");
+    appendf(&text, "snapshot_in_progress:%d\r\n", snapshot.in_progress ? 1 : 0);
+    appendf(&text, "snapshot_last_save_time:%llu\r\n", (unsigned long long)snapshot.last_save);
+    appendf(&text, "snapshot_last_status:%s\r\n", snapshot.last_ok ? "ok" : "err");
+    appendf(&text, "snapshot_last_duration_ms:%llu\r\n", (unsigned long long)snapshot.last_duration_ms);
+    AofStatus aof;
+    aofStatus(&aof);
+    appendf(&text, "aof_enabled:%d\r\n", aof.enabled ? 1 : 0);
+    if (aof.enabled)
+    {
+        appendf(&text, "aof_fsync:%s\r\n", aofFsyncName(aof.policy));
+        appendf(&text, "aof_rewrite_in_progress:%d\r\n", aof.rewrite_in_progress ? 1 : 0);
+        appendf(&text, "aof_last_rewrite_status:%s\r\n", aof.last_rewrite_ok ? "ok" : "err");
+        appendf(&text, "aof_current_size:%llu\r\n", (unsigned long long)aof.current_size);
+        appendf(&text, "aof_base_size:%llu\r\n", (unsigned long long)aof.base_size);
+        appendf(&text, "aof_fsyncs:%llu\r\n", (unsigned long long)aof.fsyncs);
+    }
+    ReplStatus repl;
+    replStatus(&repl);
+    appendf(&text, "# Replication\r\n");
+    appendf(&text, "role:%s\r\n", repl.replica ? "slave" : "master");
+    if (repl.replica)
+    {
+        appendf(&text, "master_addr:%s\r\n", repl.primary);
+        appendf(&text, "master_link_status:%s\r\n", repl.link_up ? "up" : "down");
+        appendf(&text, "master_last_io_seconds_ago:%llu\r\n", (unsigned long long)repl.last_io_seconds);
+        appendf(&text, "master_sync_in_progress:%d\r\n", repl.sync_in_progress ? 1 : 0);
+        appendf(&text, "slave_repl_offset:%llu\r\n", (unsigned long long)repl.offset);
+    }
+    else
+    {
+        appendf(&text, "connected_slaves:%d\r\n", repl.replicas);
+        for (int i = 0; i < repl.replicas; i++)
+        {
+            const ReplicaStatus *r = &repl.replica_status[i];
+            appendf(&text, "slave%d:addr=%s,state=%s,offset=%llu,lag=%llu,lag_bytes=%llu\r\n", i, r->addr,
+                    r->online ? "online" : "sync", (unsigned long long)r->ack_offset, (unsigned long long)r->lag,
+                    (unsigned long long)(repl.offset - r->ack_offset));
+        }
+    }
+    appendf(&text, "master_replid:%s\r\n", repl.replid);
+    appendf(&text, "master_repl_offset:%llu\r\n", (unsigned long long)repl.offset);
+    if (!repl.replica)
+    {
+        appendf(&text, "repl_backlog_active:%d\r\n", repl.backlog_size > 0 ? 1 : 0);
+        appendf(&text, "repl_backlog_size:%zu\r\n", repl.backlog_size);
+        appendf(&text, "repl_backlog_first_byte_offset:%llu\r\n", (unsigned long long)repl.backlog_first);
+        appendf(&text, "repl_backlog_histlen:%llu\r\n", (unsigned long long)repl.backlog_len);
+    }
+    ClusterStatus cluster;
+    clusterStatus(&cluster);
+    appendf(&text, "# Cluster\r\n");
+    appendf(&text, "cluster_enabled:%d\r\n", cluster.enabled ? 1 : 0);
+    if (cluster.enabled)
+    {
+        appendf(&text, "cluster_state:%s\r\n", cluster.ok ? "ok" : "fail");
+        appendf(&text, "cluster_myself:%s\r\n", cluster.myself);
+        appendf(&text, "cluster_slots_assigned:%d\r\n", cluster.slots_assigned);
+        appendf(&text, "cluster_slots_served:%d\r\n", cluster.slots_served);
+        appendf(&text, "cluster_known_nodes:%d\r\n", cluster.nodes);
+        appendf(&text, "cluster_slots_migrating:%d\r\n", cluster.slots_migrating);
+        if (cluster.migrating_to[0])
+        {
+            appendf(&text, "cluster_migrating_to:%s\r\n", cluster.migrating_to);
+        }
+        appendf(&text, "cluster_slots_importing:%d\r\n", cluster.slots_importing);
+        appendf(&text, "cluster_keys_migrated:%llu\r\n", (unsigned long long)cluster.keys_migrated);
+        appendf(&text, "cluster_batches_failed:%llu\r\n", (unsigned long long)cluster.batches_failed);
+    }
+    appendf(&text, "# Keyspace\r\n");
+    appendf(&text, "keys:%llu\r\n", (unsigned long long)SUM(keys));
+    appendf(&text, "expires:%llu\r\n", (unsigned long long)SUM(expires));
+
+    appendf(&text, "# Latency (usec)\r\n");
+    static const char *const stage_names[STAGE_COUNT] = {"stage_parse", "stage_execute", "stage_write"};
+    for (int stage = 0; stage < STAGE_COUNT; stage++)
+    {
+        mergeHistogram(merged, offsetof(Stats, stages) + (size_t)stage * sizeof(Histogram));
+        appendLatency(&text, stage_names[stage], merged);
+    }
+    for (size_t i = 0; i < command_count; i++)
+    {
+        mergeHistogram(merged, offsetof(Stats, commands) + i * sizeof(Histogram));
+        if (merged->total == 0)
+        {
+            continue;
+        }
+        char label[64];
+        snprintf(label, sizeof(label), "cmd_%s", command_names[i]);
+        appendLatency(&text, label, merged);
+    }
+    free(merged);
+
+    *len = text.len;
+    return text.data;
+}
@@ -0,0 +1,89 @@
+#ifndef STATS_HEADER
+#define STATS_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+// Log-linear buckets in the style of HdrHistogram: values below HIST_SUB are
+// exact, above that every power of two is split into HIST_SUB / 2 buckets, so
+// a recorded nanosecond value is off by at most 1/32 (~3%) up to ~2^41 ns.
+#define HIST_SUB_BITS 6
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_HALF (HIST_SUB / 2)
+#define HIST_MAX_SHIFT 35
+#define HIST_BUCKETS (HIST_SUB + HIST_MAX_SHIFT * HIST_HALF)
+
+#define STATS_MAX_COMMANDS 64
+#define STATS_MAX_WORKERS 64
+
+// Every counter has a single writer, its worker thread, so updates are a
+// relaxed load and store (plain moves on x86) and INFO on any thread can read
+// them without tearing.
+typedef _Atomic uint64_t StatCounter;
+
+typedef struct
+{
+    StatCounter total;
+    StatCounter max;
+    StatCounter counts[HIST_BUCKETS];
+} Histogram;
+
+typedef enum
+{
+    STAGE_PARSE,
+    STAGE_EXECUTE,
+    STAGE_WRITE,
+    STAGE_COUNT,
+} Stage;
+
+typedef struct
+{
+    Histogram commands[STATS_MAX_COMMANDS];
+    Histogram stages[STAGE_COUNT];
+    StatCounter bytes_in;
+    StatCounter bytes_out;
+    StatCounter connections_accepted;
+    StatCounter connections_closed;
+    // clients dropped for unsent replies past --output-limit
+    StatCounter output_limit_disconnections;
+    // copied from the worker's pools once per loop iteration
+    StatCounter conn_pool_hits;
+    StatCounter conn_pool_misses;
+    StatCounter segment_pool_hits;
+    StatCounter segment_pool_misses;
+    // copied from the worker's keyspace once per loop iteration
+    StatCounter keys;
+    StatCounter expires;
+    StatCounter expired_keys;
+    StatCounter evicted_keys;
+    StatCounter used_memory;
+    StatCounter maxmemory;
+    // an EvictionPolicy, the same on every worker
+    StatCounter maxmemory_policy;
+} Stats;
+
+static inline void statAdd(StatCounter *counter, uint64_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static inline void statSet(StatCounter *counter, uint64_t value)
+{
+    atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+// Monotonic nanoseconds; clock_gettime goes through the vDSO.
+uint64_t statsNow(void);
+
+void recordLatency(Histogram *histogram, uint64_t ns);
+
+// Makes a worker's counters visible to INFO. Call before the workers start.
+void registerStats(Stats *stats);
+
+// Renders the INFO report over every registered worker into a malloc'd
+// string. command_names[i] labels Stats.commands[i].
+char *statsReport(const char *const *command_names, size_t command_count, size_t *len);
+
+#endif
@@ -0,0 +1,269 @@
+#include "timerwheel.h"
+#include <time.h>
+
+#define LEVEL_SHIFT(k) (TIMER_WHEEL_SLOT_BITS * (k))
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+// deadlines past the top level's span wait here for the next epoch
+#define OVERFLOW_LEVEL TIMER_WHEEL_LEVELS
+#define EPOCH_SHIFT LEVEL_SHIFT(TIMER_WHEEL_LEVELS)
+// the budget clock is read once per this many timers moved or fired
+#define BUDGET_CHECK_EVERY 64
+
+static uint64_t monotonicNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void listInit(TimerLink *head)
+{
+    head->prev = head;
+    head->next = head;
+}
+
+static void listPush(TimerLink *head, TimerLink *link)
+{
+    link->prev = head->prev;
+    link->next = head;
+    head->prev->next = link;
+    head->prev = link;
+}
+
+static void listUnlink(TimerLink *link)
+{
+    link->prev->next = link->next;
+    link->next->prev = link->prev;
+    link->prev = link->next = link;
+}
+
+// Moves every element of `from` to the end of `to`.
+static void splice(TimerLink *to, TimerLink *from)
+{
+    if (from->next == from)
+    {
+        return;
+    }
+    from->next->prev = to->prev;
+    from->prev->next = to;
+    to->prev->next = from->next;
+    to->prev = from->prev;
+    listInit(from);
+}
+
+void initTimerWheel(TimerWheel *wheel, uint64_t now)
+{
+    for (int k = 0; k < TIMER_WHEEL_LEVELS; k++)
+    {
+        for (int s = 0; s < TIMER_WHEEL_SLOTS; s++)
+        {
+            listInit(&wheel->slots[k][s]);
+        }
+        wheel->occupied[k] = 0;
+    }
+    listInit(&wheel->overflow);
+    wheel->current = now;
+    wheel->tick_done = true;
+    wheel->count = 0;
+}
+
+// Files a linked-out timer relative to the current tick.
+static void place(TimerWheel *wheel, TimerLink *link)
+{
+    // a finished tick is history; a tick still being processed takes
+    // latecomers into its own level 0 slot
+    uint64_t earliest = wheel->tick_done ? wheel->current + 1 : wheel->current;
+    uint64_t deadline = link->deadline < earliest ? earliest : link->deadline;
+
+    for (int k = 0; k < TIMER_WHEEL_LEVELS; k++)
+    {
+        if ((deadline >> LEVEL_SHIFT(k + 1)) == (wheel->current >> LEVEL_SHIFT(k + 1)))
+        {
+            int slot = (int)((deadline >> LEVEL_SHIFT(k)) & SLOT_MASK);
+            link->level = (uint8_t)k;
+            link->slot = (uint8_t)slot;
+            listPush(&wheel->slots[k][slot], link);
+            wheel->occupied[k] |= 1ULL << slot;
+            return;
+        }
+    }
+    link->level = OVERFLOW_LEVEL;
+    link->slot = 0;
+    listPush(&wheel->overflow, link);
+}
+
+void timerWheelAdd(TimerWheel *wheel, TimerLink *link, uint64_t deadline)
+{
+    link->deadline = deadline;
+    place(wheel, link);
+    wheel->count++;
+}
+
+void timerWheelRemove(TimerWheel *wheel, TimerLink *link)
+{
+    listUnlink(link);
+    if (link->level < TIMER_WHEEL_LEVELS)
+    {
+        TimerLink *head = &wheel->slots[link->level][link->slot];
+        if (head->next == head)
+        {
+            wheel->occupied[link->level] &= ~(1ULL << link->slot);
+        }
+    }
+    wheel->count--;
+}
+
+uint64_t timerWheelNextTick(const TimerWheel *wheel)
+{
+    if (wheel->count == 0)
+    {
+        return UINT64_MAX;
+    }
+    if (!wheel->tick_done)
+    {
+        return wheel->current;
+    }
+
+    uint64_t best = UINT64_MAX;
+    for (int k = 0; k < TIMER_WHEEL_LEVELS; k++)
+    {
+        int index = (int)((wheel->current >> LEVEL_SHIFT(k)) & SLOT_MASK);
+        // only slots past the current one hold anything at this level; the
+        // shift drops to zero for the last slot, which leaves no bits
+        uint64_t ahead = wheel->occupied[k] & ~((2ULL << index) - 1);
+        if (ahead)
+        {
+            uint64_t base = (wheel->current >> LEVEL_SHIFT(k + 1)) << LEVEL_SHIFT(k + 1);
+            uint64_t tick = base | ((uint64_t)__builtin_ctzll(ahead) << LEVEL_SHIFT(k));
+            if (tick < best)
+            {
+                best = tick;
+            }
+        }
+    }
+    if (wheel->overflow.next != &wheel->overflow)
+    {
+        uint64_t epoch = ((wheel->current >> EPOCH_SHIFT) + 1) << EPOCH_SHIFT;
+        if (epoch < best)
+        {
+            best = epoch;
+        }
+    }
+    return best;
+}
+
+TimerLink *timerWheelEarliest(TimerWheel *wheel)
+{
+    if (wheel->count == 0)
+    {
+        return NULL;
+    }
+    // lower levels only hold earlier deadlines; within a level the slots from
+    // the current index on are ahead (the current one while a tick is pending)
+    for (int k = 0; k < TIMER_WHEEL_LEVELS; k++)
+    {
+        if (!wheel->occupied[k])
+        {
+            continue;
+        }
+        int index = (int)((wheel->current >> LEVEL_SHIFT(k)) & SLOT_MASK);
+        uint64_t ahead = wheel->occupied[k] & ~((1ULL << index) - 1);
+        int slot = __builtin_ctzll(ahead ? ahead : wheel->occupied[k]);
+        return wheel->slots[k][slot].next;
+    }
+    return wheel->overflow.next;
+}
+
+// Moves or fires one list's timers. Returns false when the budget ran out.
+static bool drain(TimerWheel *wheel, TimerLink *head, bool fire, TimerExpire expire, void *arg, uint64_t *work,
+                  uint64_t start, uint64_t budget_ns)
+{
+    while (head->next != head)
+    {
+        if (++*work % BUDGET_CHECK_EVERY == 0 && monotonicNs() - start >= budget_ns)
+        {
+            return false;
+        }
+        TimerLink *link = head->next;
+        listUnlink(link);
+        if (fire)
+        {
+            wheel->count--;
+            expire(link, arg);
+        }
+        else
+        {
+            place(wheel, link);
+        }
+    }
+    return true;
+}
+
+bool timerWheelAdvance(TimerWheel *wheel, uint64_t now, uint64_t budget_ns, TimerExpire expire, void *arg)
+{
+    uint64_t start = monotonicNs();
+    uint64_t work = 0;
+    while (true)
+    {
+        uint64_t tick = timerWheelNextTick(wheel);
+        if (tick == UINT64_MAX || tick > now)
+        {
+            if (wheel->count == 0 && now > wheel->current)
+            {
+                // nothing to keep relative to; skip ahead
+                wheel->current = now;
+            }
+            return true;
+        }
+        if (wheel->tick_done)
+        {
+            wheel->current = tick;
+            wheel->tick_done = false;
+        }
+
+        // top-down, so a cascade can land in a lower slot that starts at this
+        // very tick and cascade again
+        if ((tick & ((1ULL << EPOCH_SHIFT) - 1)) == 0 && wheel->overflow.next != &wheel->overflow)
+        {
+            // detach the list first: deadlines still beyond the new epoch
+            // go straight back onto it
+            TimerLink pending;
+            listInit(&pending);
+            splice(&pending, &wheel->overflow);
+            if (!drain(wheel, &pending, false, expire, arg, &work, start, budget_ns))
+            {
+                splice(&wheel->overflow, &pending);
+                return false;
+            }
+        }
+        for (int k = TIMER_WHEEL_LEVELS - 1; k >= 1; k--)
+        {
+            if ((tick & ((1ULL << LEVEL_SHIFT(k)) - 1)) != 0)
+            {
+                continue;
+            }
+            int slot = (int)((tick >> LEVEL_SHIFT(k)) & SLOT_MASK);
+            bool finished = drain(wheel, &wheel->slots[k][slot], false, expire, arg, &work, start, budget_ns);
+            if (wheel->slots[k][slot].next == &wheel->slots[k][slot])
+            {
+                wheel->occupied[k] &= ~(1ULL << slot);
+            }
+            if (!finished)
+            {
+                return false;
+            }
+        }
+
+        int slot = (int)(tick & SLOT_MASK);
+        bool finished = drain(wheel, &wheel->slots[0][slot], true, expire, arg, &work, start, budget_ns);
+        if (wheel->slots[0][slot].next == &wheel->slots[0][slot])
+        {
+            wheel->occupied[0] &= ~(1ULL << slot);
+        }
+        if (!finished)
+        {
+            return false;
+        }
+        wheel->tick_done = true;
+    }
+}
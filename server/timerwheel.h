@@ -0,0 +1,70 @@
+#ifndef TIMER_WHEEL_HEADER
+#define TIMER_WHEEL_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Hierarchical timing wheel with 1 ms ticks. Level k holds deadlines that
+// share all bits above 6 * (k + 1) with the current tick, in 64 slots of
+// 64^k ticks each; when the current tick reaches a slot of an upper level its
+// timers cascade down. Six levels cover 2^36 ms (~2 years); later deadlines
+// are parked at the top and re-filed when they cascade.
+#define TIMER_WHEEL_LEVELS 6
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+// Intrusive hook: embed it in the timed object.
+typedef struct TimerLink
+{
+    struct TimerLink *prev;
+    struct TimerLink *next;
+    uint64_t deadline;
+    uint8_t level;
+    uint8_t slot;
+} TimerLink;
+
+typedef struct
+{
+    // list heads, circular with the head as sentinel
+    TimerLink slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    // bit s of occupied[k] is set when slots[k][s] is non-empty
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    // deadlines beyond the top level's current span
+    TimerLink overflow;
+    // the tick being or last processed
+    uint64_t current;
+    // false while `current` still has cascades or expirations left because
+    // the previous advance ran out of budget
+    bool tick_done;
+    size_t count;
+} TimerWheel;
+
+// Called for every due timer after it was unlinked.
+typedef void (*TimerExpire)(TimerLink *link, void *arg);
+
+void initTimerWheel(TimerWheel *wheel, uint64_t now);
+
+void timerWheelAdd(TimerWheel *wheel, TimerLink *link, uint64_t deadline);
+
+void timerWheelRemove(TimerWheel *wheel, TimerLink *link);
+
+static inline size_t timerWheelSize(const TimerWheel *wheel)
+{
+    return wheel->count;
+}
+
+// The next tick with work to do (an expiry or a cascade), UINT64_MAX when the
+// wheel is empty. A cascade may wake the caller early; it never wakes late.
+uint64_t timerWheelNextTick(const TimerWheel *wheel);
+
+// A timer from the earliest occupied slot, NULL for an empty wheel. Slots at
+// upper levels span many ticks, so this is one of the soonest, not
+// necessarily the soonest.
+TimerLink *timerWheelEarliest(TimerWheel *wheel);
+
+// Fires every timer due at or before now. Stops once budget_ns of monotonic
+// time has passed and returns false, leaving the rest for the next call.
+bool timerWheelAdvance(TimerWheel *wheel, uint64_t now, uint64_t budget_ns, TimerExpire expire, void *arg);
+
+#endif
@@ -0,0 +1,338 @@
+#include "uring.h"
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// user_data layout: op in the top byte, the connection generation in the next
+// 24 bits and the fd in the low 32 bits
+static uint64_t packData(int op, int fd, uint32_t generation)
+{
+    return ((uint64_t)op << 56) | ((uint64_t)(generation & 0xFFFFFF) << 32) | (uint32_t)fd;
+}
+
+static struct io_uring_sqe *getSqe(UringLoop *loop)
+{
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&loop->ring);
+    if (!sqe)
+    {
+        // submission queue full: hand what we have to the kernel and retry
+        io_uring_submit(&loop->ring);
+        sqe = io_uring_get_sqe(&loop->ring);
+    }
+    return sqe;
+}
+
+bool initUringLoop(UringLoop *loop)
+{
+    memset(loop, 0, sizeof(*loop));
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 4;
+    if (io_uring_queue_init_params(URING_ENTRIES, &loop->ring, &params) < 0)
+    {
+        // older kernels reject the optional flags
+        memset(&params, 0, sizeof(params));
+        if (io_uring_queue_init_params(URING_ENTRIES, &loop->ring, &params) < 0)
+        {
+            return false;
+        }
+    }
+
+    int ret = 0;
+    loop->buf_ring = io_uring_setup_buf_ring(&loop->ring, URING_BUFFER_COUNT, URING_BUFFER_GROUP, 0, &ret);
+    if (!loop->buf_ring)
+    {
+        io_uring_queue_exit(&loop->ring);
+        errno = -ret;
+        return false;
+    }
+
+    loop->buffers = (uint8_t *)mmap(NULL, (size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE,
+                                    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (loop->buffers == MAP_FAILED)
+    {
+        loop->buffers = NULL;
+        freeUringLoop(loop);
+        return false;
+    }
+    for (uint16_t bid = 0; bid < URING_BUFFER_COUNT; bid++)
+    {
+        io_uring_buf_ring_add(loop->buf_ring, loop->buffers + (size_t)bid * URING_BUFFER_SIZE, URING_BUFFER_SIZE,
+                              bid, io_uring_buf_ring_mask(URING_BUFFER_COUNT), bid);
+    }
+    io_uring_buf_ring_advance(loop->buf_ring, URING_BUFFER_COUNT);
+
+    loop->completions_capacity = URING_ENTRIES * 4;
+    loop->completions = (UringCompletion *)malloc(loop->completions_capacity * sizeof(UringCompletion));
+    if (!loop->completions)
+    {
+        freeUringLoop(loop);
+        return false;
+    }
+    return true;
+}
+
+void freeUringLoop(UringLoop *loop)
+{
+    if (loop->buf_ring)
+    {
+        io_uring_free_buf_ring(&loop->ring, loop->buf_ring, URING_BUFFER_COUNT, URING_BUFFER_GROUP);
+        loop->buf_ring = NULL;
+    }
+    io_uring_queue_exit(&loop->ring);
+    if (loop->buffers)
+    {
+        munmap(loop->buffers, (size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+        loop->buffers = NULL;
+    }
+    for (size_t fd = 0; fd < loop->conns_size; fd++)
+    {
+        free(loop->conns[fd]);
+    }
+    free(loop->conns);
+    free(loop->completions);
+    free(loop->flush_fds);
+    loop->conns = NULL;
+    loop->conns_size = 0;
+    loop->completions = NULL;
+    loop->flush_fds = NULL;
+    loop->flush_size = 0;
+    loop->flush_capacity = 0;
+}
+
+UringConn *uringConn(UringLoop *loop, int fd)
+{
+    if ((size_t)fd >= loop->conns_size)
+    {
+        size_t new_size = loop->conns_size ? loop->conns_size : 64;
+        while (new_size <= (size_t)fd)
+        {
+            new_size *= 2;
+        }
+        UringConn **conns = (UringConn **)realloc(loop->conns, new_size * sizeof(UringConn *));
+        if (!conns)
+        {
+            return NULL;
+        }
+        memset(conns + loop->conns_size, 0, (new_size - loop->conns_size) * sizeof(UringConn *));
+        loop->conns = conns;
+        loop->conns_size = new_size;
+    }
+
+    if (!loop->conns[fd])
+    {
+        loop->conns[fd] = (UringConn *)calloc(1, sizeof(UringConn));
+    }
+    return loop->conns[fd];
+}
+
+void releaseUringConn(UringLoop *loop, int fd)
+{
+    if ((size_t)fd < loop->conns_size && loop->conns[fd])
+    {
+        // keep the allocation for the next connection on this fd
+        UringConn *state = loop->conns[fd];
+        state->recv_armed = false;
+        state->recv_paused = false;
+        state->closing = false;
+        state->sends_inflight = 0;
+    }
+}
+
+bool uringQueueFlush(UringLoop *loop, int fd)
+{
+    UringConn *state = uringConn(loop, fd);
+    if (!state)
+    {
+        return false;
+    }
+    if (state->flush_queued)
+    {
+        return true;
+    }
+
+    if (loop->flush_size == loop->flush_capacity)
+    {
+        size_t capacity = loop->flush_capacity ? loop->flush_capacity * 2 : 64;
+        int *fds = (int *)realloc(loop->flush_fds, capacity * sizeof(int));
+        if (!fds)
+        {
+            return false;
+        }
+        loop->flush_fds = fds;
+        loop->flush_capacity = capacity;
+    }
+    loop->flush_fds[loop->flush_size++] = fd;
+    state->flush_queued = true;
+    return true;
+}
+
+bool uringArmAccept(UringLoop *loop, int listen_fd)
+{
+    struct io_uring_sqe *sqe = getSqe(loop);
+    if (!sqe)
+    {
+        return false;
+    }
+    io_uring_prep_multishot_accept(sqe, listen_fd, NULL, NULL, 0);
+    io_uring_sqe_set_data64(sqe, packData(URING_OP_ACCEPT, listen_fd, 0));
+    return true;
+}
+
+bool uringArmRecv(UringLoop *loop, int fd, uint32_t generation)
+{
+    struct io_uring_sqe *sqe = getSqe(loop);
+    if (!sqe)
+    {
+        return false;
+    }
+    // the kernel picks a buffer from the group for every completion
+    io_uring_prep_recv_multishot(sqe, fd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    io_uring_sqe_set_data64(sqe, packData(URING_OP_RECV, fd, generation));
+    return true;
+}
+
+bool uringCancelRecv(UringLoop *loop, int fd, uint32_t generation)
+{
+    struct io_uring_sqe *sqe = getSqe(loop);
+    if (!sqe)
+    {
+        return false;
+    }
+    io_uring_prep_cancel64(sqe, packData(URING_OP_RECV, fd, generation), 0);
+    io_uring_sqe_set_data64(sqe, packData(URING_OP_CANCEL, fd, generation));
+    return true;
+}
+
+bool uringArmRead(UringLoop *loop, int fd, void *buf, size_t len)
+{
+    struct io_uring_sqe *sqe = getSqe(loop);
+    if (!sqe)
+    {
+        return false;
+    }
+    io_uring_prep_read(sqe, fd, buf, (unsigned)len, 0);
+    io_uring_sqe_set_data64(sqe, packData(URING_OP_WAKE, fd, 0));
+    return true;
+}
+
+int uringSend(UringLoop *loop, int fd, uint32_t generation, const struct iovec *iov, int iovcnt)
+{
+    UringConn *state = uringConn(loop, fd);
+    if (!state)
+    {
+        return 0;
+    }
+
+    int wanted = (iovcnt + URING_IOV_PER_SEND - 1) / URING_IOV_PER_SEND;
+    if (wanted > URING_SEND_CHAIN)
+    {
+        wanted = URING_SEND_CHAIN;
+    }
+    // a chain must not straddle two submissions, so make room for all of it
+    if (io_uring_sq_space_left(&loop->ring) < (unsigned)wanted)
+    {
+        io_uring_submit(&loop->ring);
+    }
+
+    int queued = 0;
+    struct io_uring_sqe *prev = NULL;
+    while (queued < wanted)
+    {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&loop->ring);
+        if (!sqe)
+        {
+            break;
+        }
+        // chain the pieces so they hit the socket in order
+        if (prev)
+        {
+            prev->flags |= IOSQE_IO_LINK;
+        }
+
+        int count = iovcnt < URING_IOV_PER_SEND ? iovcnt : URING_IOV_PER_SEND;
+        memcpy(state->iov[queued], iov, (size_t)count * sizeof(struct iovec));
+        struct msghdr *message = &state->msg[queued];
+        memset(message, 0, sizeof(*message));
+        message->msg_iov = state->iov[queued];
+        message->msg_iovlen = (size_t)count;
+
+        // MSG_WAITALL makes the kernel retry short sends internally, so a link
+        // only breaks on a real error
+        io_uring_prep_sendmsg(sqe, fd, message, MSG_NOSIGNAL | MSG_WAITALL);
+        io_uring_sqe_set_data64(sqe, packData(URING_OP_SEND, fd, generation));
+        iov += count;
+        iovcnt -= count;
+        queued++;
+        prev = sqe;
+    }
+    state->sends_inflight += (uint32_t)queued;
+    return queued;
+}
+
+void uringRecycleBuffer(UringLoop *loop, uint16_t buffer_id)
+{
+    io_uring_buf_ring_add(loop->buf_ring, loop->buffers + (size_t)buffer_id * URING_BUFFER_SIZE, URING_BUFFER_SIZE,
+                          buffer_id, io_uring_buf_ring_mask(URING_BUFFER_COUNT), 0);
+    io_uring_buf_ring_advance(loop->buf_ring, 1);
+}
+
+int uringWait(UringLoop *loop, int timeout_ms)
+{
+    int rv;
+    if (timeout_ms == 0)
+    {
+        rv = io_uring_submit(&loop->ring);
+    }
+    else if (timeout_ms < 0)
+    {
+        rv = io_uring_submit_and_wait(&loop->ring, 1);
+    }
+    else
+    {
+        struct io_uring_cqe *cqe = NULL;
+        struct __kernel_timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        rv = io_uring_submit_and_wait_timeout(&loop->ring, &cqe, 1, &ts, NULL);
+        if (rv == -ETIME)
+        {
+            rv = 0;
+        }
+    }
+    if (rv < 0)
+    {
+        errno = -rv;
+        return -1;
+    }
+
+    // one pass over the completion ring, no syscall per entry
+    int count = 0;
+    unsigned head;
+    struct io_uring_cqe *cqe;
+    io_uring_for_each_cqe(&loop->ring, head, cqe)
+    {
+        if ((size_t)count == loop->completions_capacity)
+        {
+            break;
+        }
+        uint64_t data = io_uring_cqe_get_data64(cqe);
+        UringCompletion *completion = &loop->completions[count++];
+        completion->op = (int)(data >> 56);
+        completion->fd = (int)(uint32_t)data;
+        completion->generation = (uint32_t)(data >> 32) & 0xFFFFFF;
+        completion->res = cqe->res;
+        completion->flags = cqe->flags;
+        completion->has_buffer = (cqe->flags & IORING_CQE_F_BUFFER) != 0;
+        completion->buffer_id = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        completion->data = completion->has_buffer
+                               ? loop->buffers + (size_t)completion->buffer_id * URING_BUFFER_SIZE
+                               : NULL;
+    }
+    io_uring_cq_advance(&loop->ring, (unsigned)count);
+    return count;
+}
@@ -0,0 +1,110 @@
+#ifndef URING_HEADER
+#define URING_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <liburing.h>
+
+#define URING_ENTRIES 4096
+#define URING_BUFFER_GROUP 0
+#define URING_BUFFER_COUNT 512
+#define URING_BUFFER_SIZE (16 * 1024)
+// a flush links up to URING_SEND_CHAIN sendmsg operations of
+// URING_IOV_PER_SEND segments each
+#define URING_SEND_CHAIN 4
+#define URING_IOV_PER_SEND 64
+
+enum
+{
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV = 2,
+    URING_OP_SEND = 3,
+    URING_OP_WAKE = 4,
+    URING_OP_CANCEL = 5,
+};
+
+// Per-fd state for operations the kernel still holds. The msghdrs and iovecs
+// must stay put until their sends complete.
+typedef struct
+{
+    bool recv_armed;
+    // the recv was cancelled, or is not re-armed, while the connection may
+    // not be read
+    bool recv_paused;
+    bool closing;
+    // listed in UringLoop.flush_fds
+    bool flush_queued;
+    uint32_t sends_inflight;
+    // when the chain in flight was queued, for the write stage latency
+    uint64_t send_started;
+    struct msghdr msg[URING_SEND_CHAIN];
+    struct iovec iov[URING_SEND_CHAIN][URING_IOV_PER_SEND];
+} UringConn;
+
+typedef struct
+{
+    int op;
+    int fd;
+    uint32_t generation;
+    int32_t res;
+    uint32_t flags;
+    // recv completions: the provided buffer holding the data
+    uint8_t *data;
+    uint16_t buffer_id;
+    bool has_buffer;
+} UringCompletion;
+
+typedef struct UringLoop
+{
+    struct io_uring ring;
+    struct io_uring_buf_ring *buf_ring;
+    uint8_t *buffers;
+    UringConn **conns;
+    size_t conns_size;
+    UringCompletion *completions;
+    size_t completions_capacity;
+    // connections with new output since the last flush, sent once per batch
+    int *flush_fds;
+    size_t flush_size;
+    size_t flush_capacity;
+    // target of the pending eventfd read
+    uint64_t wake_value;
+} UringLoop;
+
+bool initUringLoop(UringLoop *loop);
+
+void freeUringLoop(UringLoop *loop);
+
+UringConn *uringConn(UringLoop *loop, int fd);
+
+void releaseUringConn(UringLoop *loop, int fd);
+
+// Remembers fd for the end-of-batch flush; queueing it twice is a no-op.
+bool uringQueueFlush(UringLoop *loop, int fd);
+
+bool uringArmAccept(UringLoop *loop, int listen_fd);
+
+bool uringArmRecv(UringLoop *loop, int fd, uint32_t generation);
+
+// Asks the kernel to end the connection's multishot recv early; the recv
+// then completes without IORING_CQE_F_MORE.
+bool uringCancelRecv(UringLoop *loop, int fd, uint32_t generation);
+
+bool uringArmRead(UringLoop *loop, int fd, void *buf, size_t len);
+
+// Queues linked sendmsg operations covering iov[0..iovcnt). Returns the
+// number of operations queued.
+int uringSend(UringLoop *loop, int fd, uint32_t generation, const struct iovec *iov, int iovcnt);
+
+// Hands a provided buffer back to the kernel once its bytes were copied out.
+void uringRecycleBuffer(UringLoop *loop, uint16_t buffer_id);
+
+// Submits everything queued and waits for at least one completion, or until
+// timeout_ms passes (-1 waits forever, 0 only polls). Returns the number of
+// entries written to loop->completions.
+int uringWait(UringLoop *loop, int timeout_ms);
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef WORKER_HEADER
+#define WORKER_HEADER
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "buffer.h"
+#include "pool.h"
+#include "eventloop.h"
+#include "connectionvector.h"
+#include "keyspace.h"
+#include "spscqueue.h"
+#include "stats.h"
+
+#define MAX_WORKERS 64
+#define SHARD_QUEUE_CAPACITY 16384
+// connections carved from the pool per malloc
+#define CONNECTION_SLAB 64
+// time active expiry may take per loop iteration
+#define EXPIRE_BUDGET_NS (1000 * 1000)
+#define EXPIRE_MAX_WAIT_MS 1000
+// bytes one connection may read per turn before the others get theirs
+#define READ_BUDGET (256 << 10)
+// requests one connection may run per turn, however much it has buffered
+#define REQUEST_BUDGET 1024
+// defaults of --output-pause and --output-limit: a connection with that many
+// reply bytes unsent is not read until they drain, and past the limit it is
+// dropped
+#define OUTPUT_PAUSE_DEFAULT (1 << 20)
+#define OUTPUT_LIMIT_DEFAULT (256 << 20)
+#define MAX_BULK_REQUESTS 1000
+
+// Messages for one target that did not fit into its ring yet.
+typedef struct
+{
+    ShardMessage *items;
+    size_t size;
+    size_t capacity;
+} ShardBacklog;
+
+// Connections to revisit at a fixed point of the loop iteration.
+typedef struct
+{
+    int *fds;
+    size_t size;
+    size_t capacity;
+} FdList;
+
+// One event loop thread. Each worker owns its listener, its connections and
+// one shard of the keyspace; other workers reach its data only by sending
+// messages through its inbound queues.
+typedef struct
+{
+    int id;
+    pthread_t thread;
+    int listen_fd;
+    // eventfd used to wake the worker when it sleeps with queued messages
+    int wake_fd;
+    _Atomic int sleeping;
+    EventLoop loop;
+    // io_uring backend only, NULL otherwise
+    struct UringLoop *uring;
+    ConnectionVector fd2conn;
+    ObjectPool conn_pool;
+    // stamped on each new connection, see Connection.generation
+    uint32_t next_generation;
+    Keyspace db;
+    Stats *stats;
+    // replies to forwarded requests are built here before being handed back
+    Buffer scratch;
+    // under appendfsync always, replies to forwarded requests wait in the
+    // backlog until the end-of-iteration fsync has covered their writes
+    bool hold_replies;
+    // connections with replies to send once the iteration's writes are
+    // committed, and connections that stopped short of their input, having
+    // used up a budget or been paused, with requests left in the buffer or
+    // the socket (edge-triggered epoll will not report them again)
+    FdList flush;
+    FdList unread;
+    // indexed by the peer worker id
+    ShardBacklog *backlog;
+    bool *notify;
+} Worker;
+
+#endif
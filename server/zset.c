@@ -0,0 +1,998 @@
+#include "zset.h"
+#include "hash.h"
+#include "hashtable.h"
+#include <string.h>
+#include <malloc.h>
+
+// packed record: f64 score, u8 member length, member bytes
+#define PACKED_HEADER 9
+#define LEAF_MIN (ZSET_LEAF_SIZE / 2)
+#define BRANCH_MIN (ZSET_BRANCH_SIZE / 2)
+// with half-full nodes this still holds more members than a u32 counts
+#define MAX_HEIGHT 16
+
+typedef struct
+{
+    // hash of the member, for the index
+    HNode node;
+    double score;
+    uint32_t len;
+    uint8_t member[];
+} ZEntry;
+
+// Scores are copied next to the entry pointers so a search only follows
+// a pointer to break a tie.
+typedef struct Leaf
+{
+    uint32_t count;
+    struct Leaf *next;
+    double scores[ZSET_LEAF_SIZE];
+    ZEntry *entries[ZSET_LEAF_SIZE];
+} Leaf;
+
+// firsts[i] is the smallest entry under children[i] and scores[i] its
+// score; both are kept for i >= 1 only. sizes[i] counts the entries under
+// children[i], which is what makes ranks O(log n).
+typedef struct
+{
+    uint32_t count;
+    uint32_t sizes[ZSET_BRANCH_SIZE];
+    double scores[ZSET_BRANCH_SIZE];
+    ZEntry *firsts[ZSET_BRANCH_SIZE];
+    void *children[ZSET_BRANCH_SIZE];
+} Branch;
+
+struct ZSet
+{
+    size_t size;
+    // usable bytes of the records, nodes and entries
+    size_t memory;
+    bool tree;
+    uint8_t *packed;
+    size_t packed_len;
+    // a Leaf at height 0, Branches above
+    void *root;
+    int height;
+    HashTable index;
+};
+
+// A member that is not in an entry, for index lookups.
+typedef struct
+{
+    HNode node;
+    const uint8_t *member;
+    size_t len;
+} Probe;
+
+typedef struct
+{
+    Branch *branch;
+    uint32_t child;
+} Step;
+
+static void *allocate(ZSet *zset, size_t size)
+{
+    void *p = malloc(size);
+    if (p)
+    {
+        zset->memory += malloc_usable_size(p);
+    }
+    return p;
+}
+
+static void release(ZSet *zset, void *p)
+{
+    if (p)
+    {
+        zset->memory -= malloc_usable_size(p);
+        free(p);
+    }
+}
+
+static int compareMembers(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len)
+{
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (c != 0)
+    {
+        return c;
+    }
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+// Orders (score, member) against an entry, reading the entry only on a tie.
+static int compareToEntry(double score, const uint8_t *member, size_t len, double entry_score, const ZEntry *entry)
+{
+    if (score != entry_score)
+    {
+        return score < entry_score ? -1 : 1;
+    }
+    return compareMembers(member, len, entry->member, entry->len);
+}
+
+static bool entryEq(const HNode *lhs, const HNode *rhs)
+{
+    const ZEntry *entry = (const ZEntry *)lhs;
+    const Probe *probe = (const Probe *)rhs;
+    return entry->len == probe->len && memcmp(entry->member, probe->member, probe->len) == 0;
+}
+
+static bool sameEntry(const HNode *lhs, const HNode *rhs)
+{
+    return lhs == rhs;
+}
+
+ZSet *newZSet(void)
+{
+    ZSet *zset = (ZSet *)calloc(1, sizeof(ZSet));
+    return zset;
+}
+
+static void freeNode(ZSet *zset, void *node, int height)
+{
+    if (height == 0)
+    {
+        Leaf *leaf = (Leaf *)node;
+        for (uint32_t i = 0; i < leaf->count; i++)
+        {
+            release(zset, leaf->entries[i]);
+        }
+        release(zset, leaf);
+        return;
+    }
+    Branch *branch = (Branch *)node;
+    for (uint32_t i = 0; i < branch->count; i++)
+    {
+        freeNode(zset, branch->children[i], height - 1);
+    }
+    release(zset, branch);
+}
+
+static void freeTree(ZSet *zset)
+{
+    if (zset->root)
+    {
+        freeNode(zset, zset->root, zset->height);
+    }
+    freeHashTable(&zset->index);
+    zset->root = NULL;
+    zset->height = 0;
+}
+
+void freeZSet(ZSet *zset)
+{
+    if (zset->tree)
+    {
+        freeTree(zset);
+    }
+    free(zset->packed);
+    free(zset);
+}
+
+size_t zsetSize(const ZSet *zset)
+{
+    return zset->size;
+}
+
+size_t zsetMemory(const ZSet *zset)
+{
+    size_t bytes = malloc_usable_size((void *)zset) + zset->memory;
+    return zset->tree ? bytes + hashTableMemory(&zset->index) : bytes;
+}
+
+bool zsetPacked(const ZSet *zset)
+{
+    return !zset->tree;
+}
+
+// --- packed encoding ---
+
+static double recordScore(const uint8_t *record)
+{
+    double score;
+    memcpy(&score, record, sizeof(score));
+    return score;
+}
+
+static size_t recordSize(const uint8_t *record)
+{
+    return PACKED_HEADER + record[8];
+}
+
+static size_t packedFind(const ZSet *zset, const uint8_t *member, size_t len)
+{
+    for (size_t at = 0; at < zset->packed_len; at += recordSize(zset->packed + at))
+    {
+        const uint8_t *record = zset->packed + at;
+        if (record[8] == len && memcmp(record + PACKED_HEADER, member, len) == 0)
+        {
+            return at;
+        }
+    }
+    return SIZE_MAX;
+}
+
+static bool packedResize(ZSet *zset, size_t len)
+{
+    size_t before = zset->packed ? malloc_usable_size(zset->packed) : 0;
+    uint8_t *grown = (uint8_t *)realloc(zset->packed, len ? len : 1);
+    if (!grown)
+    {
+        return false;
+    }
+    zset->packed = grown;
+    zset->memory += malloc_usable_size(grown) - before;
+    return true;
+}
+
+// Offset of the first record ordered after (score, member).
+static size_t packedPosition(const ZSet *zset, const uint8_t *member, size_t len, double score)
+{
+    size_t at = 0;
+    while (at < zset->packed_len)
+    {
+        const uint8_t *record = zset->packed + at;
+        double other = recordScore(record);
+        if (score < other || (score == other && compareMembers(member, len, record + PACKED_HEADER, record[8]) < 0))
+        {
+            break;
+        }
+        at += recordSize(record);
+    }
+    return at;
+}
+
+// Opens a gap at the record's place and fills it; the block must have room.
+static void packedPlace(ZSet *zset, const uint8_t *member, size_t len, double score)
+{
+    size_t at = packedPosition(zset, member, len, score);
+    size_t size = PACKED_HEADER + len;
+    uint8_t *record = zset->packed + at;
+    memmove(record + size, record, zset->packed_len - at);
+    memcpy(record, &score, sizeof(score));
+    record[8] = (uint8_t)len;
+    memcpy(record + PACKED_HEADER, member, len);
+    zset->packed_len += size;
+}
+
+static void packedCut(ZSet *zset, size_t at)
+{
+    size_t size = recordSize(zset->packed + at);
+    memmove(zset->packed + at, zset->packed + at + size, zset->packed_len - at - size);
+    zset->packed_len -= size;
+}
+
+static void packedDelete(ZSet *zset, size_t at)
+{
+    packedCut(zset, at);
+    zset->size--;
+    // shrinking in place cannot fail in practice; keep the block if it does
+    packedResize(zset, zset->packed_len);
+}
+
+// --- tree encoding ---
+
+static uint32_t leafLowerBound(const Leaf *leaf, double score, const uint8_t *member, size_t len)
+{
+    uint32_t lo = 0, hi = leaf->count;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (compareToEntry(score, member, len, leaf->scores[mid], leaf->entries[mid]) > 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// The last child whose first entry is not above (score, member).
+static uint32_t childFor(const Branch *branch, double score, const uint8_t *member, size_t len)
+{
+    uint32_t lo = 1, hi = branch->count;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (compareToEntry(score, member, len, branch->scores[mid], branch->firsts[mid]) < 0)
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+    return lo - 1;
+}
+
+// Walks from the root to the leaf for (score, member), recording the path.
+static Leaf *descend(const ZSet *zset, double score, const uint8_t *member, size_t len, Step *path)
+{
+    void *node = zset->root;
+    for (int depth = 0; depth < zset->height; depth++)
+    {
+        Branch *branch = (Branch *)node;
+        uint32_t child = childFor(branch, score, member, len);
+        path[depth].branch = branch;
+        path[depth].child = child;
+        node = branch->children[child];
+    }
+    return (Leaf *)node;
+}
+
+static void setFirst(Branch *branch, uint32_t child, ZEntry *entry)
+{
+    branch->firsts[child] = entry;
+    branch->scores[child] = entry->score;
+}
+
+static void leafPut(Leaf *leaf, uint32_t slot, ZEntry *entry)
+{
+    memmove(&leaf->entries[slot + 1], &leaf->entries[slot], sizeof(ZEntry *) * (leaf->count - slot));
+    memmove(&leaf->scores[slot + 1], &leaf->scores[slot], sizeof(double) * (leaf->count - slot));
+    leaf->entries[slot] = entry;
+    leaf->scores[slot] = entry->score;
+    leaf->count++;
+}
+
+static void leafTake(Leaf *leaf, uint32_t slot)
+{
+    leaf->count--;
+    memmove(&leaf->entries[slot], &leaf->entries[slot + 1], sizeof(ZEntry *) * (leaf->count - slot));
+    memmove(&leaf->scores[slot], &leaf->scores[slot + 1], sizeof(double) * (leaf->count - slot));
+}
+
+// Copies n children with their sizes and separators; the ranges may overlap.
+static void branchCopy(Branch *dst, uint32_t dst_at, const Branch *src, uint32_t src_at, uint32_t n)
+{
+    memmove(&dst->sizes[dst_at], &src->sizes[src_at], sizeof(uint32_t) * n);
+    memmove(&dst->scores[dst_at], &src->scores[src_at], sizeof(double) * n);
+    memmove(&dst->firsts[dst_at], &src->firsts[src_at], sizeof(ZEntry *) * n);
+    memmove(&dst->children[dst_at], &src->children[src_at], sizeof(void *) * n);
+}
+
+static void branchPut(Branch *branch, uint32_t child, void *node, uint32_t size, ZEntry *first)
+{
+    branchCopy(branch, child + 1, branch, child, branch->count - child);
+    branch->children[child] = node;
+    branch->sizes[child] = size;
+    setFirst(branch, child, first);
+    branch->count++;
+}
+
+static void branchTake(Branch *branch, uint32_t child)
+{
+    branch->count--;
+    branchCopy(branch, child, branch, child + 1, branch->count - child);
+}
+
+// Links an entry that is not in the tree yet. Every node that has to split
+// is allocated up front, so it either fails untouched or succeeds.
+static bool treeInsert(ZSet *zset, ZEntry *entry)
+{
+    Step path[MAX_HEIGHT];
+    Leaf *leaf = descend(zset, entry->score, entry->member, entry->len, path);
+
+    int splits = 0;
+    if (leaf->count == ZSET_LEAF_SIZE)
+    {
+        splits = 1;
+        for (int depth = zset->height - 1; depth >= 0 && path[depth].branch->count == ZSET_BRANCH_SIZE; depth--)
+        {
+            splits++;
+        }
+    }
+    if (zset->height + (splits > zset->height) >= MAX_HEIGHT)
+    {
+        return false;
+    }
+    // one leaf, the branches above it and a new root when the old one splits
+    void *spares[MAX_HEIGHT + 1];
+    int spare_count = splits + (splits > zset->height);
+    for (int i = 0; i < spare_count; i++)
+    {
+        spares[i] = allocate(zset, i == 0 ? sizeof(Leaf) : sizeof(Branch));
+        if (!spares[i])
+        {
+            while (i-- > 0)
+            {
+                release(zset, spares[i]);
+            }
+            return false;
+        }
+    }
+    int next_spare = 0;
+
+    // a split hands its new right sibling up to the parent
+    void *carry = NULL;
+    ZEntry *carry_first = NULL;
+    uint32_t carry_size = 0;
+
+    uint32_t slot = leafLowerBound(leaf, entry->score, entry->member, entry->len);
+    if (leaf->count < ZSET_LEAF_SIZE)
+    {
+        leafPut(leaf, slot, entry);
+    }
+    else
+    {
+        Leaf *right = (Leaf *)spares[next_spare++];
+        uint32_t mid = ZSET_LEAF_SIZE / 2;
+        right->count = leaf->count - mid;
+        memcpy(right->entries, &leaf->entries[mid], sizeof(ZEntry *) * right->count);
+        memcpy(right->scores, &leaf->scores[mid], sizeof(double) * right->count);
+        right->next = leaf->next;
+        leaf->next = right;
+        leaf->count = mid;
+        if (slot <= mid)
+        {
+            leafPut(leaf, slot, entry);
+        }
+        else
+        {
+            leafPut(right, slot - mid, entry);
+        }
+        carry = right;
+        carry_first = right->entries[0];
+        carry_size = right->count;
+    }
+
+    for (int depth = zset->height - 1; depth >= 0; depth--)
+    {
+        Branch *branch = path[depth].branch;
+        uint32_t child = path[depth].child;
+        branch->sizes[child]++;
+        if (!carry)
+        {
+            continue;
+        }
+        branch->sizes[child] -= carry_size;
+        if (branch->count < ZSET_BRANCH_SIZE)
+        {
+            branchPut(branch, child + 1, carry, carry_size, carry_first);
+            carry = NULL;
+            continue;
+        }
+
+        Branch *right = (Branch *)spares[next_spare++];
+        uint32_t mid = ZSET_BRANCH_SIZE / 2;
+        right->count = branch->count - mid;
+        branchCopy(right, 0, branch, mid, right->count);
+        branch->count = mid;
+        // the new child lands in the left half when it goes right after it
+        if (child + 1 <= mid)
+        {
+            branchPut(branch, child + 1, carry, carry_size, carry_first);
+        }
+        else
+        {
+            branchPut(right, child + 1 - mid, carry, carry_size, carry_first);
+        }
+        carry_first = right->firsts[0];
+        carry_size = 0;
+        for (uint32_t i = 0; i < right->count; i++)
+        {
+            carry_size += right->sizes[i];
+        }
+        carry = right;
+    }
+
+    if (carry)
+    {
+        Branch *root = (Branch *)spares[next_spare++];
+        root->count = 2;
+        root->children[0] = zset->root;
+        root->sizes[0] = (uint32_t)(zset->size + 1 - carry_size);
+        root->children[1] = carry;
+        root->sizes[1] = carry_size;
+        setFirst(root, 1, carry_first);
+        zset->root = root;
+        zset->height++;
+    }
+    return true;
+}
+
+static void mergeLeaves(ZSet *zset, Branch *parent, uint32_t left_child)
+{
+    Leaf *left = (Leaf *)parent->children[left_child];
+    Leaf *right = (Leaf *)parent->children[left_child + 1];
+    memcpy(&left->entries[left->count], right->entries, sizeof(ZEntry *) * right->count);
+    memcpy(&left->scores[left->count], right->scores, sizeof(double) * right->count);
+    left->count += right->count;
+    left->next = right->next;
+    parent->sizes[left_child] += parent->sizes[left_child + 1];
+    branchTake(parent, left_child + 1);
+    release(zset, right);
+}
+
+static void mergeBranches(ZSet *zset, Branch *parent, uint32_t left_child)
+{
+    Branch *left = (Branch *)parent->children[left_child];
+    Branch *right = (Branch *)parent->children[left_child + 1];
+    uint32_t at = left->count;
+    branchCopy(left, at, right, 0, right->count);
+    // the right node's first child is bounded by the parent's separator
+    setFirst(left, at, parent->firsts[left_child + 1]);
+    left->count += right->count;
+    parent->sizes[left_child] += parent->sizes[left_child + 1];
+    branchTake(parent, left_child + 1);
+    release(zset, right);
+}
+
+// Refills an underfull leaf from a sibling, or merges it with one.
+static void fixLeaf(ZSet *zset, Branch *parent, uint32_t child)
+{
+    Leaf *leaf = (Leaf *)parent->children[child];
+    if (child > 0)
+    {
+        Leaf *left = (Leaf *)parent->children[child - 1];
+        if (left->count > LEAF_MIN)
+        {
+            leafPut(leaf, 0, left->entries[left->count - 1]);
+            left->count--;
+            parent->sizes[child - 1]--;
+            parent->sizes[child]++;
+            setFirst(parent, child, leaf->entries[0]);
+            return;
+        }
+    }
+    if (child + 1 < parent->count)
+    {
+        Leaf *right = (Leaf *)parent->children[child + 1];
+        if (right->count > LEAF_MIN)
+        {
+            leafPut(leaf, leaf->count, right->entries[0]);
+            leafTake(right, 0);
+            parent->sizes[child + 1]--;
+            parent->sizes[child]++;
+            setFirst(parent, child + 1, right->entries[0]);
+            return;
+        }
+    }
+    mergeLeaves(zset, parent, child > 0 ? child - 1 : child);
+}
+
+static void fixBranch(ZSet *zset, Branch *parent, uint32_t child)
+{
+    Branch *branch = (Branch *)parent->children[child];
+    if (child > 0)
+    {
+        Branch *left = (Branch *)parent->children[child - 1];
+        if (left->count > BRANCH_MIN)
+        {
+            uint32_t last = left->count - 1;
+            uint32_t moved = left->sizes[last];
+            branchCopy(branch, 1, branch, 0, branch->count);
+            branch->count++;
+            // the old first child is now bounded by the parent's separator
+            setFirst(branch, 1, parent->firsts[child]);
+            branch->children[0] = left->children[last];
+            branch->sizes[0] = moved;
+            setFirst(parent, child, left->firsts[last]);
+            left->count--;
+            parent->sizes[child - 1] -= moved;
+            parent->sizes[child] += moved;
+            return;
+        }
+    }
+    if (child + 1 < parent->count)
+    {
+        Branch *right = (Branch *)parent->children[child + 1];
+        if (right->count > BRANCH_MIN)
+        {
+            uint32_t moved = right->sizes[0];
+            uint32_t at = branch->count++;
+            branch->children[at] = right->children[0];
+            branch->sizes[at] = moved;
+            setFirst(branch, at, parent->firsts[child + 1]);
+            setFirst(parent, child + 1, right->firsts[1]);
+            branchTake(right, 0);
+            parent->sizes[child + 1] -= moved;
+            parent->sizes[child] += moved;
+            return;
+        }
+    }
+    mergeBranches(zset, parent, child > 0 ? child - 1 : child);
+}
+
+static void treeDelete(ZSet *zset, ZEntry *entry)
+{
+    Step path[MAX_HEIGHT];
+    Leaf *leaf = descend(zset, entry->score, entry->member, entry->len, path);
+    uint32_t slot = leafLowerBound(leaf, entry->score, entry->member, entry->len);
+    leafTake(leaf, slot);
+
+    for (int depth = 0; depth < zset->height; depth++)
+    {
+        Branch *branch = path[depth].branch;
+        uint32_t child = path[depth].child;
+        branch->sizes[child]--;
+        // a separator naming the entry moves to its successor, which is in
+        // the same leaf since non-root leaves hold at least LEAF_MIN
+        if (child > 0 && branch->firsts[child] == entry)
+        {
+            setFirst(branch, child, leaf->entries[0]);
+        }
+    }
+
+    void *node = leaf;
+    for (int depth = zset->height - 1; depth >= 0; depth--)
+    {
+        Branch *parent = path[depth].branch;
+        uint32_t child = path[depth].child;
+        bool leaves = depth == zset->height - 1;
+        uint32_t count = leaves ? ((Leaf *)node)->count : ((Branch *)node)->count;
+        if (count >= (leaves ? LEAF_MIN : BRANCH_MIN) || parent->count < 2)
+        {
+            break;
+        }
+        if (leaves)
+        {
+            fixLeaf(zset, parent, child);
+        }
+        else
+        {
+            fixBranch(zset, parent, child);
+        }
+        node = parent;
+    }
+
+    while (zset->height > 0 && ((Branch *)zset->root)->count == 1)
+    {
+        Branch *root = (Branch *)zset->root;
+        zset->root = root->children[0];
+        zset->height--;
+        release(zset, root);
+    }
+}
+
+static ZEntry *newEntry(ZSet *zset, const uint8_t *member, size_t len, uint64_t hcode, double score)
+{
+    ZEntry *entry = (ZEntry *)allocate(zset, sizeof(ZEntry) + len);
+    if (entry)
+    {
+        entry->node.hcode = hcode;
+        entry->score = score;
+        entry->len = (uint32_t)len;
+        memcpy(entry->member, member, len);
+    }
+    return entry;
+}
+
+static ZEntry *findEntry(const ZSet *zset, const uint8_t *member, size_t len)
+{
+    Probe probe = {{hashBytes(member, len)}, member, len};
+    // lookups also advance an incremental resize
+    return (ZEntry *)getFromHashTable((HashTable *)&zset->index, &probe.node, entryEq);
+}
+
+static bool treeAdd(ZSet *zset, const uint8_t *member, size_t len, double score, bool *added)
+{
+    uint64_t hcode = hashBytes(member, len);
+    Probe probe = {{hcode}, member, len};
+    ZEntry *old = (ZEntry *)getFromHashTable(&zset->index, &probe.node, entryEq);
+    if (old && old->score == score)
+    {
+        *added = false;
+        return true;
+    }
+    ZEntry *entry = newEntry(zset, member, len, hcode, score);
+    if (!entry)
+    {
+        return false;
+    }
+    if (!old && !insertIntoHashTable(&zset->index, &entry->node))
+    {
+        release(zset, entry);
+        return false;
+    }
+    if (!treeInsert(zset, entry))
+    {
+        if (!old)
+        {
+            deleteFromHashTable(&zset->index, &entry->node, sameEntry);
+        }
+        release(zset, entry);
+        return false;
+    }
+    if (old)
+    {
+        // the moved member is a new entry; the old one leaves both structures
+        treeDelete(zset, old);
+        replaceInHashTable(&zset->index, &old->node, &entry->node);
+        release(zset, old);
+    }
+    else
+    {
+        zset->size++;
+    }
+    *added = !old;
+    return true;
+}
+
+// Moves the packed records into a tree; on failure the set stays packed.
+static bool convertToTree(ZSet *zset)
+{
+    zset->root = allocate(zset, sizeof(Leaf));
+    if (!zset->root || !initHashTable(&zset->index, zset->size))
+    {
+        release(zset, zset->root);
+        zset->root = NULL;
+        return false;
+    }
+    ((Leaf *)zset->root)->count = 0;
+    ((Leaf *)zset->root)->next = NULL;
+    zset->height = 0;
+
+    size_t size = zset->size;
+    zset->size = 0;
+    bool ok = true;
+    for (size_t at = 0; ok && at < zset->packed_len; at += recordSize(zset->packed + at))
+    {
+        const uint8_t *record = zset->packed + at;
+        bool added;
+        ok = treeAdd(zset, record + PACKED_HEADER, record[8], recordScore(record), &added);
+    }
+    if (!ok)
+    {
+        freeTree(zset);
+        zset->size = size;
+        return false;
+    }
+    zset->tree = true;
+    release(zset, zset->packed);
+    zset->packed = NULL;
+    zset->packed_len = 0;
+    return true;
+}
+
+bool zsetAdd(ZSet *zset, const uint8_t *member, size_t len, double score, bool *added)
+{
+    if (zset->tree)
+    {
+        return treeAdd(zset, member, len, score, added);
+    }
+
+    size_t at = packedFind(zset, member, len);
+    if (at != SIZE_MAX)
+    {
+        *added = false;
+        if (recordScore(zset->packed + at) == score)
+        {
+            return true;
+        }
+        // the record leaves and comes back at the same size, in place
+        packedCut(zset, at);
+        packedPlace(zset, member, len, score);
+        return true;
+    }
+    if (zset->size + 1 > ZSET_PACKED_MAX_ENTRIES || len > ZSET_PACKED_MAX_MEMBER)
+    {
+        if (!convertToTree(zset))
+        {
+            return false;
+        }
+        return treeAdd(zset, member, len, score, added);
+    }
+    if (!packedResize(zset, zset->packed_len + PACKED_HEADER + len))
+    {
+        return false;
+    }
+    packedPlace(zset, member, len, score);
+    zset->size++;
+    *added = true;
+    return true;
+}
+
+bool zsetScore(const ZSet *zset, const uint8_t *member, size_t len, double *score)
+{
+    if (zset->tree)
+    {
+        ZEntry *entry = findEntry(zset, member, len);
+        if (entry)
+        {
+            *score = entry->score;
+        }
+        return entry != NULL;
+    }
+    size_t at = packedFind(zset, member, len);
+    if (at != SIZE_MAX)
+    {
+        *score = recordScore(zset->packed + at);
+    }
+    return at != SIZE_MAX;
+}
+
+bool zsetRemove(ZSet *zset, const uint8_t *member, size_t len)
+{
+    if (!zset->tree)
+    {
+        size_t at = packedFind(zset, member, len);
+        if (at != SIZE_MAX)
+        {
+            packedDelete(zset, at);
+        }
+        return at != SIZE_MAX;
+    }
+    ZEntry *entry = findEntry(zset, member, len);
+    if (!entry)
+    {
+        return false;
+    }
+    treeDelete(zset, entry);
+    deleteFromHashTable(&zset->index, &entry->node, sameEntry);
+    release(zset, entry);
+    zset->size--;
+    return true;
+}
+
+int64_t zsetRank(const ZSet *zset, const uint8_t *member, size_t len)
+{
+    if (!zset->tree)
+    {
+        int64_t rank = 0;
+        for (size_t at = 0; at < zset->packed_len; at += recordSize(zset->packed + at), rank++)
+        {
+            const uint8_t *record = zset->packed + at;
+            if (record[8] == len && memcmp(record + PACKED_HEADER, member, len) == 0)
+            {
+                return rank;
+            }
+        }
+        return -1;
+    }
+    ZEntry *entry = findEntry(zset, member, len);
+    if (!entry)
+    {
+        return -1;
+    }
+    int64_t rank = 0;
+    void *node = zset->root;
+    for (int depth = 0; depth < zset->height; depth++)
+    {
+        Branch *branch = (Branch *)node;
+        uint32_t child = childFor(branch, entry->score, member, len);
+        for (uint32_t i = 0; i < child; i++)
+        {
+            rank += branch->sizes[i];
+        }
+        node = branch->children[child];
+    }
+    return rank + leafLowerBound((Leaf *)node, entry->score, member, len);
+}
+
+static bool scoreBelow(double score, double bound, bool inclusive)
+{
+    return inclusive ? score <= bound : score < bound;
+}
+
+size_t zsetCountBelow(const ZSet *zset, double bound, bool inclusive)
+{
+    size_t count = 0;
+    if (!zset->tree)
+    {
+        for (size_t at = 0; at < zset->packed_len; at += recordSize(zset->packed + at))
+        {
+            if (!scoreBelow(recordScore(zset->packed + at), bound, inclusive))
+            {
+                break;
+            }
+            count++;
+        }
+        return count;
+    }
+
+    void *node = zset->root;
+    for (int depth = 0; depth < zset->height; depth++)
+    {
+        // every entry left of a child whose first entry is below the bound
+        // is below it as well
+        Branch *branch = (Branch *)node;
+        uint32_t lo = 1, hi = branch->count;
+        while (lo < hi)
+        {
+            uint32_t mid = (lo + hi) / 2;
+            if (scoreBelow(branch->scores[mid], bound, inclusive))
+            {
+                lo = mid + 1;
+            }
+            else
+            {
+                hi = mid;
+            }
+        }
+        uint32_t child = lo - 1;
+        for (uint32_t i = 0; i < child; i++)
+        {
+            count += branch->sizes[i];
+        }
+        node = branch->children[child];
+    }
+    const Leaf *leaf = (const Leaf *)node;
+    uint32_t lo = 0, hi = leaf->count;
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        if (scoreBelow(leaf->scores[mid], bound, inclusive))
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return count + lo;
+}
+
+void zsetSeek(const ZSet *zset, size_t rank, ZSetIter *iter)
+{
+    iter->zset = zset;
+    iter->offset = 0;
+    iter->leaf = NULL;
+    iter->slot = 0;
+    if (rank >= zset->size)
+    {
+        iter->offset = zset->packed_len;
+        return;
+    }
+    if (!zset->tree)
+    {
+        for (size_t i = 0; i < rank; i++)
+        {
+            iter->offset += recordSize(zset->packed + iter->offset);
+        }
+        return;
+    }
+    void *node = zset->root;
+    for (int depth = 0; depth < zset->height; depth++)
+    {
+        Branch *branch = (Branch *)node;
+        uint32_t child = 0;
+        while (child + 1 < branch->count && rank >= branch->sizes[child])
+        {
+            rank -= branch->sizes[child];
+            child++;
+        }
+        node = branch->children[child];
+    }
+    iter->leaf = node;
+    iter->slot = (uint32_t)rank;
+}
+
+bool zsetNext(ZSetIter *iter, const uint8_t **member, uint32_t *len, double *score)
+{
+    const ZSet *zset = iter->zset;
+    if (!zset->tree)
+    {
+        if (iter->offset >= zset->packed_len)
+        {
+            return false;
+        }
+        const uint8_t *record = zset->packed + iter->offset;
+        *score = recordScore(record);
+        *len = record[8];
+        *member = record + PACKED_HEADER;
+        iter->offset += recordSize(record);
+        return true;
+    }
+
+    const Leaf *leaf = (const Leaf *)iter->leaf;
+    while (leaf && iter->slot >= leaf->count)
+    {
+        leaf = leaf->next;
+        iter->slot = 0;
+    }
+    iter->leaf = leaf;
+    if (!leaf)
+    {
+        return false;
+    }
+    const ZEntry *entry = leaf->entries[iter->slot++];
+    *score = entry->score;
+    *len = entry->len;
+    *member = entry->member;
+    return true;
+}
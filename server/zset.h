@@ -0,0 +1,62 @@
+#ifndef ZSET_HEADER
+#define ZSET_HEADER
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+// Members are ordered by score, then by their bytes. A small set is one
+// packed array of (f64 score, u8 length, bytes) records searched linearly.
+// Past ZSET_PACKED_MAX_ENTRIES members, or with a member longer than
+// ZSET_PACKED_MAX_MEMBER, it turns for good into a B+-tree whose wide nodes
+// keep scores inline and count the members below every child, plus a hash
+// index from member to entry. Lookups, updates and ranks then take
+// O(log n) and a range walks leaves in order after one descent.
+#define ZSET_PACKED_MAX_ENTRIES 128
+#define ZSET_PACKED_MAX_MEMBER 64
+// entries per leaf and children per inner node
+#define ZSET_LEAF_SIZE 64
+#define ZSET_BRANCH_SIZE 32
+
+typedef struct ZSet ZSet;
+
+ZSet *newZSet(void);
+
+void freeZSet(ZSet *zset);
+
+size_t zsetSize(const ZSet *zset);
+
+// Usable size of every allocation the set holds, itself included.
+size_t zsetMemory(const ZSet *zset);
+
+bool zsetPacked(const ZSet *zset);
+
+// Inserts member or moves it to a new score; *added tells which. The score
+// must not be NaN. Returns false when out of memory.
+bool zsetAdd(ZSet *zset, const uint8_t *member, size_t len, double score, bool *added);
+
+bool zsetScore(const ZSet *zset, const uint8_t *member, size_t len, double *score);
+
+bool zsetRemove(ZSet *zset, const uint8_t *member, size_t len);
+
+// 0-based position in ascending order, -1 when absent.
+int64_t zsetRank(const ZSet *zset, const uint8_t *member, size_t len);
+
+// How many members score below bound, or at most bound when inclusive.
+size_t zsetCountBelow(const ZSet *zset, double bound, bool inclusive);
+
+// Walks members in order from a rank. Any change to the set invalidates it.
+typedef struct
+{
+    const ZSet *zset;
+    // packed: byte offset of the next record; tree: leaf and slot in it
+    size_t offset;
+    const void *leaf;
+    uint32_t slot;
+} ZSetIter;
+
+void zsetSeek(const ZSet *zset, size_t rank, ZSetIter *iter);
+
+bool zsetNext(ZSetIter *iter, const uint8_t **member, uint32_t *len, double *score);
+
+#endif